@@ -0,0 +1,623 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#ifdef KNIPSER_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "archive.h"
+#include "hash.h"
+#include "io.h"
+#include "log.h"
+#include "stats.h"
+#include "tiles.h"
+#include "trace.h"
+
+/*
+ * Archives of mostly identical screenshots, the same desktop and the same
+ * application chrome, only grow by the tiles that are new. Encoders store
+ * tiles concurrently, the lock covers the index and appending to the files,
+ * compression happens outside of it.
+ */
+#define MAX_TILE_BYTES (TILE_SIZE * TILE_SIZE * 8) // 16-bit RGBA
+#define MAX_PACKED_BYTES (MAX_TILE_BYTES + MAX_TILE_BYTES / 64 + 1024)
+#define MAX_SCRATCH_BYTES (MAX_PACKED_BYTES + MAX_TILE_BYTES) // A tile read back
+#define INDEX_EMPTY UINT64_MAX
+
+static bool enabled = false;
+static char dir[PATH_MAX - 32];
+static int pack_fd = -1;
+static int index_fd = -1;
+static uint64_t pack_size = 0;
+
+// Open addressing on the first half of the hash, at most half full
+static struct archive_index_entry *table = NULL;
+static size_t table_mask = 0;
+static size_t table_count = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void table_put(struct archive_index_entry *entries, size_t mask,
+		      const struct archive_index_entry *entry)
+{
+	size_t i = entry->hash[0] & mask;
+	while (entries[i].offset != INDEX_EMPTY) {
+		i = (i + 1) & mask;
+	}
+	entries[i] = *entry;
+}
+
+static const struct archive_index_entry *table_find(const uint64_t hash[2])
+{
+	if (table == NULL) {
+		return NULL;
+	}
+	for (size_t i = hash[0] & table_mask; table[i].offset != INDEX_EMPTY;
+	     i = (i + 1) & table_mask) {
+		if (table[i].hash[0] == hash[0] && table[i].hash[1] == hash[1]) {
+			return &table[i];
+		}
+	}
+	return NULL;
+}
+
+static int table_insert(const struct archive_index_entry *entry)
+{
+	if (table == NULL || (table_count + 1) * 2 > table_mask + 1) {
+		size_t capacity = table != NULL ? (table_mask + 1) * 2 : 4096;
+		struct archive_index_entry *grown =
+			malloc(capacity * sizeof(*grown));
+		if (grown == NULL) {
+			return -1;
+		}
+		memset(grown, 0xff, capacity * sizeof(*grown));
+		for (size_t i = 0; table != NULL && i <= table_mask; i++) {
+			if (table[i].offset != INDEX_EMPTY) {
+				table_put(grown, capacity - 1, &table[i]);
+			}
+		}
+		free(table);
+		table = grown;
+		table_mask = capacity - 1;
+	}
+	table_put(table, table_mask, entry);
+	table_count++;
+	return 0;
+}
+
+// A write cut short, by a crash or a full disk, leaves a partial index entry
+static void trim_index(void)
+{
+	struct stat st;
+	if (fstat(index_fd, &st) == 0 &&
+	    st.st_size % sizeof(struct archive_index_entry) != 0 &&
+	    ftruncate(index_fd, st.st_size - st.st_size %
+					sizeof(struct archive_index_entry)) < 0) {
+		log_warn("Failed to trim the tile index: %s", strerror(errno));
+	}
+}
+
+// Entries past the end of the pack were written for tiles that never made it
+static int load_index(void)
+{
+	trim_index();
+
+	struct archive_index_entry entries[1024];
+	ssize_t count;
+	while ((count = read(index_fd, entries, sizeof(entries))) > 0) {
+		for (size_t i = 0; i < count / sizeof(entries[0]); i++) {
+			if (entries[i].offset + sizeof(struct archive_tile) <=
+				    pack_size &&
+			    table_find(entries[i].hash) == NULL &&
+			    table_insert(&entries[i]) < 0) {
+				log_error("Failed to allocate the tile index");
+				return -1;
+			}
+		}
+	}
+	if (count < 0) {
+		log_error("Failed to read the tile index: %s", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+static int open_file(const char *name)
+{
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	int fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		log_error("Failed to open %s: %s", path, strerror(errno));
+	}
+	return fd;
+}
+
+// KNIPSER_ARCHIVE=DIR writes screenshots into the tile store in DIR
+int archive_init(void)
+{
+	const char *env = getenv("KNIPSER_ARCHIVE");
+	if (env == NULL || env[0] == '\0') {
+		return 0;
+	}
+	if (strlen(env) >= sizeof(dir)) {
+		log_error("KNIPSER_ARCHIVE is too long");
+		return -1;
+	}
+	snprintf(dir, sizeof(dir), "%s", env);
+	if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+		log_error("Failed to create %s: %s", dir, strerror(errno));
+		return -1;
+	}
+
+	struct stat st;
+	pack_fd = open_file("tiles.pack");
+	index_fd = open_file("tiles.idx");
+	if (pack_fd < 0 || index_fd < 0 || fstat(pack_fd, &st) < 0) {
+		archive_deinit();
+		return -1;
+	}
+	pack_size = st.st_size;
+	if (load_index() < 0) {
+		archive_deinit();
+		return -1;
+	}
+
+	enabled = true;
+	log_info("Archiving to %s, which holds %zu tiles", dir, table_count);
+	return 0;
+}
+
+void archive_deinit(void)
+{
+	if (pack_fd >= 0) {
+		close(pack_fd);
+		pack_fd = -1;
+	}
+	if (index_fd >= 0) {
+		close(index_fd);
+		index_fd = -1;
+	}
+	free(table);
+	table = NULL;
+	table_mask = 0;
+	table_count = 0;
+	enabled = false;
+}
+
+bool archive_enabled(void)
+{
+	return enabled;
+}
+
+// Stores the tile as is when compressing it doesn't help
+static uint32_t compress_tile(const uint8_t *data, size_t size, uint8_t *out,
+			      uint32_t *codec)
+{
+#ifdef KNIPSER_HAVE_ZSTD
+	size_t packed = ZSTD_compress(out, MAX_PACKED_BYTES, data, size, 3);
+	if (!ZSTD_isError(packed) && packed < size) {
+		*codec = ARCHIVE_CODEC_ZSTD;
+		return packed;
+	}
+#else
+	uLongf packed = MAX_PACKED_BYTES;
+	if (compress2(out, &packed, data, size, 6) == Z_OK && packed < size) {
+		*codec = ARCHIVE_CODEC_ZLIB;
+		return packed;
+	}
+#endif
+	memcpy(out, data, size);
+	*codec = ARCHIVE_CODEC_NONE;
+	return size;
+}
+
+// Read and unpack the tile at offset into out, packed holds MAX_PACKED_BYTES
+static int load_tile(int fd, uint64_t offset, size_t raw_size,
+		     uint8_t *packed, uint8_t *out)
+{
+	struct archive_tile tile;
+	if (pread(fd, &tile, sizeof(tile), offset) != sizeof(tile) ||
+	    tile.raw_size != raw_size || tile.size > MAX_PACKED_BYTES ||
+	    pread(fd, packed, tile.size, offset + sizeof(tile)) !=
+		    (ssize_t)tile.size) {
+		return -1;
+	}
+
+	switch (tile.codec) {
+	case ARCHIVE_CODEC_NONE:
+		if (tile.size != raw_size) {
+			return -1;
+		}
+		memcpy(out, packed, raw_size);
+		return 0;
+	case ARCHIVE_CODEC_ZLIB: {
+		uLongf size = raw_size;
+		if (uncompress(out, &size, packed, tile.size) != Z_OK ||
+		    size != raw_size) {
+			return -1;
+		}
+		return 0;
+	}
+#ifdef KNIPSER_HAVE_ZSTD
+	case ARCHIVE_CODEC_ZSTD: {
+		size_t size = ZSTD_decompress(out, raw_size, packed, tile.size);
+		return !ZSTD_isError(size) && size == raw_size ? 0 : -1;
+	}
+#endif
+	default:
+		return -1;
+	}
+}
+
+/*
+ * hash128 is fast, not collision resistant, so a hit only counts once the
+ * stored pixels turn out to be the same. Tiles that repeat are mostly
+ * recent ones, still in the page cache.
+ */
+static bool tile_matches(uint64_t offset, const uint8_t *data, size_t size,
+			 uint8_t *scratch)
+{
+	uint8_t *stored = scratch + MAX_PACKED_BYTES;
+	return load_tile(pack_fd, offset, size, scratch, stored) == 0 &&
+	       memcmp(stored, data, size) == 0;
+}
+
+/*
+ * Append a tile unless the store has it. packed holds MAX_PACKED_BYTES and
+ * scratch MAX_SCRATCH_BYTES. A tile whose hash collides with another one's
+ * is appended without an index entry, so it is never deduplicated.
+ */
+static int store_tile(const uint8_t *data, size_t size, uint64_t seed,
+		      uint8_t *packed, uint8_t *scratch, uint64_t *offset,
+		      bool *added)
+{
+	struct archive_tile tile = { .raw_size = size };
+	hash128(data, size, seed, tile.hash);
+
+	pthread_mutex_lock(&lock);
+	const struct archive_index_entry *found = table_find(tile.hash);
+	uint64_t found_offset = found != NULL ? found->offset : 0;
+	pthread_mutex_unlock(&lock);
+	if (found != NULL &&
+	    tile_matches(found_offset, data, size, scratch)) {
+		*offset = found_offset;
+		return 0;
+	}
+	bool collision = found != NULL;
+	if (collision) {
+		log_warn("Tile hash collision at offset %llu",
+			 (unsigned long long)found_offset);
+	}
+
+	// Another encoder may store the same tile meanwhile, so look again
+	tile.size = compress_tile(data, size, packed, &tile.codec);
+
+	int ret = 0;
+	pthread_mutex_lock(&lock);
+	found = collision ? NULL : table_find(tile.hash);
+	if (found != NULL &&
+	    tile_matches(found->offset, data, size, scratch)) {
+		*offset = found->offset;
+	} else {
+		collision |= found != NULL;
+		struct archive_index_entry entry = {
+			.hash = { tile.hash[0], tile.hash[1] },
+			.offset = pack_size,
+		};
+		if (io_write_full(pack_fd, &tile, sizeof(tile)) < 0 ||
+		    io_write_full(pack_fd, packed, tile.size) < 0 ||
+		    (!collision &&
+		     io_write_full(index_fd, &entry, sizeof(entry)) < 0)) {
+			log_error("Failed to append to the tile store: %s",
+				  strerror(errno));
+			struct stat st;
+			if (fstat(pack_fd, &st) == 0) {
+				pack_size = st.st_size;
+			}
+			trim_index();
+			ret = -1;
+		} else {
+			// A tile missing from the table is only stored again
+			pack_size += sizeof(tile) + tile.size;
+			if (!collision) {
+				table_insert(&entry);
+			}
+			*offset = entry.offset;
+			*added = true;
+		}
+	}
+	pthread_mutex_unlock(&lock);
+	return ret;
+}
+
+struct tile_writer {
+	int width, height, bpp;
+	size_t row_size;
+	int tiles_x;
+	uint8_t *band; // TILE_SIZE rows
+	uint8_t *tile;
+	uint8_t *packed;
+	uint8_t *scratch;
+	uint64_t *offsets;
+	int new_tiles;
+};
+
+static int write_band(struct tile_writer *writer, int band, int rows)
+{
+	for (int tx = 0; tx < writer->tiles_x; tx++) {
+		int x = tx * TILE_SIZE;
+		int width = writer->width - x < TILE_SIZE ? writer->width - x :
+							    TILE_SIZE;
+		size_t tile_row = (size_t)width * writer->bpp;
+		for (int i = 0; i < rows; i++) {
+			memcpy(writer->tile + i * tile_row,
+			       writer->band + i * writer->row_size +
+				       (size_t)x * writer->bpp,
+			       tile_row);
+		}
+
+		// Equal bytes in a tile of another shape are another tile
+		uint64_t seed = (uint64_t)width << 32 | (uint64_t)rows << 16 |
+				writer->bpp;
+		bool added = false;
+		if (store_tile(writer->tile, tile_row * rows, seed,
+			       writer->packed, writer->scratch,
+			       &writer->offsets[band * writer->tiles_x + tx],
+			       &added) < 0) {
+			return -1;
+		}
+		writer->new_tiles += added;
+	}
+	return 0;
+}
+
+void archive_path(const char *filename, char *path, size_t size)
+{
+	snprintf(path, size, "%s/%s", dir, filename);
+}
+
+// Written next to the final name and renamed, so a manifest is always complete
+static int write_manifest(const char *filename,
+			  const struct archive_manifest *manifest,
+			  const uint64_t *offsets)
+{
+	char path[PATH_MAX], tmp[PATH_MAX];
+	archive_path(filename, path, sizeof(path));
+	snprintf(tmp, sizeof(tmp), "%s/.%s.tmp", dir, filename);
+
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		log_error("Failed to create %s: %s", tmp, strerror(errno));
+		return -1;
+	}
+	int ret = 0;
+	if (io_write_full(fd, manifest, sizeof(*manifest)) < 0 ||
+	    io_write_full(fd, offsets, manifest->num_tiles * sizeof(offsets[0])) <
+		    0) {
+		ret = -1;
+	}
+	if (close(fd) < 0) {
+		ret = -1;
+	}
+	if (ret == 0 && rename(tmp, path) < 0) {
+		ret = -1;
+	}
+	if (ret < 0) {
+		log_error("Failed to write %s: %s", path, strerror(errno));
+		unlink(tmp);
+	}
+	return ret;
+}
+
+// An image_rows_writer, filename is the manifest's name within the archive
+int archive_write_rows(const char *filename, int fd, int width, int height,
+		       int bit_depth, int band_rows, image_row_source source,
+		       void *user, const struct image_options *options)
+{
+	if (!enabled || fd >= 0) {
+		log_error("%s can only be archived into a tile store", filename);
+		return -1;
+	}
+	if (width > ARCHIVE_MAX_SIZE || height > ARCHIVE_MAX_SIZE) {
+		log_error("%s is too large to archive", filename);
+		return -1;
+	}
+
+	uint64_t start_ns = stats_now();
+	struct tile_writer writer = {
+		.width = width,
+		.height = height,
+		.bpp = 4 * bit_depth / 8,
+		.tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE,
+	};
+	writer.row_size = (size_t)width * writer.bpp;
+	struct archive_manifest manifest = {
+		.magic = ARCHIVE_MAGIC,
+		.version = ARCHIVE_VERSION,
+		.width = width,
+		.height = height,
+		.bit_depth = bit_depth,
+		.tile_size = TILE_SIZE,
+		.num_tiles = tiles_count(width, height),
+	};
+	writer.band = malloc(writer.row_size * TILE_SIZE);
+	writer.tile = malloc(MAX_TILE_BYTES);
+	writer.packed = malloc(MAX_PACKED_BYTES);
+	writer.scratch = malloc(MAX_SCRATCH_BYTES);
+	writer.offsets = malloc(manifest.num_tiles * sizeof(uint64_t));
+
+	int ret = 0;
+	if (writer.band == NULL || writer.tile == NULL ||
+	    writer.packed == NULL || writer.scratch == NULL ||
+	    writer.offsets == NULL) {
+		log_error("Failed to allocate tile buffers");
+		ret = -1;
+	}
+
+	// Rows arrive in the source's bands, tiles are cut once TILE_SIZE are in
+	for (int y = 0; ret == 0 && y < height; y += band_rows) {
+		int count = height - y < band_rows ? height - y : band_rows;
+		const uint8_t *rows = source(user, y, count);
+		for (int i = 0; i < count && ret == 0; i++) {
+			int row = y + i;
+			memcpy(writer.band + (size_t)(row % TILE_SIZE) *
+						     writer.row_size,
+			       rows + i * writer.row_size, writer.row_size);
+			if (row % TILE_SIZE == TILE_SIZE - 1 ||
+			    row == height - 1) {
+				ret = write_band(&writer, row / TILE_SIZE,
+						 row % TILE_SIZE + 1);
+			}
+		}
+	}
+	if (ret == 0) {
+		ret = write_manifest(filename, &manifest, writer.offsets);
+	}
+	if (trace_enabled()) {
+		trace_end("encode", "tiles", start_ns);
+	}
+	log_debug("Archived %s with %d of %u tiles new", filename,
+		  writer.new_tiles, manifest.num_tiles);
+
+	free(writer.band);
+	free(writer.tile);
+	free(writer.packed);
+	free(writer.scratch);
+	free(writer.offsets);
+	return ret;
+}
+
+struct tile_reader {
+	int pack_fd;
+	const struct archive_manifest *manifest;
+	const uint64_t *offsets;
+	int bpp, tiles_x;
+	size_t row_size;
+	uint8_t *band;
+	uint8_t *tile;
+	uint8_t *packed;
+	bool failed;
+};
+
+static int read_tile(struct tile_reader *reader, uint64_t offset,
+		     size_t raw_size)
+{
+	return load_tile(reader->pack_fd, offset, raw_size, reader->packed,
+			 reader->tile);
+}
+
+// Called for one band of tiles at a time, the band rows are the tile size
+static const uint8_t *unpack_rows(void *user, int y, int count)
+{
+	struct tile_reader *reader = user;
+	int band = y / TILE_SIZE;
+	for (int tx = 0; tx < reader->tiles_x && !reader->failed; tx++) {
+		int x = tx * TILE_SIZE;
+		int width = (int)reader->manifest->width - x < TILE_SIZE ?
+				    (int)reader->manifest->width - x :
+				    TILE_SIZE;
+		size_t tile_row = (size_t)width * reader->bpp;
+		if (read_tile(reader,
+			      reader->offsets[band * reader->tiles_x + tx],
+			      tile_row * count) < 0) {
+			log_error("Tile %d,%d is missing or damaged", tx, band);
+			reader->failed = true;
+			break;
+		}
+		for (int i = 0; i < count; i++) {
+			memcpy(reader->band + i * reader->row_size +
+				       (size_t)x * reader->bpp,
+			       reader->tile + i * tile_row, tile_row);
+		}
+	}
+	return reader->band;
+}
+
+// Reconstruct the PNG of a manifest, its pack is the one next to it
+int archive_unpack(const char *manifest_path, const char *filename, int fd)
+{
+	struct archive_manifest manifest;
+	struct tile_reader reader = { .pack_fd = -1, .manifest = &manifest };
+	uint64_t *offsets = NULL;
+	int ret = -1;
+
+	int manifest_fd = open(manifest_path, O_RDONLY | O_CLOEXEC);
+	if (manifest_fd < 0) {
+		log_error("Failed to open %s: %s", manifest_path,
+			  strerror(errno));
+		return -1;
+	}
+	if (io_read_full(manifest_fd, &manifest, sizeof(manifest)) < 0 ||
+	    manifest.magic != ARCHIVE_MAGIC ||
+	    manifest.version != ARCHIVE_VERSION ||
+	    manifest.tile_size != TILE_SIZE ||
+	    (manifest.bit_depth != 8 && manifest.bit_depth != 16) ||
+	    manifest.width == 0 || manifest.height == 0 ||
+	    manifest.width > ARCHIVE_MAX_SIZE ||
+	    manifest.height > ARCHIVE_MAX_SIZE ||
+	    manifest.num_tiles != (uint32_t)tiles_count(manifest.width,
+							manifest.height)) {
+		log_error("%s is not a tile manifest", manifest_path);
+		goto out;
+	}
+	offsets = malloc(manifest.num_tiles * sizeof(uint64_t));
+	if (offsets == NULL ||
+	    io_read_full(manifest_fd, offsets,
+		      manifest.num_tiles * sizeof(uint64_t)) < 0) {
+		log_error("Failed to read %s", manifest_path);
+		goto out;
+	}
+
+	char pack_path[PATH_MAX];
+	const char *slash = strrchr(manifest_path, '/');
+	if (slash != NULL) {
+		snprintf(pack_path, sizeof(pack_path), "%.*s/tiles.pack",
+			 (int)(slash - manifest_path), manifest_path);
+	} else {
+		snprintf(pack_path, sizeof(pack_path), "tiles.pack");
+	}
+	reader.pack_fd = open(pack_path, O_RDONLY | O_CLOEXEC);
+	if (reader.pack_fd < 0) {
+		log_error("Failed to open %s: %s", pack_path, strerror(errno));
+		goto out;
+	}
+
+	reader.offsets = offsets;
+	reader.bpp = 4 * manifest.bit_depth / 8;
+	reader.tiles_x = (manifest.width + TILE_SIZE - 1) / TILE_SIZE;
+	reader.row_size = (size_t)manifest.width * reader.bpp;
+	reader.band = malloc(reader.row_size * TILE_SIZE);
+	reader.tile = malloc(MAX_TILE_BYTES);
+	reader.packed = malloc(MAX_PACKED_BYTES);
+	if (reader.band == NULL || reader.tile == NULL ||
+	    reader.packed == NULL) {
+		log_error("Failed to allocate tile buffers");
+		goto out;
+	}
+
+	ret = write_image_rows(filename, fd, manifest.width, manifest.height,
+			       manifest.bit_depth, TILE_SIZE, unpack_rows,
+			       &reader, &image_default_options);
+	if (reader.failed) {
+		ret = -1;
+	}
+
+out:
+	free(reader.band);
+	free(reader.tile);
+	free(reader.packed);
+	free(offsets);
+	if (reader.pack_fd >= 0) {
+		close(reader.pack_fd);
+	}
+	close(manifest_fd);
+	return ret;
+}
@@ -0,0 +1,66 @@
+#ifndef _ARCHIVE_H_
+#define _ARCHIVE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "image.h"
+
+/*
+ * Tile store. With KNIPSER_ARCHIVE=DIR, screenshots are cut into square
+ * tiles of their RGBA rows instead of being encoded as PNG. DIR/tiles.pack
+ * holds every distinct tile once, compressed, and each screenshot is a
+ * small manifest naming its tiles by their offset in the pack.
+ * DIR/tiles.idx lists the hash and offset of every tile, so only tiles with
+ * a known hash are read back from the pack, to compare their pixels. All
+ * three are only ever appended to or created, and all integers are in host
+ * byte order.
+ */
+#define ARCHIVE_MAGIC 0x464d544b // "KTMF"
+#define ARCHIVE_VERSION 1
+#define ARCHIVE_MAX_SIZE 65536 // Largest width or height of a screenshot
+
+enum archive_codec {
+	ARCHIVE_CODEC_NONE,
+	ARCHIVE_CODEC_ZLIB,
+	ARCHIVE_CODEC_ZSTD,
+};
+
+// A manifest, followed by one uint64_t pack offset per tile, row by row
+struct archive_manifest {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t width, height;
+	uint32_t bit_depth; // Of each RGBA channel, 8 or 16
+	uint32_t tile_size;
+	uint32_t num_tiles;
+	uint32_t reserved;
+};
+
+// Precedes the data of each tile in the pack
+struct archive_tile {
+	uint64_t hash[2]; // Of the pixels, seeded with the tile's size and depth
+	uint32_t size; // Of the data that follows
+	uint32_t raw_size; // Of the pixels, tightly packed rows
+	uint32_t codec;
+	uint32_t reserved;
+};
+
+// One per tile in the index, written after the tile
+struct archive_index_entry {
+	uint64_t hash[2];
+	uint64_t offset;
+};
+
+int archive_init(void);
+void archive_deinit(void);
+bool archive_enabled(void);
+// Where a manifest named filename is stored
+void archive_path(const char *filename, char *path, size_t size);
+int archive_write_rows(const char *filename, int fd, int width, int height,
+		       int bit_depth, int band_rows, image_row_source source,
+		       void *user, const struct image_options *options);
+int archive_unpack(const char *manifest, const char *filename, int fd);
+
+#endif /* _ARCHIVE_H_ */
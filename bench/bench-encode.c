@@ -0,0 +1,718 @@
+/*
+ * Encoder benchmark for write_image().
+ *
+ * Frames of typical screen content are generated at several resolutions (or
+ * loaded from a directory of PNG files with --corpus), converted into every
+ * supported wl_shm format and encoded with each encoder setting. Results go
+ * to stdout as a tab separated table, one row per configuration.
+ */
+
+#include <dirent.h>
+#include <getopt.h>
+#include <math.h>
+#include <png.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#include "image.h"
+#include "stats.h"
+
+#define MAX_ITEMS 32
+
+struct frame {
+	char name[64];
+	int width, height;
+	uint8_t *rgba; // Tightly packed RGBA8
+};
+
+struct resolution {
+	const char *name;
+	int width, height;
+};
+
+struct setting {
+	const char *name;
+	int compression_level;
+	int filters;
+	int bit_depth;
+};
+
+typedef void (*generator_t)(struct frame *frame);
+
+static const struct resolution resolutions[] = {
+	{ "1080p", 1920, 1080 },
+	{ "1440p", 2560, 1440 },
+	{ "4k", 3840, 2160 },
+	{ "8k", 7680, 4320 },
+};
+
+static const struct {
+	const char *name;
+	enum wl_shm_format format;
+} formats[] = {
+	{ "xrgb8888", WL_SHM_FORMAT_XRGB8888 },
+	{ "argb8888", WL_SHM_FORMAT_ARGB8888 },
+	{ "xbgr8888", WL_SHM_FORMAT_XBGR8888 },
+	{ "abgr8888", WL_SHM_FORMAT_ABGR8888 },
+	{ "xrgb2101010", WL_SHM_FORMAT_XRGB2101010 },
+	{ "xbgr2101010", WL_SHM_FORMAT_XBGR2101010 },
+	{ "abgr16161616f", WL_SHM_FORMAT_ABGR16161616F },
+};
+
+static const struct setting settings[] = {
+	{ "default", -1, 0, 0 },
+	{ "level1", 1, 0, 0 },
+	{ "level3", 3, 0, 0 },
+	{ "level9", 9, 0, 0 },
+	{ "nofilter", -1, PNG_FILTER_NONE, 0 },
+	{ "up", -1, PNG_FILTER_UP, 0 },
+	{ "paeth", -1, PNG_FILTER_PAETH, 0 },
+	{ "fast", 1, PNG_FILTER_UP, 0 },
+	{ "dither8", -1, 0, 8 }, // Only differs from default for deep formats
+};
+
+// Content generators
+
+static uint32_t rng_state = 0x12345678;
+
+static uint32_t rng(void)
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 17;
+	rng_state ^= rng_state << 5;
+	return rng_state;
+}
+
+static void put(struct frame *frame, int x, int y, const uint8_t color[3])
+{
+	if (x < 0 || y < 0 || x >= frame->width || y >= frame->height) {
+		return;
+	}
+	uint8_t *p = frame->rgba + ((size_t)y * frame->width + x) * 4;
+	p[0] = color[0];
+	p[1] = color[1];
+	p[2] = color[2];
+	p[3] = 0xff;
+}
+
+static void fill(struct frame *frame, int x0, int y0, int w, int h,
+		 const uint8_t color[3])
+{
+	for (int y = y0; y < y0 + h; y++) {
+		for (int x = x0; x < x0 + w; x++) {
+			put(frame, x, y, color);
+		}
+	}
+}
+
+// Scale factor so text keeps its apparent size on HiDPI resolutions
+static int ui_scale(const struct frame *frame)
+{
+	return frame->height >= 2160 ? frame->height / 1080 : 1;
+}
+
+// Draw a run of pseudo glyphs, each a random 5x7 bitmap in an 8x16 cell
+static void draw_text(struct frame *frame, int x0, int y0, int cells,
+		      const uint8_t color[3])
+{
+	int scale = ui_scale(frame);
+	for (int c = 0; c < cells; c++) {
+		uint32_t bits = rng();
+		if ((bits & 0x1f) == 0) {
+			continue; // Space
+		}
+		for (int gy = 0; gy < 7; gy++) {
+			for (int gx = 0; gx < 5; gx++) {
+				if (!((bits >> ((gy * 5 + gx) % 32)) & 1)) {
+					continue;
+				}
+				int px = x0 + (c * 8 + 1 + gx) * scale;
+				int py = y0 + (4 + gy) * scale;
+				fill(frame, px, py, scale, scale, color);
+			}
+		}
+	}
+}
+
+static void gen_gradient(struct frame *frame)
+{
+	for (int y = 0; y < frame->height; y++) {
+		for (int x = 0; x < frame->width; x++) {
+			uint8_t color[3] = {
+				(uint8_t)(x * 255 / frame->width),
+				(uint8_t)(y * 255 / frame->height),
+				(uint8_t)((x + y) * 255 /
+					  (frame->width + frame->height)),
+			};
+			put(frame, x, y, color);
+		}
+	}
+}
+
+static void gen_terminal(struct frame *frame)
+{
+	static const uint8_t background[3] = { 30, 30, 30 };
+	static const uint8_t palette[][3] = {
+		{ 204, 204, 204 }, { 204, 204, 204 }, { 204, 204, 204 },
+		{ 78, 201, 176 },  { 220, 220, 170 }, { 86, 156, 214 },
+		{ 244, 71, 71 },   { 106, 153, 85 },
+	};
+	int line = 16 * ui_scale(frame);
+	int cols = frame->width / (8 * ui_scale(frame));
+
+	fill(frame, 0, 0, frame->width, frame->height, background);
+	for (int y = 0; y + line <= frame->height; y += line) {
+		int x = 0;
+		int length = (int)(rng() % (uint32_t)cols);
+		while (length > 0) {
+			int run = 1 + (int)(rng() % 12);
+			if (run > length) {
+				run = length;
+			}
+			draw_text(frame, x, y, run, palette[rng() % 8]);
+			x += (run + 1) * 8 * ui_scale(frame);
+			length -= run + 1;
+		}
+	}
+}
+
+static void gen_ide(struct frame *frame)
+{
+	static const uint8_t sidebar[3] = { 37, 37, 38 };
+	static const uint8_t editor[3] = { 30, 30, 30 };
+	static const uint8_t tabs[3] = { 45, 45, 45 };
+	static const uint8_t status[3] = { 0, 122, 204 };
+	static const uint8_t gutter[3] = { 133, 133, 133 };
+	static const uint8_t syntax[][3] = {
+		{ 212, 212, 212 }, { 86, 156, 214 }, { 206, 145, 120 },
+		{ 78, 201, 176 },  { 106, 153, 85 }, { 197, 134, 192 },
+	};
+	int scale = ui_scale(frame);
+	int line = 18 * scale;
+	int side = frame->width * 15 / 100;
+	int top = 35 * scale;
+	int bottom = frame->height - 22 * scale;
+
+	fill(frame, 0, 0, frame->width, frame->height, editor);
+	fill(frame, 0, 0, side, frame->height, sidebar);
+	fill(frame, side, 0, frame->width - side, top, tabs);
+	fill(frame, 0, bottom, frame->width, frame->height - bottom, status);
+
+	for (int y = top; y + line <= bottom; y += line) {
+		draw_text(frame, 8 * scale, y, 3 + (int)(rng() % 20),
+			  syntax[0]);
+		draw_text(frame, side + 8 * scale, y, 4, gutter);
+
+		int indent = (int)(rng() % 4) * 4;
+		int x = side + (48 + indent * 8) * scale;
+		int tokens = (int)(rng() % 10);
+		for (int t = 0; t < tokens && x < frame->width; t++) {
+			int run = 2 + (int)(rng() % 10);
+			draw_text(frame, x, y, run, syntax[rng() % 6]);
+			x += (run + 1) * 8 * scale;
+		}
+	}
+}
+
+static void gen_photo_area(struct frame *frame, int x0, int y0, int w, int h)
+{
+	double fx = 6.0 / w, fy = 4.0 / h;
+	for (int y = y0; y < y0 + h; y++) {
+		for (int x = x0; x < x0 + w; x++) {
+			double v = sin(x * fx * 3.1) + sin(y * fy * 2.3) +
+				   sin((x + y) * fx * 1.7) +
+				   0.5 * sin(x * fx * 11.0 + y * fy * 7.0);
+			int grain = (int)(rng() % 17) - 8;
+			int base = (int)(v * 40.0) + 128;
+			uint8_t color[3];
+			for (int c = 0; c < 3; c++) {
+				int value = base + grain + c * 20 - 20;
+				color[c] = (uint8_t)(value < 0 ? 0 :
+						     value > 255 ? 255 : value);
+			}
+			put(frame, x, y, color);
+		}
+	}
+}
+
+static void gen_photo(struct frame *frame)
+{
+	gen_photo_area(frame, 0, 0, frame->width, frame->height);
+}
+
+static void gen_browser(struct frame *frame)
+{
+	static const uint8_t chrome[3] = { 222, 225, 230 };
+	static const uint8_t page[3] = { 255, 255, 255 };
+	static const uint8_t text[3] = { 32, 33, 36 };
+	static const uint8_t link[3] = { 26, 13, 171 };
+	int scale = ui_scale(frame);
+	int top = 80 * scale;
+	int margin = frame->width / 5;
+	int line = 22 * scale;
+
+	fill(frame, 0, 0, frame->width, frame->height, page);
+	fill(frame, 0, 0, frame->width, top, chrome);
+	draw_text(frame, 120 * scale, 45 * scale, 40, text);
+
+	int y = top + 40 * scale;
+	while (y + line < frame->height) {
+		if (rng() % 5 == 0) {
+			int h = (120 + (int)(rng() % 200)) * scale;
+			if (y + h > frame->height) {
+				h = frame->height - y;
+			}
+			gen_photo_area(frame, margin, y, frame->width / 3, h);
+			y += h + line;
+			continue;
+		}
+
+		int lines = 3 + (int)(rng() % 6);
+		for (int l = 0; l < lines && y + line < frame->height; l++) {
+			int cells = (frame->width - 2 * margin) / (8 * scale);
+			draw_text(frame, margin, y, cells - (int)(rng() % 20),
+				  rng() % 10 == 0 ? link : text);
+			y += line;
+		}
+		y += line;
+	}
+}
+
+// Decoded video: blocky, high entropy content
+static void gen_video(struct frame *frame)
+{
+	for (int by = 0; by < frame->height; by += 8) {
+		for (int bx = 0; bx < frame->width; bx += 8) {
+			uint32_t seed = rng();
+			int base[3] = { (int)(seed & 0xff), (int)((seed >> 8) & 0xff),
+					(int)((seed >> 16) & 0xff) };
+			int slope = (int)((seed >> 24) % 7) - 3;
+			for (int y = by; y < by + 8; y++) {
+				for (int x = bx; x < bx + 8; x++) {
+					int noise = (int)(rng() % 41) - 20;
+					uint8_t color[3];
+					for (int c = 0; c < 3; c++) {
+						int value = base[c] + noise +
+							    slope * (x - bx + y - by);
+						color[c] = (uint8_t)(value < 0 ? 0 :
+								     value > 255 ? 255 : value);
+					}
+					put(frame, x, y, color);
+				}
+			}
+		}
+	}
+}
+
+static const struct {
+	const char *name;
+	generator_t generate;
+} contents[] = {
+	{ "terminal", gen_terminal },
+	{ "ide", gen_ide },
+	{ "browser", gen_browser },
+	{ "photo", gen_photo },
+	{ "video", gen_video },
+	{ "gradient", gen_gradient },
+};
+
+// Corpus loading
+
+static bool load_png(const char *path, struct frame *out)
+{
+	png_image image;
+	memset(&image, 0, sizeof(image));
+	image.version = PNG_IMAGE_VERSION;
+	if (!png_image_begin_read_from_file(&image, path)) {
+		return false;
+	}
+
+	image.format = PNG_FORMAT_RGBA;
+	out->width = (int)image.width;
+	out->height = (int)image.height;
+	out->rgba = malloc(PNG_IMAGE_SIZE(image));
+	if (out->rgba == NULL ||
+	    !png_image_finish_read(&image, NULL, out->rgba, 0, NULL)) {
+		free(out->rgba);
+		png_image_free(&image);
+		return false;
+	}
+	return true;
+}
+
+static int load_corpus(const char *dir, struct frame *frames, int max)
+{
+	DIR *d = opendir(dir);
+	if (d == NULL) {
+		fprintf(stderr, "Failed to open corpus %s\n", dir);
+		return -1;
+	}
+
+	int count = 0;
+	struct dirent *entry;
+	while ((entry = readdir(d)) != NULL && count < max) {
+		size_t len = strlen(entry->d_name);
+		if (len < 5 || strcmp(entry->d_name + len - 4, ".png") != 0) {
+			continue;
+		}
+
+		char path[4096];
+		snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+		struct frame *frame = &frames[count];
+		snprintf(frame->name, sizeof(frame->name), "%.*s",
+			 (int)(len - 4), entry->d_name);
+		if (load_png(path, frame)) {
+			count++;
+		} else {
+			fprintf(stderr, "Skipping %s\n", path);
+		}
+	}
+	closedir(d);
+	return count;
+}
+
+// Tile a corpus image over the target resolution
+static void tile_frame(const struct frame *src, struct frame *dst)
+{
+	for (int y = 0; y < dst->height; y++) {
+		const uint8_t *row = src->rgba +
+				     (size_t)(y % src->height) * src->width * 4;
+		uint8_t *out = dst->rgba + (size_t)y * dst->width * 4;
+		for (int x = 0; x < dst->width; x += src->width) {
+			int w = dst->width - x < src->width ? dst->width - x :
+							      src->width;
+			memcpy(out + (size_t)x * 4, row, (size_t)w * 4);
+		}
+	}
+}
+
+// Convert RGBA8 into the memory layout of a little-endian wl_shm format
+// Encode a value in [0, 1] as a half float, exact for the 8-bit inputs used here
+static uint16_t to_half(float value)
+{
+	if (value <= 0) {
+		return 0;
+	}
+	int exponent;
+	float mantissa = frexpf(value, &exponent); // value = mantissa * 2^exponent
+	if (exponent < -13) {
+		return (uint16_t)lrintf(value * 16777216.0f); // Subnormal
+	}
+	return (uint16_t)(((exponent + 14) << 10) |
+			  ((uint32_t)lrintf(mantissa * 2048.0f) - 1024));
+}
+
+static void pack_frame(const struct frame *frame, enum wl_shm_format format,
+		       void *out)
+{
+	bool is_bgr = format == WL_SHM_FORMAT_XRGB8888 ||
+		      format == WL_SHM_FORMAT_ARGB8888 ||
+		      format == WL_SHM_FORMAT_XRGB2101010;
+	bool has_alpha = format == WL_SHM_FORMAT_ARGB8888 ||
+			 format == WL_SHM_FORMAT_ABGR8888 ||
+			 format == WL_SHM_FORMAT_ABGR16161616F;
+	size_t count = (size_t)frame->width * frame->height;
+
+	for (size_t i = 0; i < count; i++) {
+		const uint8_t *p = frame->rgba + i * 4;
+		uint32_t a = has_alpha ? p[3] : 0xff;
+		uint32_t first = is_bgr ? p[0] : p[2];
+		uint32_t last = is_bgr ? p[2] : p[0];
+
+		if (format == WL_SHM_FORMAT_ABGR16161616F) {
+			uint16_t *half = (uint16_t *)out + i * 4;
+			for (int c = 0; c < 4; c++) {
+				half[c] = to_half((c == 3 ? a : p[c]) / 255.0f);
+			}
+		} else if (format == WL_SHM_FORMAT_XRGB2101010 ||
+			   format == WL_SHM_FORMAT_XBGR2101010) {
+			// Spread to 10 bits so the low bits are not all zero
+			((uint32_t *)out)[i] = (3u << 30) |
+					       ((first * 1023 / 255) << 20) |
+					       ((p[1] * 1023u / 255) << 10) |
+					       (last * 1023 / 255);
+		} else {
+			((uint32_t *)out)[i] = (a << 24) | (first << 16) |
+					       ((uint32_t)p[1] << 8) | last;
+		}
+	}
+}
+
+// Memory accounting
+
+static long read_status_kb(const char *key)
+{
+	FILE *f = fopen("/proc/self/status", "r");
+	if (f == NULL) {
+		return -1;
+	}
+
+	char line[256];
+	long value = -1;
+	size_t key_len = strlen(key);
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (strncmp(line, key, key_len) == 0) {
+			value = strtol(line + key_len, NULL, 10);
+			break;
+		}
+	}
+	fclose(f);
+	return value;
+}
+
+// Reset VmHWM to the current RSS, so peaks can be measured per configuration
+static void reset_peak_rss(void)
+{
+	FILE *f = fopen("/proc/self/clear_refs", "w");
+	if (f != NULL) {
+		fputs("5", f);
+		fclose(f);
+	}
+}
+
+static long peak_rss_kb(void)
+{
+	long peak = read_status_kb("VmHWM:");
+	if (peak < 0) {
+		struct rusage usage;
+		getrusage(RUSAGE_SELF, &usage);
+		peak = usage.ru_maxrss;
+	}
+	return peak;
+}
+
+// Benchmark
+
+static int compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static double percentile_ms(const uint64_t *sorted, int count, double p)
+{
+	int rank = (int)ceil(p / 100.0 * count);
+	if (rank < 1) {
+		rank = 1;
+	}
+	return sorted[rank - 1] / 1e6;
+}
+
+static void run_config(const struct frame *frame, const char *resolution,
+		       const char *format_name, enum wl_shm_format format,
+		       const void *pixels, const struct setting *setting,
+		       int iterations, const char *path)
+{
+	struct image_options options = {
+		.compression_level = setting->compression_level,
+		.filters = setting->filters,
+		.bit_depth = setting->bit_depth,
+	};
+	int bpp = image_format_bpp(format);
+	uint64_t *samples = calloc((size_t)iterations, sizeof(uint64_t));
+	struct stat st = { 0 };
+
+	long rss_before = read_status_kb("VmRSS:");
+	reset_peak_rss();
+	for (int i = 0; i < iterations; i++) {
+		uint64_t start_ns = stats_now();
+		write_image(path, -1, format, frame->width, frame->height,
+			    frame->width * bpp, false,
+			    WL_OUTPUT_TRANSFORM_NORMAL, pixels, &options);
+		samples[i] = stats_now() - start_ns;
+	}
+	long rss_peak = peak_rss_kb();
+	stat(path, &st);
+	unlink(path);
+
+	qsort(samples, (size_t)iterations, sizeof(uint64_t), compare_u64);
+	uint64_t total = 0;
+	for (int i = 0; i < iterations; i++) {
+		total += samples[i];
+	}
+	double megapixels = (double)frame->width * frame->height / 1e6;
+	double raw_bytes = (double)frame->width * frame->height * bpp;
+
+	printf("%s\t%s\t%dx%d\t%s\t%s\t%d\t%.1f\t%.2f\t%.2f\t%.2f\t%.2f\t%ld\t%ld\t%lld\t%.4f\n",
+	       frame->name, resolution, frame->width, frame->height,
+	       format_name, setting->name, iterations,
+	       megapixels * iterations / (total / 1e9),
+	       percentile_ms(samples, iterations, 50),
+	       percentile_ms(samples, iterations, 90),
+	       percentile_ms(samples, iterations, 99),
+	       samples[iterations - 1] / 1e6, rss_peak,
+	       rss_before >= 0 ? rss_peak - rss_before : -1,
+	       (long long)st.st_size, st.st_size / raw_bytes);
+	fflush(stdout);
+	free(samples);
+}
+
+// Comma separated filter lists, NULL matches everything
+static bool selected(const char *list, const char *name)
+{
+	if (list == NULL) {
+		return true;
+	}
+
+	size_t len = strlen(name);
+	for (const char *p = list; *p != '\0';) {
+		const char *end = strchr(p, ',');
+		size_t item = end ? (size_t)(end - p) : strlen(p);
+		if (item == len && strncmp(p, name, len) == 0) {
+			return true;
+		}
+		p += item + (end ? 1 : 0);
+	}
+	return false;
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"  --corpus DIR          encode the PNG files in DIR instead of generated content\n"
+		"  --contents LIST       terminal,ide,browser,photo,video,gradient\n"
+		"  --resolutions LIST    1080p,1440p,4k,8k\n"
+		"  --formats LIST        xrgb8888,argb8888,xbgr8888,abgr8888,\n"
+		"                        xrgb2101010,xbgr2101010,abgr16161616f\n"
+		"  --settings LIST       default,level1,level3,level9,nofilter,up,paeth,fast,\n"
+		"                        dither8\n"
+		"  --iterations N        encodes per configuration (default 3)\n"
+		"  --output-dir DIR      where encoded files are written (default /tmp)\n",
+		argv0);
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct option options[] = {
+		{ "corpus", required_argument, NULL, 'c' },
+		{ "contents", required_argument, NULL, 'C' },
+		{ "resolutions", required_argument, NULL, 'r' },
+		{ "formats", required_argument, NULL, 'f' },
+		{ "settings", required_argument, NULL, 's' },
+		{ "iterations", required_argument, NULL, 'i' },
+		{ "output-dir", required_argument, NULL, 'o' },
+		{ "help", no_argument, NULL, 'h' },
+		{ 0 },
+	};
+	const char *corpus = NULL, *content_list = NULL;
+	const char *resolution_list = NULL, *format_list = NULL;
+	const char *setting_list = NULL, *output_dir = "/tmp";
+	int iterations = 3;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+		switch (opt) {
+		case 'c':
+			corpus = optarg;
+			break;
+		case 'C':
+			content_list = optarg;
+			break;
+		case 'r':
+			resolution_list = optarg;
+			break;
+		case 'f':
+			format_list = optarg;
+			break;
+		case 's':
+			setting_list = optarg;
+			break;
+		case 'i':
+			iterations = atoi(optarg);
+			break;
+		case 'o':
+			output_dir = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+	if (iterations < 1) {
+		iterations = 1;
+	}
+
+	struct frame sources[MAX_ITEMS];
+	int num_sources = 0;
+	if (corpus != NULL) {
+		num_sources = load_corpus(corpus, sources, MAX_ITEMS);
+		if (num_sources <= 0) {
+			fprintf(stderr, "No PNG files in %s\n", corpus);
+			return EXIT_FAILURE;
+		}
+	}
+
+	char path[4096];
+	snprintf(path, sizeof(path), "%s/knipser-bench-%d.png", output_dir,
+		 (int)getpid());
+
+	printf("content\tresolution\tsize\tformat\tsetting\titerations\tmp_per_s\tp50_ms\tp90_ms\tp99_ms\tmax_ms\tpeak_rss_kb\tencoder_rss_kb\tbytes\tratio\n");
+
+	size_t num_items = corpus ? (size_t)num_sources :
+				    sizeof(contents) / sizeof(contents[0]);
+	for (size_t r = 0; r < sizeof(resolutions) / sizeof(resolutions[0]); r++) {
+		const struct resolution *res = &resolutions[r];
+		if (!selected(resolution_list, res->name)) {
+			continue;
+		}
+
+		size_t pixel_count = (size_t)res->width * res->height;
+		struct frame frame = { .width = res->width,
+				       .height = res->height };
+		frame.rgba = malloc(pixel_count * 4);
+		void *pixels = malloc(pixel_count * 8); // Up to 8 bytes per pixel
+		if (frame.rgba == NULL || pixels == NULL) {
+			fprintf(stderr, "Out of memory at %s\n", res->name);
+			return EXIT_FAILURE;
+		}
+
+		for (size_t c = 0; c < num_items; c++) {
+			const char *name = corpus ? sources[c].name :
+						    contents[c].name;
+			if (!selected(content_list, name)) {
+				continue;
+			}
+
+			snprintf(frame.name, sizeof(frame.name), "%.63s", name);
+			if (corpus) {
+				tile_frame(&sources[c], &frame);
+			} else {
+				rng_state = 0x12345678;
+				contents[c].generate(&frame);
+			}
+
+			for (size_t f = 0; f < sizeof(formats) / sizeof(formats[0]); f++) {
+				if (!selected(format_list, formats[f].name)) {
+					continue;
+				}
+				pack_frame(&frame, formats[f].format, pixels);
+
+				for (size_t s = 0; s < sizeof(settings) / sizeof(settings[0]); s++) {
+					if (!selected(setting_list, settings[s].name)) {
+						continue;
+					}
+					fprintf(stderr, "%s %s %s %s\n", name,
+						res->name, formats[f].name,
+						settings[s].name);
+					run_config(&frame, res->name,
+						   formats[f].name,
+						   formats[f].format, pixels,
+						   &settings[s], iterations,
+						   path);
+				}
+			}
+		}
+
+		free(frame.rgba);
+		free(pixels);
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,352 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "canvas.h"
+#include "log.h"
+#include "trace.h"
+#include "transform.h"
+
+/*
+ * The canvas is never materialised. Worker threads blit one band of rows
+ * into one of two band buffers while the encoder compresses the other, and
+ * a barrier hands the bands over.
+ */
+#define CANVAS_BAND_ROWS 32
+#define CANVAS_MAX_WORKERS 4
+
+struct canvas {
+	const struct canvas_output *outputs; // Sorted by x
+	int count;
+	int min_x, min_y;
+	int width, height;
+	int num_bands;
+
+	uint32_t *bands[2];
+	uint8_t *scratch[CANVAS_MAX_WORKERS]; // Raw rows before conversion
+	pthread_barrier_t barrier;
+	int num_workers;
+	int bands_taken;
+
+	// Workers wait until the barrier is sized for the number that started
+	pthread_mutex_t start_lock;
+	pthread_cond_t start_cond;
+	bool started;
+};
+
+struct canvas_worker {
+	struct canvas *canvas;
+	pthread_t thread;
+	int index;
+};
+
+static struct transform_source output_source(const struct canvas_output *out)
+{
+	return (struct transform_source){
+		.data = out->data,
+		.width = out->width,
+		.height = out->height,
+		.stride = out->stride,
+		.bpp = image_format_bpp(out->format),
+		.y_invert = out->y_invert,
+		.transform = out->transform,
+	};
+}
+
+// Outputs that are only rotated or flipped are blitted a slice at a time
+static bool is_unscaled(const struct canvas_output *out)
+{
+	int width, height;
+	transform_size(out->transform, out->width, out->height, &width,
+		       &height);
+	return width == out->canvas_width && height == out->canvas_height;
+}
+
+// Upright outputs are converted straight from the buffer
+static void blit_rows(const struct canvas_output *out, uint32_t *dst,
+		      size_t dst_stride, int v, int count)
+{
+	for (int i = 0; i < count; i++) {
+		int y = out->y_invert ? out->height - (v + i) - 1 : v + i;
+		image_convert_row(out->format, dst + (size_t)i * dst_stride,
+				  (const uint8_t *)out->data +
+					  (size_t)y * out->stride,
+				  out->width);
+	}
+}
+
+// Blit the part of a scaled output covering one canvas row, v is the row within the output
+static void blit_scaled_row(const struct canvas_output *out, uint32_t *dst,
+			    uint8_t *scratch, int v)
+{
+	int bpp = image_format_bpp(out->format);
+	int width, height;
+	transform_size(out->transform, out->width, out->height, &width,
+		       &height);
+
+	// Gather raw pixels, then convert the whole row in one pass
+	int tv = (int)((int64_t)v * height / out->canvas_height);
+	for (int u = 0; u < out->canvas_width; u++) {
+		int tu = (int)((int64_t)u * width / out->canvas_width);
+		int x, y;
+		transform_coords(out->transform, width, height, tu, tv, &x, &y);
+		if (out->y_invert) {
+			y = out->height - y - 1;
+		}
+		memcpy(scratch + (size_t)u * bpp,
+		       (const uint8_t *)out->data + (size_t)y * out->stride +
+			       (size_t)x * bpp,
+		       bpp);
+	}
+	image_convert_row(out->format, dst, scratch, out->canvas_width);
+}
+
+// Fill one canvas row, clearing only the gaps between outputs and blitting scaled ones
+static void compose_row(const struct canvas *canvas, uint32_t *dst,
+			uint8_t *scratch, int y)
+{
+	int filled = 0;
+	for (int i = 0; i < canvas->count; i++) {
+		const struct canvas_output *out = &canvas->outputs[i];
+		int top = out->y - canvas->min_y;
+		int left = out->x - canvas->min_x;
+		if (y < top || y >= top + out->canvas_height) {
+			continue;
+		}
+
+		if (left > filled) {
+			memset(dst + filled, 0, (size_t)(left - filled) * 4);
+		}
+		if (!is_unscaled(out)) {
+			blit_scaled_row(out, dst + left, scratch, y - top);
+		}
+		if (left + out->canvas_width > filled) {
+			filled = left + out->canvas_width;
+		}
+	}
+
+	if (filled < canvas->width) {
+		memset(dst + filled, 0, (size_t)(canvas->width - filled) * 4);
+	}
+}
+
+// Each worker composes a contiguous slice of the band's rows
+static void compose_band(struct canvas *canvas, int band, int worker)
+{
+	int first = band * CANVAS_BAND_ROWS;
+	int count = canvas->height - first < CANVAS_BAND_ROWS ?
+			    canvas->height - first :
+			    CANVAS_BAND_ROWS;
+	int workers = canvas->num_workers > 0 ? canvas->num_workers : 1;
+	int slice = (count + workers - 1) / workers;
+	int begin = worker * slice;
+	int end = begin + slice < count ? begin + slice : count;
+
+	uint32_t *rows = canvas->bands[band & 1];
+	uint8_t *scratch = canvas->scratch[worker];
+	for (int i = begin; i < end; i++) {
+		compose_row(canvas, rows + (size_t)i * canvas->width, scratch,
+			    first + i);
+	}
+
+	// Unscaled outputs go through the blocked transform kernel per slice
+	for (int i = 0; i < canvas->count; i++) {
+		const struct canvas_output *out = &canvas->outputs[i];
+		int top = out->y - canvas->min_y;
+		int from = first + begin > top ? first + begin : top;
+		int to = first + end < top + out->canvas_height ?
+				 first + end :
+				 top + out->canvas_height;
+		if (from >= to || !is_unscaled(out)) {
+			continue;
+		}
+
+		uint32_t *dst = rows + (size_t)(from - first) * canvas->width +
+				(out->x - canvas->min_x);
+		if (out->transform == WL_OUTPUT_TRANSFORM_NORMAL) {
+			blit_rows(out, dst, canvas->width, from - top, to - from);
+			continue;
+		}
+
+		struct transform_source src = output_source(out);
+		transform_rows(&src, scratch, out->canvas_width, from - top,
+			       to - from);
+		for (int y = from; y < to; y++) {
+			image_convert_row(out->format,
+					  dst + (size_t)(y - from) * canvas->width,
+					  scratch + (size_t)(y - from) *
+							    out->canvas_width *
+							    src.bpp,
+					  out->canvas_width);
+		}
+	}
+}
+
+static void *worker_main(void *data)
+{
+	struct canvas_worker *worker = data;
+	struct canvas *canvas = worker->canvas;
+	trace_set_thread_name("canvas");
+
+	pthread_mutex_lock(&canvas->start_lock);
+	while (!canvas->started) {
+		pthread_cond_wait(&canvas->start_cond, &canvas->start_lock);
+	}
+	pthread_mutex_unlock(&canvas->start_lock);
+	if (canvas->num_workers == 0) {
+		return NULL;
+	}
+
+	for (int band = 0; band < canvas->num_bands; band++) {
+		uint64_t span = trace_begin();
+		compose_band(canvas, band, worker->index);
+		trace_end("canvas", "compose", span);
+		pthread_barrier_wait(&canvas->barrier);
+	}
+	return NULL;
+}
+
+// Workers start on band n + 1 as soon as band n is handed to the encoder
+static const uint8_t *canvas_rows(void *user, int y, int count)
+{
+	struct canvas *canvas = user;
+	if (canvas->num_workers == 0) {
+		compose_band(canvas, y / CANVAS_BAND_ROWS, 0);
+	} else {
+		pthread_barrier_wait(&canvas->barrier);
+	}
+	canvas->bands_taken++;
+	return (const uint8_t *)canvas->bands[(y / CANVAS_BAND_ROWS) & 1];
+}
+
+static int compare_x(const void *a, const void *b)
+{
+	const struct canvas_output *oa = a, *ob = b;
+	return (oa->x > ob->x) - (oa->x < ob->x);
+}
+
+static int worker_count(void)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus <= 2) {
+		return 1;
+	}
+	return cpus - 1 < CANVAS_MAX_WORKERS ? (int)cpus - 1 :
+					       CANVAS_MAX_WORKERS;
+}
+
+// Encode all outputs into one image covering their bounding box
+int canvas_write(const char *filename, int fd,
+		 const struct canvas_output *outputs, int count, const struct image_options *options)
+{
+	struct canvas canvas = { .count = count };
+	struct canvas_worker workers[CANVAS_MAX_WORKERS];
+	int ret = -1;
+
+	if (count == 0) {
+		log_error("No outputs to capture");
+		return -1;
+	}
+
+	struct canvas_output *sorted = malloc(sizeof(*sorted) * count);
+	if (sorted == NULL) {
+		log_error("Failed to allocate canvas");
+		return -1;
+	}
+	memcpy(sorted, outputs, sizeof(*sorted) * count);
+	qsort(sorted, count, sizeof(*sorted), compare_x);
+	canvas.outputs = sorted;
+
+	int max_x = sorted[0].x + sorted[0].canvas_width;
+	int max_y = sorted[0].y + sorted[0].canvas_height;
+	int max_width = sorted[0].canvas_width;
+	canvas.min_x = sorted[0].x;
+	canvas.min_y = sorted[0].y;
+	for (int i = 1; i < count; i++) {
+		const struct canvas_output *out = &sorted[i];
+		if (out->canvas_width > max_width) {
+			max_width = out->canvas_width;
+		}
+		canvas.min_x = out->x < canvas.min_x ? out->x : canvas.min_x;
+		canvas.min_y = out->y < canvas.min_y ? out->y : canvas.min_y;
+		if (out->x + out->canvas_width > max_x) {
+			max_x = out->x + out->canvas_width;
+		}
+		if (out->y + out->canvas_height > max_y) {
+			max_y = out->y + out->canvas_height;
+		}
+	}
+	canvas.width = max_x - canvas.min_x;
+	canvas.height = max_y - canvas.min_y;
+	canvas.num_bands = (canvas.height + CANVAS_BAND_ROWS - 1) /
+			   CANVAS_BAND_ROWS;
+	log_debug("Composing %d outputs into a %dx%d canvas", count,
+		  canvas.width, canvas.height);
+
+	// Scratch rows hold up to 8 bytes per pixel for half float outputs
+	int wanted = worker_count();
+	size_t band_size = (size_t)canvas.width * CANVAS_BAND_ROWS * 4;
+	size_t scratch_size = (size_t)max_width * CANVAS_BAND_ROWS * 8;
+	canvas.bands[0] = malloc(band_size);
+	canvas.bands[1] = malloc(band_size);
+	bool allocated = canvas.bands[0] != NULL && canvas.bands[1] != NULL;
+	for (int i = 0; i < wanted; i++) {
+		canvas.scratch[i] = malloc(scratch_size);
+		allocated = allocated && canvas.scratch[i] != NULL;
+	}
+	if (!allocated) {
+		log_error("Failed to allocate canvas");
+		goto out;
+	}
+
+	pthread_mutex_init(&canvas.start_lock, NULL);
+	pthread_cond_init(&canvas.start_cond, NULL);
+	int started = 0;
+	for (; started < wanted; started++) {
+		workers[started].canvas = &canvas;
+		workers[started].index = started;
+		if (pthread_create(&workers[started].thread, NULL, worker_main,
+				   &workers[started]) != 0) {
+			log_warn("Failed to start canvas worker: %d of %d running",
+				 started, wanted);
+			break;
+		}
+	}
+
+	// Without any workers the encoder thread composes each band itself
+	canvas.num_workers = started;
+	if (started > 0) {
+		pthread_barrier_init(&canvas.barrier, NULL, started + 1);
+	}
+	pthread_mutex_lock(&canvas.start_lock);
+	canvas.started = true;
+	pthread_cond_broadcast(&canvas.start_cond);
+	pthread_mutex_unlock(&canvas.start_lock);
+
+	ret = write_image_rows(filename, fd, canvas.width, canvas.height, 8,
+			       CANVAS_BAND_ROWS, canvas_rows, &canvas, options);
+
+	// When encoding failed early the workers still wait for the other bands
+	while (started > 0 && canvas.bands_taken < canvas.num_bands) {
+		pthread_barrier_wait(&canvas.barrier);
+		canvas.bands_taken++;
+	}
+	for (int i = 0; i < started; i++) {
+		pthread_join(workers[i].thread, NULL);
+	}
+	if (started > 0) {
+		pthread_barrier_destroy(&canvas.barrier);
+	}
+	pthread_cond_destroy(&canvas.start_cond);
+	pthread_mutex_destroy(&canvas.start_lock);
+
+out:
+	free(canvas.bands[0]);
+	free(canvas.bands[1]);
+	for (int i = 0; i < wanted; i++) {
+		free(canvas.scratch[i]);
+	}
+	free(sorted);
+	return ret;
+}
@@ -0,0 +1,24 @@
+#ifndef _CANVAS_H_
+#define _CANVAS_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <wayland-client.h>
+
+#include "image.h"
+
+// One captured output and where it goes on the canvas
+struct canvas_output {
+	const void *data;
+	enum wl_shm_format format;
+	int width, height, stride; // Of the captured buffer
+	bool y_invert;
+	enum wl_output_transform transform;
+	int x, y; // Canvas pixels
+	int canvas_width, canvas_height; // Size on the canvas after transform and scale
+};
+
+int canvas_write(const char *filename, int fd,
+		 const struct canvas_output *outputs, int count, const struct image_options *options);
+
+#endif /* _CANVAS_H_ */
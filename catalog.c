@@ -0,0 +1,352 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "archive.h"
+#include "catalog.h"
+#include "hash.h"
+#include "image.h"
+#include "io.h"
+#include "log.h"
+#include "transform.h"
+
+/*
+ * Entries are added by the encoders once a file is written, so they can
+ * finish out of order. An entry a little older than the newest is moved
+ * into place among the last few. Anything older means the clock went
+ * back, and starts a new epoch. A crash while entries are moved can leave
+ * one of them in the file twice.
+ */
+#define CATALOG_REORDER_NS (60 * 1000000000LL) // Longer than any capture takes
+#define CATALOG_REORDER_ENTRIES 64
+
+_Static_assert(sizeof(struct catalog_header) == sizeof(struct catalog_entry),
+	       "catalog header and entries must be the same size");
+
+static int catalog_fd = -1;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t count = 0; // Entries in the file
+static int64_t last_time_ns = INT64_MIN; // Newest in the last epoch
+static uint32_t epoch = 0;
+
+static off_t entry_offset(uint64_t index)
+{
+	return sizeof(struct catalog_header) +
+	       (off_t)index * sizeof(struct catalog_entry);
+}
+
+static bool header_valid(const struct catalog_header *header)
+{
+	return header->magic == CATALOG_MAGIC &&
+	       header->version == CATALOG_VERSION &&
+	       header->entry_size == sizeof(struct catalog_entry);
+}
+
+// A new catalog gets its header, an existing one loses a partial last entry
+static int load_catalog(const char *path)
+{
+	struct stat st;
+	if (fstat(catalog_fd, &st) < 0) {
+		log_error("Failed to stat %s: %s", path, strerror(errno));
+		return -1;
+	}
+	if (st.st_size == 0) {
+		struct catalog_header header = {
+			.magic = CATALOG_MAGIC,
+			.version = CATALOG_VERSION,
+			.entry_size = sizeof(struct catalog_entry),
+		};
+		if (io_pwrite_full(catalog_fd, &header, sizeof(header), 0) < 0) {
+			log_error("Failed to write %s: %s", path,
+				  strerror(errno));
+			return -1;
+		}
+		return 0;
+	}
+
+	struct catalog_header header;
+	if (pread(catalog_fd, &header, sizeof(header), 0) !=
+		    (ssize_t)sizeof(header) ||
+	    !header_valid(&header)) {
+		log_error("%s is not a screenshot catalog", path);
+		return -1;
+	}
+
+	off_t entries = (st.st_size - sizeof(header)) /
+			sizeof(struct catalog_entry);
+	off_t size = sizeof(header) + entries * sizeof(struct catalog_entry);
+	if (size != st.st_size) {
+		log_warn("Dropping a partial entry at the end of %s", path);
+		if (ftruncate(catalog_fd, size) < 0) {
+			log_error("Failed to truncate %s: %s", path,
+				  strerror(errno));
+			return -1;
+		}
+	}
+
+	// Entries are only ever inserted among the last ones of the last epoch
+	struct catalog_entry last;
+	count = entries;
+	if (entries > 0 &&
+	    pread(catalog_fd, &last, sizeof(last), size - sizeof(last)) ==
+		    (ssize_t)sizeof(last)) {
+		last_time_ns = last.time_ns;
+		epoch = last.epoch;
+	}
+	return 0;
+}
+
+// KNIPSER_CATALOG=FILE records every screenshot written in FILE
+int catalog_init(void)
+{
+	const char *path = getenv("KNIPSER_CATALOG");
+	if (path == NULL || path[0] == '\0') {
+		return 0;
+	}
+
+	catalog_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (catalog_fd < 0) {
+		log_error("Failed to open %s: %s", path, strerror(errno));
+		return -1;
+	}
+	if (load_catalog(path) < 0) {
+		catalog_deinit();
+		return -1;
+	}
+	log_info("Cataloguing screenshots in %s", path);
+	return 0;
+}
+
+void catalog_deinit(void)
+{
+	if (catalog_fd >= 0) {
+		close(catalog_fd);
+		catalog_fd = -1;
+	}
+}
+
+// Hashes row by row, the pixels are still mapped
+static void prepare(struct capture_job *job)
+{
+	uint64_t hash[2] = { 0, 0 };
+	for (int i = 0; i < job->count; i++) {
+		const struct canvas_output *frame = &job->frames[i];
+		size_t row_size =
+			(size_t)frame->width * image_format_bpp(frame->format);
+		for (int y = 0; y < frame->height; y++) {
+			hash128((const uint8_t *)frame->data +
+					(size_t)y * frame->stride,
+				row_size, hash[0] ^ hash[1], hash);
+		}
+	}
+	job->content_hash[0] = hash[0];
+	job->content_hash[1] = hash[1];
+
+	char path[PATH_MAX];
+	if (archive_enabled()) {
+		archive_path(job->filename, path, sizeof(path));
+	} else {
+		snprintf(path, sizeof(path), "%s", job->filename);
+	}
+	struct stat st;
+	job->file_size = stat(path, &st) == 0 ? (uint64_t)st.st_size : 0;
+}
+
+/*
+ * Write entry where it belongs among the last entries of the epoch, moving
+ * the newer ones up. Returns 1 when it is too old for that.
+ */
+static int insert_entry(const struct catalog_entry *entry)
+{
+	struct catalog_entry tail[CATALOG_REORDER_ENTRIES + 1];
+	size_t num_tail = count < CATALOG_REORDER_ENTRIES ?
+				  count :
+				  CATALOG_REORDER_ENTRIES;
+	off_t offset = entry_offset(count - num_tail);
+	if (pread(catalog_fd, &tail[1], num_tail * sizeof(*tail), offset) !=
+	    (ssize_t)(num_tail * sizeof(*tail))) {
+		return -1;
+	}
+
+	size_t first = num_tail; // The first entry to move up
+	while (first > 0 && tail[first].epoch == entry->epoch &&
+	       tail[first].time_ns > entry->time_ns) {
+		first--;
+	}
+	if (first == 0 && num_tail < count) {
+		return 1;
+	}
+	tail[first] = *entry;
+	return io_pwrite_full(catalog_fd, &tail[first],
+			      (num_tail - first + 1) * sizeof(*tail),
+			      offset + (off_t)first * sizeof(*tail));
+}
+
+// Called by the encoders once a file is written, before its frames are released
+int catalog_add(struct capture_job *job)
+{
+	if (catalog_fd < 0) {
+		return 0;
+	}
+	prepare(job);
+
+	struct catalog_entry entry = {
+		.time_ns = job->time_ns,
+		.hash = { job->content_hash[0], job->content_hash[1] },
+		.file_size = job->file_size,
+		.kind = job->kind,
+		.format = job->frames[0].format,
+		.x = job->area.x,
+		.y = job->area.y,
+		.width = job->area.width,
+		.height = job->area.height,
+	};
+	if (job->kind == CAPTURE_DESKTOP) {
+		// Sized as the canvas is, the layout need not start at 0,0
+		const struct canvas_output *first = &job->frames[0];
+		int min_x = first->x, min_y = first->y;
+		int max_x = first->x + first->canvas_width;
+		int max_y = first->y + first->canvas_height;
+		for (int i = 1; i < job->count; i++) {
+			const struct canvas_output *frame = &job->frames[i];
+			min_x = frame->x < min_x ? frame->x : min_x;
+			min_y = frame->y < min_y ? frame->y : min_y;
+			if (frame->x + frame->canvas_width > max_x) {
+				max_x = frame->x + frame->canvas_width;
+			}
+			if (frame->y + frame->canvas_height > max_y) {
+				max_y = frame->y + frame->canvas_height;
+			}
+		}
+		entry.image_width = max_x - min_x;
+		entry.image_height = max_y - min_y;
+	} else {
+		int width, height;
+		transform_size(job->frames[0].transform, job->frames[0].width,
+			       job->frames[0].height, &width, &height);
+		entry.image_width = width;
+		entry.image_height = height;
+	}
+	snprintf(entry.output, sizeof(entry.output), "%s", job->output);
+	snprintf(entry.description, sizeof(entry.description), "%s",
+		 job->description);
+	snprintf(entry.filename, sizeof(entry.filename), "%s", job->filename);
+
+	pthread_mutex_lock(&lock);
+	int ret = 1;
+	entry.epoch = epoch;
+	if (entry.time_ns < last_time_ns &&
+	    last_time_ns - entry.time_ns <= CATALOG_REORDER_NS) {
+		ret = insert_entry(&entry);
+	}
+	if (ret > 0 && entry.time_ns < last_time_ns) {
+		log_info("The clock went back, starting catalog epoch %u",
+			 epoch + 1);
+		entry.epoch = ++epoch;
+		last_time_ns = INT64_MIN;
+	}
+	if (ret > 0) {
+		ret = io_pwrite_full(catalog_fd, &entry, sizeof(entry),
+				     entry_offset(count));
+		if (ret == 0) {
+			last_time_ns = entry.time_ns;
+		}
+	}
+	if (ret == 0) {
+		count++;
+	} else {
+		log_error("Failed to add to the catalog: %s", strerror(errno));
+	}
+	pthread_mutex_unlock(&lock);
+	return ret;
+}
+
+// Entries appended after mapping are not seen, open again to see them
+int catalog_open(const char *path, struct catalog *catalog)
+{
+	*catalog = (struct catalog){ 0 };
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		log_error("Failed to open %s: %s", path, strerror(errno));
+		return -1;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) < 0 ||
+	    st.st_size < (off_t)sizeof(struct catalog_header)) {
+		log_error("%s is not a screenshot catalog", path);
+		close(fd);
+		return -1;
+	}
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		log_error("Failed to map %s: %s", path, strerror(errno));
+		return -1;
+	}
+	if (!header_valid(map)) {
+		log_error("%s is not a screenshot catalog", path);
+		munmap(map, st.st_size);
+		return -1;
+	}
+
+	// Lookups touch a few pages each, read ahead would only waste memory
+	madvise(map, st.st_size, MADV_RANDOM);
+	*catalog = (struct catalog){
+		.entries = (const struct catalog_entry *)
+				   ((const struct catalog_header *)map + 1),
+		.count = (st.st_size - sizeof(struct catalog_header)) /
+			 sizeof(struct catalog_entry),
+		.map = map,
+		.map_size = st.st_size,
+	};
+	return 0;
+}
+
+void catalog_close(struct catalog *catalog)
+{
+	if (catalog->map != NULL) {
+		munmap(catalog->map, catalog->map_size);
+	}
+	*catalog = (struct catalog){ 0 };
+}
+
+// Index just past the epoch of the entry at start
+size_t catalog_epoch_end(const struct catalog *catalog, size_t start)
+{
+	uint32_t epoch = catalog->entries[start].epoch;
+	size_t low = start, high = catalog->count;
+	while (low < high) {
+		size_t mid = low + (high - low) / 2;
+		if (catalog->entries[mid].epoch <= epoch) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	return low;
+}
+
+// Index of the first entry at or after time_ns in one epoch, end if there is none
+size_t catalog_lower_bound(const struct catalog *catalog, size_t start,
+			   size_t end, int64_t time_ns)
+{
+	size_t low = start, high = end;
+	while (low < high) {
+		size_t mid = low + (high - low) / 2;
+		if (catalog->entries[mid].time_ns < time_ns) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	return low;
+}
@@ -0,0 +1,61 @@
+#ifndef _CATALOG_H_
+#define _CATALOG_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "job.h"
+
+/*
+ * Screenshot catalog. With KNIPSER_CATALOG=FILE, every screenshot written
+ * to disk adds one fixed-size entry to FILE, so finding one by time or
+ * output maps the catalog and never opens an image. Entries hold the real
+ * time of their capture and are sorted by it within an epoch. When the
+ * clock goes back, say when NTP corrects a wrong boot clock, a new epoch
+ * starts after the last one. Each epoch is binary searchable by time, and
+ * the epochs by their number. All integers are in host byte order.
+ */
+#define CATALOG_MAGIC 0x5441434b // "KCAT"
+#define CATALOG_VERSION 2
+
+// As large as an entry, so entries stay aligned in the mapped file
+struct catalog_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t entry_size;
+	uint32_t reserved[61];
+};
+
+struct catalog_entry {
+	int64_t time_ns; // CLOCK_REALTIME when submitted
+	uint64_t hash[2]; // Of the captured pixels, without row padding
+	uint64_t file_size;
+	uint32_t kind; // A capture_kind
+	uint32_t format; // wl_shm format of the first output
+	int32_t x, y, width, height; // Captured area in layout coordinates
+	uint32_t image_width, image_height;
+	char output[48]; // Empty for the desktop
+	char description[76];
+	uint32_t epoch; // Never decreases from one entry to the next
+	char filename[64]; // A manifest in the archive when archiving
+};
+
+// A catalog mapped read-only
+struct catalog {
+	const struct catalog_entry *entries;
+	size_t count;
+	void *map;
+	size_t map_size;
+};
+
+int catalog_init(void);
+void catalog_deinit(void);
+int catalog_add(struct capture_job *job);
+
+int catalog_open(const char *path, struct catalog *catalog);
+void catalog_close(struct catalog *catalog);
+size_t catalog_epoch_end(const struct catalog *catalog, size_t start);
+size_t catalog_lower_bound(const struct catalog *catalog, size_t start,
+			   size_t end, int64_t time_ns);
+
+#endif /* _CATALOG_H_ */
@@ -0,0 +1,546 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "archive.h"
+#include "catalog.h"
+#include "cli.h"
+#include "io.h"
+#include "libknipser.h"
+#include "transform.h"
+
+/*
+ * One-shot captures for scripts. Nothing but the Wayland connection is set
+ * up, no D-Bus, no threads and no tray: connect, capture, write, exit. With
+ * --batch, every line on stdin is one more command with the same options,
+ * run over the same connection and into the same buffer.
+ */
+#define CLI_MAX_ARGS 16
+
+struct cli_command {
+	const char *output; // NULL for the first output
+	bool has_region;
+	int32_t x, y, width, height; // In layout coordinates
+	bool raw;
+	const char *path; // NULL for a timestamped name, "-" for stdout
+	const char *unpack; // Manifest to rebuild a PNG from instead of capturing
+	const char *catalog; // Catalog to look screenshots up in instead of capturing
+	int64_t from_ns, to_ns; // Times to list, to is exclusive
+	int64_t near_ns; // Time to find the closest screenshot to, or -1
+};
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"  --output NAME         capture this output (default: the first)\n"
+		"  --region X,Y,W,H      capture a region in layout coordinates\n"
+		"  --format png|raw      encode as PNG (default) or write the buffer\n"
+		"  -o FILE               write to FILE, - for stdout\n"
+		"  --batch               read one set of options per line from stdin\n"
+		"  --unpack MANIFEST     rebuild the PNG of an archived screenshot\n"
+		"  --catalog FILE        list screenshots in a catalog, of --output only\n"
+		"  --from TIME           ... taken at or after TIME\n"
+		"  --to TIME             ... taken before TIME\n"
+		"  --near TIME           ... the one taken closest to TIME\n"
+		"TIME is YYYY-MM-DD[Thh:mm[:ss]] or hh:mm[:ss] today in local time,\n"
+		"or @SECONDS since the epoch.\n"
+		"Without options knipser runs as a tray icon.\n",
+		argv0);
+}
+
+static int parse_time(const char *text, int64_t *time_ns)
+{
+	if (text[0] == '@') {
+		char *end;
+		double seconds = strtod(text + 1, &end);
+		if (end == text + 1 || *end != '\0') {
+			return -1;
+		}
+		*time_ns = (int64_t)(seconds * 1e9);
+		return 0;
+	}
+
+	// Fields a format doesn't mention keep today's date or midnight
+	static const char *const formats[] = {
+		"%Y-%m-%dT%H:%M:%S", "%Y-%m-%dT%H:%M", "%Y-%m-%d",
+		"%H:%M:%S",	     "%H:%M",
+	};
+	time_t now = time(NULL);
+	for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+		struct tm tm;
+		localtime_r(&now, &tm);
+		tm.tm_hour = tm.tm_min = tm.tm_sec = 0;
+		const char *end = strptime(text, formats[i], &tm);
+		if (end != NULL && *end == '\0') {
+			tm.tm_isdst = -1;
+			*time_ns = (int64_t)mktime(&tm) * 1000000000;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+// Returns 1 for --help, -1 for invalid options
+static int parse_command(int argc, char *argv[], struct cli_command *command,
+			 bool *batch)
+{
+	static const struct option options[] = {
+		{ "output", required_argument, NULL, 'O' },
+		{ "region", required_argument, NULL, 'r' },
+		{ "format", required_argument, NULL, 'f' },
+		{ "batch", no_argument, NULL, 'b' },
+		{ "unpack", required_argument, NULL, 'u' },
+		{ "catalog", required_argument, NULL, 'c' },
+		{ "from", required_argument, NULL, 'F' },
+		{ "to", required_argument, NULL, 'T' },
+		{ "near", required_argument, NULL, 'n' },
+		{ "help", no_argument, NULL, 'h' },
+		{ 0 },
+	};
+	int opt;
+
+	*command = (struct cli_command){
+		.from_ns = INT64_MIN,
+		.to_ns = INT64_MAX,
+		.near_ns = -1,
+	};
+	optind = 0; // Batch lines are parsed one after another
+	while ((opt = getopt_long(argc, argv, "o:", options, NULL)) != -1) {
+		switch (opt) {
+		case 'O':
+			command->output = optarg;
+			break;
+		case 'r':
+			if (sscanf(optarg, "%d,%d,%d,%d", &command->x,
+				   &command->y, &command->width,
+				   &command->height) != 4 ||
+			    command->width <= 0 || command->height <= 0) {
+				fprintf(stderr, "Invalid region %s\n", optarg);
+				return -1;
+			}
+			command->has_region = true;
+			break;
+		case 'f':
+			if (strcmp(optarg, "raw") == 0) {
+				command->raw = true;
+			} else if (strcmp(optarg, "png") != 0) {
+				fprintf(stderr, "Unknown format %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'o':
+			command->path = optarg;
+			break;
+		case 'u':
+			command->unpack = optarg;
+			break;
+		case 'c':
+			command->catalog = optarg;
+			break;
+		case 'F':
+		case 'T':
+		case 'n':
+			if (parse_time(optarg, opt == 'F' ? &command->from_ns :
+					       opt == 'T' ? &command->to_ns :
+							    &command->near_ns) < 0) {
+				fprintf(stderr, "Invalid time %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'b':
+			if (batch == NULL) {
+				return -1;
+			}
+			*batch = true;
+			break;
+		default:
+			return opt == 'h' ? 1 : -1;
+		}
+	}
+	if (optind < argc) {
+		fprintf(stderr, "Unexpected argument %s\n", argv[optind]);
+		return -1;
+	}
+	if (command->has_region && command->output != NULL) {
+		fprintf(stderr, "--region picks its output, drop --output\n");
+		return -1;
+	}
+	return 0;
+}
+
+// Clip a region to the output containing its top left corner, like the daemon
+static int resolve_region(struct knipser_client *client,
+			  const struct cli_command *command,
+			  struct knipser_target *target)
+{
+	for (int i = 0; i < knipser_client_output_count(client); i++) {
+		const struct knipser_output *out =
+			knipser_client_get_output(client, i);
+		int width, height;
+		transform_size(out->transform, out->width, out->height, &width,
+			       &height);
+		width /= out->scale;
+		height /= out->scale;
+
+		int32_t x = command->x - out->x, y = command->y - out->y;
+		if (x < 0 || y < 0 || x >= width || y >= height) {
+			continue;
+		}
+		// Names need wl_output version 4, indexes work with any
+		*target = (struct knipser_target){
+			.index = i,
+			.x = x,
+			.y = y,
+			.width = command->width < width - x ? command->width :
+							      width - x,
+			.height = command->height < height - y ?
+					  command->height :
+					  height - y,
+		};
+		return 0;
+	}
+	return -ENOENT;
+}
+
+static int write_raw(const struct knipser_frame *frame, const void *data,
+		     const char *path)
+{
+	int fd = strcmp(path, "-") == 0 ? STDOUT_FILENO :
+					  creat(path, 0644);
+	if (fd < 0) {
+		return -errno;
+	}
+	size_t size = (size_t)frame->stride * frame->height;
+	int ret = io_write_full(fd, data, size) < 0 ? -errno : 0;
+	if (fd != STDOUT_FILENO && close(fd) < 0 && ret == 0) {
+		ret = -errno;
+	}
+	return ret;
+}
+
+// Captures into the shared buffer, growing it once if the frame doesn't fit
+static int capture(struct knipser_client *client,
+		   const struct knipser_target *target,
+		   struct knipser_buffer *buffer, struct knipser_frame *frame)
+{
+	int ret = knipser_client_capture(client, target, buffer, frame);
+	if (ret != -ENOSPC) {
+		return ret;
+	}
+
+	knipser_buffer_destroy(buffer);
+	ret = knipser_buffer_create((size_t)frame->stride * frame->height,
+				    buffer);
+	if (ret < 0) {
+		return ret;
+	}
+	return knipser_client_capture(client, target, buffer, frame);
+}
+
+// Named after the manifest, in the working directory
+static int unpack(const struct cli_command *command, char *path,
+		  size_t path_size)
+{
+	if (command->path != NULL) {
+		snprintf(path, path_size, "%s", command->path);
+	} else {
+		const char *base = strrchr(command->unpack, '/');
+		base = base != NULL ? base + 1 : command->unpack;
+		const char *dot = strrchr(base, '.');
+		int length = dot != NULL ? (int)(dot - base) : (int)strlen(base);
+		snprintf(path, path_size, "%.*s.png", length, base);
+	}
+
+	bool to_stdout = strcmp(path, "-") == 0;
+	if (archive_unpack(command->unpack, to_stdout ? "" : path,
+			   to_stdout ? STDOUT_FILENO : -1) < 0) {
+		return -EIO;
+	}
+	return 0;
+}
+
+// One tab separated line per screenshot, for people and for cut(1)
+static void print_entry(const struct catalog_entry *entry)
+{
+	char timestamp[32];
+	time_t seconds = entry->time_ns / 1000000000;
+	struct tm tm;
+	localtime_r(&seconds, &tm);
+	strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%S", &tm);
+
+	printf("%s.%03d\t%s\t%d,%d %dx%d\t%ux%u\t%016llx%016llx\t%llu\t%s\t%s\n",
+	       timestamp, (int)(entry->time_ns / 1000000 % 1000),
+	       entry->output[0] != '\0' ? entry->output : "desktop", entry->x,
+	       entry->y, entry->width, entry->height, entry->image_width,
+	       entry->image_height, (unsigned long long)entry->hash[0],
+	       (unsigned long long)entry->hash[1],
+	       (unsigned long long)entry->file_size, entry->filename,
+	       entry->description);
+}
+
+static bool entry_matches(const struct catalog_entry *entry,
+			  const struct cli_command *command)
+{
+	return command->output == NULL ||
+	       strcmp(entry->output, command->output) == 0;
+}
+
+// Closer of two entries to time_ns, either may be NULL
+static const struct catalog_entry *
+nearer(const struct catalog_entry *a, const struct catalog_entry *b,
+       int64_t time_ns)
+{
+	if (a == NULL || b == NULL) {
+		return a != NULL ? a : b;
+	}
+	uint64_t distance_a = a->time_ns < time_ns ?
+				      (uint64_t)time_ns - a->time_ns :
+				      (uint64_t)a->time_ns - time_ns;
+	uint64_t distance_b = b->time_ns < time_ns ?
+				      (uint64_t)time_ns - b->time_ns :
+				      (uint64_t)b->time_ns - time_ns;
+	return distance_b < distance_a ? b : a;
+}
+
+// Matching entry of one epoch closest to near_ns, NULL if there is none
+static const struct catalog_entry *
+find_near(const struct catalog *catalog, size_t start, size_t end,
+	  const struct cli_command *command)
+{
+	size_t after =
+		catalog_lower_bound(catalog, start, end, command->near_ns);
+	size_t before = after;
+	while (after < end &&
+	       !entry_matches(&catalog->entries[after], command)) {
+		after++;
+	}
+	while (before > start &&
+	       !entry_matches(&catalog->entries[before - 1], command)) {
+		before--;
+	}
+	return nearer(before > start ? &catalog->entries[before - 1] : NULL,
+		      after < end ? &catalog->entries[after] : NULL,
+		      command->near_ns);
+}
+
+/*
+ * Times are found by binary search in each epoch, the output is then
+ * matched entry by entry from there, so only the pages of the entries
+ * around the results are read no matter how large the catalog is.
+ */
+static int query(const struct cli_command *command)
+{
+	struct catalog catalog;
+	if (catalog_open(command->catalog, &catalog) < 0) {
+		return -EIO;
+	}
+
+	int found = 0;
+	const struct catalog_entry *best = NULL;
+	size_t end;
+	for (size_t start = 0; start < catalog.count; start = end) {
+		end = catalog_epoch_end(&catalog, start);
+		if (command->near_ns >= 0) {
+			best = nearer(best,
+				      find_near(&catalog, start, end, command),
+				      command->near_ns);
+			continue;
+		}
+		size_t last = catalog_lower_bound(&catalog, start, end,
+						  command->to_ns);
+		for (size_t i = catalog_lower_bound(&catalog, start, end,
+						    command->from_ns);
+		     i < last; i++) {
+			if (entry_matches(&catalog.entries[i], command)) {
+				print_entry(&catalog.entries[i]);
+				found++;
+			}
+		}
+	}
+	if (best != NULL) {
+		print_entry(best);
+		found++;
+	}
+
+	catalog_close(&catalog);
+	return found > 0 ? 0 : -ENOENT;
+}
+
+static int run_command(struct knipser_client *client,
+		       struct knipser_buffer *buffer,
+		       const struct cli_command *command, char *path,
+		       size_t path_size)
+{
+	if (command->unpack != NULL) {
+		return unpack(command, path, path_size);
+	}
+
+	struct knipser_target target = { .output = command->output };
+	int ret = 0;
+	if (command->has_region) {
+		ret = resolve_region(client, command, &target);
+	}
+
+	struct knipser_frame frame;
+	if (ret == 0) {
+		ret = capture(client, &target, buffer, &frame);
+	}
+	if (ret < 0) {
+		return ret;
+	}
+
+	if (command->path != NULL) {
+		snprintf(path, path_size, "%s", command->path);
+	} else {
+		// Batches write more than one file a second, so they are numbered
+		static int sequence = 0;
+		char timestamp[20];
+		time_t now = time(NULL);
+		strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%S",
+			 localtime(&now));
+		const char *extension = command->raw ? "raw" : "png";
+		if (sequence > 0) {
+			snprintf(path, path_size, "screenshot_%s-%d.%s", timestamp,
+				 sequence, extension);
+		} else {
+			snprintf(path, path_size, "screenshot_%s.%s", timestamp,
+				 extension);
+		}
+		sequence++;
+	}
+
+	if (command->raw) {
+		ret = write_raw(&frame, buffer->data, path);
+		fprintf(stderr, "%s: %dx%d stride %d format 0x%08x%s\n", path,
+			frame.width, frame.height, frame.stride, frame.format,
+			frame.y_invert ? " y-inverted" : "");
+		return ret;
+	}
+	bool to_stdout = strcmp(path, "-") == 0;
+	return knipser_encode(&frame, buffer->data, to_stdout ? NULL : path,
+			      to_stdout ? STDOUT_FILENO : -1);
+}
+
+// Each line answers with "ok PATH" or "error MESSAGE", so a script can wait for its file
+static int run_batch(struct knipser_client *client,
+		     struct knipser_buffer *buffer)
+{
+	char *line = NULL;
+	size_t line_size = 0;
+	int failed = 0;
+
+	while (getline(&line, &line_size, stdin) >= 0) {
+		char *argv[CLI_MAX_ARGS + 1] = { "knipser" };
+		int argc = 1;
+		char *save;
+		char *arg = strtok_r(line, " \t\n", &save);
+		for (; arg != NULL && argc < CLI_MAX_ARGS;
+		     arg = strtok_r(NULL, " \t\n", &save)) {
+			argv[argc++] = arg;
+		}
+		if (argc == 1 || argv[1][0] == '#') {
+			continue;
+		}
+
+		struct cli_command command;
+		char path[256];
+		int ret = -1;
+		if (arg != NULL) {
+			fprintf(stderr, "Batch lines take at most %d arguments\n",
+				CLI_MAX_ARGS - 1);
+		} else {
+			ret = parse_command(argc, argv, &command, NULL);
+		}
+		if (ret == 0 && command.path != NULL &&
+		    strcmp(command.path, "-") == 0) {
+			fprintf(stderr, "Batches can't write to stdout\n");
+			ret = -1;
+		} else if (ret == 0 && command.catalog != NULL) {
+			fprintf(stderr, "Batches can't query catalogs\n");
+			ret = -1;
+		}
+		if (ret != 0) {
+			printf("error invalid command\n");
+		} else if ((ret = run_command(client, buffer, &command, path,
+					      sizeof(path))) < 0) {
+			printf("error %s\n", strerror(-ret));
+		} else {
+			printf("ok %s\n", path);
+		}
+		fflush(stdout);
+		failed += ret != 0;
+	}
+
+	free(line);
+	return failed > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+int cli_main(int argc, char *argv[])
+{
+	struct cli_command command;
+	bool batch = false;
+	int ret = parse_command(argc, argv, &command, &batch);
+	if (ret != 0) {
+		usage(argv[0]);
+		return ret > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	// Catalogs and archived screenshots are read without a compositor
+	if (!batch && command.catalog != NULL) {
+		ret = query(&command);
+		if (ret == -ENOENT) {
+			fprintf(stderr, "No screenshot found\n");
+		}
+		return ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+
+	char path[256];
+	if (!batch && command.unpack != NULL) {
+		ret = unpack(&command, path, sizeof(path));
+		if (ret < 0) {
+			fprintf(stderr, "Failed to unpack %s\n", command.unpack);
+		} else if (command.path == NULL) {
+			printf("%s\n", path);
+		}
+		return ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+
+	struct knipser_client *client;
+	ret = knipser_client_connect(NULL, &client);
+	if (ret < 0) {
+		fprintf(stderr, "Failed to connect to the compositor: %s\n",
+			strerror(-ret));
+		return EXIT_FAILURE;
+	}
+
+	// Sized for the first output, only deeper formats or larger outputs reallocate
+	struct knipser_buffer buffer = { .fd = -1 };
+	const struct knipser_output *first = knipser_client_get_output(client, 0);
+	if (first != NULL) {
+		knipser_buffer_create((size_t)first->width * first->height * 4,
+				      &buffer);
+	}
+
+	if (batch) {
+		ret = run_batch(client, &buffer);
+	} else {
+		ret = run_command(client, &buffer, &command, path, sizeof(path));
+		if (ret < 0) {
+			fprintf(stderr, "Capture failed: %s\n", strerror(-ret));
+		} else if (command.path == NULL) {
+			printf("%s\n", path);
+		}
+		ret = ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+
+	knipser_buffer_destroy(&buffer);
+	knipser_client_disconnect(client);
+	return ret;
+}
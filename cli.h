@@ -0,0 +1,6 @@
+#ifndef _CLI_H_
+#define _CLI_H_
+
+int cli_main(int argc, char *argv[]);
+
+#endif /* _CLI_H_ */
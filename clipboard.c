@@ -0,0 +1,373 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+
+#include "clipboard.h"
+#include "codec.h"
+#include "encoder.h"
+#include "log.h"
+#include "queue.h"
+#include "trace.h"
+#include "wayland.h"
+#include "wayland-protocols/wlr-data-control-unstable-v1-client-protocol.h"
+
+/*
+ * Encoding and sending run on a worker of their own: the target reads at
+ * its own pace, and the Wayland thread must keep capturing meanwhile. Only
+ * one paste is served at a time, so the caches need no lock.
+ */
+#define CLIPBOARD_MAX_SENDS 16
+#define CLIPBOARD_SEND_TIMEOUT_MS 5000 // For a target that stops reading
+
+static const struct clipboard_type {
+	const char *mime_type;
+	image_rows_writer writer; // NULL for PNG
+} types[] = {
+	{ "image/png", NULL },
+#ifdef KNIPSER_HAVE_JPEG
+	{ "image/jpeg", codec_write_jpeg },
+#endif
+#ifdef KNIPSER_HAVE_WEBP
+	{ "image/webp", codec_write_webp },
+#endif
+	{ "image/x-portable-pixmap", codec_write_ppm },
+};
+#define NUM_TYPES (sizeof(types) / sizeof(types[0]))
+
+// Shared by the selection and the pastes in progress
+struct clipboard_image {
+	atomic_int refs;
+	struct capture_job job; // Owns the mappings
+	int cache[NUM_TYPES]; // memfds, -1 until pasted as that type
+	off_t cache_size[NUM_TYPES];
+};
+
+struct clipboard_send {
+	struct clipboard_image *image;
+	size_t type;
+	int fd;
+};
+
+// Only touched by the Wayland thread, and by clipboard_deinit() once it stopped
+static struct zwlr_data_control_manager_v1 *manager = NULL;
+static struct wl_seat *seat = NULL;
+static struct zwlr_data_control_device_v1 *device = NULL;
+static struct zwlr_data_control_source_v1 *source = NULL;
+static struct clipboard_image *current = NULL;
+
+static atomic_bool available = false;
+static atomic_bool owned = false;
+static atomic_bool stopping = false;
+static struct queue sends;
+static pthread_t worker;
+static bool worker_started = false;
+
+static void image_unref(struct clipboard_image *image)
+{
+	if (atomic_fetch_sub(&image->refs, 1) != 1) {
+		return;
+	}
+	for (int i = 0; i < image->job.count; i++) {
+		wayland_release_mapping(image->job.mappings[i]);
+	}
+	for (size_t i = 0; i < NUM_TYPES; i++) {
+		if (image->cache[i] >= 0) {
+			close(image->cache[i]);
+		}
+	}
+	free(image);
+}
+
+static void free_send(struct clipboard_send *send)
+{
+	close(send->fd);
+	image_unref(send->image);
+	free(send);
+}
+
+static int encode(struct clipboard_image *image, size_t type)
+{
+	uint64_t span = trace_begin();
+	int fd = memfd_create("knipser-clipboard", MFD_CLOEXEC);
+	if (fd < 0) {
+		log_error("memfd_create failed: %s", strerror(errno));
+		return -EIO;
+	}
+
+	struct image_options options = image_default_options;
+	if (types[type].writer != NULL) {
+		options.writer = types[type].writer;
+		options.bit_depth = 8;
+	}
+	struct stat st;
+	if (encoder_write(&image->job, fd, &options) < 0 ||
+	    fstat(fd, &st) < 0) {
+		close(fd);
+		return -EIO;
+	}
+
+	image->cache[type] = fd;
+	image->cache_size[type] = st.st_size;
+	trace_end("clipboard", types[type].mime_type, span);
+	return 0;
+}
+
+// The target's fd is non-blocking, so a target that stops reading times out
+static int send_cached(int cache, off_t size, int fd)
+{
+	off_t offset = 0;
+	while (offset < size) {
+		ssize_t sent = sendfile(fd, cache, &offset, size - offset);
+		if (sent < 0 && errno == EINTR) {
+			continue;
+		}
+		if (sent < 0 && errno == EAGAIN) {
+			struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+			int ready = poll(&pfd, 1, CLIPBOARD_SEND_TIMEOUT_MS);
+			if (ready == 0) {
+				return -ETIMEDOUT;
+			}
+			if (ready < 0 && errno != EINTR) {
+				return -errno;
+			}
+			continue;
+		}
+		if (sent <= 0) {
+			return sent < 0 ? -errno : -EIO;
+		}
+	}
+	return 0;
+}
+
+static void serve(struct clipboard_send *send)
+{
+	struct clipboard_image *image = send->image;
+	int ret = 0;
+	if (image->cache[send->type] < 0) {
+		ret = encode(image, send->type);
+	}
+	if (ret == 0) {
+		ret = send_cached(image->cache[send->type],
+				  image->cache_size[send->type], send->fd);
+	}
+	if (ret < 0) {
+		log_warn("Failed to paste as %s: %s", types[send->type].mime_type,
+			 strerror(-ret));
+	}
+	free_send(send);
+}
+
+static void *worker_main(void *data)
+{
+	trace_set_thread_name("clipboard");
+
+	// A target that closes early makes sendfile fail with EPIPE instead
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+	while (1) {
+		struct clipboard_send *send = queue_wait(&sends);
+		if (send == NULL) {
+			if (atomic_load(&stopping)) {
+				break;
+			}
+			continue;
+		}
+		serve(send);
+	}
+	return NULL;
+}
+
+static void drop_selection(void)
+{
+	if (source != NULL) {
+		zwlr_data_control_source_v1_destroy(source);
+		source = NULL;
+	}
+	if (current != NULL) {
+		image_unref(current);
+		current = NULL;
+	}
+	atomic_store(&owned, false);
+}
+
+static void source_handle_send(void *data,
+			       struct zwlr_data_control_source_v1 *offered,
+			       const char *mime_type, int32_t fd)
+{
+	struct clipboard_image *image = data;
+	size_t type = 0;
+	while (type < NUM_TYPES &&
+	       strcmp(types[type].mime_type, mime_type) != 0) {
+		type++;
+	}
+	struct clipboard_send *send =
+		type < NUM_TYPES ? malloc(sizeof(*send)) : NULL;
+	if (send == NULL) {
+		close(fd);
+		return;
+	}
+
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	atomic_fetch_add(&image->refs, 1);
+	*send = (struct clipboard_send){ image, type, fd };
+	if (!queue_push(&sends, send)) {
+		log_warn("Too many pastes at once");
+		free_send(send);
+	}
+}
+
+// Another client took the selection
+static void source_handle_cancelled(void *data,
+				    struct zwlr_data_control_source_v1 *offered)
+{
+	drop_selection();
+}
+
+static const struct zwlr_data_control_source_v1_listener source_listener = {
+	.send = source_handle_send,
+	.cancelled = source_handle_cancelled,
+};
+
+// Offers are announced before they become the selection, which we never read
+static void device_handle_data_offer(void *data,
+				     struct zwlr_data_control_device_v1 *data_device,
+				     struct zwlr_data_control_offer_v1 *offer)
+{
+}
+
+static void device_handle_selection(void *data,
+				    struct zwlr_data_control_device_v1 *data_device,
+				    struct zwlr_data_control_offer_v1 *offer)
+{
+	if (offer != NULL) {
+		zwlr_data_control_offer_v1_destroy(offer);
+	}
+}
+
+static void device_handle_finished(void *data,
+				   struct zwlr_data_control_device_v1 *data_device)
+{
+	drop_selection();
+	zwlr_data_control_device_v1_destroy(device);
+	device = NULL;
+}
+
+static const struct zwlr_data_control_device_v1_listener device_listener = {
+	.data_offer = device_handle_data_offer,
+	.selection = device_handle_selection,
+	.finished = device_handle_finished,
+	.primary_selection = device_handle_selection,
+};
+
+// Called once the globals are known, the Wayland thread keeps ownership of both
+void clipboard_bind(struct zwlr_data_control_manager_v1 *manager_arg,
+		    struct wl_seat *seat_arg)
+{
+	if (queue_init(&sends, CLIPBOARD_MAX_SENDS, true) < 0) {
+		return;
+	}
+	if (pthread_create(&worker, NULL, worker_main, NULL) != 0) {
+		log_error("Failed to start clipboard thread");
+		queue_finish(&sends);
+		return;
+	}
+	worker_started = true;
+	manager = manager_arg;
+	seat = seat_arg;
+	atomic_store(&available, true);
+}
+
+// Takes the job's mappings and offers every type, without encoding any
+int clipboard_publish(struct capture_job *job)
+{
+	if (!atomic_load(&available)) {
+		log_error("Compositor doesn't support wlr-data-control-unstable-v1");
+		return -1;
+	}
+	if (device == NULL) {
+		device = zwlr_data_control_manager_v1_get_data_device(manager,
+								      seat);
+		zwlr_data_control_device_v1_add_listener(device,
+							 &device_listener, NULL);
+	}
+
+	struct clipboard_image *image = malloc(sizeof(*image));
+	if (image == NULL) {
+		log_error("Failed to allocate clipboard image");
+		return -1;
+	}
+	atomic_init(&image->refs, 1);
+	image->job = *job;
+	for (size_t i = 0; i < NUM_TYPES; i++) {
+		image->cache[i] = -1;
+	}
+	for (int i = 0; i < job->count; i++) {
+		job->mappings[i] = NULL;
+	}
+
+	struct zwlr_data_control_source_v1 *offered =
+		zwlr_data_control_manager_v1_create_data_source(manager);
+	zwlr_data_control_source_v1_add_listener(offered, &source_listener,
+						 image);
+	for (size_t i = 0; i < NUM_TYPES; i++) {
+		zwlr_data_control_source_v1_offer(offered, types[i].mime_type);
+	}
+	zwlr_data_control_device_v1_set_selection(device, offered);
+
+	drop_selection();
+	source = offered;
+	current = image;
+	atomic_store(&owned, true);
+	return 0;
+}
+
+// After the Wayland thread stopped, before the manager is destroyed
+void clipboard_deinit(void)
+{
+	if (worker_started) {
+		atomic_store(&stopping, true);
+		queue_wake(&sends);
+		pthread_join(worker, NULL);
+		worker_started = false;
+
+		struct clipboard_send *send;
+		while ((send = queue_pop(&sends)) != NULL) {
+			free_send(send);
+		}
+		queue_finish(&sends);
+	}
+
+	drop_selection();
+	if (device != NULL) {
+		zwlr_data_control_device_v1_destroy(device);
+		device = NULL;
+	}
+	manager = NULL;
+	seat = NULL;
+	atomic_store(&available, false);
+}
+
+bool clipboard_available(void)
+{
+	return atomic_load(&available);
+}
+
+// The selection is lost when knipser exits, so owning it counts as activity
+bool clipboard_owned(void)
+{
+	return atomic_load(&owned);
+}
@@ -0,0 +1,25 @@
+#ifndef _CLIPBOARD_H_
+#define _CLIPBOARD_H_
+
+#include <stdbool.h>
+
+#include "job.h"
+
+struct wl_seat;
+struct zwlr_data_control_manager_v1;
+
+/*
+ * Screenshots on the clipboard through wlr-data-control. The captured
+ * frames stay mapped while knipser owns the selection, and nothing is
+ * encoded until something is pasted. Each paste is encoded in the type it
+ * asks for, once, and later pastes of that type are sent from the cached
+ * encoding. Everything but the sending runs on the Wayland thread.
+ */
+void clipboard_bind(struct zwlr_data_control_manager_v1 *manager,
+		    struct wl_seat *seat);
+int clipboard_publish(struct capture_job *job);
+void clipboard_deinit(void);
+bool clipboard_available(void);
+bool clipboard_owned(void);
+
+#endif /* _CLIPBOARD_H_ */
@@ -0,0 +1,208 @@
+#define _GNU_SOURCE
+#include <setjmp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef KNIPSER_HAVE_JPEG
+#include <jpeglib.h>
+#endif
+#ifdef KNIPSER_HAVE_WEBP
+#include <webp/encode.h>
+#endif
+
+#include "codec.h"
+#include "io.h"
+#include "log.h"
+
+// Screenshots are mostly text and edges, which suffer below this
+#define CODEC_QUALITY 90
+
+static int close_output(FILE *file, int ret, const char *filename)
+{
+	if (ferror(file)) {
+		ret = -1;
+	}
+	if (fclose(file) != 0) {
+		ret = -1;
+	}
+	if (ret < 0) {
+		log_error("Failed to write %s", filename);
+	}
+	return ret;
+}
+
+static void rgba_to_rgb(uint8_t *dst, const uint8_t *src, int width)
+{
+	for (int x = 0; x < width; x++) {
+		dst[3 * x] = src[4 * x];
+		dst[3 * x + 1] = src[4 * x + 1];
+		dst[3 * x + 2] = src[4 * x + 2];
+	}
+}
+
+// Binary PPM, the pixels and nothing else that any image tool reads
+int codec_write_ppm(const char *filename, int fd, int width, int height,
+		    int bit_depth, int band_rows, image_row_source source,
+		    void *user, const struct image_options *options)
+{
+	if (bit_depth != 8) {
+		log_error("PPM needs 8-bit rows, not %d", bit_depth);
+		return -1;
+	}
+	FILE *file = io_open_output(filename, fd);
+	uint8_t *rgb = malloc((size_t)width * 3);
+	if (file == NULL || rgb == NULL) {
+		log_error("Failed to open %s", filename);
+		free(rgb);
+		if (file != NULL) {
+			fclose(file);
+		}
+		return -1;
+	}
+
+	int ret = 0;
+	fprintf(file, "P6\n%d %d\n255\n", width, height);
+	for (int y = 0; y < height && ret == 0; y += band_rows) {
+		int count = band_rows < height - y ? band_rows : height - y;
+		const uint8_t *rows = source(user, y, count);
+		for (int i = 0; i < count && rows != NULL; i++) {
+			rgba_to_rgb(rgb, rows + (size_t)i * width * 4, width);
+			if (fwrite(rgb, 3, width, file) != (size_t)width) {
+				ret = -1;
+				break;
+			}
+		}
+		if (rows == NULL) {
+			ret = -1;
+		}
+	}
+
+	free(rgb);
+	return close_output(file, ret, filename);
+}
+
+#ifdef KNIPSER_HAVE_JPEG
+// libjpeg exits on errors unless error_exit jumps back out
+struct jpeg_error {
+	struct jpeg_error_mgr mgr;
+	jmp_buf jump;
+};
+
+static void jpeg_error_exit(j_common_ptr cinfo)
+{
+	char message[JMSG_LENGTH_MAX];
+	cinfo->err->format_message(cinfo, message);
+	log_error("JPEG encoding failed: %s", message);
+	longjmp(((struct jpeg_error *)cinfo->err)->jump, 1);
+}
+
+int codec_write_jpeg(const char *filename, int fd, int width, int height,
+		     int bit_depth, int band_rows, image_row_source source,
+		     void *user, const struct image_options *options)
+{
+	if (bit_depth != 8) {
+		log_error("JPEG needs 8-bit rows, not %d", bit_depth);
+		return -1;
+	}
+	FILE *file = io_open_output(filename, fd);
+	uint8_t *volatile rgb = malloc((size_t)width * 3);
+	if (file == NULL || rgb == NULL) {
+		log_error("Failed to open %s", filename);
+		free(rgb);
+		if (file != NULL) {
+			fclose(file);
+		}
+		return -1;
+	}
+
+	struct jpeg_compress_struct cinfo;
+	struct jpeg_error error;
+	cinfo.err = jpeg_std_error(&error.mgr);
+	error.mgr.error_exit = jpeg_error_exit;
+	if (setjmp(error.jump) != 0) {
+		jpeg_destroy_compress(&cinfo);
+		free(rgb);
+		return close_output(file, -1, filename);
+	}
+
+	jpeg_create_compress(&cinfo);
+	jpeg_stdio_dest(&cinfo, file);
+	cinfo.image_width = width;
+	cinfo.image_height = height;
+	cinfo.input_components = 3;
+	cinfo.in_color_space = JCS_RGB;
+	jpeg_set_defaults(&cinfo);
+	jpeg_set_quality(&cinfo, CODEC_QUALITY, TRUE);
+	jpeg_start_compress(&cinfo, TRUE);
+
+	int ret = 0;
+	for (int y = 0; y < height && ret == 0; y += band_rows) {
+		int count = band_rows < height - y ? band_rows : height - y;
+		const uint8_t *rows = source(user, y, count);
+		if (rows == NULL) {
+			ret = -1;
+			break;
+		}
+		for (int i = 0; i < count; i++) {
+			JSAMPROW row = rgb;
+			rgba_to_rgb(rgb, rows + (size_t)i * width * 4, width);
+			jpeg_write_scanlines(&cinfo, &row, 1);
+		}
+	}
+
+	if (ret == 0) {
+		jpeg_finish_compress(&cinfo);
+	}
+	jpeg_destroy_compress(&cinfo);
+	free(rgb);
+	return close_output(file, ret, filename);
+}
+#endif
+
+#ifdef KNIPSER_HAVE_WEBP
+// The WebP encoder wants the whole image at once, so the rows are gathered first
+int codec_write_webp(const char *filename, int fd, int width, int height,
+		     int bit_depth, int band_rows, image_row_source source,
+		     void *user, const struct image_options *options)
+{
+	if (bit_depth != 8) {
+		log_error("WebP needs 8-bit rows, not %d", bit_depth);
+		return -1;
+	}
+	size_t row_size = (size_t)width * 4;
+	uint8_t *rgba = malloc(row_size * height);
+	if (rgba == NULL) {
+		log_error("Failed to allocate %dx%d image", width, height);
+		return -1;
+	}
+	for (int y = 0; y < height; y += band_rows) {
+		int count = band_rows < height - y ? band_rows : height - y;
+		const uint8_t *rows = source(user, y, count);
+		if (rows == NULL) {
+			free(rgba);
+			return -1;
+		}
+		memcpy(rgba + y * row_size, rows, count * row_size);
+	}
+
+	uint8_t *output = NULL;
+	size_t size = WebPEncodeRGBA(rgba, width, height, row_size,
+				     CODEC_QUALITY, &output);
+	free(rgba);
+	if (size == 0) {
+		log_error("WebP encoding failed");
+		return -1;
+	}
+
+	FILE *file = io_open_output(filename, fd);
+	if (file == NULL) {
+		log_error("Failed to open %s", filename);
+		WebPFree(output);
+		return -1;
+	}
+	int ret = fwrite(output, 1, size, file) == size ? 0 : -1;
+	WebPFree(output);
+	return close_output(file, ret, filename);
+}
+#endif
@@ -0,0 +1,25 @@
+#ifndef _CODEC_H_
+#define _CODEC_H_
+
+#include "image.h"
+
+/*
+ * Encodings besides PNG, as image_rows_writers for image_options.writer.
+ * They take 8-bit rows only, so set image_options.bit_depth to 8 as well.
+ * JPEG and WebP are only built when their libraries are found.
+ */
+int codec_write_ppm(const char *filename, int fd, int width, int height,
+		    int bit_depth, int band_rows, image_row_source source,
+		    void *user, const struct image_options *options);
+#ifdef KNIPSER_HAVE_JPEG
+int codec_write_jpeg(const char *filename, int fd, int width, int height,
+		     int bit_depth, int band_rows, image_row_source source,
+		     void *user, const struct image_options *options);
+#endif
+#ifdef KNIPSER_HAVE_WEBP
+int codec_write_webp(const char *filename, int fd, int width, int height,
+		     int bit_depth, int band_rows, image_row_source source,
+		     void *user, const struct image_options *options);
+#endif
+
+#endif /* _CODEC_H_ */
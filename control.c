@@ -0,0 +1,334 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "control.h"
+#include "knipser.h"
+#include "log.h"
+
+#define CONTROL_MAX_CLIENTS (CONTROL_MAX_FDS - 2)
+
+/*
+ * A reply may arrive after its client went away and the slot was reused, so
+ * waiters carry the slot and its generation.
+ */
+struct control_client {
+	int fd;
+	uint32_t generation;
+};
+
+static int signal_fd = -1;
+static int listen_fd = -1;
+static struct control_client clients[CONTROL_MAX_CLIENTS];
+static bool quit = false;
+
+static int open_socket(const char *env)
+{
+	char name[sizeof(((struct sockaddr_un *)0)->sun_path) - 1];
+	if (strcmp(env, "1") == 0) {
+		snprintf(name, sizeof(name), "knipser-%u", (unsigned)getuid());
+	} else {
+		snprintf(name, sizeof(name), "%s", env);
+	}
+
+	listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			   0);
+	if (listen_fd < 0) {
+		log_error("Failed to create control socket: %s",
+			  strerror(errno));
+		return -1;
+	}
+
+	// Abstract addresses start with a NUL byte and are not NUL terminated
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	size_t len = strlen(name);
+	memcpy(addr.sun_path + 1, name, len);
+	socklen_t addr_len = offsetof(struct sockaddr_un, sun_path) + 1 + len;
+	if (bind(listen_fd, (struct sockaddr *)&addr, addr_len) < 0 ||
+	    listen(listen_fd, CONTROL_MAX_CLIENTS) < 0) {
+		log_error("Failed to listen on @%s: %s", name, strerror(errno));
+		close(listen_fd);
+		listen_fd = -1;
+		return -1;
+	}
+
+	log_info("Listening for capture commands on @%s", name);
+	return 0;
+}
+
+static void get_mask(sigset_t *mask)
+{
+	sigemptyset(mask);
+	sigaddset(mask, SIGUSR1);
+	sigaddset(mask, SIGUSR2);
+	sigaddset(mask, SIGINT);
+	sigaddset(mask, SIGTERM);
+}
+
+/*
+ * Must run before any thread starts, the logger's included. A thread that
+ * left them unblocked would take the signals itself, and SIGUSR1 or SIGUSR2
+ * would kill the process.
+ */
+void control_block_signals(void)
+{
+	sigset_t mask;
+	get_mask(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+}
+
+int control_init(void)
+{
+	for (int i = 0; i < CONTROL_MAX_CLIENTS; i++) {
+		clients[i].fd = -1;
+	}
+
+	sigset_t mask;
+	get_mask(&mask);
+	signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (signal_fd < 0) {
+		log_error("Failed to create signalfd: %s", strerror(errno));
+		return -1;
+	}
+
+	const char *env = getenv("KNIPSER_CONTROL_SOCKET");
+	if (env != NULL && env[0] != '\0' && open_socket(env) < 0) {
+		return -1;
+	}
+	return 0;
+}
+
+static void close_client(struct control_client *client)
+{
+	close(client->fd);
+	client->fd = -1;
+	client->generation++;
+}
+
+void control_deinit(void)
+{
+	for (int i = 0; i < CONTROL_MAX_CLIENTS; i++) {
+		if (clients[i].fd >= 0) {
+			close_client(&clients[i]);
+		}
+	}
+	if (listen_fd >= 0) {
+		close(listen_fd);
+		listen_fd = -1;
+	}
+	if (signal_fd >= 0) {
+		close(signal_fd);
+		signal_fd = -1;
+	}
+}
+
+int control_prepare_poll(struct pollfd *fds, int max)
+{
+	int count = 0;
+	if (signal_fd >= 0 && count < max) {
+		fds[count++] = (struct pollfd){ .fd = signal_fd, .events = POLLIN };
+	}
+	if (listen_fd >= 0 && count < max) {
+		fds[count++] = (struct pollfd){ .fd = listen_fd, .events = POLLIN };
+	}
+	for (int i = 0; i < CONTROL_MAX_CLIENTS && count < max; i++) {
+		if (clients[i].fd >= 0) {
+			fds[count++] = (struct pollfd){ .fd = clients[i].fd,
+							.events = POLLIN };
+		}
+	}
+	return count;
+}
+
+static void send_reply(struct control_client *client, int status,
+		       const char *filename)
+{
+	struct control_reply reply = {
+		.magic = CONTROL_MAGIC,
+		.status = status,
+	};
+	if (filename != NULL) {
+		snprintf(reply.filename, sizeof(reply.filename), "%s", filename);
+	}
+
+	// A client that doesn't read its replies loses them rather than blocking us
+	send(client->fd, &reply, sizeof(reply), MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+static void complete_client(void *user, int result,
+			    const struct capture_job *job)
+{
+	uintptr_t token = (uintptr_t)user;
+	struct control_client *client = &clients[token & 0xff];
+	if (client->fd < 0 || client->generation != (uint32_t)(token >> 8)) {
+		return;
+	}
+	send_reply(client, result < 0 && result != -ECANCELED ? -EIO : result,
+		   job != NULL ? job->filename : NULL);
+}
+
+static void complete_signal(void *user, int result,
+			    const struct capture_job *job)
+{
+	if (result < 0) {
+		log_warn("Capture triggered by signal failed");
+	} else {
+		log_info("Saved %s", job->filename);
+	}
+}
+
+static int run_command(const struct control_command *command,
+		       struct capture_waiter waiter)
+{
+	switch (command->kind) {
+	case CONTROL_OUTPUT:
+		return knipser_handle_screenshot(command->x, command->y, waiter);
+	case CONTROL_DESKTOP:
+		return knipser_handle_desktop_screenshot(waiter);
+	case CONTROL_REGION:
+		return knipser_handle_region(command->x, command->y,
+					     command->width, command->height,
+					     waiter);
+	}
+	return -1;
+}
+
+// Returns 1 when a capture was triggered
+static int handle_client(int index)
+{
+	struct control_client *client = &clients[index];
+	struct control_command command;
+	ssize_t len = recv(client->fd, &command, sizeof(command), MSG_DONTWAIT);
+	if (len < 0 && (errno == EAGAIN || errno == EINTR)) {
+		return 0;
+	}
+	if (len <= 0) {
+		close_client(client);
+		return 0;
+	}
+
+	if ((size_t)len != sizeof(command) || command.magic != CONTROL_MAGIC ||
+	    command.version != CONTROL_VERSION) {
+		send_reply(client, -EPROTO, NULL);
+		return 0;
+	}
+	if (command.format != CONTROL_FORMAT_DEFAULT &&
+	    command.format != CONTROL_FORMAT_PNG) {
+		send_reply(client, -ENOTSUP, NULL);
+		return 0;
+	}
+
+	struct capture_waiter waiter = {
+		.complete = complete_client,
+		.user = (void *)(((uintptr_t)client->generation << 8) | index),
+	};
+	if (run_command(&command, waiter) < 0) {
+		send_reply(client, -EBUSY, NULL);
+	}
+	return 1;
+}
+
+static void accept_clients(void)
+{
+	while (1) {
+		int fd = accept4(listen_fd, NULL, NULL,
+				 SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0) {
+			return;
+		}
+
+		// Abstract sockets have no file permissions, check the peer instead
+		struct ucred cred;
+		socklen_t cred_len = sizeof(cred);
+		if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) < 0) {
+			log_warn("Rejected control connection, no credentials: %s",
+				 strerror(errno));
+			close(fd);
+			continue;
+		}
+		if (cred.uid != getuid()) {
+			log_warn("Rejected control connection from uid %u",
+				 (unsigned)cred.uid);
+			close(fd);
+			continue;
+		}
+
+		int i = 0;
+		while (i < CONTROL_MAX_CLIENTS && clients[i].fd >= 0) {
+			i++;
+		}
+		if (i == CONTROL_MAX_CLIENTS) {
+			log_warn("Too many control connections");
+			close(fd);
+			continue;
+		}
+		clients[i].fd = fd;
+	}
+}
+
+static int handle_signals(void)
+{
+	int triggered = 0;
+	struct signalfd_siginfo info;
+	while (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+		struct capture_waiter waiter = { complete_signal, NULL };
+		int ret;
+		switch (info.ssi_signo) {
+		case SIGUSR1:
+			ret = knipser_handle_screenshot(0, 0, waiter);
+			break;
+		case SIGUSR2:
+			ret = knipser_handle_desktop_screenshot(waiter);
+			break;
+		default:
+			log_info("Received signal %u, exiting", info.ssi_signo);
+			quit = true;
+			continue;
+		}
+		if (ret < 0) {
+			log_warn("The capture for signal %u was rejected",
+				 info.ssi_signo);
+			continue;
+		}
+		triggered++;
+	}
+	return triggered;
+}
+
+// Returns the number of captures triggered
+int control_dispatch(const struct pollfd *fds, int count)
+{
+	int triggered = 0;
+	for (int i = 0; i < count; i++) {
+		if (fds[i].revents == 0) {
+			continue;
+		}
+
+		if (fds[i].fd == signal_fd) {
+			triggered += handle_signals();
+		} else if (fds[i].fd == listen_fd) {
+			accept_clients();
+		} else {
+			for (int j = 0; j < CONTROL_MAX_CLIENTS; j++) {
+				if (clients[j].fd == fds[i].fd) {
+					triggered += handle_client(j);
+					break;
+				}
+			}
+		}
+	}
+	return triggered;
+}
+
+bool control_should_quit(void)
+{
+	return quit;
+}
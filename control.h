@@ -0,0 +1,54 @@
+#ifndef _CONTROL_H_
+#define _CONTROL_H_
+
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Capture triggers that bypass D-Bus. SIGUSR1 captures the output at the
+ * origin and SIGUSR2 the whole desktop. With KNIPSER_CONTROL_SOCKET set, a
+ * SOCK_SEQPACKET socket in the abstract namespace accepts one
+ * control_command per packet and answers each with a control_reply once the
+ * file is written. Only the user running knipser may connect.
+ */
+#define CONTROL_MAGIC 0x53504e4b // "KNPS" in little endian
+#define CONTROL_VERSION 1
+#define CONTROL_MAX_FDS 10 // Signals, listening socket and clients
+
+enum control_kind {
+	CONTROL_OUTPUT, // The output at x, y
+	CONTROL_DESKTOP, // All outputs
+	CONTROL_REGION, // x, y, width, height in layout coordinates
+};
+
+enum control_format {
+	CONTROL_FORMAT_DEFAULT, // PNG
+	CONTROL_FORMAT_PNG,
+};
+
+// All fields in host byte order, the socket never leaves the machine
+struct control_command {
+	uint32_t magic;
+	uint8_t version;
+	uint8_t kind; // enum control_kind
+	uint8_t format; // enum control_format
+	uint8_t reserved;
+	int32_t x, y;
+	int32_t width, height;
+};
+
+struct control_reply {
+	uint32_t magic;
+	int32_t status; // 0 or a negative errno
+	char filename[64];
+};
+
+void control_block_signals(void);
+int control_init(void);
+void control_deinit(void);
+int control_prepare_poll(struct pollfd *fds, int max);
+int control_dispatch(const struct pollfd *fds, int count);
+bool control_should_quit(void);
+
+#endif /* _CONTROL_H_ */
@@ -0,0 +1,213 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "archive.h"
+#include "canvas.h"
+#include "catalog.h"
+#include "codec.h"
+#include "encoder.h"
+#include "image.h"
+#include "knipser.h"
+#include "log.h"
+#include "queue.h"
+#include "tiles.h"
+#include "trace.h"
+#include "wayland.h"
+
+/*
+ * Encoder pool. Workers sleep on a blocking queue and take one job each, so
+ * a slow disk holds up only the job being written, never a copy or a bus
+ * call. Two workers keep a second capture moving while one is stuck.
+ */
+#define ENCODER_THREADS 2
+
+static struct queue jobs;
+static pthread_t threads[ENCODER_THREADS];
+static int num_threads = 0;
+static atomic_bool stopping = false;
+static struct image_options file_options; // PNG, or tiles when archiving
+static struct image_options jpeg_options;
+
+// Encode the frames of a job into its file, or into fd when it is not negative
+int encoder_write(const struct capture_job *job, int fd,
+		  const struct image_options *options)
+{
+	if (job->kind == CAPTURE_DESKTOP) {
+		return canvas_write(job->filename, fd, job->frames, job->count,
+				    options);
+	}
+
+	const struct canvas_output *frame = &job->frames[0];
+	return write_image(job->filename, fd, frame->format, frame->width,
+			   frame->height, frame->stride, frame->y_invert,
+			   frame->transform, frame->data, options);
+}
+
+static int write_job(struct capture_job *job, int fd)
+{
+	return encoder_write(job, fd,
+			     fd < 0 ? &file_options : &image_default_options);
+}
+
+// Encode into a memfd named after the file it would have been
+static int write_job_memfd(struct capture_job *job,
+			   const struct image_options *options)
+{
+	int fd = memfd_create(job->filename, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0) {
+		log_error("memfd_create failed: %s", strerror(errno));
+		return -1;
+	}
+
+	// Clients get descriptions of their own, which start at offset 0 like this one
+	if (encoder_write(job, fd, options) < 0 || shm_seal(fd) < 0 ||
+	    lseek(fd, 0, SEEK_SET) < 0) {
+		close(fd);
+		return -1;
+	}
+	job->fd = fd;
+	return 0;
+}
+
+/*
+ * A timelapse frame is only written once enough of it differs from the last
+ * one written. Nothing outside the damage can have changed, so too little
+ * damage settles it without looking at a pixel.
+ */
+static bool frame_changed(const struct capture_job *job)
+{
+	const struct canvas_output *frame = &job->frames[0];
+	const struct canvas_output *reference = job->reference;
+	if (reference == NULL || frame->format != reference->format ||
+	    frame->width != reference->width ||
+	    frame->height != reference->height) {
+		return true;
+	}
+
+	const struct capture_rect *damage = &job->damage;
+	if ((double)damage->width * damage->height <
+	    job->min_change * frame->width * frame->height) {
+		return false;
+	}
+	int changed = tiles_count_changed(frame, reference, damage);
+	return changed > 0 &&
+	       changed >= job->min_change *
+				  tiles_count(frame->width, frame->height);
+}
+
+static void encode_job(struct capture_job *job)
+{
+	long faults = shm_minor_faults();
+
+	if (job->delivery == CAPTURE_TO_RAW_FD) {
+		// Nothing to encode, the client gets the compositor's copy
+		job->fd = shm_mapping_take_fd(job->mappings[0]);
+		job->frames[0].data = NULL;
+		job->result = job->fd < 0 ? -1 : 0;
+	} else if (job->delivery == CAPTURE_TO_PNG_FD) {
+		job->result = write_job_memfd(job, &image_default_options);
+	} else if (job->delivery == CAPTURE_TO_JPEG_FD) {
+		job->result = write_job_memfd(job, &jpeg_options);
+	} else if (job->delivery == CAPTURE_TO_TIMELAPSE &&
+		   !frame_changed(job)) {
+		job->result = CAPTURE_UNCHANGED;
+	} else {
+		job->result = write_job(job, -1);
+	}
+
+	// Only files are catalogued, and the hash needs the pixels still mapped
+	if (job->result == 0 && (job->delivery == CAPTURE_TO_FILE ||
+				 job->delivery == CAPTURE_TO_TIMELAPSE)) {
+		catalog_add(job);
+	}
+
+	log_debug("Encoding %s took %ld minor page faults", job->filename,
+		  shm_minor_faults() - faults);
+
+	// A timelapse frame in a buffer of its own becomes the next reference
+	if (job->delivery == CAPTURE_TO_TIMELAPSE) {
+		return;
+	}
+	for (int i = 0; i < job->count; i++) {
+		wayland_release_mapping(job->mappings[i]);
+		job->mappings[i] = NULL;
+	}
+}
+
+static void *encoder_main(void *data)
+{
+	trace_set_thread_name("encoder");
+	while (1) {
+		struct capture_job *job = queue_wait(&jobs);
+		if (job == NULL) {
+			if (atomic_load(&stopping)) {
+				break;
+			}
+			continue;
+		}
+
+		uint64_t span = trace_begin();
+		encode_job(job);
+		trace_end("encoder", "job", span);
+		knipser_complete(job);
+	}
+	return NULL;
+}
+
+int encoder_init(void)
+{
+	file_options = image_default_options;
+	if (archive_enabled()) {
+		file_options.writer = archive_write_rows;
+	}
+	jpeg_options = image_default_options;
+#ifdef KNIPSER_HAVE_JPEG
+	jpeg_options.writer = codec_write_jpeg;
+	jpeg_options.bit_depth = 8;
+#endif
+
+	if (queue_init(&jobs, CAPTURE_MAX_JOBS, true) < 0) {
+		return -1;
+	}
+
+	for (; num_threads < ENCODER_THREADS; num_threads++) {
+		if (pthread_create(&threads[num_threads], NULL, encoder_main,
+				   NULL) != 0) {
+			break;
+		}
+	}
+	if (num_threads == 0) {
+		log_error("Failed to start encoder threads");
+		queue_finish(&jobs);
+		return -1;
+	}
+	return 0;
+}
+
+// Workers finish the jobs already queued before they stop
+void encoder_deinit(void)
+{
+	if (num_threads == 0) {
+		return;
+	}
+
+	atomic_store(&stopping, true);
+	for (int i = 0; i < num_threads; i++) {
+		queue_wake(&jobs);
+	}
+	for (int i = 0; i < num_threads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	num_threads = 0;
+	queue_finish(&jobs);
+}
+
+bool encoder_submit(struct capture_job *job)
+{
+	return num_threads > 0 && queue_push(&jobs, job);
+}
@@ -0,0 +1,15 @@
+#ifndef _ENCODER_H_
+#define _ENCODER_H_
+
+#include <stdbool.h>
+
+#include "image.h"
+#include "job.h"
+
+int encoder_init(void);
+void encoder_deinit(void);
+bool encoder_submit(struct capture_job *job);
+int encoder_write(const struct capture_job *job, int fd,
+		  const struct image_options *options);
+
+#endif /* _ENCODER_H_ */
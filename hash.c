@@ -0,0 +1,61 @@
+#include <string.h>
+
+#include "hash.h"
+
+#define PRIME1 0x9e3779b185ebca87ULL
+#define PRIME2 0xc2b2ae3d27d4eb4fULL
+#define PRIME3 0x165667b19e3779f9ULL
+
+static inline uint64_t rotl(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t hash_round(uint64_t acc, uint64_t input)
+{
+	acc += input * PRIME2;
+	return rotl(acc, 31) * PRIME1;
+}
+
+static inline uint64_t avalanche(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= PRIME2;
+	h ^= h >> 29;
+	h *= PRIME3;
+	h ^= h >> 32;
+	return h;
+}
+
+/*
+ * Four independent lanes, as in XXH64, keep the multipliers busy in
+ * parallel, and two different merges of the lanes give the two halves.
+ */
+void hash128(const void *bytes, size_t size, uint64_t seed, uint64_t out[2])
+{
+	const uint8_t *data = bytes;
+	uint64_t lanes[4] = { seed + PRIME1 + PRIME2, seed + PRIME2, seed,
+			      seed - PRIME1 };
+	uint64_t word;
+	size_t i = 0;
+	for (; i + 32 <= size; i += 32) {
+		for (int lane = 0; lane < 4; lane++) {
+			memcpy(&word, data + i + lane * 8, 8);
+			lanes[lane] = hash_round(lanes[lane], word);
+		}
+	}
+	for (int lane = 0; i + 8 <= size; i += 8, lane++) {
+		memcpy(&word, data + i, 8);
+		lanes[lane] = hash_round(lanes[lane], word);
+	}
+	if (i < size) {
+		uint32_t half;
+		memcpy(&half, data + i, 4);
+		lanes[3] = hash_round(lanes[3], half ^ PRIME3);
+	}
+
+	out[0] = avalanche(rotl(lanes[0], 1) + rotl(lanes[1], 7) +
+			   rotl(lanes[2], 12) + rotl(lanes[3], 18) + size);
+	out[1] = avalanche((lanes[0] ^ rotl(lanes[2], 29)) * PRIME3 +
+			   (lanes[1] ^ rotl(lanes[3], 41)) * PRIME1 + seed);
+}
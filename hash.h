@@ -0,0 +1,10 @@
+#ifndef _HASH_H_
+#define _HASH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Non-cryptographic 128-bit hash, size must be a multiple of 4 bytes
+void hash128(const void *data, size_t size, uint64_t seed, uint64_t out[2]);
+
+#endif /* _HASH_H_ */
@@ -0,0 +1,461 @@
+#include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <png.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "image.h"
+#include "io.h"
+#include "log.h"
+#include "stats.h"
+#include "trace.h"
+#include "transform.h"
+
+enum pixel_layout {
+    LAYOUT_8888,
+    LAYOUT_2101010,
+    LAYOUT_16161616F,
+};
+
+static const struct format {
+    enum wl_shm_format wl_format;
+    enum pixel_layout layout;
+    bool is_bgr;
+    bool has_alpha;
+} formats[] = {
+    { WL_SHM_FORMAT_XRGB8888, LAYOUT_8888, true, false },
+    { WL_SHM_FORMAT_ARGB8888, LAYOUT_8888, true, true },
+    { WL_SHM_FORMAT_XBGR8888, LAYOUT_8888, false, false },
+    { WL_SHM_FORMAT_ABGR8888, LAYOUT_8888, false, true },
+    { WL_SHM_FORMAT_XRGB2101010, LAYOUT_2101010, true, false },
+    { WL_SHM_FORMAT_ARGB2101010, LAYOUT_2101010, true, true },
+    { WL_SHM_FORMAT_XBGR2101010, LAYOUT_2101010, false, false },
+    { WL_SHM_FORMAT_ABGR2101010, LAYOUT_2101010, false, true },
+    { WL_SHM_FORMAT_XBGR16161616F, LAYOUT_16161616F, false, false },
+    { WL_SHM_FORMAT_ABGR16161616F, LAYOUT_16161616F, false, true },
+};
+
+const struct image_options image_default_options = {
+    .compression_level = -1,
+    .filters = 0,
+    .bit_depth = 0,
+    .writer = NULL,
+};
+
+// Convert one row of 32-bit pixels to RGBA byte order
+static void convert_row(uint32_t *dst, const uint32_t *src, int width, bool is_bgr, bool has_alpha)
+{
+    // wl_shm formats are little-endian, so byte 0 of XRGB8888 is blue
+    uint32_t alpha = has_alpha ? 0 : 0xff000000;
+    if (is_bgr) {
+        for (int x = 0; x < width; ++x) {
+            uint32_t p = src[x];
+            dst[x] = (p & 0xff00ff00) | ((p >> 16) & 0xff) | ((p & 0xff) << 16) | alpha;
+        }
+    } else {
+        for (int x = 0; x < width; ++x) {
+            dst[x] = src[x] | alpha;
+        }
+    }
+}
+
+// Widen a 10-bit channel to 16 bits by repeating its top bits
+static inline uint32_t widen_10(uint32_t v)
+{
+    return (v << 6) | (v >> 4);
+}
+
+/*
+ * Unpack a row of 2:10:10:10 pixels to RGBA with 16 bits per channel in host
+ * byte order. Four pixels are unpacked per iteration with SSE2.
+ */
+static void unpack_2101010(uint16_t *dst, const uint32_t *src, int width, bool is_bgr, bool has_alpha)
+{
+    // For XRGB the low 10 bits are blue, for XBGR they are red
+    int shift_r = is_bgr ? 20 : 0;
+    int shift_b = is_bgr ? 0 : 20;
+    int x = 0;
+
+#ifdef __SSE2__
+    const __m128i mask = _mm_set1_epi32(0x3ff);
+    const __m128i opaque = _mm_set1_epi32(0xffff0000);
+    __m128i sr = _mm_cvtsi32_si128(shift_r);
+    __m128i sb = _mm_cvtsi32_si128(shift_b);
+    for (; x + 4 <= width; x += 4) {
+        __m128i p = _mm_loadu_si128((const __m128i *)(src + x));
+        __m128i r = _mm_and_si128(_mm_srl_epi32(p, sr), mask);
+        __m128i g = _mm_and_si128(_mm_srli_epi32(p, 10), mask);
+        __m128i b = _mm_and_si128(_mm_srl_epi32(p, sb), mask);
+        r = _mm_or_si128(_mm_slli_epi32(r, 6), _mm_srli_epi32(r, 4));
+        g = _mm_or_si128(_mm_slli_epi32(g, 6), _mm_srli_epi32(g, 4));
+        b = _mm_or_si128(_mm_slli_epi32(b, 6), _mm_srli_epi32(b, 4));
+
+        // The 2-bit alpha times 0x5555 spans the full 16-bit range
+        __m128i a;
+        if (has_alpha) {
+            __m128i a2 = _mm_srli_epi32(p, 30);
+            a = _mm_slli_epi32(_mm_or_si128(_mm_or_si128(a2, _mm_slli_epi32(a2, 2)),
+                                            _mm_or_si128(_mm_slli_epi32(a2, 4), _mm_slli_epi32(a2, 6))), 16);
+            a = _mm_or_si128(a, _mm_slli_epi32(a, 8));
+        } else {
+            a = opaque;
+        }
+
+        // Pair up R,G and B,A in 32-bit lanes, then interleave per pixel
+        __m128i rg = _mm_or_si128(r, _mm_slli_epi32(g, 16));
+        __m128i ba = _mm_or_si128(b, a);
+        _mm_storeu_si128((__m128i *)(dst + x * 4), _mm_unpacklo_epi32(rg, ba));
+        _mm_storeu_si128((__m128i *)(dst + x * 4 + 8), _mm_unpackhi_epi32(rg, ba));
+    }
+#endif
+
+    for (; x < width; ++x) {
+        uint32_t p = src[x];
+        dst[x * 4 + 0] = widen_10((p >> shift_r) & 0x3ff);
+        dst[x * 4 + 1] = widen_10((p >> 10) & 0x3ff);
+        dst[x * 4 + 2] = widen_10((p >> shift_b) & 0x3ff);
+        dst[x * 4 + 3] = has_alpha ? (p >> 30) * 0x5555 : 0xffff;
+    }
+}
+
+/*
+ * Half floats are mapped to 16-bit channels through a table covering every
+ * bit pattern, so unpacking is a single load per channel. Values outside of
+ * [0, 1], such as HDR highlights, are clipped.
+ */
+static uint16_t half_to_unorm[1 << 16];
+static pthread_once_t half_table_once = PTHREAD_ONCE_INIT;
+
+static void init_half_table(void)
+{
+    for (uint32_t h = 0; h < (1 << 16); ++h) {
+        uint32_t exponent = (h >> 10) & 0x1f;
+        uint32_t mantissa = h & 0x3ff;
+        double value;
+        if (exponent == 0) {
+            value = ldexp(mantissa, -24);
+        } else if (exponent == 0x1f) {
+            value = mantissa == 0 ? INFINITY : 0; // NaN becomes black
+        } else {
+            value = ldexp(mantissa | 0x400, (int)exponent - 25);
+        }
+        if (h & 0x8000) {
+            value = 0;
+        }
+        half_to_unorm[h] = value >= 1 ? 0xffff : (uint16_t)lrint(value * 0xffff);
+    }
+}
+
+static void unpack_16161616f(uint16_t *dst, const uint16_t *src, int width, bool has_alpha)
+{
+    pthread_once(&half_table_once, init_half_table);
+
+    // ABGR16161616F is R, G, B, A in memory, which is already the PNG order
+    for (int x = 0; x < width * 4; x += 4) {
+        dst[x + 0] = half_to_unorm[src[x + 0]];
+        dst[x + 1] = half_to_unorm[src[x + 1]];
+        dst[x + 2] = half_to_unorm[src[x + 2]];
+        dst[x + 3] = has_alpha ? half_to_unorm[src[x + 3]] : 0xffff;
+    }
+}
+
+static void unpack_row(const struct format *fmt, uint16_t *dst, const void *src, int width)
+{
+    if (fmt->layout == LAYOUT_2101010) {
+        unpack_2101010(dst, src, width, fmt->is_bgr, fmt->has_alpha);
+    } else {
+        unpack_16161616f(dst, src, width, fmt->has_alpha);
+    }
+}
+
+// 4x4 Bayer matrix, spreads the rounding error of deep formats over the image
+static const uint8_t bayer_4x4[4][4] = {
+    { 0, 8, 2, 10 },
+    { 12, 4, 14, 6 },
+    { 3, 11, 1, 9 },
+    { 15, 7, 13, 5 },
+};
+
+// Reduce 16-bit RGBA to 8 bits, with ordered dithering or plain rounding
+static void narrow_row(uint32_t *dst, const uint16_t *src, int width, int y, bool dither)
+{
+    uint8_t *out = (uint8_t *)dst;
+    for (int x = 0; x < width * 4; ++x) {
+        uint32_t bias = dither ? (bayer_4x4[y & 3][(x >> 2) & 3] * 2 + 1) * 0xffff / 32 : 0x7fff;
+        out[x] = (uint8_t)((src[x] * 255u + bias) / 0xffff);
+    }
+}
+
+struct png_file_writer {
+    FILE *file;
+    uint64_t write_ns;
+};
+
+static void png_file_write(png_structp png, png_bytep data, png_size_t length)
+{
+    struct png_file_writer *writer = png_get_io_ptr(png);
+    uint64_t start_ns = stats_now();
+    if (fwrite(data, 1, length, writer->file) != length) {
+        png_error(png, "Write error");
+    }
+    writer->write_ns += stats_now() - start_ns;
+    if (trace_enabled()) {
+        trace_end("io", "fwrite", start_ns);
+    }
+}
+
+static void png_file_flush(png_structp png)
+{
+    struct png_file_writer *writer = png_get_io_ptr(png);
+    fflush(writer->file);
+}
+
+static const struct format *find_format(enum wl_shm_format wl_fmt)
+{
+    for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); ++i) {
+        if (formats[i].wl_format == wl_fmt) {
+            return &formats[i];
+        }
+    }
+    return NULL;
+}
+
+bool image_format_supported(enum wl_shm_format wl_fmt)
+{
+    return find_format(wl_fmt) != NULL;
+}
+
+int image_format_bpp(enum wl_shm_format wl_fmt)
+{
+    const struct format *fmt = find_format(wl_fmt);
+    return fmt != NULL && fmt->layout == LAYOUT_16161616F ? 8 : 4;
+}
+
+// Convert a row of any supported format to 8-bit RGBA, dst must not overlap src
+void image_convert_row(enum wl_shm_format wl_fmt, uint32_t *dst, const void *src, int width)
+{
+    const struct format *fmt = find_format(wl_fmt);
+    if (fmt == NULL) {
+        return;
+    }
+    if (fmt->layout == LAYOUT_8888) {
+        convert_row(dst, src, width, fmt->is_bgr, fmt->has_alpha);
+        return;
+    }
+
+    // Deep formats go through a small 16-bit buffer that stays in L1
+    uint16_t wide[256 * 4];
+    int bpp = image_format_bpp(wl_fmt);
+    for (int x = 0; x < width; x += 256) {
+        int count = width - x < 256 ? width - x : 256;
+        unpack_row(fmt, wide, (const uint8_t *)src + (size_t)x * bpp, count);
+        narrow_row(dst + x, wide, count, 0, false);
+    }
+}
+
+// Encode an image whose rows are produced band by band by a row source
+int write_image_rows(const char *filename, int fd, int width, int height, int bit_depth, int band_rows, image_row_source source, void *user, const struct image_options *options)
+{
+    if (options->writer != NULL) {
+        return options->writer(filename, fd, width, height, bit_depth, band_rows, source, user, options);
+    }
+
+    struct png_file_writer writer = { 0 };
+    uint64_t start_ns = stats_now();
+    writer.file = io_open_output(filename, fd);
+    if (writer.file == NULL) {
+        log_error("Failed to open output file %s", filename);
+        return -1;
+    }
+    writer.write_ns = stats_now() - start_ns;
+    if (trace_enabled()) {
+        trace_end("io", "fopen", start_ns);
+    }
+
+    png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    png_infop info = png_create_info_struct(png);
+    if (png == NULL || info == NULL) {
+        log_error("Failed to create PNG encoder");
+        png_destroy_write_struct(&png, &info);
+        fclose(writer.file);
+        return -1;
+    }
+
+    // libpng reports errors, including failed writes, by jumping back here
+    if (setjmp(png_jmpbuf(png))) {
+        log_error("Failed to encode %s", filename);
+        png_destroy_write_struct(&png, &info);
+        fclose(writer.file);
+        return -1;
+    }
+
+    png_set_write_fn(png, &writer, png_file_write, png_file_flush);
+
+    png_set_IHDR(png, info, width, height, bit_depth, PNG_COLOR_TYPE_RGBA, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+
+    if (options->compression_level >= 0) {
+        png_set_compression_level(png, options->compression_level);
+    }
+    if (options->filters != 0) {
+        png_set_filter(png, PNG_FILTER_TYPE_BASE, options->filters);
+    }
+
+    png_write_info(png, info);
+
+    // 16-bit rows are produced in host byte order, PNG stores them big-endian
+    if (bit_depth == 16) {
+        uint16_t probe = 1;
+        if (*(uint8_t *)&probe == 1) {
+            png_set_swap(png);
+        }
+    }
+
+    // Producing rows and compressing them are interleaved to stay in cache,
+    // so accumulate their time separately and record it once per image
+    size_t row_size = (size_t)width * 4 * (bit_depth / 8);
+    uint64_t convert_ns = 0;
+    uint64_t header_write_ns = writer.write_ns; // The file was opened and the header written before
+    uint64_t encode_start_ns = stats_now();
+    for (int y = 0; y < height; y += band_rows) {
+        int count = height - y < band_rows ? height - y : band_rows;
+
+        uint64_t convert_start_ns = stats_now();
+        const uint8_t *rows = source(user, y, count);
+        convert_ns += stats_now() - convert_start_ns;
+
+        for (int i = 0; i < count; ++i) {
+            png_write_row(png, (png_bytep)(rows + i * row_size));
+        }
+    }
+
+    png_write_end(png, NULL);
+    uint64_t encode_ns = stats_now() - encode_start_ns;
+    if (trace_enabled()) {
+        trace_end("encode", "png", encode_start_ns);
+    }
+
+    png_destroy_write_struct(&png, &info);
+
+    start_ns = stats_now();
+    int ret = fclose(writer.file) == 0 ? 0 : -1;
+    stats_record_since(STATS_STAGE_CLOSE, start_ns);
+    if (trace_enabled()) {
+        trace_end("io", "fclose", start_ns);
+    }
+    if (ret < 0) {
+        log_error("Failed to write %s", filename);
+    }
+
+    // Only writes made while encoding count against it, and clock jitter can't make it negative
+    uint64_t other_ns = convert_ns + (writer.write_ns - header_write_ns);
+    stats_record(STATS_STAGE_CONVERT, convert_ns);
+    stats_record(STATS_STAGE_COMPRESS, encode_ns > other_ns ? encode_ns - other_ns : 0);
+    stats_record(STATS_STAGE_WRITE, writer.write_ns);
+    return ret;
+}
+
+#define BUFFER_BAND_ROWS 16
+
+struct buffer_source {
+    const struct format *fmt;
+    struct transform_source src;
+    int width; // Of the upright image
+    int bit_depth;
+    bool dither;
+    uint8_t *band; // Converted rows handed to the encoder
+    uint8_t *raw; // Rotated or flipped rows before conversion
+    uint16_t *wide; // One row of 16-bit channels when dithering
+};
+
+static void convert_buffer_row(struct buffer_source *buf, void *dst, const void *src, int y)
+{
+    if (buf->fmt->layout == LAYOUT_8888) {
+        convert_row(dst, src, buf->width, buf->fmt->is_bgr, buf->fmt->has_alpha);
+    } else if (buf->bit_depth == 16) {
+        unpack_row(buf->fmt, dst, src, buf->width);
+    } else {
+        unpack_row(buf->fmt, buf->wide, src, buf->width);
+        narrow_row(dst, buf->wide, buf->width, y, buf->dither);
+    }
+}
+
+static const uint8_t *buffer_source_rows(void *user, int y, int count)
+{
+    struct buffer_source *buf = user;
+    const struct transform_source *src = &buf->src;
+    size_t row_size = (size_t)buf->width * 4 * (buf->bit_depth / 8);
+
+    // Rotated or flipped rows are gathered first and converted while cached
+    if (src->transform != WL_OUTPUT_TRANSFORM_NORMAL) {
+        transform_rows(src, buf->raw, buf->width, y, count);
+        for (int i = 0; i < count; ++i) {
+            convert_buffer_row(buf, buf->band + i * row_size,
+                               buf->raw + (size_t)i * buf->width * src->bpp, y + i);
+        }
+        return buf->band;
+    }
+
+    for (int i = 0; i < count; ++i) {
+        int row = src->y_invert ? src->height - (y + i) - 1 : y + i;
+        convert_buffer_row(buf, buf->band + i * row_size,
+                           (const uint8_t *)src->data + (size_t)row * src->stride, y + i);
+    }
+    return buf->band;
+}
+
+/*
+ * Write image to file, or to fd when it is not negative. Formats with more than 8 bits per channel are written
+ * as 16-bit PNG, unless options->bit_depth asks for 8 bits, in which case
+ * they are dithered down.
+ */
+int write_image(const char *filename, int fd, enum wl_shm_format wl_fmt, int width, int height, int stride, bool y_invert, enum wl_output_transform transform, const void *data, const struct image_options *options)
+{
+    struct buffer_source buf = {
+        .fmt = find_format(wl_fmt),
+        .src = {
+            .data = data,
+            .width = width,
+            .height = height,
+            .stride = stride,
+            .bpp = image_format_bpp(wl_fmt),
+            .y_invert = y_invert,
+            .transform = transform,
+        },
+        .bit_depth = 8,
+    };
+    if (buf.fmt == NULL) {
+        log_error("Unsupported format 0x%08" PRIx32, (uint32_t)wl_fmt);
+        return -1;
+    }
+    if (buf.fmt->layout != LAYOUT_8888) {
+        buf.bit_depth = options->bit_depth == 8 ? 8 : 16;
+        buf.dither = options->bit_depth == 8;
+    }
+
+    int upright_height;
+    transform_size(transform, width, height, &buf.width, &upright_height);
+    size_t band_size = (size_t)buf.width * BUFFER_BAND_ROWS * 8;
+    buf.band = malloc(band_size);
+    if (transform != WL_OUTPUT_TRANSFORM_NORMAL) {
+        buf.raw = malloc(band_size);
+    }
+    buf.wide = malloc((size_t)buf.width * 8);
+
+    int ret = -1;
+    if (buf.band == NULL || buf.wide == NULL ||
+        (transform != WL_OUTPUT_TRANSFORM_NORMAL && buf.raw == NULL)) {
+        log_error("Failed to allocate row buffer");
+    } else {
+        ret = write_image_rows(filename, fd, buf.width, upright_height, buf.bit_depth, BUFFER_BAND_ROWS, buffer_source_rows, &buf, options);
+    }
+
+    free(buf.band);
+    free(buf.raw);
+    free(buf.wide);
+    return ret;
+}
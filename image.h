@@ -0,0 +1,46 @@
+#ifndef _IMAGE_H_
+#define _IMAGE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <wayland-client.h>
+
+/*
+ * Returns count rows of RGBA pixels starting at row y, with 8 or 16 bits
+ * per channel and no padding between rows. The rows only need to stay valid
+ * until the next call.
+ */
+typedef const uint8_t *(*image_row_source)(void *user, int y, int count);
+
+struct image_options;
+typedef int (*image_rows_writer)(const char *filename, int fd, int width,
+				 int height, int bit_depth, int band_rows,
+				 image_row_source source, void *user,
+				 const struct image_options *options);
+
+struct image_options {
+	int compression_level; // zlib level 0-9, or -1 for the libpng default
+	int filters; // Mask of PNG_FILTER_* values, or 0 for the libpng default
+	int bit_depth; // 8 to dither deep formats down, 0 to keep their depth
+	image_rows_writer writer; // Takes the rows instead of the PNG encoder, or NULL
+};
+
+extern const struct image_options image_default_options;
+
+bool image_format_supported(enum wl_shm_format format);
+int image_format_bpp(enum wl_shm_format format);
+void image_convert_row(enum wl_shm_format format, uint32_t *dst,
+		       const void *src, int width);
+/*
+ * The writers below create filename, or write to fd from its current offset
+ * when fd is not negative and only use filename in messages.
+ */
+int write_image_rows(const char *filename, int fd, int width, int height,
+		     int bit_depth, int band_rows, image_row_source source,
+		     void *user, const struct image_options *options);
+int write_image(const char *filename, int fd, enum wl_shm_format format,
+		int width, int height, int stride, bool y_invert,
+		enum wl_output_transform transform, const void *data,
+		const struct image_options *options);
+
+#endif /* _IMAGE_H_ */
@@ -0,0 +1,71 @@
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "io.h"
+
+int io_write_full(int fd, const void *data, size_t size)
+{
+	while (size > 0) {
+		ssize_t written = write(fd, data, size);
+		if (written < 0 && errno == EINTR) {
+			continue;
+		}
+		if (written < 0) {
+			return -1;
+		}
+		data = (const uint8_t *)data + written;
+		size -= written;
+	}
+	return 0;
+}
+
+int io_pwrite_full(int fd, const void *data, size_t size, off_t offset)
+{
+	while (size > 0) {
+		ssize_t written = pwrite(fd, data, size, offset);
+		if (written < 0 && errno == EINTR) {
+			continue;
+		}
+		if (written < 0) {
+			return -1;
+		}
+		data = (const uint8_t *)data + written;
+		size -= written;
+		offset += written;
+	}
+	return 0;
+}
+
+int io_read_full(int fd, void *data, size_t size)
+{
+	while (size > 0) {
+		ssize_t count = read(fd, data, size);
+		if (count < 0 && errno == EINTR) {
+			continue;
+		}
+		if (count == 0) {
+			errno = EIO;
+		}
+		if (count <= 0) {
+			return -1;
+		}
+		data = (uint8_t *)data + count;
+		size -= count;
+	}
+	return 0;
+}
+
+// Open filename, or a duplicate of fd so that closing the file leaves fd open
+FILE *io_open_output(const char *filename, int fd)
+{
+	if (fd < 0) {
+		return fopen(filename, "wb");
+	}
+	int copy = dup(fd);
+	FILE *file = copy >= 0 ? fdopen(copy, "wb") : NULL;
+	if (file == NULL && copy >= 0) {
+		close(copy);
+	}
+	return file;
+}
@@ -0,0 +1,15 @@
+#ifndef _IO_H_
+#define _IO_H_
+
+#include <stddef.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+// All return 0, or -1 with errno set, and retry short transfers and EINTR
+int io_write_full(int fd, const void *data, size_t size);
+int io_read_full(int fd, void *data, size_t size); // Running out of data is EIO
+int io_pwrite_full(int fd, const void *data, size_t size, off_t offset);
+
+FILE *io_open_output(const char *filename, int fd);
+
+#endif /* _IO_H_ */
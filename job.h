@@ -0,0 +1,107 @@
+#ifndef _JOB_H_
+#define _JOB_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "canvas.h"
+#include "layout.h"
+#include "shm.h"
+
+// Captures queued or in progress at once, every queue between threads holds this many
+#define CAPTURE_MAX_JOBS 16
+
+enum capture_kind {
+	CAPTURE_OUTPUT, // The output at x, y
+	CAPTURE_DESKTOP, // All outputs on one canvas
+	CAPTURE_REGION, // x, y, width, height within the output at x, y
+};
+
+enum capture_delivery {
+	CAPTURE_TO_FILE, // PNG in the working directory
+	CAPTURE_TO_PNG_FD, // PNG in a sealed memfd
+	CAPTURE_TO_RAW_FD, // The sealed screencopy buffer itself, single outputs only
+	CAPTURE_TO_RING, // Into a slot of the frame ring, single outputs only
+	CAPTURE_TO_TIMELAPSE, // PNG in the working directory if it changed enough
+	CAPTURE_TO_CLIPBOARD, // Offered on the clipboard, encoded when pasted
+	CAPTURE_TO_JPEG_FD, // JPEG in a sealed memfd, only when built with libjpeg
+	CAPTURE_TO_VNC, // Handed to the VNC server with its damage, single outputs only
+};
+
+// Result of a timelapse frame that was too close to the last one to write
+#define CAPTURE_UNCHANGED 1
+
+// Memory a frame is copied into in place, the job doesn't own it
+struct capture_target {
+	const struct shm_mapping *mapping; // NULL to allocate a buffer
+	size_t offset, size;
+};
+
+// A rectangle, empty while width or height is 0
+struct capture_rect {
+	int32_t x, y, width, height;
+};
+
+static inline void capture_rect_add(struct capture_rect *rect,
+				    const struct capture_rect *other)
+{
+	if (other->width <= 0 || other->height <= 0) {
+		return;
+	}
+	if (rect->width <= 0 || rect->height <= 0) {
+		*rect = *other;
+		return;
+	}
+	int32_t x1 = rect->x + rect->width, y1 = rect->y + rect->height;
+	int32_t ox1 = other->x + other->width, oy1 = other->y + other->height;
+	rect->x = other->x < rect->x ? other->x : rect->x;
+	rect->y = other->y < rect->y ? other->y : rect->y;
+	rect->width = (ox1 > x1 ? ox1 : x1) - rect->x;
+	rect->height = (oy1 > y1 ? oy1 : y1) - rect->y;
+}
+
+/*
+ * One capture request. It is created on the D-Bus thread, captured by the
+ * Wayland thread, encoded by the encoder pool and handed back to the D-Bus
+ * thread to reply, and only one thread owns it at a time.
+ */
+struct capture_job {
+	enum capture_kind kind;
+	enum capture_delivery delivery;
+	int32_t x, y;
+	int32_t width, height; // Only for regions
+	char filename[64];
+	void *user; // Passed back on completion
+	uint64_t start_ns;
+	int result;
+	int fd; // The memfd for fd deliveries, -1 otherwise, closed with the job
+	struct capture_target target; // Used if the frame fits, else it gets a mapping
+
+	/*
+	 * A damage-tracked capture waits until the output changes, and the
+	 * compositor's damage is added to damage. Other jobs are never held up
+	 * by one, it is cancelled when they arrive.
+	 */
+	bool with_damage;
+	struct capture_rect damage; // In buffer coordinates
+
+	// Timelapse frames are compared to the last one written
+	const struct canvas_output *reference; // NULL to always write
+	double min_change; // Fraction of tiles that must differ
+
+	// What the catalog records, filled in by every thread along the way
+	int64_t time_ns; // CLOCK_REALTIME when submitted
+	char output[64]; // Empty for the desktop
+	char description[128];
+	struct capture_rect area; // In layout coordinates
+	uint64_t content_hash[2];
+	uint64_t file_size;
+
+	// Filled by the Wayland thread, the mappings stay alive until encoded.
+	// Raw deliveries keep the frame description but not its data.
+	int count;
+	struct canvas_output frames[LAYOUT_MAX_OUTPUTS];
+	struct shm_mapping *mappings[LAYOUT_MAX_OUTPUTS];
+};
+
+#endif /* _JOB_H_ */
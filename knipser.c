@@ -1,10 +1,69 @@
+#include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <unistd.h>
 
+#include "archive.h"
+#include "encoder.h"
+#include "knipser.h"
+#include "log.h"
+#include "queue.h"
+#include "stats.h"
 #include "wayland.h"
 
+/*
+ * Captures are submitted from the D-Bus thread and come back on the
+ * completion queue once written or failed, the D-Bus thread then replies.
+ *
+ * Triggers for the same target within a frame interval of a submitted
+ * capture would see the same frame, so they wait for that capture instead
+ * of starting another. At most max_in_flight captures run at once. When all
+ * are busy, a new trigger is either rejected or parked until one finishes,
+ * replacing an older parked trigger for another target.
+ */
+#define MAX_WAITERS 32
+#define MAX_COALESCE_MS 1000 // Longer would join triggers a user means apart
 
-int knipser_handle_screenshot(int cursor_x, int cursor_y) {
+enum overload_policy {
+	OVERLOAD_DROP,
+	OVERLOAD_LATEST,
+};
+
+// Where and how a capture is made, beyond its kind and delivery
+struct capture_setup {
+	struct capture_target target;
+	bool with_damage;
+	struct capture_rect damage;
+	const struct canvas_output *reference;
+	double min_change;
+};
+
+// Triggers waiting for one capture, only touched by the D-Bus thread
+struct capture_request {
+	struct capture_job *job; // NULL while parked
+	enum capture_kind kind;
+	enum capture_delivery delivery;
+	struct capture_setup setup;
+	int32_t x, y, width, height;
+	char output[64]; // Empty for the desktop
+	uint64_t submitted_ns;
+	int num_waiters;
+	struct capture_waiter waiters[MAX_WAITERS];
+};
+
+static struct queue completed;
+static struct capture_request *in_flight[CAPTURE_MAX_JOBS];
+static int num_in_flight = 0;
+static struct capture_request *parked = NULL;
+static struct knipser_counters counters;
+
+static uint64_t coalesce_ns = 16666667; // One frame at 60 Hz
+static int max_in_flight = 4;
+static enum overload_policy overload_policy = OVERLOAD_LATEST;
+
+static void make_filename(char *filename, size_t size) {
 	time_t now;
 	struct tm *tm_info;
 	char timestamp[20]; // Enough for YYYY-MM-DDThh:mm:ss\0
@@ -13,7 +72,331 @@ int knipser_handle_screenshot(int cursor_x, int cursor_y) {
 	tm_info = localtime(&now);
 	strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%S", tm_info);
 
-	char filename[40];
-	sprintf(filename, "screenshot_%s.png", timestamp);
-	take_screenshot(filename, cursor_x, cursor_y);
-}
\ No newline at end of file
+	snprintf(filename, size, "screenshot_%s.%s", timestamp,
+		 archive_enabled() ? "tiles" : "png");
+}
+
+// KNIPSER_COALESCE_MS, KNIPSER_MAX_CAPTURES and KNIPSER_OVERLOAD tune the scheduler
+static void read_config(void) {
+	const char *env = getenv("KNIPSER_COALESCE_MS");
+	if (env != NULL) {
+		char *end;
+		long ms = strtol(env, &end, 10);
+		if (end == env || *end != '\0' || ms < 0 ||
+		    ms > MAX_COALESCE_MS) {
+			log_warn("Ignoring invalid KNIPSER_COALESCE_MS=%s, it must be between 0 and %d",
+				 env, MAX_COALESCE_MS);
+		} else {
+			coalesce_ns = (uint64_t)ms * 1000000ULL;
+		}
+	}
+
+	env = getenv("KNIPSER_MAX_CAPTURES");
+	if (env != NULL) {
+		int value = atoi(env);
+		if (value >= 1 && value <= CAPTURE_MAX_JOBS) {
+			max_in_flight = value;
+		} else {
+			log_warn("KNIPSER_MAX_CAPTURES must be between 1 and %d",
+				 CAPTURE_MAX_JOBS);
+		}
+	}
+
+	env = getenv("KNIPSER_OVERLOAD");
+	if (env != NULL && strcmp(env, "drop") == 0) {
+		overload_policy = OVERLOAD_DROP;
+	} else if (env != NULL && strcmp(env, "latest") != 0) {
+		log_warn("Unknown KNIPSER_OVERLOAD=%s, using latest", env);
+	}
+}
+
+int knipser_init(void) {
+	read_config();
+	if (queue_init(&completed, CAPTURE_MAX_JOBS, false) < 0) {
+		return -1;
+	}
+	return encoder_init();
+}
+
+void knipser_deinit(void) {
+	encoder_deinit();
+	queue_finish(&completed);
+}
+
+static void reply_all(struct capture_request *request, int result,
+		      const struct capture_job *job) {
+	for (int i = 0; i < request->num_waiters; i++) {
+		const struct capture_waiter *waiter = &request->waiters[i];
+		if (waiter->complete != NULL) {
+			waiter->complete(waiter->user, result, job);
+		}
+	}
+	request->num_waiters = 0;
+}
+
+static bool same_target(const struct capture_request *request,
+			const struct capture_request *target) {
+	if (request->kind != target->kind ||
+	    request->delivery != target->delivery ||
+	    strcmp(request->output, target->output) != 0 ||
+	    request->num_waiters == MAX_WAITERS) {
+		return false;
+	}
+	return target->kind != CAPTURE_REGION ||
+	       (request->x == target->x && request->y == target->y &&
+		request->width == target->width &&
+		request->height == target->height);
+}
+
+static int start_request(struct capture_request *request) {
+	struct capture_job *job = calloc(1, sizeof(*job));
+	if (job == NULL) {
+		log_error("Failed to allocate capture");
+		return -1;
+	}
+	job->kind = request->kind;
+	job->delivery = request->delivery;
+	job->target = request->setup.target;
+	job->with_damage = request->setup.with_damage;
+	job->damage = request->setup.damage;
+	job->reference = request->setup.reference;
+	job->min_change = request->setup.min_change;
+	job->fd = -1;
+	job->x = request->x;
+	job->y = request->y;
+	job->width = request->width;
+	job->height = request->height;
+	job->user = request;
+	job->start_ns = stats_now();
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	job->time_ns = (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+	make_filename(job->filename, sizeof(job->filename));
+
+	if (!wayland_submit(job)) {
+		log_error("Failed to queue capture");
+		free(job);
+		return -1;
+	}
+	request->job = job;
+	request->submitted_ns = job->start_ns;
+	in_flight[num_in_flight++] = request;
+	counters.captures++;
+	return 0;
+}
+
+// Returns 0 when the waiter will be told about the outcome
+static int submit(enum capture_kind kind, int x, int y, int width, int height,
+		  enum capture_delivery delivery,
+		  const struct capture_setup *setup,
+		  struct capture_waiter waiter) {
+	struct capture_request target = {
+		.kind = kind,
+		.delivery = delivery,
+		.x = x,
+		.y = y,
+		.width = width,
+		.height = height,
+		.num_waiters = 1,
+		.waiters = { waiter },
+	};
+	if (setup != NULL) {
+		target.setup = *setup;
+	}
+	if (kind != CAPTURE_DESKTOP) {
+		get_display_name_for_coordinates(x, y, target.output,
+						 sizeof(target.output));
+	}
+
+	// Join a capture of the same target that was only just requested
+	uint64_t now = stats_now();
+	struct capture_request *request = NULL;
+	for (int i = 0; i < num_in_flight && request == NULL; i++) {
+		if (same_target(in_flight[i], &target) &&
+		    now - in_flight[i]->submitted_ns < coalesce_ns) {
+			request = in_flight[i];
+		}
+	}
+	if (request == NULL && parked != NULL && same_target(parked, &target)) {
+		request = parked;
+	}
+	if (request != NULL) {
+		request->waiters[request->num_waiters++] = waiter;
+		counters.coalesced++;
+		return 0;
+	}
+
+	if (num_in_flight >= max_in_flight) {
+		if (overload_policy == OVERLOAD_DROP) {
+			counters.rejected++;
+			return -1;
+		}
+		if (parked != NULL) {
+			counters.superseded += parked->num_waiters;
+			reply_all(parked, -ECANCELED, NULL);
+		} else {
+			parked = malloc(sizeof(*parked));
+			if (parked == NULL) {
+				return -1;
+			}
+		}
+		*parked = target;
+		return 0;
+	}
+
+	request = malloc(sizeof(*request));
+	if (request == NULL) {
+		return -1;
+	}
+	*request = target;
+	if (start_request(request) < 0) {
+		free(request);
+		return -1;
+	}
+	return 0;
+}
+
+int knipser_handle_screenshot(int cursor_x, int cursor_y,
+			      struct capture_waiter waiter) {
+	return knipser_handle_capture(CAPTURE_OUTPUT, cursor_x, cursor_y, 0, 0,
+				      CAPTURE_TO_FILE, waiter);
+}
+
+int knipser_handle_desktop_screenshot(struct capture_waiter waiter) {
+	return knipser_handle_capture(CAPTURE_DESKTOP, 0, 0, 0, 0,
+				      CAPTURE_TO_FILE, waiter);
+}
+
+int knipser_handle_region(int x, int y, int width, int height,
+			  struct capture_waiter waiter) {
+	return knipser_handle_capture(CAPTURE_REGION, x, y, width, height,
+				      CAPTURE_TO_FILE, waiter);
+}
+
+// Raw buffers are only delivered for a single output or region, JPEG with libjpeg
+int knipser_handle_capture(enum capture_kind kind, int x, int y, int width,
+			   int height, enum capture_delivery delivery,
+			   struct capture_waiter waiter) {
+	if (kind == CAPTURE_REGION && (width <= 0 || height <= 0)) {
+		return -1;
+	}
+	if (kind == CAPTURE_DESKTOP && delivery == CAPTURE_TO_RAW_FD) {
+		return -1;
+	}
+#ifndef KNIPSER_HAVE_JPEG
+	if (delivery == CAPTURE_TO_JPEG_FD) {
+		return -1;
+	}
+#endif
+	return submit(kind, x, y, width, height, delivery, NULL, waiter);
+}
+
+// A frame of the output at x, y for the frame ring, copied into target if it fits
+int knipser_handle_ring_capture(int x, int y,
+				const struct capture_target *target,
+				struct capture_waiter waiter) {
+	struct capture_setup setup = { .target = *target };
+	return submit(CAPTURE_OUTPUT, x, y, 0, 0, CAPTURE_TO_RING, &setup,
+		      waiter);
+}
+
+/*
+ * A timelapse frame of the output at x, y, made once the output changes. It
+ * is written only if at least min_change of its tiles differ from
+ * reference, looking only within damage and what the compositor reports.
+ */
+int knipser_handle_timelapse_capture(int x, int y,
+				     const struct capture_target *target,
+				     const struct capture_rect *damage,
+				     const struct canvas_output *reference,
+				     double min_change,
+				     struct capture_waiter waiter) {
+	struct capture_setup setup = {
+		.target = *target,
+		.with_damage = true,
+		.damage = *damage,
+		.reference = reference,
+		.min_change = min_change,
+	};
+	return submit(CAPTURE_OUTPUT, x, y, 0, 0, CAPTURE_TO_TIMELAPSE, &setup,
+		      waiter);
+}
+
+// A frame of the output at x, y for the VNC server, made once the output changes
+int knipser_handle_vnc_capture(int x, int y,
+			       const struct capture_target *target,
+			       struct capture_waiter waiter) {
+	struct capture_setup setup = {
+		.target = *target,
+		.with_damage = true,
+	};
+	return submit(CAPTURE_OUTPUT, x, y, 0, 0, CAPTURE_TO_VNC, &setup,
+		      waiter);
+}
+
+// Called by the Wayland thread or an encoder once a job is written or failed
+void knipser_complete(struct capture_job *job) {
+	if (!queue_push(&completed, job)) {
+		log_error("Completion queue full, dropping %s", job->filename);
+	}
+}
+
+// Wake the D-Bus thread to look at Wayland state
+void knipser_wake(void) {
+	queue_wake(&completed);
+}
+
+int knipser_get_fd(void) {
+	return queue_fd(&completed);
+}
+
+// Reply to finished captures and start a parked one, returns how many finished
+int knipser_dispatch(void) {
+	int count = 0;
+	struct capture_job *job;
+
+	queue_clear(&completed);
+	while ((job = queue_pop(&completed)) != NULL) {
+		struct capture_request *request = job->user;
+		stats_record_since(STATS_STAGE_TOTAL, job->start_ns);
+		reply_all(request, job->result, job);
+		if (job->fd >= 0) {
+			close(job->fd);
+		}
+		for (int i = 0; i < job->count; i++) {
+			wayland_release_mapping(job->mappings[i]);
+		}
+
+		for (int i = 0; i < num_in_flight; i++) {
+			if (in_flight[i] == request) {
+				in_flight[i] = in_flight[--num_in_flight];
+				break;
+			}
+		}
+		free(request);
+		free(job);
+		count++;
+	}
+
+	if (parked != NULL && num_in_flight < max_in_flight) {
+		struct capture_request *request = parked;
+		parked = NULL;
+		if (start_request(request) < 0) {
+			reply_all(request, -1, NULL);
+			free(request);
+		}
+	}
+	return count;
+}
+
+bool knipser_busy(void) {
+	return num_in_flight > 0 || parked != NULL;
+}
+
+void knipser_get_counters(struct knipser_counters *out) {
+	*out = counters;
+}
+
+void knipser_reset_counters(void) {
+	memset(&counters, 0, sizeof(counters));
+}
@@ -1,6 +1,57 @@
 #ifndef _KNIPSER_H_
 #define _KNIPSER_H_
 
-int knipser_handle_screenshot(int, int);
+#include <stdbool.h>
+#include <stdint.h>
 
-#endif /*ifndef _KNIPSER_H_*/
\ No newline at end of file
+#include "job.h"
+
+// Scheduler counters, in triggers except for captures
+struct knipser_counters {
+	uint64_t captures; // Compositor copies started
+	uint64_t coalesced; // Joined a capture already requested
+	uint64_t rejected; // Turned away while all captures were busy
+	uint64_t superseded; // Parked, then replaced by a newer trigger
+};
+
+int knipser_init(void);
+void knipser_deinit(void);
+/*
+ * Told about the outcome of a capture on the main thread, complete may be
+ * NULL. The job is NULL when no capture was made and is only valid during
+ * the call, a waiter that wants to keep its fd dups it.
+ */
+struct capture_waiter {
+	void (*complete)(void *user, int result,
+			 const struct capture_job *job);
+	void *user;
+};
+
+int knipser_handle_screenshot(int, int, struct capture_waiter waiter);
+int knipser_handle_desktop_screenshot(struct capture_waiter waiter);
+int knipser_handle_region(int x, int y, int width, int height,
+			  struct capture_waiter waiter);
+int knipser_handle_capture(enum capture_kind kind, int x, int y, int width,
+			   int height, enum capture_delivery delivery,
+			   struct capture_waiter waiter);
+int knipser_handle_ring_capture(int x, int y,
+				const struct capture_target *target,
+				struct capture_waiter waiter);
+int knipser_handle_timelapse_capture(int x, int y,
+				     const struct capture_target *target,
+				     const struct capture_rect *damage,
+				     const struct canvas_output *reference,
+				     double min_change,
+				     struct capture_waiter waiter);
+int knipser_handle_vnc_capture(int x, int y,
+			       const struct capture_target *target,
+			       struct capture_waiter waiter);
+void knipser_complete(struct capture_job *job);
+void knipser_wake(void);
+int knipser_get_fd(void);
+int knipser_dispatch(void);
+bool knipser_busy(void);
+void knipser_get_counters(struct knipser_counters *out);
+void knipser_reset_counters(void);
+
+#endif /*ifndef _KNIPSER_H_*/
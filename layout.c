@@ -0,0 +1,224 @@
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "layout.h"
+#include "log.h"
+
+/*
+ * Snapshots are replaced, never modified. Readers only bump a counter while
+ * they hold one, and the publishing thread frees replaced snapshots once it
+ * sees no reader at all: any reader arriving later can only load the
+ * current snapshot.
+ */
+static _Atomic(struct layout *) current_layout = NULL;
+static atomic_uint active_readers = 0;
+static struct layout *retired = NULL;
+
+static int compare_int32(const void *a, const void *b)
+{
+	int32_t ia = *(const int32_t *)a, ib = *(const int32_t *)b;
+	return (ia > ib) - (ia < ib);
+}
+
+static int unique(int32_t *values, int count)
+{
+	qsort(values, count, sizeof(*values), compare_int32);
+	int n = 0;
+	for (int i = 0; i < count; i++) {
+		if (n == 0 || values[n - 1] != values[i]) {
+			values[n++] = values[i];
+		}
+	}
+	return n;
+}
+
+// Index of the last edge at or before v, or -1
+static int find_edge(const int32_t *edges, int count, int32_t v)
+{
+	int lo = 0, hi = count;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (edges[mid] <= v) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo - 1;
+}
+
+static uint64_t *cell(struct layout *layout, int col, int row)
+{
+	return &layout->cells[(size_t)row * (layout->num_xs - 1) + col];
+}
+
+struct layout *layout_create(uint32_t serial,
+			     const struct layout_output *outputs, int count)
+{
+	if (count > LAYOUT_MAX_OUTPUTS) {
+		log_warn("Only indexing %d of %d outputs", LAYOUT_MAX_OUTPUTS,
+			 count);
+		count = LAYOUT_MAX_OUTPUTS;
+	}
+
+	int32_t xs[2 * LAYOUT_MAX_OUTPUTS], ys[2 * LAYOUT_MAX_OUTPUTS];
+	for (int i = 0; i < count; i++) {
+		xs[2 * i] = outputs[i].x;
+		xs[2 * i + 1] = outputs[i].x + outputs[i].width;
+		ys[2 * i] = outputs[i].y;
+		ys[2 * i + 1] = outputs[i].y + outputs[i].height;
+	}
+	int num_xs = unique(xs, 2 * count);
+	int num_ys = unique(ys, 2 * count);
+	size_t num_cells = count > 0 ? (size_t)(num_xs - 1) * (num_ys - 1) : 0;
+
+	struct layout *layout = calloc(1, sizeof(*layout) +
+						  num_cells * sizeof(uint64_t));
+	if (layout == NULL) {
+		return NULL;
+	}
+	layout->serial = serial;
+	layout->count = count;
+	layout->num_xs = num_xs;
+	layout->num_ys = num_ys;
+	memcpy(layout->outputs, outputs, sizeof(*outputs) * count);
+	memcpy(layout->xs, xs, sizeof(*xs) * num_xs);
+	memcpy(layout->ys, ys, sizeof(*ys) * num_ys);
+
+	for (int i = 0; i < count; i++) {
+		const struct layout_output *out = &outputs[i];
+		if (out->width <= 0 || out->height <= 0) {
+			continue;
+		}
+		int col0 = find_edge(xs, num_xs, out->x);
+		int col1 = find_edge(xs, num_xs, out->x + out->width);
+		int row0 = find_edge(ys, num_ys, out->y);
+		int row1 = find_edge(ys, num_ys, out->y + out->height);
+		for (int row = row0; row < row1; row++) {
+			for (int col = col0; col < col1; col++) {
+				*cell(layout, col, row) |= UINT64_C(1) << i;
+			}
+		}
+	}
+
+	return layout;
+}
+
+static void reclaim(void)
+{
+	if (atomic_load(&active_readers) != 0) {
+		return;
+	}
+	while (retired != NULL) {
+		struct layout *next = retired->retired_next;
+		free(retired);
+		retired = next;
+	}
+}
+
+// Replace the current snapshot, only ever called from the Wayland thread
+void layout_publish(struct layout *layout)
+{
+	struct layout *old = atomic_exchange(&current_layout, layout);
+	if (old != NULL) {
+		old->retired_next = retired;
+		retired = old;
+	}
+	reclaim();
+}
+
+// The snapshot stays valid until layout_release(), even if it is replaced
+const struct layout *layout_acquire(void)
+{
+	atomic_fetch_add(&active_readers, 1);
+	return atomic_load(&current_layout);
+}
+
+void layout_release(const struct layout *layout)
+{
+	atomic_fetch_sub(&active_readers, 1);
+}
+
+const struct layout_output *layout_find_name(const struct layout *layout,
+					     const char *name)
+{
+	for (int i = 0; layout != NULL && i < layout->count; i++) {
+		if (strcmp(layout->outputs[i].name, name) == 0) {
+			return &layout->outputs[i];
+		}
+	}
+	return NULL;
+}
+
+// The output containing a point, using the lowest index where outputs overlap
+const struct layout_output *layout_find_point(const struct layout *layout,
+					      int32_t x, int32_t y)
+{
+	if (layout == NULL || layout->count == 0) {
+		return NULL;
+	}
+
+	int col = find_edge(layout->xs, layout->num_xs, x);
+	int row = find_edge(layout->ys, layout->num_ys, y);
+	if (col < 0 || col >= layout->num_xs - 1 || row < 0 ||
+	    row >= layout->num_ys - 1) {
+		return NULL;
+	}
+
+	uint64_t mask = layout->cells[(size_t)row * (layout->num_xs - 1) + col];
+	return mask ? &layout->outputs[__builtin_ctzll(mask)] : NULL;
+}
+
+// Like layout_find_point(), falling back to the output with the closest center
+const struct layout_output *layout_find_nearest(const struct layout *layout,
+						int32_t x, int32_t y)
+{
+	const struct layout_output *found = layout_find_point(layout, x, y);
+	if (found != NULL || layout == NULL) {
+		return found;
+	}
+
+	int64_t nearest_distance = INT64_MAX;
+	for (int i = 0; i < layout->count; i++) {
+		const struct layout_output *out = &layout->outputs[i];
+		int64_t dx = x - (out->x + out->width / 2);
+		int64_t dy = y - (out->y + out->height / 2);
+		int64_t distance = dx * dx + dy * dy;
+		if (distance < nearest_distance) {
+			nearest_distance = distance;
+			found = out;
+		}
+	}
+	return found;
+}
+
+// Mask of the outputs intersecting a rectangle, bit i is outputs[i]
+uint64_t layout_find_rect(const struct layout *layout, int32_t x, int32_t y,
+			  int32_t width, int32_t height)
+{
+	if (layout == NULL || layout->count == 0 || width <= 0 ||
+	    height <= 0) {
+		return 0;
+	}
+
+	int last_col = layout->num_xs - 2;
+	int last_row = layout->num_ys - 2;
+	int col0 = find_edge(layout->xs, layout->num_xs, x);
+	int col1 = find_edge(layout->xs, layout->num_xs, x + width - 1);
+	int row0 = find_edge(layout->ys, layout->num_ys, y);
+	int row1 = find_edge(layout->ys, layout->num_ys, y + height - 1);
+	col0 = col0 < 0 ? 0 : col0;
+	row0 = row0 < 0 ? 0 : row0;
+	col1 = col1 > last_col ? last_col : col1;
+	row1 = row1 > last_row ? last_row : row1;
+
+	uint64_t mask = 0;
+	for (int row = row0; row <= row1; row++) {
+		for (int col = col0; col <= col1; col++) {
+			mask |= layout->cells[(size_t)row * (layout->num_xs - 1) +
+					      col];
+		}
+	}
+	return mask;
+}
@@ -0,0 +1,50 @@
+#ifndef _LAYOUT_H_
+#define _LAYOUT_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <wayland-client.h>
+
+#define LAYOUT_MAX_OUTPUTS 64
+
+struct layout_output {
+	char name[64];
+	char description[128];
+	struct wl_output *wl_output;
+	int32_t x, y, width, height; // Logical coordinates
+	enum wl_output_transform transform;
+	wl_fixed_t scale;
+};
+
+/*
+ * An immutable snapshot of the output layout. The spatial index cuts the
+ * layout at every output edge, each cell of the resulting grid holds the
+ * mask of outputs covering it.
+ */
+struct layout {
+	uint32_t serial;
+	int count;
+	struct layout_output outputs[LAYOUT_MAX_OUTPUTS];
+	int num_xs, num_ys;
+	int32_t xs[2 * LAYOUT_MAX_OUTPUTS];
+	int32_t ys[2 * LAYOUT_MAX_OUTPUTS];
+	struct layout *retired_next; // Owned by the publishing thread
+	uint64_t cells[];
+};
+
+struct layout *layout_create(uint32_t serial,
+			     const struct layout_output *outputs, int count);
+void layout_publish(struct layout *layout);
+const struct layout *layout_acquire(void);
+void layout_release(const struct layout *layout);
+
+const struct layout_output *layout_find_name(const struct layout *layout,
+					     const char *name);
+const struct layout_output *layout_find_point(const struct layout *layout,
+					      int32_t x, int32_t y);
+const struct layout_output *layout_find_nearest(const struct layout *layout,
+						int32_t x, int32_t y);
+uint64_t layout_find_rect(const struct layout *layout, int32_t x, int32_t y,
+			  int32_t width, int32_t height);
+
+#endif /* _LAYOUT_H_ */
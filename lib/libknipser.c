@@ -0,0 +1,372 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <wayland-client.h>
+
+#include "image.h"
+#include "libknipser.h"
+#include "wayland-protocols/wlr-screencopy-unstable-v1-client-protocol.h"
+
+#define MAX_OUTPUTS 64
+
+struct client_output {
+	struct knipser_output info;
+	struct wl_output *wl_output;
+	char *name;
+};
+
+struct knipser_client {
+	struct wl_display *display;
+	struct wl_registry *registry;
+	struct wl_shm *shm;
+	struct zwlr_screencopy_manager_v1 *screencopy_manager;
+	struct client_output outputs[MAX_OUTPUTS];
+	int num_outputs;
+};
+
+// One screencopy frame on its way into the caller's buffer
+struct client_capture {
+	struct wl_shm *shm;
+	const struct knipser_buffer *buffer;
+	struct knipser_frame *frame;
+	struct wl_buffer *wl_buffer;
+	int result;
+	bool done;
+};
+
+static void output_handle_geometry(void *data, struct wl_output *wl_output,
+				   int32_t x, int32_t y, int32_t physical_width,
+				   int32_t physical_height, int32_t subpixel,
+				   const char *make, const char *model,
+				   int32_t transform)
+{
+	struct client_output *output = data;
+	output->info.x = x;
+	output->info.y = y;
+	output->info.transform = transform;
+}
+
+static void output_handle_mode(void *data, struct wl_output *wl_output,
+			       uint32_t flags, int32_t width, int32_t height,
+			       int32_t refresh)
+{
+	struct client_output *output = data;
+	if (flags & WL_OUTPUT_MODE_CURRENT) {
+		output->info.width = width;
+		output->info.height = height;
+	}
+}
+
+static void output_handle_done(void *data, struct wl_output *wl_output)
+{
+}
+
+static void output_handle_scale(void *data, struct wl_output *wl_output,
+				int32_t factor)
+{
+	struct client_output *output = data;
+	output->info.scale = factor;
+}
+
+static void output_handle_name(void *data, struct wl_output *wl_output,
+			       const char *name)
+{
+	struct client_output *output = data;
+	free(output->name);
+	output->name = strdup(name);
+	output->info.name = output->name;
+}
+
+static void output_handle_description(void *data, struct wl_output *wl_output,
+				      const char *description)
+{
+}
+
+static const struct wl_output_listener output_listener = {
+	.geometry = output_handle_geometry,
+	.mode = output_handle_mode,
+	.done = output_handle_done,
+	.scale = output_handle_scale,
+	.name = output_handle_name,
+	.description = output_handle_description,
+};
+
+// Outputs are only bound at connect time, reconnect to see hotplugged ones
+static void registry_handle_global(void *data, struct wl_registry *registry,
+				   uint32_t name, const char *interface,
+				   uint32_t version)
+{
+	struct knipser_client *client = data;
+	if (strcmp(interface, wl_shm_interface.name) == 0) {
+		client->shm = wl_registry_bind(registry, name, &wl_shm_interface,
+					       1);
+	} else if (strcmp(interface,
+			  zwlr_screencopy_manager_v1_interface.name) == 0) {
+		client->screencopy_manager = wl_registry_bind(
+			registry, name, &zwlr_screencopy_manager_v1_interface, 1);
+	} else if (strcmp(interface, wl_output_interface.name) == 0 &&
+		   version >= 2 && client->num_outputs < MAX_OUTPUTS) {
+		// Version 4 names the output, so no output manager is needed
+		struct client_output *output =
+			&client->outputs[client->num_outputs++];
+		output->info.scale = 1;
+		output->wl_output = wl_registry_bind(registry, name,
+						     &wl_output_interface,
+						     version < 4 ? version : 4);
+		wl_output_add_listener(output->wl_output, &output_listener,
+				       output);
+	}
+}
+
+static void registry_handle_global_remove(void *data,
+					  struct wl_registry *registry,
+					  uint32_t name)
+{
+}
+
+static const struct wl_registry_listener registry_listener = {
+	.global = registry_handle_global,
+	.global_remove = registry_handle_global_remove,
+};
+
+// Two roundtrips, one for the globals and one for the output events
+int knipser_client_connect(const char *display, struct knipser_client **out)
+{
+	struct knipser_client *client = calloc(1, sizeof(*client));
+	if (client == NULL) {
+		return -ENOMEM;
+	}
+
+	client->display = wl_display_connect(display);
+	if (client->display == NULL) {
+		int ret = errno != 0 ? -errno : -ECONNREFUSED;
+		free(client);
+		return ret;
+	}
+
+	client->registry = wl_display_get_registry(client->display);
+	wl_registry_add_listener(client->registry, &registry_listener, client);
+	if (wl_display_roundtrip(client->display) < 0 ||
+	    wl_display_roundtrip(client->display) < 0) {
+		knipser_client_disconnect(client);
+		return -EPIPE;
+	}
+	if (client->shm == NULL || client->screencopy_manager == NULL) {
+		knipser_client_disconnect(client);
+		return -ENOTSUP;
+	}
+
+	*out = client;
+	return 0;
+}
+
+void knipser_client_disconnect(struct knipser_client *client)
+{
+	if (client == NULL) {
+		return;
+	}
+	for (int i = 0; i < client->num_outputs; i++) {
+		wl_output_destroy(client->outputs[i].wl_output);
+		free(client->outputs[i].name);
+	}
+	if (client->screencopy_manager != NULL) {
+		zwlr_screencopy_manager_v1_destroy(client->screencopy_manager);
+	}
+	if (client->shm != NULL) {
+		wl_shm_destroy(client->shm);
+	}
+	if (client->registry != NULL) {
+		wl_registry_destroy(client->registry);
+	}
+	wl_display_disconnect(client->display);
+	free(client);
+}
+
+int knipser_client_output_count(struct knipser_client *client)
+{
+	return client->num_outputs;
+}
+
+const struct knipser_output *
+knipser_client_get_output(struct knipser_client *client, int index)
+{
+	if (index < 0 || index >= client->num_outputs) {
+		return NULL;
+	}
+	return &client->outputs[index].info;
+}
+
+int knipser_buffer_create(size_t size, struct knipser_buffer *buffer)
+{
+	int fd = memfd_create("knipser-client", MFD_CLOEXEC);
+	if (fd < 0) {
+		return -errno;
+	}
+	if (ftruncate(fd, size) < 0) {
+		int ret = -errno;
+		close(fd);
+		return ret;
+	}
+
+	void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (data == MAP_FAILED) {
+		int ret = -errno;
+		close(fd);
+		return ret;
+	}
+
+	*buffer = (struct knipser_buffer){
+		.fd = fd,
+		.size = size,
+		.data = data,
+	};
+	return 0;
+}
+
+void knipser_buffer_destroy(struct knipser_buffer *buffer)
+{
+	if (buffer->data != NULL) {
+		munmap(buffer->data, buffer->size);
+	}
+	if (buffer->fd >= 0) {
+		close(buffer->fd);
+	}
+	*buffer = (struct knipser_buffer){ .fd = -1 };
+}
+
+static void frame_handle_buffer(void *data,
+				struct zwlr_screencopy_frame_v1 *frame,
+				uint32_t format, uint32_t width,
+				uint32_t height, uint32_t stride)
+{
+	struct client_capture *capture = data;
+	const struct knipser_buffer *buffer = capture->buffer;
+	capture->frame->format = format;
+	capture->frame->width = width;
+	capture->frame->height = height;
+	capture->frame->stride = stride;
+
+	// The frame tells the caller how big a buffer to retry with
+	size_t size = (size_t)stride * height;
+	if (size > buffer->size) {
+		capture->result = -ENOSPC;
+		capture->done = true;
+		return;
+	}
+
+	struct wl_shm_pool *pool = wl_shm_create_pool(capture->shm, buffer->fd,
+						      buffer->offset + size);
+	capture->wl_buffer = wl_shm_pool_create_buffer(
+		pool, buffer->offset, width, height, stride, format);
+	wl_shm_pool_destroy(pool);
+	zwlr_screencopy_frame_v1_copy(frame, capture->wl_buffer);
+}
+
+static void frame_handle_flags(void *data,
+			       struct zwlr_screencopy_frame_v1 *frame,
+			       uint32_t flags)
+{
+	struct client_capture *capture = data;
+	capture->frame->y_invert = flags & ZWLR_SCREENCOPY_FRAME_V1_FLAGS_Y_INVERT;
+}
+
+static void frame_handle_ready(void *data,
+			       struct zwlr_screencopy_frame_v1 *frame,
+			       uint32_t tv_sec_hi, uint32_t tv_sec_lo,
+			       uint32_t tv_nsec)
+{
+	struct client_capture *capture = data;
+	capture->done = true;
+}
+
+static void frame_handle_failed(void *data,
+				struct zwlr_screencopy_frame_v1 *frame)
+{
+	struct client_capture *capture = data;
+	capture->result = -EPROTO;
+	capture->done = true;
+}
+
+static const struct zwlr_screencopy_frame_v1_listener frame_listener = {
+	.buffer = frame_handle_buffer,
+	.flags = frame_handle_flags,
+	.ready = frame_handle_ready,
+	.failed = frame_handle_failed,
+};
+
+static struct client_output *find_output(struct knipser_client *client,
+					 const struct knipser_target *target)
+{
+	if (target->output == NULL) {
+		return target->index >= 0 && target->index < client->num_outputs ?
+			       &client->outputs[target->index] :
+			       NULL;
+	}
+	for (int i = 0; i < client->num_outputs; i++) {
+		struct client_output *output = &client->outputs[i];
+		if (output->name != NULL &&
+		    strcmp(output->name, target->output) == 0) {
+			return output;
+		}
+	}
+	return NULL;
+}
+
+// Blocks until the compositor has copied the frame into the buffer
+int knipser_client_capture(struct knipser_client *client,
+			   const struct knipser_target *target,
+			   const struct knipser_buffer *buffer,
+			   struct knipser_frame *frame)
+{
+	struct client_output *output = find_output(client, target);
+	if (output == NULL) {
+		return -ENOENT;
+	}
+
+	*frame = (struct knipser_frame){ .transform = output->info.transform };
+	struct client_capture capture = {
+		.shm = client->shm,
+		.buffer = buffer,
+		.frame = frame,
+	};
+	struct zwlr_screencopy_frame_v1 *screencopy_frame;
+	if (target->width > 0 && target->height > 0) {
+		screencopy_frame = zwlr_screencopy_manager_v1_capture_output_region(
+			client->screencopy_manager, 0, output->wl_output,
+			target->x, target->y, target->width, target->height);
+	} else {
+		screencopy_frame = zwlr_screencopy_manager_v1_capture_output(
+			client->screencopy_manager, 0, output->wl_output);
+	}
+	zwlr_screencopy_frame_v1_add_listener(screencopy_frame, &frame_listener,
+					      &capture);
+
+	while (!capture.done) {
+		if (wl_display_dispatch(client->display) < 0) {
+			capture.result = -EPIPE;
+			break;
+		}
+	}
+
+	zwlr_screencopy_frame_v1_destroy(screencopy_frame);
+	if (capture.wl_buffer != NULL) {
+		wl_buffer_destroy(capture.wl_buffer);
+	}
+	return capture.result;
+}
+
+int knipser_encode(const struct knipser_frame *frame, const void *data,
+		   const char *path, int fd)
+{
+	if (data == NULL || !image_format_supported(frame->format)) {
+		return -EINVAL;
+	}
+	int ret = write_image(path != NULL ? path : "", fd, frame->format,
+			      frame->width, frame->height, frame->stride,
+			      frame->y_invert, frame->transform, data,
+			      &image_default_options);
+	return ret < 0 ? -EIO : 0;
+}
@@ -0,0 +1,93 @@
+#ifndef _LIBKNIPSER_H_
+#define _LIBKNIPSER_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Embeddable screen capture for wlroots compositors.
+ *
+ * A client is one Wayland connection and holds all state, so several can
+ * be used side by side, each from one thread at a time. Nothing is printed
+ * and nothing exits, every function returns 0 or a negative errno:
+ *
+ *   -ENOENT   no output of that name
+ *   -ENOTSUP  the compositor lacks wl_shm or wlr-screencopy
+ *   -ENOSPC   the buffer is too small, the frame says how much is needed
+ *   -EPROTO   the compositor failed the copy
+ *   -EPIPE    the connection is broken, disconnect and connect again
+ *
+ * Frames are copied by the compositor straight into the caller's buffer,
+ * which is the only copy a capture makes.
+ */
+struct knipser_client;
+
+// The library is built with hidden visibility, only these are exported
+#define KNIPSER_EXPORT __attribute__((visibility("default")))
+
+struct knipser_output {
+	const char *name; // NULL before wl_output version 4, valid until disconnected
+	int32_t x, y; // Position in the compositor's layout
+	int32_t width, height; // Current mode in pixels
+	int32_t scale;
+	int32_t transform; // A wl_output transform
+};
+
+// What to capture, a region is in logical coordinates within the output
+struct knipser_target {
+	const char *output; // NULL to pick the output by index
+	int32_t x, y, width, height; // A width of 0 captures the whole output
+	int32_t index; // As in knipser_client_get_output(), 0 for the first
+};
+
+/*
+ * Memory the compositor copies into: any shared memory fd, like a memfd,
+ * that is at least offset + size bytes long. data is only needed for
+ * knipser_encode() and may be NULL otherwise.
+ */
+struct knipser_buffer {
+	int fd;
+	size_t offset;
+	size_t size;
+	void *data;
+};
+
+struct knipser_frame {
+	uint32_t format; // A wl_shm format
+	int32_t width, height, stride;
+	bool y_invert;
+	int32_t transform; // Of the output, applied by knipser_encode()
+};
+
+KNIPSER_EXPORT int knipser_client_connect(const char *display,
+					  struct knipser_client **client);
+KNIPSER_EXPORT void knipser_client_disconnect(struct knipser_client *client);
+
+KNIPSER_EXPORT int knipser_client_output_count(struct knipser_client *client);
+KNIPSER_EXPORT const struct knipser_output *
+knipser_client_get_output(struct knipser_client *client, int index);
+
+// A mapped memfd that can be reused for any number of captures
+KNIPSER_EXPORT int knipser_buffer_create(size_t size,
+					 struct knipser_buffer *buffer);
+KNIPSER_EXPORT void knipser_buffer_destroy(struct knipser_buffer *buffer);
+
+KNIPSER_EXPORT int knipser_client_capture(struct knipser_client *client,
+					  const struct knipser_target *target,
+					  const struct knipser_buffer *buffer,
+					  struct knipser_frame *frame);
+
+// Write a captured frame as PNG to path, or to fd when it is not negative
+KNIPSER_EXPORT int knipser_encode(const struct knipser_frame *frame,
+				  const void *data, const char *path, int fd);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _LIBKNIPSER_H_ */
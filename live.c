@@ -0,0 +1,704 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+
+#include "knipser.h"
+#include "layout.h"
+#include "live.h"
+#include "local.h"
+#include "log.h"
+#include "stats.h"
+
+/*
+ * Everything runs on the D-Bus thread with non-blocking sockets. All
+ * clients of an output share one capture per format: a request joins the
+ * capture in flight, or is answered from the last frame while it is younger
+ * than a frame interval. The encoder pool encodes each frame into a memfd
+ * once, and every client is sent it from there with sendfile at its own
+ * offset. A stream client that falls behind finishes the frame it is
+ * sending and then skips to the newest one.
+ */
+#define LIVE_MAX_CLIENTS (LIVE_MAX_FDS - 2)
+#define LIVE_MAX_REQUEST 2048
+#define LIVE_BOUNDARY "knipserframe"
+
+enum live_format {
+	LIVE_JPEG,
+	LIVE_PNG,
+	LIVE_NUM_FORMATS,
+};
+
+static const struct live_type {
+	const char *extension;
+	const char *content_type;
+	enum capture_delivery delivery;
+} types[LIVE_NUM_FORMATS] = {
+	[LIVE_JPEG] = { "jpg", "image/jpeg", CAPTURE_TO_JPEG_FD },
+	[LIVE_PNG] = { "png", "image/png", CAPTURE_TO_PNG_FD },
+};
+
+// An encoded frame, freed once it is neither the latest nor being sent
+struct live_frame {
+	int fd;
+	off_t size;
+	int refs;
+	uint64_t seq;
+	uint64_t time_ns; // stats_now() when it arrived
+};
+
+// Free while name is empty, kept while it has clients or a capture in flight
+struct live_output {
+	char name[64];
+	int clients;
+	int streams;
+	struct live_frame *latest[LIVE_NUM_FORMATS];
+	bool in_flight[LIVE_NUM_FORMATS];
+};
+
+enum live_state {
+	LIVE_READING, // The request
+	LIVE_WAITING, // For the first frame
+	LIVE_SENDING, // The head, then the frame if there is one
+	LIVE_IDLE, // A stream that has sent the newest frame
+};
+
+struct live_client {
+	int fd;
+	enum live_state state;
+	struct live_output *output; // NULL until a frame is asked for
+	enum live_format format;
+	bool stream;
+	char request[LIVE_MAX_REQUEST];
+	size_t request_len;
+	char *head; // Response or part header, or all of an error response
+	size_t head_len, head_sent;
+	struct live_frame *frame; // Sent after the head
+	off_t offset;
+	uint64_t seq; // Of the last frame sent, 0 before the first
+};
+
+static struct local_socket server = { .fd = -1 };
+static int timer_fd = -1;
+static uint64_t interval_ns = 200000000; // 5 frames per second
+static struct live_client clients[LIVE_MAX_CLIENTS];
+static struct live_output outputs[LIVE_MAX_CLIENTS];
+static int num_clients = 0;
+static int num_streams = 0;
+static uint64_t frames = 0;
+
+static void send_frame(struct live_client *client, struct live_frame *frame);
+
+// KNIPSER_LIVE=PORT, PATH or @NAME serves the live view, KNIPSER_LIVE_FPS paces streams
+int live_init(void)
+{
+	for (int i = 0; i < LIVE_MAX_CLIENTS; i++) {
+		clients[i].fd = -1;
+	}
+
+	const char *env = getenv("KNIPSER_LIVE");
+	if (env == NULL || env[0] == '\0') {
+		return 0;
+	}
+
+	const char *fps_env = getenv("KNIPSER_LIVE_FPS");
+	if (fps_env != NULL) {
+		int fps = atoi(fps_env);
+		if (fps >= 1 && fps <= 60) {
+			interval_ns = 1000000000ULL / fps;
+		} else {
+			log_warn("KNIPSER_LIVE_FPS must be between 1 and 60");
+		}
+	}
+
+	// sendfile has no MSG_NOSIGNAL, a client going away must not kill knipser
+	signal(SIGPIPE, SIG_IGN);
+
+	timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (timer_fd < 0) {
+		log_error("Failed to create live view timer: %s",
+			  strerror(errno));
+		return -1;
+	}
+	if (local_listen(&server, env, LIVE_MAX_CLIENTS) < 0) {
+		return -1;
+	}
+	log_info("Serving the live view on %s", env);
+	return 0;
+}
+
+static void set_timer(bool running)
+{
+	struct itimerspec spec = { 0 };
+	if (running) {
+		spec.it_interval.tv_sec = interval_ns / 1000000000ULL;
+		spec.it_interval.tv_nsec = interval_ns % 1000000000ULL;
+		spec.it_value = spec.it_interval;
+	}
+	timerfd_settime(timer_fd, 0, &spec, NULL);
+}
+
+static void frame_unref(struct live_frame *frame)
+{
+	if (frame != NULL && --frame->refs == 0) {
+		close(frame->fd);
+		free(frame);
+	}
+}
+
+// Cached frames go with the last client, nothing is kept for nobody
+static void release_output(struct live_output *output)
+{
+	if (output->clients > 0) {
+		return;
+	}
+	for (int i = 0; i < LIVE_NUM_FORMATS; i++) {
+		if (output->in_flight[i]) {
+			return;
+		}
+	}
+	for (int i = 0; i < LIVE_NUM_FORMATS; i++) {
+		frame_unref(output->latest[i]);
+		output->latest[i] = NULL;
+	}
+	output->name[0] = '\0';
+}
+
+static struct live_output *get_output(const char *name)
+{
+	struct live_output *free_output = NULL;
+	for (int i = 0; i < LIVE_MAX_CLIENTS; i++) {
+		if (strcmp(outputs[i].name, name) == 0) {
+			return &outputs[i];
+		}
+		if (outputs[i].name[0] == '\0' && free_output == NULL) {
+			free_output = &outputs[i];
+		}
+	}
+	if (free_output != NULL) {
+		snprintf(free_output->name, sizeof(free_output->name), "%s",
+			 name);
+	}
+	return free_output;
+}
+
+static void close_client(struct live_client *client)
+{
+	frame_unref(client->frame);
+	client->frame = NULL;
+	free(client->head);
+	client->head = NULL;
+	if (client->output != NULL) {
+		client->output->clients--;
+		if (client->stream) {
+			client->output->streams--;
+			if (--num_streams == 0) {
+				set_timer(false);
+			}
+		}
+		release_output(client->output);
+		client->output = NULL;
+	}
+	close(client->fd);
+	client->fd = -1;
+	num_clients--;
+}
+
+static int set_head(struct live_client *client, const char *format, ...)
+{
+	free(client->head);
+	va_list args;
+	va_start(args, format);
+	int len = vasprintf(&client->head, format, args);
+	va_end(args);
+	if (len < 0) {
+		client->head = NULL;
+		return -1;
+	}
+	client->head_len = len;
+	client->head_sent = 0;
+	return 0;
+}
+
+// Send what the socket takes, a stream then moves on to a newer frame if there is one
+static void flush_client(struct live_client *client)
+{
+	while (client->head_sent < client->head_len) {
+		ssize_t sent = send(client->fd, client->head + client->head_sent,
+				    client->head_len - client->head_sent,
+				    MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (sent < 0 && errno == EINTR) {
+			continue;
+		}
+		if (sent < 0 && errno == EAGAIN) {
+			return;
+		}
+		if (sent <= 0) {
+			close_client(client);
+			return;
+		}
+		client->head_sent += sent;
+	}
+
+	struct live_frame *frame = client->frame;
+	while (frame != NULL && client->offset < frame->size) {
+		ssize_t sent = sendfile(client->fd, frame->fd, &client->offset,
+					frame->size - client->offset);
+		if (sent < 0 && errno == EINTR) {
+			continue;
+		}
+		if (sent < 0 && errno == EAGAIN) {
+			return;
+		}
+		if (sent <= 0) {
+			close_client(client);
+			return;
+		}
+	}
+
+	if (!client->stream || frame == NULL) {
+		close_client(client);
+		return;
+	}
+	client->seq = frame->seq;
+	client->frame = NULL;
+	frame_unref(frame);
+	client->state = LIVE_IDLE;
+
+	struct live_frame *latest = client->output->latest[client->format];
+	if (latest != NULL && latest->seq > client->seq) {
+		send_frame(client, latest);
+	}
+}
+
+static void send_frame(struct live_client *client, struct live_frame *frame)
+{
+	const char *content_type = types[client->format].content_type;
+	int ret;
+	if (!client->stream) {
+		ret = set_head(client,
+			       "HTTP/1.1 200 OK\r\n"
+			       "Content-Type: %s\r\n"
+			       "Content-Length: %lld\r\n"
+			       "Cache-Control: no-store\r\n"
+			       "Connection: close\r\n\r\n",
+			       content_type, (long long)frame->size);
+	} else {
+		// Each part ends with the CRLF in front of the next boundary
+		ret = set_head(client,
+			       "%s--" LIVE_BOUNDARY "\r\n"
+			       "Content-Type: %s\r\n"
+			       "Content-Length: %lld\r\n\r\n",
+			       client->seq == 0 ?
+				       "HTTP/1.1 200 OK\r\n"
+				       "Content-Type: multipart/x-mixed-replace; "
+				       "boundary=" LIVE_BOUNDARY "\r\n"
+				       "Cache-Control: no-store\r\n"
+				       "Connection: close\r\n\r\n" :
+				       "\r\n",
+			       content_type, (long long)frame->size);
+	}
+	if (ret < 0) {
+		close_client(client);
+		return;
+	}
+
+	frame->refs++;
+	client->frame = frame;
+	client->offset = 0;
+	client->state = LIVE_SENDING;
+	flush_client(client);
+}
+
+static void send_error(struct live_client *client, const char *status)
+{
+	if (set_head(client,
+		     "HTTP/1.1 %s\r\n"
+		     "Content-Type: text/plain\r\n"
+		     "Content-Length: %zu\r\n"
+		     "Connection: close\r\n\r\n%s\n",
+		     status, strlen(status) + 1, status) < 0) {
+		close_client(client);
+		return;
+	}
+	client->state = LIVE_SENDING;
+	flush_client(client);
+}
+
+// A frame for everyone waiting, or an error for snapshots if there is none
+static void frame_complete(void *user, int result,
+			   const struct capture_job *job)
+{
+	uintptr_t token = (uintptr_t)user;
+	struct live_output *output = &outputs[token / LIVE_NUM_FORMATS];
+	enum live_format format = token % LIVE_NUM_FORMATS;
+	output->in_flight[format] = false;
+
+	struct live_frame *frame = NULL;
+	struct stat st;
+	if (result == 0 && job != NULL && job->fd >= 0 &&
+	    fstat(job->fd, &st) == 0) {
+		frame = malloc(sizeof(*frame));
+	}
+	if (frame != NULL) {
+		frame->fd = fcntl(job->fd, F_DUPFD_CLOEXEC, 0);
+		if (frame->fd < 0) {
+			free(frame);
+			frame = NULL;
+		}
+	}
+	if (frame != NULL) {
+		frame->size = st.st_size;
+		frame->refs = 2; // Held until every client has been told
+		frame->seq = ++frames;
+		frame->time_ns = stats_now();
+		frame_unref(output->latest[format]);
+		output->latest[format] = frame;
+	}
+
+	// Streams that failed keep waiting for the next tick
+	for (int i = 0; i < LIVE_MAX_CLIENTS; i++) {
+		struct live_client *client = &clients[i];
+		if (client->fd < 0 || client->output != output ||
+		    client->format != format) {
+			continue;
+		}
+		if (frame == NULL && client->state == LIVE_WAITING &&
+		    !client->stream) {
+			send_error(client, "503 Service Unavailable");
+		} else if (frame != NULL && (client->state == LIVE_WAITING ||
+					     client->state == LIVE_IDLE)) {
+			send_frame(client, frame);
+		}
+	}
+	frame_unref(frame);
+	release_output(output);
+}
+
+// Joins the capture in flight if there is one
+static int request_frame(struct live_output *output, enum live_format format)
+{
+	if (output->in_flight[format]) {
+		return 0;
+	}
+
+	const struct layout *layout = layout_acquire();
+	const struct layout_output *found = layout_find_name(layout,
+							     output->name);
+	int32_t x = found != NULL ? found->x : 0;
+	int32_t y = found != NULL ? found->y : 0;
+	layout_release(layout);
+	if (found == NULL) {
+		return -1;
+	}
+
+	struct capture_waiter waiter = {
+		.complete = frame_complete,
+		.user = (void *)(uintptr_t)((output - outputs) *
+						    LIVE_NUM_FORMATS +
+					    format),
+	};
+	if (knipser_handle_capture(CAPTURE_OUTPUT, x, y, 0, 0,
+				   types[format].delivery, waiter) < 0) {
+		return -1;
+	}
+	output->in_flight[format] = true;
+	return 0;
+}
+
+// Output names come from the compositor and could contain markup
+static void put_html(FILE *f, const char *text)
+{
+	for (; *text != '\0'; text++) {
+		switch (*text) {
+		case '&':
+			fputs("&amp;", f);
+			break;
+		case '<':
+			fputs("&lt;", f);
+			break;
+		case '>':
+			fputs("&gt;", f);
+			break;
+		case '"':
+			fputs("&quot;", f);
+			break;
+		case '\'':
+			fputs("&#39;", f);
+			break;
+		default:
+			fputc(*text, f);
+		}
+	}
+}
+
+// Lists no outputs before the first layout and after the last
+static void send_index(struct live_client *client)
+{
+	char *body = NULL;
+	size_t size = 0;
+	FILE *f = open_memstream(&body, &size);
+	if (f == NULL) {
+		send_error(client, "500 Internal Server Error");
+		return;
+	}
+	fputs("<!DOCTYPE html>\n<title>knipser</title>\n<ul>\n", f);
+	const struct layout *layout = layout_acquire();
+	for (int i = 0; layout != NULL && i < layout->count; i++) {
+		const char *name = layout->outputs[i].name;
+		fputs("<li><a href=\"", f);
+		put_html(f, name);
+		fputs(".mjpg\">", f);
+		put_html(f, name);
+		fputs("</a> (<a href=\"", f);
+		put_html(f, name);
+		fputs(".jpg\">jpg</a>, <a href=\"", f);
+		put_html(f, name);
+		fputs(".png\">png</a>)\n", f);
+	}
+	layout_release(layout);
+	fputs("</ul>\n", f);
+	fclose(f);
+
+	int ret = set_head(client,
+			   "HTTP/1.1 200 OK\r\n"
+			   "Content-Type: text/html\r\n"
+			   "Content-Length: %zu\r\n"
+			   "Cache-Control: no-store\r\n"
+			   "Connection: close\r\n\r\n%s",
+			   size, body);
+	free(body);
+	if (ret < 0) {
+		close_client(client);
+		return;
+	}
+	client->state = LIVE_SENDING;
+	flush_client(client);
+}
+
+static void handle_request(struct live_client *client)
+{
+	char method[8], path[128];
+	if (sscanf(client->request, "%7s %127s", method, path) != 2) {
+		send_error(client, "400 Bad Request");
+		return;
+	}
+	if (strcmp(method, "GET") != 0) {
+		send_error(client, "405 Method Not Allowed");
+		return;
+	}
+	path[strcspn(path, "?")] = '\0';
+	if (strcmp(path, "/") == 0) {
+		send_index(client);
+		return;
+	}
+
+	char *dot = strrchr(path, '.');
+	if (path[0] != '/' || dot == NULL || dot == path + 1 ||
+	    dot - path > (ptrdiff_t)sizeof(outputs[0].name)) {
+		send_error(client, "404 Not Found");
+		return;
+	}
+	*dot = '\0';
+	const char *name = path + 1, *extension = dot + 1;
+
+	bool stream = strcmp(extension, "mjpg") == 0;
+	enum live_format format = stream ? LIVE_JPEG : 0;
+	while (!stream && format < LIVE_NUM_FORMATS &&
+	       strcmp(types[format].extension, extension) != 0) {
+		format++;
+	}
+	const struct layout *layout = layout_acquire();
+	bool exists = layout_find_name(layout, name) != NULL;
+	layout_release(layout);
+	if (format == LIVE_NUM_FORMATS || !exists) {
+		send_error(client, "404 Not Found");
+		return;
+	}
+#ifndef KNIPSER_HAVE_JPEG
+	if (format == LIVE_JPEG) {
+		send_error(client, "501 Not Implemented");
+		return;
+	}
+#endif
+
+	struct live_output *output = get_output(name);
+	if (output == NULL) {
+		send_error(client, "503 Service Unavailable");
+		return;
+	}
+	client->output = output;
+	client->format = format;
+	client->stream = stream;
+	output->clients++;
+	if (stream) {
+		output->streams++;
+		if (num_streams++ == 0) {
+			set_timer(true);
+		}
+	}
+
+	// A stream starts with whatever there is, the timer brings fresh frames
+	struct live_frame *latest = output->latest[format];
+	if (latest != NULL &&
+	    (stream || stats_now() - latest->time_ns < interval_ns)) {
+		send_frame(client, latest);
+		return;
+	}
+	client->state = LIVE_WAITING;
+	if (request_frame(output, format) < 0 && !stream) {
+		send_error(client, "503 Service Unavailable");
+	}
+}
+
+// Anything after the request is read and dropped, every response closes the connection
+static void read_client(struct live_client *client)
+{
+	char discard[256];
+	bool reading = client->state == LIVE_READING;
+	char *buf = reading ? client->request + client->request_len : discard;
+	size_t size = reading ? sizeof(client->request) - 1 - client->request_len :
+				sizeof(discard);
+	ssize_t len = recv(client->fd, buf, size, MSG_DONTWAIT);
+	if (len < 0 && (errno == EAGAIN || errno == EINTR)) {
+		return;
+	}
+	if (len <= 0) {
+		close_client(client);
+		return;
+	}
+	if (!reading) {
+		return;
+	}
+
+	client->request_len += len;
+	client->request[client->request_len] = '\0';
+	if (strstr(client->request, "\r\n\r\n") != NULL) {
+		handle_request(client);
+	} else if (client->request_len == sizeof(client->request) - 1) {
+		send_error(client, "431 Request Header Fields Too Large");
+	}
+}
+
+static void accept_clients(void)
+{
+	int fd;
+	while ((fd = local_accept(&server)) >= 0) {
+		int i = 0;
+		while (i < LIVE_MAX_CLIENTS && clients[i].fd >= 0) {
+			i++;
+		}
+		if (i == LIVE_MAX_CLIENTS) {
+			log_warn("Too many live view clients");
+			close(fd);
+			continue;
+		}
+		clients[i] = (struct live_client){ .fd = fd,
+						   .state = LIVE_READING };
+		num_clients++;
+	}
+}
+
+// One frame per stream interval, shared by every stream of the output
+static void start_frames(void)
+{
+	uint64_t expirations;
+	if (read(timer_fd, &expirations, sizeof(expirations)) < 0) {
+		return;
+	}
+	for (int i = 0; i < LIVE_MAX_CLIENTS; i++) {
+		if (outputs[i].name[0] != '\0' && outputs[i].streams > 0) {
+			request_frame(&outputs[i], LIVE_JPEG);
+		}
+	}
+}
+
+// Connected clients keep an idle daemon alive
+bool live_active(void)
+{
+	return num_clients > 0;
+}
+
+int live_prepare_poll(struct pollfd *fds, int max)
+{
+	int count = 0;
+	if (server.fd >= 0 && count < max) {
+		fds[count++] = (struct pollfd){ .fd = server.fd, .events = POLLIN };
+	}
+	if (timer_fd >= 0 && count < max) {
+		fds[count++] = (struct pollfd){ .fd = timer_fd, .events = POLLIN };
+	}
+	for (int i = 0; i < LIVE_MAX_CLIENTS && count < max; i++) {
+		if (clients[i].fd >= 0) {
+			short events = POLLIN;
+			if (clients[i].state == LIVE_SENDING) {
+				events |= POLLOUT;
+			}
+			fds[count++] = (struct pollfd){ .fd = clients[i].fd,
+							.events = events };
+		}
+	}
+	return count;
+}
+
+void live_dispatch(const struct pollfd *fds, int count)
+{
+	for (int i = 0; i < count; i++) {
+		if (fds[i].revents == 0) {
+			continue;
+		}
+
+		if (fds[i].fd == server.fd) {
+			accept_clients();
+		} else if (fds[i].fd == timer_fd) {
+			start_frames();
+		} else {
+			for (int j = 0; j < LIVE_MAX_CLIENTS; j++) {
+				struct live_client *client = &clients[j];
+				if (client->fd != fds[i].fd) {
+					continue;
+				}
+				if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+					read_client(client);
+				}
+				if (client->fd >= 0 &&
+				    client->state == LIVE_SENDING &&
+				    (fds[i].revents & POLLOUT)) {
+					flush_client(client);
+				}
+				break;
+			}
+		}
+	}
+}
+
+void live_deinit(void)
+{
+	for (int i = 0; i < LIVE_MAX_CLIENTS; i++) {
+		if (clients[i].fd >= 0) {
+			close_client(&clients[i]);
+		}
+	}
+	for (int i = 0; i < LIVE_MAX_CLIENTS; i++) {
+		for (int j = 0; j < LIVE_NUM_FORMATS; j++) {
+			frame_unref(outputs[i].latest[j]);
+			outputs[i].latest[j] = NULL;
+		}
+		outputs[i].name[0] = '\0';
+	}
+	local_close(&server);
+	if (timer_fd >= 0) {
+		close(timer_fd);
+		timer_fd = -1;
+	}
+}
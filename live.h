@@ -0,0 +1,23 @@
+#ifndef _LIVE_H_
+#define _LIVE_H_
+
+#include <poll.h>
+#include <stdbool.h>
+
+/*
+ * Live view over HTTP, for monitoring dashboards. With KNIPSER_LIVE set,
+ * GET /NAME.jpg and /NAME.png return a recent frame of output NAME,
+ * /NAME.mjpg a multipart/x-mixed-replace stream of JPEG frames, and / lists
+ * the outputs. KNIPSER_LIVE is a port on 127.0.0.1, the path of a UNIX
+ * socket, or @NAME for one in the abstract namespace. Nothing is captured
+ * while no client is connected.
+ */
+#define LIVE_MAX_FDS 18 // Listening socket, timer and clients
+
+int live_init(void);
+void live_deinit(void);
+bool live_active(void);
+int live_prepare_poll(struct pollfd *fds, int max);
+void live_dispatch(const struct pollfd *fds, int count);
+
+#endif /* _LIVE_H_ */
@@ -0,0 +1,123 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "local.h"
+#include "log.h"
+
+int local_listen(struct local_socket *server, const char *address,
+		 int backlog)
+{
+	*server = (struct local_socket){ .fd = -1 };
+	union {
+		struct sockaddr sa;
+		struct sockaddr_in in;
+		struct sockaddr_un un;
+	} addr = { 0 };
+	socklen_t addr_len;
+
+	char *end;
+	long port = strtol(address, &end, 10);
+	if (end != address && *end == '\0') {
+		if (port < 1 || port > 65535) {
+			log_error("Port %s must be between 1 and 65535", address);
+			return -1;
+		}
+		addr.in.sin_family = AF_INET;
+		addr.in.sin_port = htons(port);
+		addr.in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		addr_len = sizeof(addr.in);
+	} else {
+		size_t len = strlen(address);
+		if (len >= sizeof(addr.un.sun_path)) {
+			log_error("Socket address %s is too long", address);
+			return -1;
+		}
+		server->is_unix = true;
+		addr.un.sun_family = AF_UNIX;
+		memcpy(addr.un.sun_path, address, len);
+		addr_len = offsetof(struct sockaddr_un, sun_path) + len;
+
+		// Abstract addresses start with a NUL byte and are not NUL terminated
+		if (address[0] == '@') {
+			addr.un.sun_path[0] = '\0';
+		} else {
+			addr_len++;
+			snprintf(server->path, sizeof(server->path), "%s",
+				 address);
+		}
+	}
+
+	server->fd = socket(addr.sa.sa_family,
+			    SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (server->fd < 0) {
+		log_error("Failed to create socket: %s", strerror(errno));
+		return -1;
+	}
+	int one = 1;
+	if (!server->is_unix) {
+		setsockopt(server->fd, SOL_SOCKET, SO_REUSEADDR, &one,
+			   sizeof(one));
+	}
+
+	// A socket file left behind by a knipser that didn't exit cleanly
+	struct stat st;
+	if (server->path[0] != '\0' && lstat(server->path, &st) == 0 &&
+	    S_ISSOCK(st.st_mode)) {
+		unlink(server->path);
+	}
+
+	// Nobody can connect before listen(), so the file is private by then
+	if (bind(server->fd, &addr.sa, addr_len) < 0 ||
+	    (server->path[0] != '\0' && chmod(server->path, 0600) < 0) ||
+	    listen(server->fd, backlog) < 0) {
+		log_error("Failed to listen on %s: %s", address,
+			  strerror(errno));
+		close(server->fd);
+		server->fd = -1;
+		server->path[0] = '\0';
+		return -1;
+	}
+	return 0;
+}
+
+// The next connection from someone allowed to connect, -1 once there is none
+int local_accept(struct local_socket *server)
+{
+	while (1) {
+		int fd = accept4(server->fd, NULL, NULL,
+				 SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0 || !server->is_unix) {
+			return fd;
+		}
+
+		// Abstract sockets have no file permissions, check the peer instead
+		struct ucred cred = { .uid = (uid_t)-1 };
+		socklen_t cred_len = sizeof(cred);
+		if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) == 0 &&
+		    cred.uid == getuid()) {
+			return fd;
+		}
+		log_warn("Rejected connection from uid %u", (unsigned)cred.uid);
+		close(fd);
+	}
+}
+
+void local_close(struct local_socket *server)
+{
+	if (server->fd >= 0) {
+		close(server->fd);
+		server->fd = -1;
+	}
+	if (server->path[0] != '\0') {
+		unlink(server->path);
+		server->path[0] = '\0';
+	}
+}
@@ -0,0 +1,24 @@
+#ifndef _LOCAL_H_
+#define _LOCAL_H_
+
+#include <stdbool.h>
+#include <sys/un.h>
+
+/*
+ * Listening sockets for servers meant for this machine only. An address is
+ * a port on 127.0.0.1, the path of a UNIX socket that only the user can
+ * connect to, or @NAME for one in the abstract namespace. Sockets are
+ * non-blocking and so is every connection accepted from them.
+ */
+struct local_socket {
+	int fd;
+	bool is_unix;
+	char path[sizeof(((struct sockaddr_un *)0)->sun_path)]; // Unlinked on close
+};
+
+int local_listen(struct local_socket *server, const char *address,
+		 int backlog);
+int local_accept(struct local_socket *server);
+void local_close(struct local_socket *server);
+
+#endif /* _LOCAL_H_ */
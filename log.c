@@ -0,0 +1,334 @@
+#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <systemd/sd-journal.h>
+
+#include "log.h"
+
+/*
+ * Log lines are formatted by the caller straight into a slot of a bounded
+ * multi-producer ring and written out by a background thread, so logging
+ * never blocks a capture on the terminal or journald. Messages below the
+ * current level are rejected before they are formatted.
+ */
+#define LOG_RING_SIZE 1024 // Must be a power of two
+#define LOG_LINE_MAX 256
+#define LOG_BATCH_SIZE 4096
+
+struct log_slot {
+	atomic_size_t seq;
+	enum log_level level;
+	char text[LOG_LINE_MAX];
+};
+
+static struct log_slot ring[LOG_RING_SIZE];
+static atomic_size_t enqueue_pos;
+static atomic_size_t dequeue_pos;
+static atomic_size_t dropped;
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static atomic_int current_level = LOG_LEVEL_INFO;
+static bool use_journal = false;
+
+static pthread_t drain_thread;
+static atomic_bool running = false;
+static atomic_bool drain_sleeping = false;
+static atomic_uint wake_word;
+
+static const int syslog_priority[] = {
+	[LOG_LEVEL_ERROR] = LOG_ERR,
+	[LOG_LEVEL_WARN] = LOG_WARNING,
+	[LOG_LEVEL_INFO] = LOG_INFO,
+	[LOG_LEVEL_DEBUG] = LOG_DEBUG,
+};
+
+static void futex_wait(atomic_uint *word, unsigned int expected)
+{
+	struct timespec timeout = { .tv_sec = 1 };
+	syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, expected, &timeout, NULL,
+		0);
+}
+
+static void futex_wake(atomic_uint *word)
+{
+	syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+static void wake_drain_thread(void)
+{
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&drain_sleeping, memory_order_relaxed)) {
+		atomic_fetch_add(&wake_word, 1);
+		futex_wake(&wake_word);
+	}
+}
+
+static void write_all(int fd, const char *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t ret = write(fd, buf, len);
+		if (ret <= 0) {
+			return;
+		}
+		buf += ret;
+		len -= (size_t)ret;
+	}
+}
+
+struct log_batch {
+	int fd;
+	size_t len;
+	char buf[LOG_BATCH_SIZE];
+};
+
+static void batch_flush(struct log_batch *batch)
+{
+	write_all(batch->fd, batch->buf, batch->len);
+	batch->len = 0;
+}
+
+static void batch_append(struct log_batch *batch, const char *text)
+{
+	size_t len = strlen(text);
+	if (batch->len + len + 1 > sizeof(batch->buf)) {
+		batch_flush(batch);
+	}
+	memcpy(batch->buf + batch->len, text, len);
+	batch->buf[batch->len + len] = '\n';
+	batch->len += len + 1;
+}
+
+static void emit(struct log_batch *out, struct log_batch *err,
+		 enum log_level level, const char *text)
+{
+	if (use_journal) {
+		sd_journal_print(syslog_priority[level], "%s", text);
+	} else if (level <= LOG_LEVEL_WARN) {
+		// Keep the relative order of stdout and stderr lines
+		batch_flush(out);
+		batch_append(err, text);
+	} else {
+		batch_flush(err);
+		batch_append(out, text);
+	}
+}
+
+static void init_ring(void)
+{
+	for (size_t i = 0; i < LOG_RING_SIZE; i++) {
+		atomic_init(&ring[i].seq, i);
+	}
+}
+
+/*
+ * Write out everything queued so far. Normally only the drain thread gets
+ * here, the lock covers callers draining synchronously before log_init() or
+ * after log_deinit().
+ */
+static void drain(void)
+{
+	static struct log_batch out = { .fd = STDOUT_FILENO };
+	static struct log_batch err = { .fd = STDERR_FILENO };
+
+	pthread_mutex_lock(&drain_lock);
+
+	size_t lost = atomic_exchange(&dropped, 0);
+	if (lost > 0) {
+		char text[64];
+		snprintf(text, sizeof(text), "%zu log messages dropped", lost);
+		emit(&out, &err, LOG_LEVEL_WARN, text);
+	}
+
+	while (1) {
+		size_t pos = atomic_load_explicit(&dequeue_pos,
+						  memory_order_relaxed);
+		struct log_slot *slot = &ring[pos & (LOG_RING_SIZE - 1)];
+		size_t seq = atomic_load_explicit(&slot->seq,
+						  memory_order_acquire);
+		if (seq != pos + 1) {
+			break;
+		}
+
+		emit(&out, &err, slot->level, slot->text);
+		atomic_store_explicit(&slot->seq, pos + LOG_RING_SIZE,
+				      memory_order_release);
+		atomic_store_explicit(&dequeue_pos, pos + 1,
+				      memory_order_release);
+	}
+
+	batch_flush(&out);
+	batch_flush(&err);
+	pthread_mutex_unlock(&drain_lock);
+}
+
+static bool ring_empty(void)
+{
+	return atomic_load(&dequeue_pos) == atomic_load(&enqueue_pos);
+}
+
+static void *drain_main(void *arg)
+{
+	while (atomic_load(&running)) {
+		drain();
+
+		unsigned int word = atomic_load(&wake_word);
+		atomic_store(&drain_sleeping, true);
+		atomic_thread_fence(memory_order_seq_cst);
+		if (ring_empty() && atomic_load(&running)) {
+			futex_wait(&wake_word, word);
+		}
+		atomic_store(&drain_sleeping, false);
+	}
+
+	drain();
+	return NULL;
+}
+
+void log_write(enum log_level level, const char *fmt, ...)
+{
+	if ((int)level > atomic_load_explicit(&current_level,
+					      memory_order_relaxed)) {
+		return;
+	}
+	pthread_once(&ring_once, init_ring);
+
+	// Reserve a slot, or drop the message when the drain thread fell behind
+	size_t pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+	struct log_slot *slot;
+	while (1) {
+		slot = &ring[pos & (LOG_RING_SIZE - 1)];
+		size_t seq = atomic_load_explicit(&slot->seq,
+						  memory_order_acquire);
+		intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak_explicit(
+				    &enqueue_pos, &pos, pos + 1,
+				    memory_order_relaxed,
+				    memory_order_relaxed)) {
+				break;
+			}
+		} else if (diff < 0) {
+			atomic_fetch_add(&dropped, 1);
+			return;
+		} else {
+			pos = atomic_load_explicit(&enqueue_pos,
+						   memory_order_relaxed);
+		}
+	}
+
+	va_list args;
+	va_start(args, fmt);
+	vsnprintf(slot->text, sizeof(slot->text), fmt, args);
+	va_end(args);
+	slot->level = level;
+	atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+
+	if (atomic_load_explicit(&running, memory_order_relaxed)) {
+		wake_drain_thread();
+	} else {
+		drain();
+	}
+}
+
+// Block until everything logged so far has been written
+void log_flush(void)
+{
+	if (!atomic_load(&running)) {
+		drain();
+		return;
+	}
+
+	struct timespec pause = { .tv_nsec = 1000000 };
+	for (int i = 0; i < 1000 && !ring_empty(); i++) {
+		wake_drain_thread();
+		nanosleep(&pause, NULL);
+	}
+}
+
+void log_set_level(enum log_level level)
+{
+	atomic_store(&current_level, level);
+}
+
+// Log to the journal directly when stderr is connected to it
+static bool stderr_is_journal(void)
+{
+	const char *stream = getenv("JOURNAL_STREAM");
+	struct stat st;
+	unsigned long long dev, ino;
+
+	if (stream == NULL || sscanf(stream, "%llu:%llu", &dev, &ino) != 2) {
+		return false;
+	}
+	if (fstat(STDERR_FILENO, &st) < 0) {
+		return false;
+	}
+	return st.st_dev == dev && st.st_ino == ino;
+}
+
+/*
+ * KNIPSER_LOG_LEVEL selects error, warn, info or debug and KNIPSER_LOG=journal
+ * or KNIPSER_LOG=stderr overrides where messages go.
+ */
+void log_init(void)
+{
+	static const char *const level_names[] = {
+		[LOG_LEVEL_ERROR] = "error",
+		[LOG_LEVEL_WARN] = "warn",
+		[LOG_LEVEL_INFO] = "info",
+		[LOG_LEVEL_DEBUG] = "debug",
+	};
+
+	pthread_once(&ring_once, init_ring);
+
+#ifndef NDEBUG
+	log_set_level(LOG_LEVEL_DEBUG);
+#endif
+	const char *level = getenv("KNIPSER_LOG_LEVEL");
+	for (size_t i = 0; level != NULL && i < 4; i++) {
+		if (strcmp(level, level_names[i]) == 0) {
+			log_set_level((enum log_level)i);
+		}
+	}
+
+	const char *target = getenv("KNIPSER_LOG");
+	if (target != NULL) {
+		use_journal = strcmp(target, "journal") == 0;
+	} else {
+		use_journal = stderr_is_journal();
+	}
+
+	atomic_store(&running, true);
+	if (pthread_create(&drain_thread, NULL, drain_main, NULL) != 0) {
+		// Fall back to writing synchronously from the caller
+		atomic_store(&running, false);
+		return;
+	}
+
+	// Messages logged right before exit() must not get lost
+	atexit(log_deinit);
+}
+
+void log_deinit(void)
+{
+	if (!atomic_exchange(&running, false)) {
+		return;
+	}
+
+	atomic_fetch_add(&wake_word, 1);
+	futex_wake(&wake_word);
+	pthread_join(drain_thread, NULL);
+}
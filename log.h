@@ -0,0 +1,46 @@
+#ifndef _LOG_H_
+#define _LOG_H_
+
+enum log_level {
+	LOG_LEVEL_ERROR,
+	LOG_LEVEL_WARN,
+	LOG_LEVEL_INFO,
+	LOG_LEVEL_DEBUG,
+};
+
+void log_init(void);
+void log_flush(void);
+void log_deinit(void);
+void log_set_level(enum log_level level);
+void log_write(enum log_level level, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+// libknipser never prints, its callers get error codes instead
+#ifdef KNIPSER_LIBRARY
+static inline __attribute__((format(printf, 1, 2))) void
+log_discard(const char *fmt, ...)
+{
+}
+
+#define log_error(...) log_discard(__VA_ARGS__)
+#define log_warn(...) log_discard(__VA_ARGS__)
+#define log_info(...) log_discard(__VA_ARGS__)
+#define log_debug(...) log_discard(__VA_ARGS__)
+#else
+#define log_error(...) log_write(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define log_warn(...) log_write(LOG_LEVEL_WARN, __VA_ARGS__)
+#define log_info(...) log_write(LOG_LEVEL_INFO, __VA_ARGS__)
+
+// Debug messages are compiled out of release builds, but still type checked
+#ifdef NDEBUG
+#define log_debug(...)                                         \
+	do {                                                   \
+		if (0)                                         \
+			log_write(LOG_LEVEL_DEBUG, __VA_ARGS__); \
+	} while (0)
+#else
+#define log_debug(...) log_write(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#endif
+#endif
+
+#endif /* _LOG_H_ */
@@ -1,24 +1,205 @@
-#include <stdio.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
 
+#include "archive.h"
+#include "catalog.h"
+#include "cli.h"
+#include "clipboard.h"
+#include "control.h"
+#include "knipser.h"
+#include "live.h"
+#include "log.h"
+#include "ring.h"
+#include "startup.h"
+#include "stats.h"
+#include "timelapse.h"
+#include "trace.h"
+#include "vnc.h"
 #include "wayland.h"
 #include "tray.h"
 
+/*
+ * KNIPSER_IDLE_TIMEOUT=<seconds> exits after that long without a call, for
+ * running as an activated service. Unset or 0 keeps knipser resident.
+ */
+static uint64_t idle_timeout_ns(void)
+{
+	const char *env = getenv("KNIPSER_IDLE_TIMEOUT");
+	if (env == NULL) {
+		return 0;
+	}
+
+	char *end;
+	long seconds = strtol(env, &end, 10);
+	if (end == env || *end != '\0' || seconds < 0) {
+		log_warn("Ignoring invalid KNIPSER_IDLE_TIMEOUT=%s", env);
+		return 0;
+	}
+	return (uint64_t)seconds * 1000000000ULL;
+}
 
 int main(int argc, char *argv[])
 {
-	int ret = 0;
-	init_wayland();
+	// Any option makes this a one-shot capture that never touches D-Bus
+	if (argc > 1) {
+		return cli_main(argc, argv);
+	}
+
+	// Every thread started from here on inherits the blocked signals
+	control_block_signals();
 
-	ret = init_tray();
+	startup_begin();
+	log_init();
+	trace_init();
+
+	if (control_init() != 0) {
+		log_error("Failed to set up capture triggers!");
+		return 1;
+	}
+
+	if (archive_init() != 0) {
+		log_error("Failed to open the archive!");
+		return 1;
+	}
+	if (catalog_init() != 0) {
+		log_error("Failed to open the catalog!");
+		return 1;
+	}
+	if (knipser_init() != 0) {
+		log_error("Failed to start encoders!");
+		return 1;
+	}
+	if (ring_init() != 0) {
+		log_error("Failed to set up the frame ring!");
+		return 1;
+	}
+	if (timelapse_init() != 0) {
+		log_error("Failed to set up the timelapse!");
+		return 1;
+	}
+	if (live_init() != 0) {
+		log_error("Failed to start the live view!");
+		return 1;
+	}
+	if (vnc_init() != 0) {
+		log_error("Failed to start the VNC server!");
+		return 1;
+	}
 
-	if (ret != 0) {
-		printf("Failed to init tray!\n");
+	// The Wayland thread starts up while this thread, the D-Bus thread, connects
+	if (init_wayland() != 0) {
+		log_error("Failed to init Wayland!");
+		return 1;
+	}
+	if (init_tray() != 0) {
+		log_error("Failed to init tray!");
+		return 1;
 	}
 
-	while(1) {
-		handle_sd_process();
+	uint64_t idle_ns = idle_timeout_ns();
+	uint64_t last_activity = stats_now();
+	bool ready = false;
+	bool exiting = false;
+	int status = 1;
+	while (1) {
+		struct pollfd fds[4 + CONTROL_MAX_FDS + LIVE_MAX_FDS + VNC_MAX_FDS] = {
+			{ .fd = knipser_get_fd(), .events = POLLIN },
+			{ .fd = ring_get_fd(), .events = POLLIN },
+			{ .fd = timelapse_get_fd(), .events = POLLIN },
+		};
+		int timeout = tray_prepare_poll(&fds[3]);
+		int num_control = control_prepare_poll(&fds[4], CONTROL_MAX_FDS);
+		struct pollfd *live_fds = &fds[4 + num_control];
+		int num_live = live_prepare_poll(live_fds, LIVE_MAX_FDS);
+		struct pollfd *vnc_fds = &live_fds[num_live];
+		int num_vnc = vnc_prepare_poll(vnc_fds, VNC_MAX_FDS);
+		int num_fds = 4 + num_control + num_live + num_vnc;
+
+		// Wake up in time to exit when idle
+		if (idle_ns > 0 && !exiting) {
+			uint64_t idle = stats_now() - last_activity;
+			int remaining = idle < idle_ns ?
+						(int)((idle_ns - idle + 999999) / 1000000) :
+						0;
+			if (timeout < 0 || remaining < timeout) {
+				timeout = remaining;
+			}
+		}
+
+		if (poll(fds, num_fds, timeout) < 0 && errno != EINTR) {
+			log_error("poll failed: %s", strerror(errno));
+			break;
+		}
+
+		// Replies to finished captures count as activity too
+		int completed = knipser_dispatch();
+		int triggered = control_dispatch(&fds[4], num_control);
+		live_dispatch(live_fds, num_live);
+		vnc_dispatch(vnc_fds, num_vnc);
+		if (fds[1].revents & POLLIN) {
+			ring_dispatch();
+		}
+		if (fds[2].revents & POLLIN) {
+			timelapse_dispatch();
+		}
+		if (tray_dispatch() < 0 || wayland_failed()) {
+			break;
+		}
+
+		// Measured from the end of a capture, so a slow one doesn't count as idle
+		if (tray_take_activity() || completed > 0 || triggered > 0 ||
+		    ring_active() || timelapse_enabled() || clipboard_owned() ||
+		    live_active() || vnc_active()) {
+			last_activity = stats_now();
+		}
+
+		// SIGTERM and SIGINT let the captures in progress finish
+		if (control_should_quit() && !exiting) {
+			exiting = true;
+			status = 0;
+		}
+
+		if (!ready && wayland_ready() && tray_ready()) {
+			ready = true;
+			startup_mark("ready");
+			startup_report();
+			if (startup_measuring()) {
+				status = 0;
+				break;
+			}
+		}
+
+		// Calls queued before the name was released may still start captures
+		if (ready && idle_ns > 0 && !exiting && !knipser_busy() &&
+		    stats_now() - last_activity >= idle_ns) {
+			log_info("Idle for %llu s, exiting",
+				 (unsigned long long)(idle_ns / 1000000000ULL));
+			exiting = true;
+			status = tray_release_name() < 0 ? 1 : 0;
+		}
+		// Timelapse and VNC frames may wait for a change that never comes
+		if (exiting) {
+			timelapse_stop();
+			vnc_stop();
+		}
+		if (exiting && !knipser_busy()) {
+			break;
+		}
 	}
 
+	// Releases every capture buffer, including pre-faulted hugepages
+	deinit_wayland();
+	knipser_deinit();
+	ring_deinit();
+	timelapse_deinit();
+	live_deinit();
+	vnc_deinit();
+	archive_deinit();
+	catalog_deinit();
 	deinit_tray();
-	return 0;
-}
\ No newline at end of file
+	control_deinit();
+	return status;
+}
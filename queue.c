@@ -0,0 +1,149 @@
+#include <errno.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "log.h"
+#include "queue.h"
+
+// Capacity must be a power of two
+int queue_init(struct queue *queue, size_t capacity, bool blocking)
+{
+	memset(queue, 0, sizeof(*queue));
+	queue->cells = calloc(capacity, sizeof(*queue->cells));
+	if (queue->cells == NULL) {
+		log_error("Failed to allocate queue");
+		return -1;
+	}
+	for (size_t i = 0; i < capacity; i++) {
+		atomic_init(&queue->cells[i].seq, i);
+	}
+	queue->mask = capacity - 1;
+
+	// A blocking queue wakes exactly one waiter per item
+	int flags = EFD_CLOEXEC | (blocking ? EFD_SEMAPHORE : EFD_NONBLOCK);
+	queue->fd = eventfd(0, flags);
+	if (queue->fd < 0) {
+		log_error("Failed to create eventfd: %s", strerror(errno));
+		free(queue->cells);
+		queue->cells = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+void queue_finish(struct queue *queue)
+{
+	if (queue->cells == NULL) {
+		return;
+	}
+	close(queue->fd);
+	free(queue->cells);
+	queue->cells = NULL;
+}
+
+bool queue_push(struct queue *queue, void *item)
+{
+	size_t pos = atomic_load_explicit(&queue->enqueue_pos,
+					  memory_order_relaxed);
+	struct queue_cell *cell;
+	while (1) {
+		cell = &queue->cells[pos & queue->mask];
+		size_t seq = atomic_load_explicit(&cell->seq,
+						  memory_order_acquire);
+		intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak_explicit(
+				    &queue->enqueue_pos, &pos, pos + 1,
+				    memory_order_relaxed,
+				    memory_order_relaxed)) {
+				break;
+			}
+		} else if (diff < 0) {
+			return false;
+		} else {
+			pos = atomic_load_explicit(&queue->enqueue_pos,
+						   memory_order_relaxed);
+		}
+	}
+
+	cell->item = item;
+	atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+	queue_wake(queue);
+	return true;
+}
+
+// Returns NULL when the queue is empty
+void *queue_pop(struct queue *queue)
+{
+	size_t pos = atomic_load_explicit(&queue->dequeue_pos,
+					  memory_order_relaxed);
+	struct queue_cell *cell;
+	while (1) {
+		cell = &queue->cells[pos & queue->mask];
+		size_t seq = atomic_load_explicit(&cell->seq,
+						  memory_order_acquire);
+		intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak_explicit(
+				    &queue->dequeue_pos, &pos, pos + 1,
+				    memory_order_relaxed,
+				    memory_order_relaxed)) {
+				break;
+			}
+		} else if (diff < 0) {
+			return NULL;
+		} else {
+			pos = atomic_load_explicit(&queue->dequeue_pos,
+						   memory_order_relaxed);
+		}
+	}
+
+	void *item = cell->item;
+	atomic_store_explicit(&cell->seq, pos + queue->mask + 1,
+			      memory_order_release);
+	return item;
+}
+
+/*
+ * Sleep until an item or a wakeup arrives. Returns NULL for a bare
+ * queue_wake(), which is how a blocking queue's consumers are stopped.
+ */
+void *queue_wait(struct queue *queue)
+{
+	uint64_t count;
+	while (read(queue->fd, &count, sizeof(count)) < 0 && errno == EINTR) {
+	}
+
+	// The item counted may sit behind a slot another producer is still filling
+	void *item;
+	while ((item = queue_pop(queue)) == NULL &&
+	       atomic_load(&queue->dequeue_pos) !=
+		       atomic_load(&queue->enqueue_pos)) {
+		sched_yield();
+	}
+	return item;
+}
+
+void queue_wake(struct queue *queue)
+{
+	uint64_t one = 1;
+	while (write(queue->fd, &one, sizeof(one)) < 0 && errno == EINTR) {
+	}
+}
+
+int queue_fd(const struct queue *queue)
+{
+	return queue->fd;
+}
+
+// Reset the eventfd of a polled queue before popping, so no push is missed
+void queue_clear(struct queue *queue)
+{
+	uint64_t count;
+	while (read(queue->fd, &count, sizeof(count)) < 0 && errno == EINTR) {
+	}
+}
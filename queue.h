@@ -0,0 +1,36 @@
+#ifndef _QUEUE_H_
+#define _QUEUE_H_
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Bounded lock-free queue of pointers between threads. Pushing never blocks,
+ * it fails when the queue is full. Every push also counts up an eventfd, so
+ * a consumer either polls queue_fd() and pops until the queue is empty, or,
+ * for a blocking queue, sleeps in queue_wait() for one item at a time.
+ */
+struct queue_cell {
+	atomic_size_t seq;
+	void *item;
+};
+
+struct queue {
+	struct queue_cell *cells;
+	size_t mask;
+	atomic_size_t enqueue_pos;
+	atomic_size_t dequeue_pos;
+	int fd;
+};
+
+int queue_init(struct queue *queue, size_t capacity, bool blocking);
+void queue_finish(struct queue *queue);
+bool queue_push(struct queue *queue, void *item);
+void *queue_pop(struct queue *queue);
+void *queue_wait(struct queue *queue);
+void queue_wake(struct queue *queue);
+int queue_fd(const struct queue *queue);
+void queue_clear(struct queue *queue);
+
+#endif /* _QUEUE_H_ */
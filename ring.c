@@ -0,0 +1,414 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+
+#include "knipser.h"
+#include "layout.h"
+#include "log.h"
+#include "ring.h"
+#include "shm.h"
+
+/*
+ * Publisher for the frame ring. While anyone is subscribed, a timer starts
+ * one capture per interval into the slot after the latest, so the
+ * compositor copies straight into shared memory and any number of
+ * consumers read the same frame. Only the very first frame of a ring, which
+ * sizes its slots, is copied once more.
+ */
+#define RING_MAX_SUBSCRIBERS 16
+
+struct ring_subscriber {
+	char owner[64]; // D-Bus unique name, empty when the entry is free
+	int notify_fd;
+	struct ring_waiter waiter; // ready is NULL once told
+};
+
+static bool enabled = false;
+static char output_name[64]; // Empty for the output at the origin
+static uint64_t interval_ns = 33333333; // 30 frames per second
+static int num_slots = 3;
+
+static int timer_fd = -1;
+static struct ring_subscriber subscribers[RING_MAX_SUBSCRIBERS];
+static int num_subscribers = 0;
+
+static struct shm_mapping mapping; // The current ring, data is NULL until the first frame
+static struct ring_header *header = NULL;
+static int readonly_fd = -1; // What subscribers get
+static size_t page_size;
+static bool in_flight = false;
+static int writing = -1; // Slot being copied into
+static uint64_t frames = 0;
+
+// KNIPSER_RING=1 streams the output at the origin, KNIPSER_RING=NAME that output
+static void read_config(void)
+{
+	const char *env = getenv("KNIPSER_RING");
+	if (env == NULL || env[0] == '\0') {
+		return;
+	}
+	enabled = true;
+	if (strcmp(env, "1") != 0) {
+		snprintf(output_name, sizeof(output_name), "%s", env);
+	}
+
+	env = getenv("KNIPSER_RING_FPS");
+	if (env != NULL) {
+		int fps = atoi(env);
+		if (fps >= 1 && fps <= 1000) {
+			interval_ns = 1000000000ULL / fps;
+		} else {
+			log_warn("KNIPSER_RING_FPS must be between 1 and 1000");
+		}
+	}
+
+	env = getenv("KNIPSER_RING_SLOTS");
+	if (env != NULL) {
+		int slots = atoi(env);
+		if (slots >= 2 && slots <= RING_MAX_SLOTS) {
+			num_slots = slots;
+		} else {
+			log_warn("KNIPSER_RING_SLOTS must be between 2 and %d",
+				 RING_MAX_SLOTS);
+		}
+	}
+}
+
+int ring_init(void)
+{
+	page_size = sysconf(_SC_PAGESIZE);
+	for (int i = 0; i < RING_MAX_SUBSCRIBERS; i++) {
+		subscribers[i].notify_fd = -1;
+	}
+	read_config();
+	if (!enabled) {
+		return 0;
+	}
+
+	timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (timer_fd < 0) {
+		log_error("Failed to create ring timer: %s", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+bool ring_enabled(void)
+{
+	return enabled;
+}
+
+// Subscribers keep an idle daemon alive
+bool ring_active(void)
+{
+	return num_subscribers > 0;
+}
+
+int ring_get_fd(void)
+{
+	return timer_fd;
+}
+
+static void set_timer(bool running)
+{
+	struct itimerspec spec = { 0 };
+	if (running) {
+		spec.it_interval.tv_sec = interval_ns / 1000000000ULL;
+		spec.it_interval.tv_nsec = interval_ns % 1000000000ULL;
+		spec.it_value = spec.it_interval;
+	}
+	timerfd_settime(timer_fd, 0, &spec, NULL);
+}
+
+static void begin_write(struct ring_slot *slot)
+{
+	__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void end_write(struct ring_slot *slot)
+{
+	__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+}
+
+// A slot the compositor may have written part of no longer holds a frame
+static void abandon_write(void)
+{
+	if (writing >= 0 && header != NULL) {
+		struct ring_slot *slot = &header->slots[writing];
+		slot->frame = 0;
+		end_write(slot);
+	}
+	writing = -1;
+}
+
+// Wake futex waiters and signal every subscriber
+static void notify(void)
+{
+	__atomic_add_fetch(&header->frame, 1, __ATOMIC_RELEASE);
+	syscall(SYS_futex, &header->frame, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+
+	// Only fails once a counter saturates, that subscriber is far behind anyway
+	for (int i = 0; i < RING_MAX_SUBSCRIBERS; i++) {
+		if (subscribers[i].owner[0] != '\0') {
+			eventfd_write(subscribers[i].notify_fd, 1);
+		}
+	}
+}
+
+// Retire the current ring, subscribers keep their own mappings of it
+static void close_ring(void)
+{
+	if (header == NULL) {
+		return;
+	}
+	__atomic_store_n(&header->retired, 1, __ATOMIC_RELEASE);
+	notify();
+	close(readonly_fd);
+	readonly_fd = -1;
+	shm_mapping_destroy(&mapping);
+	header = NULL;
+}
+
+static void answer(struct ring_subscriber *subscriber, int ring_fd,
+		   int notify_fd)
+{
+	struct ring_waiter waiter = subscriber->waiter;
+	subscriber->waiter.ready = NULL;
+	if (waiter.ready != NULL) {
+		waiter.ready(waiter.user, ring_fd, notify_fd);
+	}
+}
+
+/*
+ * Resizing is sealed off, so mapping the ring can never fault. Writes
+ * can't be, the compositor maps every capture buffer writable.
+ */
+static int create_ring(size_t frame_size)
+{
+	close_ring();
+
+	size_t slot_size = (frame_size + page_size - 1) / page_size * page_size;
+	if (shm_mapping_create(&mapping, page_size + num_slots * slot_size,
+			       false) < 0) {
+		return -1;
+	}
+	if (fcntl(mapping.fd, F_ADD_SEALS,
+		  F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0) {
+		log_warn("Failed to seal frame ring: %s", strerror(errno));
+	}
+
+	// A read only file description keeps subscribers from mapping it writable
+	char path[32];
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", mapping.fd);
+	readonly_fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (readonly_fd < 0) {
+		log_error("Failed to reopen frame ring: %s", strerror(errno));
+		shm_mapping_destroy(&mapping);
+		return -1;
+	}
+
+	header = mapping.data;
+	header->magic = RING_MAGIC;
+	header->version = RING_VERSION;
+	header->num_slots = num_slots;
+	header->slot_size = slot_size;
+	for (int i = 0; i < num_slots; i++) {
+		header->slots[i].offset = page_size + i * slot_size;
+	}
+	log_debug("Created frame ring of %d %zu KiB slots", num_slots,
+		  slot_size / 1024);
+
+	for (int i = 0; i < RING_MAX_SUBSCRIBERS; i++) {
+		if (subscribers[i].owner[0] != '\0') {
+			answer(&subscribers[i], readonly_fd,
+			       subscribers[i].notify_fd);
+		}
+	}
+	return 0;
+}
+
+static void publish(const struct capture_job *job)
+{
+	const struct canvas_output *frame = &job->frames[0];
+	struct ring_slot *slot = &header->slots[writing];
+	slot->format = frame->format;
+	slot->width = frame->width;
+	slot->height = frame->height;
+	slot->stride = frame->stride;
+	slot->flags = frame->y_invert ? RING_SLOT_Y_INVERT : 0;
+	slot->transform = frame->transform;
+	slot->frame = ++frames;
+	slot->timestamp_ns = job->start_ns;
+	end_write(slot);
+
+	__atomic_store_n(&header->latest, writing, __ATOMIC_RELEASE);
+	writing = -1;
+	notify();
+}
+
+static void frame_complete(void *user, int result,
+			   const struct capture_job *job)
+{
+	in_flight = false;
+	if (result < 0 || job == NULL) {
+		abandon_write();
+		return;
+	}
+
+	// The frame has a buffer of its own when there was no ring yet or it didn't fit
+	const struct canvas_output *frame = &job->frames[0];
+	if (job->mappings[0] != NULL) {
+		abandon_write();
+		if (create_ring((size_t)frame->stride * frame->height) < 0) {
+			return;
+		}
+		writing = 0;
+		begin_write(&header->slots[0]);
+		memcpy((uint8_t *)mapping.data + header->slots[0].offset,
+		       frame->data, (size_t)frame->stride * frame->height);
+	}
+	publish(job);
+}
+
+static bool find_output(int32_t *x, int32_t *y)
+{
+	*x = 0;
+	*y = 0;
+	if (output_name[0] == '\0') {
+		return true;
+	}
+
+	const struct layout *layout = layout_acquire();
+	const struct layout_output *found = layout_find_name(layout, output_name);
+	if (found != NULL) {
+		*x = found->x;
+		*y = found->y;
+	}
+	layout_release(layout);
+	return found != NULL;
+}
+
+// One frame at a time, a tick that finds the last one still copying is skipped
+static void start_frame(void)
+{
+	int32_t x, y;
+	if (in_flight || num_subscribers == 0 || !find_output(&x, &y)) {
+		return;
+	}
+
+	struct capture_target target = { 0 };
+	if (header != NULL) {
+		writing = (header->latest + 1) % header->num_slots;
+		begin_write(&header->slots[writing]);
+		target.mapping = &mapping;
+		target.offset = header->slots[writing].offset;
+		target.size = header->slot_size;
+	}
+
+	struct capture_waiter waiter = { frame_complete, NULL };
+	if (knipser_handle_ring_capture(x, y, &target, waiter) < 0) {
+		abandon_write();
+		return;
+	}
+	in_flight = true;
+}
+
+void ring_dispatch(void)
+{
+	uint64_t expirations;
+	if (timer_fd < 0 ||
+	    read(timer_fd, &expirations, sizeof(expirations)) < 0) {
+		return;
+	}
+	start_frame();
+}
+
+static struct ring_subscriber *find_subscriber(const char *owner)
+{
+	for (int i = 0; i < RING_MAX_SUBSCRIBERS; i++) {
+		if (strcmp(subscribers[i].owner, owner) == 0) {
+			return &subscribers[i];
+		}
+	}
+	return NULL;
+}
+
+// Returns 0 when the waiter will be told, which may already have happened
+int ring_subscribe(const char *owner, struct ring_waiter waiter)
+{
+	if (!enabled || owner[0] == '\0' ||
+	    strlen(owner) >= sizeof(subscribers[0].owner)) {
+		return -1;
+	}
+
+	struct ring_subscriber *subscriber = find_subscriber(owner);
+	if (subscriber == NULL) {
+		subscriber = find_subscriber("");
+		if (subscriber == NULL) {
+			return -1;
+		}
+		subscriber->notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (subscriber->notify_fd < 0) {
+			log_error("Failed to create eventfd: %s",
+				  strerror(errno));
+			return -1;
+		}
+		snprintf(subscriber->owner, sizeof(subscriber->owner), "%s",
+			 owner);
+		if (num_subscribers++ == 0) {
+			set_timer(true);
+			start_frame();
+		}
+	}
+
+	// A repeated call replaces one still waiting for the first frame
+	answer(subscriber, -1, -1);
+	subscriber->waiter = waiter;
+	if (header != NULL) {
+		answer(subscriber, readonly_fd, subscriber->notify_fd);
+	}
+	return 0;
+}
+
+void ring_unsubscribe(const char *owner)
+{
+	if (owner[0] == '\0') {
+		return;
+	}
+	struct ring_subscriber *subscriber = find_subscriber(owner);
+	if (subscriber == NULL) {
+		return;
+	}
+
+	answer(subscriber, -1, -1);
+	close(subscriber->notify_fd);
+	subscriber->notify_fd = -1;
+	subscriber->owner[0] = '\0';
+	if (--num_subscribers == 0) {
+		set_timer(false);
+	}
+}
+
+void ring_deinit(void)
+{
+	for (int i = 0; i < RING_MAX_SUBSCRIBERS; i++) {
+		if (subscribers[i].owner[0] != '\0') {
+			ring_unsubscribe(subscribers[i].owner);
+		}
+	}
+	close_ring();
+	if (timer_fd >= 0) {
+		close(timer_fd);
+		timer_fd = -1;
+	}
+}
@@ -0,0 +1,66 @@
+#ifndef _RING_H_
+#define _RING_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Shared frame ring. One memfd holds this header in its first page and
+ * num_slots frames after it, each at a page aligned offset. Subscribers get
+ * a read only descriptor for it, so every consumer maps the same frames.
+ *
+ * Each slot is a seqlock: seq is odd while a frame is copied into it. A
+ * reader loads seq and skips the slot while it is odd, reads the slot and
+ * its pixels, and throws away what it read if seq changed in the meantime.
+ * Once a frame is published, latest names its slot and frame is
+ * incremented. frame is a futex word that can be waited on without
+ * FUTEX_PRIVATE_FLAG, and each subscriber's eventfd is signalled as well.
+ *
+ * A frame that no longer fits the slots starts a new ring. The old one is
+ * marked retired and subscribers call Subscribe again to get the new one.
+ */
+#define RING_MAGIC 0x474e524b // "KRNG"
+#define RING_VERSION 1
+#define RING_MAX_SLOTS 8
+
+#define RING_SLOT_Y_INVERT 1
+
+struct ring_slot {
+	uint32_t seq;
+	uint32_t format; // A wl_shm format
+	uint32_t width, height, stride;
+	uint32_t flags;
+	uint32_t transform; // A wl_output transform
+	uint32_t reserved;
+	uint64_t offset; // Of the pixels from the start of the memfd
+	uint64_t frame; // Zero while the slot holds no frame
+	uint64_t timestamp_ns; // CLOCK_MONOTONIC when the capture was requested
+};
+
+struct ring_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t frame;
+	uint32_t latest;
+	uint32_t num_slots;
+	uint32_t retired;
+	uint64_t slot_size;
+	struct ring_slot slots[RING_MAX_SLOTS];
+};
+
+// Told once the ring exists, with -1 for both if it never will
+struct ring_waiter {
+	void (*ready)(void *user, int ring_fd, int notify_fd);
+	void *user;
+};
+
+int ring_init(void);
+void ring_deinit(void);
+bool ring_enabled(void);
+bool ring_active(void);
+int ring_get_fd(void);
+void ring_dispatch(void);
+int ring_subscribe(const char *owner, struct ring_waiter waiter);
+void ring_unsubscribe(const char *owner);
+
+#endif /* _RING_H_ */
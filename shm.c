@@ -0,0 +1,201 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include "log.h"
+#include "shm.h"
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+#ifndef F_SEAL_FUTURE_WRITE
+#define F_SEAL_FUTURE_WRITE 0x0010
+#endif
+
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+static size_t round_up(size_t size, size_t align)
+{
+	return (size + align - 1) / align * align;
+}
+
+// Fault in every page now rather than during the compositor's copy
+static void populate(void *data, size_t size)
+{
+	if (madvise(data, size, MADV_POPULATE_WRITE) == 0) {
+		return;
+	}
+
+	// Kernels older than 5.14, touch one byte per page instead
+	long page_size = sysconf(_SC_PAGESIZE);
+	for (size_t offset = 0; offset < size; offset += page_size) {
+		((volatile uint8_t *)data)[offset] = 0;
+	}
+}
+
+/*
+ * Reserved hugetlb pages are tried first. MAP_POPULATE makes the kernel
+ * reserve them at mmap() time, so running out fails here instead of with a
+ * SIGBUS in the middle of a capture.
+ */
+static int create_hugetlb(struct shm_mapping *mapping, size_t size)
+{
+	size = round_up(size, HUGE_PAGE_SIZE);
+	int fd = memfd_create("knipser-screencopy",
+			      MFD_CLOEXEC | MFD_ALLOW_SEALING |
+				      MFD_HUGETLB);
+	if (fd < 0) {
+		return -1;
+	}
+	if (ftruncate(fd, size) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	void *data = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, fd, 0);
+	if (data == MAP_FAILED) {
+		close(fd);
+		return -1;
+	}
+
+	mapping->fd = fd;
+	mapping->data = data;
+	mapping->size = size;
+	mapping->hugetlb = true;
+	return 0;
+}
+
+int shm_mapping_create(struct shm_mapping *mapping, size_t size,
+		       bool hugepages)
+{
+	if (hugepages) {
+		if (create_hugetlb(mapping, size) == 0) {
+			return 0;
+		}
+
+		// Without reserved pages, shmem may still back the mapping with THP
+		log_debug("No hugetlb pages available, using transparent hugepages");
+		size = round_up(size, HUGE_PAGE_SIZE);
+	}
+
+	int fd = memfd_create("knipser-screencopy",
+			      MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0) {
+		log_error("memfd_create failed: %s", strerror(errno));
+		return -1;
+	}
+
+	int ret;
+	while ((ret = ftruncate(fd, size)) < 0 && errno == EINTR) {
+		// No-op
+	}
+	if (ret < 0) {
+		log_error("ftruncate failed: %s", strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (data == MAP_FAILED) {
+		log_error("mmap failed: %s", strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	if (hugepages) {
+		if (madvise(data, size, MADV_HUGEPAGE) < 0) {
+			log_debug("MADV_HUGEPAGE failed: %s", strerror(errno));
+		}
+		populate(data, size);
+	}
+
+	mapping->fd = fd;
+	mapping->data = data;
+	mapping->size = size;
+	mapping->hugetlb = false;
+	return 0;
+}
+
+// A zeroed mapping counts as already destroyed
+void shm_mapping_destroy(struct shm_mapping *mapping)
+{
+	if (mapping->data == NULL) {
+		return;
+	}
+	munmap(mapping->data, mapping->size);
+	close(mapping->fd);
+	mapping->data = NULL;
+	mapping->fd = -1;
+	mapping->size = 0;
+}
+
+/*
+ * Seal a memfd against resizing and writes so a client can map it without
+ * fear of SIGBUS or the contents changing. A full write seal fails while
+ * anyone, like the compositor, still maps it writable, then only new
+ * writers are locked out.
+ */
+int shm_seal(int fd)
+{
+	if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW) < 0) {
+		log_error("Failed to seal memfd: %s", strerror(errno));
+		return -1;
+	}
+	if (fcntl(fd, F_ADD_SEALS, F_SEAL_WRITE) < 0 &&
+	    fcntl(fd, F_ADD_SEALS, F_SEAL_FUTURE_WRITE) < 0) {
+		log_debug("Failed to seal memfd against writes: %s",
+			  strerror(errno));
+	}
+	fcntl(fd, F_ADD_SEALS, F_SEAL_SEAL);
+	return 0;
+}
+
+// Unmap and seal the buffer, the caller owns the returned fd
+int shm_mapping_take_fd(struct shm_mapping *mapping)
+{
+	int fd = mapping->fd;
+	munmap(mapping->data, mapping->size);
+	mapping->data = NULL;
+	mapping->fd = -1;
+	mapping->size = 0;
+
+	if (shm_seal(fd) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * A new read-only open file description of a memfd. Duplicated fds share
+ * their file offset, so every client of a coalesced capture gets one of
+ * these and can read() without moving anyone else's offset.
+ */
+int shm_reopen(int fd)
+{
+	char path[32];
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+	int copy = open(path, O_RDONLY | O_CLOEXEC);
+	if (copy < 0) {
+		log_error("Failed to reopen memfd: %s", strerror(errno));
+	}
+	return copy;
+}
+
+// Minor page faults taken by this process so far
+long shm_minor_faults(void)
+{
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) < 0) {
+		return 0;
+	}
+	return usage.ru_minflt;
+}
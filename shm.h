@@ -0,0 +1,23 @@
+#ifndef _SHM_H_
+#define _SHM_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// A shared memory mapping that can be handed to the compositor as a wl_shm pool
+struct shm_mapping {
+	int fd;
+	void *data;
+	size_t size; // Rounded up to the page size actually used
+	bool hugetlb;
+};
+
+int shm_mapping_create(struct shm_mapping *mapping, size_t size,
+		       bool hugepages);
+void shm_mapping_destroy(struct shm_mapping *mapping);
+int shm_mapping_take_fd(struct shm_mapping *mapping);
+int shm_seal(int fd);
+int shm_reopen(int fd);
+long shm_minor_faults(void);
+
+#endif /* _SHM_H_ */
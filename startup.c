@@ -0,0 +1,78 @@
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "startup.h"
+#include "stats.h"
+#include "trace.h"
+
+#define STARTUP_MAX_MARKS 16
+
+// Knipser is started on login, so being ready later than this is reported
+#define STARTUP_TARGET_US 20000
+
+struct startup_mark {
+	const char *name;
+	uint64_t ns;
+};
+
+// Marks come from the main and Wayland threads, each claims its own slot
+static uint64_t start_ns = 0;
+static struct startup_mark marks[STARTUP_MAX_MARKS];
+static atomic_int num_marks = 0;
+static bool measuring = false;
+
+void startup_begin(void)
+{
+	start_ns = stats_now();
+
+	const char *env = getenv("KNIPSER_STARTUP_TIME");
+	measuring = env != NULL && strcmp(env, "1") == 0;
+}
+
+void startup_mark(const char *name)
+{
+	trace_instant("startup", name);
+	int index = atomic_fetch_add(&num_marks, 1);
+	if (index < STARTUP_MAX_MARKS) {
+		marks[index] = (struct startup_mark){
+			.name = name,
+			.ns = stats_now() - start_ns,
+		};
+	}
+}
+
+bool startup_measuring(void)
+{
+	return measuring;
+}
+
+// The last mark is taken as the time the daemon became ready
+void startup_report(void)
+{
+	int count = atomic_load(&num_marks);
+	if (count > STARTUP_MAX_MARKS) {
+		count = STARTUP_MAX_MARKS;
+	}
+	if (count == 0) {
+		return;
+	}
+
+	uint64_t ready_us = marks[count - 1].ns / 1000;
+	if (ready_us > STARTUP_TARGET_US) {
+		log_warn("Ready after %.2f ms, target is %d ms",
+			 ready_us / 1000.0, STARTUP_TARGET_US / 1000);
+	} else {
+		log_info("Ready after %.2f ms", ready_us / 1000.0);
+	}
+
+	// Tab separated on stdout, so repeated runs are easy to aggregate
+	if (measuring) {
+		for (int i = 0; i < count; i++) {
+			printf("%s\t%.3f\n", marks[i].name, marks[i].ns / 1e6);
+		}
+		fflush(stdout);
+	}
+}
@@ -0,0 +1,19 @@
+#ifndef _STARTUP_H_
+#define _STARTUP_H_
+
+#include <stdbool.h>
+
+/*
+ * Startup timing. Milestones are recorded relative to the start of main(),
+ * KNIPSER_STARTUP_TIME=1 prints them once the daemon is ready and exits, so
+ * `hyperfine` or `perf stat` can measure exec to ready.
+ *
+ * Names must be string literals, only the pointer is stored.
+ */
+
+void startup_begin(void);
+void startup_mark(const char *name);
+bool startup_measuring(void);
+void startup_report(void);
+
+#endif /* _STARTUP_H_ */
@@ -0,0 +1,182 @@
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+
+#include "stats.h"
+
+/*
+ * Log-linear (HDR style) histogram of durations in nanoseconds. Values below
+ * HIST_SUB_COUNT get a bucket each, above that every power of two is split
+ * into HIST_HALF_COUNT linear sub-buckets, which keeps the relative error
+ * below 1/HIST_HALF_COUNT (~1.6%) over the whole range.
+ */
+#define HIST_SUB_BITS 7
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_HALF_COUNT (HIST_SUB_COUNT / 2)
+#define HIST_MAX_BITS 40 // ~18 minutes, anything above is clamped
+#define HIST_NUM_BUCKETS \
+	((HIST_MAX_BITS - HIST_SUB_BITS + 2) * HIST_HALF_COUNT + HIST_HALF_COUNT)
+
+/*
+ * Stages are recorded from the Wayland, encoder and D-Bus threads, so every
+ * field is updated atomically. A summary taken during a capture may mix two
+ * samples, which is fine for statistics.
+ */
+struct histogram {
+	atomic_uint_least64_t buckets[HIST_NUM_BUCKETS];
+	atomic_uint_least64_t count;
+	atomic_uint_least64_t sum;
+	atomic_uint_least64_t inverted_min; // ~min, so zero means empty
+	atomic_uint_least64_t max;
+};
+
+static struct histogram histograms[STATS_NUM_STAGES];
+
+static const char *const stage_names[STATS_NUM_STAGES] = {
+	[STATS_STAGE_FIND_OUTPUT] = "FindOutput",
+	[STATS_STAGE_CREATE_BUFFER] = "CreateBuffer",
+	[STATS_STAGE_COPY] = "Copy",
+	[STATS_STAGE_CONVERT] = "Convert",
+	[STATS_STAGE_COMPRESS] = "Compress",
+	[STATS_STAGE_WRITE] = "Write",
+	[STATS_STAGE_CLOSE] = "Close",
+	[STATS_STAGE_TOTAL] = "Total",
+};
+
+static int bucket_index(uint64_t value)
+{
+	if (value >= (1ULL << HIST_MAX_BITS)) {
+		value = (1ULL << HIST_MAX_BITS) - 1;
+	}
+	if (value < HIST_SUB_COUNT) {
+		return (int)value;
+	}
+
+	int msb = 63 - __builtin_clzll(value);
+	int shift = msb - (HIST_SUB_BITS - 1);
+	return shift * HIST_HALF_COUNT + (int)(value >> shift);
+}
+
+// Highest value that maps into the given bucket
+static uint64_t bucket_value(int index)
+{
+	if (index < HIST_SUB_COUNT) {
+		return (uint64_t)index;
+	}
+
+	int shift = index / HIST_HALF_COUNT - 1;
+	uint64_t mantissa = (uint64_t)(index - shift * HIST_HALF_COUNT);
+	return ((mantissa + 1) << shift) - 1;
+}
+
+static uint64_t histogram_percentile(const struct histogram *hist,
+				     uint64_t count, uint64_t max,
+				     double percentile)
+{
+	uint64_t target = (uint64_t)(percentile / 100.0 * count + 0.5);
+	if (target < 1) {
+		target = 1;
+	}
+
+	uint64_t seen = 0;
+	for (int i = 0; i < HIST_NUM_BUCKETS; i++) {
+		seen += atomic_load_explicit(&hist->buckets[i],
+					     memory_order_relaxed);
+		if (seen >= target) {
+			uint64_t value = bucket_value(i);
+			return value < max ? value : max;
+		}
+	}
+	return max;
+}
+
+static void histogram_reset(struct histogram *hist)
+{
+	for (int i = 0; i < HIST_NUM_BUCKETS; i++) {
+		atomic_store_explicit(&hist->buckets[i], 0,
+				      memory_order_relaxed);
+	}
+	atomic_store(&hist->count, 0);
+	atomic_store(&hist->sum, 0);
+	atomic_store(&hist->inverted_min, 0);
+	atomic_store(&hist->max, 0);
+}
+
+static void atomic_max(atomic_uint_least64_t *value, uint64_t candidate)
+{
+	uint64_t current = atomic_load_explicit(value, memory_order_relaxed);
+	while (candidate > current &&
+	       !atomic_compare_exchange_weak_explicit(value, &current,
+						      candidate,
+						      memory_order_relaxed,
+						      memory_order_relaxed)) {
+	}
+}
+
+uint64_t stats_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+void stats_record(enum stats_stage stage, uint64_t duration_ns)
+{
+	if (stage >= STATS_NUM_STAGES) {
+		return;
+	}
+
+	struct histogram *hist = &histograms[stage];
+	atomic_fetch_add_explicit(&hist->buckets[bucket_index(duration_ns)], 1,
+				  memory_order_relaxed);
+	atomic_max(&hist->inverted_min, ~duration_ns);
+	atomic_max(&hist->max, duration_ns);
+
+	atomic_fetch_add_explicit(&hist->sum, duration_ns,
+				  memory_order_relaxed);
+	atomic_fetch_add_explicit(&hist->count, 1, memory_order_release);
+}
+
+void stats_record_since(enum stats_stage stage, uint64_t start_ns)
+{
+	stats_record(stage, stats_now() - start_ns);
+}
+
+void stats_get_summary(enum stats_stage stage, struct stats_summary *out)
+{
+	memset(out, 0, sizeof(*out));
+	if (stage >= STATS_NUM_STAGES) {
+		return;
+	}
+
+	const struct histogram *hist = &histograms[stage];
+	uint64_t count = atomic_load_explicit(&hist->count,
+					      memory_order_acquire);
+	if (count == 0) {
+		return;
+	}
+	uint64_t max = atomic_load(&hist->max);
+
+	out->count = count;
+	out->min_us = ~atomic_load(&hist->inverted_min) / 1000;
+	out->mean_us = atomic_load(&hist->sum) / count / 1000;
+	out->p50_us = histogram_percentile(hist, count, max, 50.0) / 1000;
+	out->p90_us = histogram_percentile(hist, count, max, 90.0) / 1000;
+	out->p99_us = histogram_percentile(hist, count, max, 99.0) / 1000;
+	out->max_us = max / 1000;
+}
+
+const char *stats_stage_name(enum stats_stage stage)
+{
+	if (stage >= STATS_NUM_STAGES) {
+		return NULL;
+	}
+	return stage_names[stage];
+}
+
+void stats_reset(void)
+{
+	for (int stage = 0; stage < STATS_NUM_STAGES; stage++) {
+		histogram_reset(&histograms[stage]);
+	}
+}
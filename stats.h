@@ -0,0 +1,56 @@
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stdint.h>
+#include <time.h>
+
+// Stages of a capture, from the D-Bus call to the file being closed
+enum stats_stage {
+	STATS_STAGE_FIND_OUTPUT,
+	STATS_STAGE_CREATE_BUFFER,
+	STATS_STAGE_COPY,
+	STATS_STAGE_CONVERT,
+	STATS_STAGE_COMPRESS,
+	STATS_STAGE_WRITE,
+	STATS_STAGE_CLOSE,
+	STATS_STAGE_TOTAL,
+	STATS_NUM_STAGES
+};
+
+struct stats_summary {
+	uint64_t count;
+	uint64_t min_us;
+	uint64_t mean_us;
+	uint64_t p50_us;
+	uint64_t p90_us;
+	uint64_t p99_us;
+	uint64_t max_us;
+};
+
+// libknipser keeps no global histograms, all of its state is in the client
+#ifdef KNIPSER_LIBRARY
+static inline uint64_t stats_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline void stats_record(enum stats_stage stage, uint64_t duration_ns)
+{
+}
+
+static inline void stats_record_since(enum stats_stage stage,
+				      uint64_t start_ns)
+{
+}
+#else
+uint64_t stats_now(void);
+void stats_record(enum stats_stage stage, uint64_t duration_ns);
+void stats_record_since(enum stats_stage stage, uint64_t start_ns);
+#endif
+void stats_get_summary(enum stats_stage stage, struct stats_summary *out);
+const char *stats_stage_name(enum stats_stage stage);
+void stats_reset(void);
+
+#endif /* _STATS_H_ */
@@ -0,0 +1,66 @@
+#!/bin/sh
+# Capture latency against the mock compositor, run headless by CTest.
+# Usage: mock-capture.sh MOCK KNIPSER FORMAT [CAPTURES]
+set -eu
+
+mock=$1
+knipser=$2
+format=$3
+captures=${4:-50}
+
+dir=$(mktemp -d)
+mock_pid=
+cleanup() {
+	[ -z "$mock_pid" ] || kill "$mock_pid" 2>/dev/null || true
+	rm -rf "$dir"
+}
+trap cleanup EXIT
+
+# The mock's socket goes to XDG_RUNTIME_DIR, so tests never see a real session
+export XDG_RUNTIME_DIR="$dir"
+export WAYLAND_DISPLAY=knipser-test
+"$mock" --head MOCK-1:1920x1080 --head MOCK-2:1280x720 --format "$format" \
+	--socket "$WAYLAND_DISPLAY" >"$dir/mock.out" 2>&1 &
+mock_pid=$!
+tries=0
+while [ ! -S "$dir/$WAYLAND_DISPLAY" ]; do
+	tries=$((tries + 1))
+	if [ "$tries" -gt 100 ]; then
+		echo "The mock compositor did not start" >&2
+		cat "$dir/mock.out" >&2
+		exit 1
+	fi
+	sleep 0.05
+done
+
+# Whole outputs by name and a region, all over one connection
+i=0
+while [ "$i" -lt "$captures" ]; do
+	case $((i % 3)) in
+	0) echo "--output MOCK-1 -o $dir/$i.png" ;;
+	1) echo "--output MOCK-2 -o $dir/$i.png" ;;
+	2) echo "--region 1900,100,640,480 -o $dir/$i.png" ;;
+	esac
+	i=$((i + 1))
+done >"$dir/batch"
+
+start=$(date +%s%N)
+"$knipser" --batch <"$dir/batch" >"$dir/results"
+end=$(date +%s%N)
+
+ok=$(grep -c '^ok ' "$dir/results" || true)
+if [ "$ok" -ne "$captures" ]; then
+	echo "Only $ok of $captures captures succeeded:" >&2
+	grep -v '^ok ' "$dir/results" >&2
+	exit 1
+fi
+i=0
+while [ "$i" -lt "$captures" ]; do
+	if [ "$(head -c 4 "$dir/$i.png" | tail -c 3)" != PNG ]; then
+		echo "$i.png is not a PNG" >&2
+		exit 1
+	fi
+	i=$((i + 1))
+done
+
+echo "$format: $captures captures, $(((end - start) / captures / 1000)) us each"
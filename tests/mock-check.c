@@ -0,0 +1,158 @@
+/*
+ * Checks a screenshot against the mock compositor's test pattern: every
+ * pixel of a head is either its gradient or part of the white box. Formats
+ * wider than 8 bits are compared after scaling down, with a little slack for
+ * rounding.
+ *
+ * Usage: knipser-mock-check FILE WIDTH HEIGHT INDEX:WxH+X+Y...
+ * Each head is given with its index in the mock and where it lies in the
+ * image.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <png.h>
+
+#define BOX_SIZE 64 // As in tools/mock-compositor.c
+#define TOLERANCE 2
+
+struct head {
+	int index;
+	int width, height;
+	int x, y;
+};
+
+static bool near(int value, int expected)
+{
+	return abs(value - expected) <= TOLERANCE;
+}
+
+// As 8-bit RGBA, without any gamma correction
+static uint8_t *read_png(const char *filename, int *width, int *height)
+{
+	FILE *f = fopen(filename, "rb");
+	if (f == NULL) {
+		perror(filename);
+		return NULL;
+	}
+	png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL,
+						 NULL, NULL);
+	png_infop info = png != NULL ? png_create_info_struct(png) : NULL;
+	uint8_t *volatile pixels = NULL;
+	png_bytep *volatile rows = NULL;
+	if (info == NULL || setjmp(png_jmpbuf(png))) {
+		fprintf(stderr, "%s: not a readable PNG\n", filename);
+		png_destroy_read_struct(&png, &info, NULL);
+		free(rows);
+		free(pixels);
+		fclose(f);
+		return NULL;
+	}
+
+	png_init_io(png, f);
+	png_read_info(png, info);
+	png_set_scale_16(png);
+	png_set_expand(png);
+	png_set_gray_to_rgb(png);
+	png_set_add_alpha(png, 0xff, PNG_FILLER_AFTER);
+	png_read_update_info(png, info);
+
+	*width = png_get_image_width(png, info);
+	*height = png_get_image_height(png, info);
+	pixels = malloc((size_t)*width * *height * 4);
+	rows = malloc(*height * sizeof(*rows));
+	if (pixels == NULL || rows == NULL) {
+		png_error(png, "out of memory");
+	}
+	for (int y = 0; y < *height; y++) {
+		rows[y] = pixels + (size_t)y * *width * 4;
+	}
+	png_read_image(png, rows);
+
+	png_destroy_read_struct(&png, &info, NULL);
+	free(rows);
+	fclose(f);
+	return pixels;
+}
+
+static int check_head(const uint8_t *pixels, int width, int height,
+		      const struct head *head)
+{
+	if (head->x < 0 || head->y < 0 || head->x + head->width > width ||
+	    head->y + head->height > height) {
+		fprintf(stderr, "Head %d does not fit the %dx%d image\n",
+			head->index, width, height);
+		return -1;
+	}
+
+	uint8_t blue = (uint8_t)(head->index * 64);
+	int box = 0;
+	for (int y = 0; y < head->height; y++) {
+		uint8_t green = (uint8_t)(y * 255 / head->height);
+		for (int x = 0; x < head->width; x++) {
+			const uint8_t *p = pixels +
+					   ((size_t)(head->y + y) * width +
+					    head->x + x) * 4;
+			if (p[0] == 0xff && p[1] == 0xff && p[2] == 0xff) {
+				box++;
+				continue;
+			}
+			uint8_t red = (uint8_t)(x * 255 / head->width);
+			if (!near(p[0], red) || !near(p[1], green) ||
+			    !near(p[2], blue) || p[3] != 0xff) {
+				fprintf(stderr,
+					"Head %d at %d,%d is %02x%02x%02x%02x, "
+					"expected %02x%02x%02xff\n",
+					head->index, x, y, p[0], p[1], p[2],
+					p[3], red, green, blue);
+				return -1;
+			}
+		}
+	}
+
+	// Anything whiter than the box is not the pattern at all
+	if (box > BOX_SIZE * BOX_SIZE) {
+		fprintf(stderr, "Head %d has %d white pixels\n", head->index,
+			box);
+		return -1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc < 5) {
+		fprintf(stderr,
+			"Usage: %s FILE WIDTH HEIGHT INDEX:WxH+X+Y...\n",
+			argv[0]);
+		return 2;
+	}
+
+	int width, height;
+	uint8_t *pixels = read_png(argv[1], &width, &height);
+	if (pixels == NULL) {
+		return 1;
+	}
+	if (width != atoi(argv[2]) || height != atoi(argv[3])) {
+		fprintf(stderr, "%s is %dx%d, expected %sx%s\n", argv[1], width,
+			height, argv[2], argv[3]);
+		free(pixels);
+		return 1;
+	}
+
+	int status = 0;
+	for (int i = 4; i < argc && status == 0; i++) {
+		struct head head;
+		if (sscanf(argv[i], "%d:%dx%d+%d+%d", &head.index, &head.width,
+			   &head.height, &head.x, &head.y) != 5) {
+			fprintf(stderr, "Invalid head '%s'\n", argv[i]);
+			status = 2;
+		} else if (check_head(pixels, width, height, &head) < 0) {
+			status = 1;
+		}
+	}
+	free(pixels);
+	return status;
+}
@@ -0,0 +1,85 @@
+#!/bin/sh
+# Captures through the daemon and its Wayland thread against the mock
+# compositor, run headless by CTest inside dbus-run-session. Every image is
+# checked against the mock's test pattern.
+# Usage: mock-daemon.sh MOCK KNIPSER CHECK FORMAT [MOCK OPTION]...
+set -eu
+
+mock=$1
+knipser=$2
+check=$3
+format=$4
+shift 4
+
+dir=$(mktemp -d)
+mock_pid=
+knipser_pid=
+cleanup() {
+	[ -z "$knipser_pid" ] || kill "$knipser_pid" 2>/dev/null || true
+	[ -z "$mock_pid" ] || kill "$mock_pid" 2>/dev/null || true
+	rm -rf "$dir"
+}
+trap cleanup EXIT
+
+fail() {
+	echo "$1" >&2
+	cat "$dir/mock.out" "$dir/knipser.log" >&2
+	exit 1
+}
+
+wait_for() {
+	tries=0
+	until eval "$1"; do
+		tries=$((tries + 1))
+		if [ "$tries" -gt 200 ]; then
+			fail "Timed out waiting for: $1"
+		fi
+		sleep 0.05
+	done
+}
+
+saved() {
+	grep -c "Saved " "$dir/knipser.log" || true
+}
+
+export XDG_RUNTIME_DIR="$dir"
+export WAYLAND_DISPLAY=knipser-test
+"$mock" --head MOCK-1:640x480 --head MOCK-2:320x240 --format "$format" "$@" \
+	--socket "$WAYLAND_DISPLAY" >"$dir/mock.out" 2>&1 &
+mock_pid=$!
+wait_for '[ -S "$dir/$WAYLAND_DISPLAY" ]'
+
+# Screenshots are written to the working directory
+cd "$dir"
+KNIPSER_LOG=stderr KNIPSER_LOG_LEVEL=info KNIPSER_COALESCE_MS=0 \
+	"$knipser" 2>"$dir/knipser.log" &
+knipser_pid=$!
+wait_for 'grep -q "Ready after" "$dir/knipser.log"'
+
+# Triggers one capture with SIGNAL, then checks the file it saved
+capture() {
+	signal=$1
+	shift
+	count=$(saved)
+	kill "-$signal" "$knipser_pid"
+	wait_for '[ "$(saved)" -gt "$count" ] || ! kill -0 "$knipser_pid" 2>/dev/null'
+	kill -0 "$knipser_pid" 2>/dev/null || fail "knipser died on SIG$signal"
+	file=$(grep "Saved " "$dir/knipser.log" | tail -n 1 | sed 's/.*Saved //')
+	"$check" "$dir/$file" "$@" || fail "SIG$signal saved a wrong image"
+	# Names have a resolution of a second, the next capture may reuse it
+	rm -f "$dir/$file"
+}
+
+# The output at the origin, then the desktop with MOCK-2 right of MOCK-1
+for i in 1 2 3; do
+	capture USR1 640 480 0:640x480+0+0
+	capture USR2 960 480 0:640x480+0+0 1:320x240+640+0
+done
+
+kill "$knipser_pid"
+status=0
+wait "$knipser_pid" || status=$?
+knipser_pid=
+[ "$status" -eq 0 ] || fail "knipser exited with $status"
+
+echo "$format $*: $(saved) captures match the pattern"
@@ -0,0 +1,98 @@
+#!/bin/sh
+# Desktop captures while the mock compositor unplugs and replugs an output,
+# run headless by CTest inside dbus-run-session.
+# Usage: mock-hotplug.sh MOCK KNIPSER CHECK [SECONDS]
+set -eu
+
+mock=$1
+knipser=$2
+check=$3
+seconds=${4:-3}
+
+dir=$(mktemp -d)
+mock_pid=
+knipser_pid=
+cleanup() {
+	[ -z "$knipser_pid" ] || kill "$knipser_pid" 2>/dev/null || true
+	[ -z "$mock_pid" ] || kill "$mock_pid" 2>/dev/null || true
+	rm -rf "$dir"
+}
+trap cleanup EXIT
+
+wait_for() {
+	tries=0
+	until eval "$1"; do
+		tries=$((tries + 1))
+		if [ "$tries" -gt 200 ]; then
+			echo "Timed out waiting for: $1" >&2
+			cat "$dir/mock.out" "$dir/knipser.log" >&2
+			exit 1
+		fi
+		sleep 0.05
+	done
+}
+
+export XDG_RUNTIME_DIR="$dir"
+export WAYLAND_DISPLAY=knipser-test
+"$mock" --head MOCK-1:1280x720 --head MOCK-2:1280x720 --head MOCK-3:640x480 \
+	--hotplug 70 --socket "$WAYLAND_DISPLAY" >"$dir/mock.out" 2>&1 &
+mock_pid=$!
+wait_for '[ -S "$dir/$WAYLAND_DISPLAY" ]'
+
+# Screenshots are written to the working directory
+cd "$dir"
+KNIPSER_LOG=stderr KNIPSER_LOG_LEVEL=info KNIPSER_COALESCE_MS=0 \
+	"$knipser" 2>"$dir/knipser.log" &
+knipser_pid=$!
+wait_for 'grep -q "Ready after" "$dir/knipser.log"'
+
+# SIGUSR2 captures the desktop, so every capture touches the output that comes and goes
+end=$(($(date +%s) + seconds))
+while [ "$(date +%s)" -lt "$end" ]; do
+	kill -USR2 "$knipser_pid"
+	sleep 0.02
+done
+sleep 0.5
+
+if ! kill -0 "$knipser_pid" 2>/dev/null; then
+	echo "knipser died during hotplug" >&2
+	cat "$dir/knipser.log" >&2
+	exit 1
+fi
+kill "$knipser_pid"
+status=0
+wait "$knipser_pid" || status=$?
+knipser_pid=
+if [ "$status" -ne 0 ]; then
+	echo "knipser exited with $status" >&2
+	cat "$dir/knipser.log" >&2
+	exit 1
+fi
+
+saved=$(grep -c "Saved " "$dir/knipser.log" || true)
+plugs=$(grep -c "Plugging in" "$dir/mock.out" || true)
+failed=$(grep -c "failed" "$dir/knipser.log" || true)
+if [ "$saved" -eq 0 ] || [ "$plugs" -eq 0 ]; then
+	echo "Expected captures across replugs, saved $saved with $plugs replugs" >&2
+	cat "$dir/knipser.log" >&2
+	exit 1
+fi
+
+# Names have a resolution of a second, so there are fewer files than captures.
+# Each shows the desktop with or without MOCK-3.
+files=0
+for file in "$dir"/screenshot_*.png; do
+	[ -e "$file" ] || continue
+	if ! "$check" "$file" 3200 720 0:1280x720+0+0 1:1280x720+1280+0 \
+		2:640x480+2560+0 2>/dev/null &&
+		! "$check" "$file" 2560 720 0:1280x720+0+0 1:1280x720+1280+0; then
+		echo "$file is neither desktop" >&2
+		exit 1
+	fi
+	files=$((files + 1))
+done
+if [ "$files" -eq 0 ]; then
+	echo "Saved $saved captures, but there are no files" >&2
+	exit 1
+fi
+echo "$saved desktop captures saved in $files files, $failed failed, across $plugs replugs"
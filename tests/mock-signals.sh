@@ -0,0 +1,73 @@
+#!/bin/sh
+# Signal triggers on a running daemon against the mock compositor, run
+# headless by CTest inside dbus-run-session. Every thread must leave the
+# signals to the signalfd, or SIGUSR1 and SIGUSR2 would kill the daemon.
+# Usage: mock-signals.sh MOCK KNIPSER
+set -eu
+
+mock=$1
+knipser=$2
+
+dir=$(mktemp -d)
+mock_pid=
+knipser_pid=
+cleanup() {
+	[ -z "$knipser_pid" ] || kill "$knipser_pid" 2>/dev/null || true
+	[ -z "$mock_pid" ] || kill "$mock_pid" 2>/dev/null || true
+	rm -rf "$dir"
+}
+trap cleanup EXIT
+
+fail() {
+	echo "$1" >&2
+	cat "$dir/mock.out" "$dir/knipser.log" >&2
+	exit 1
+}
+
+wait_for() {
+	tries=0
+	until eval "$1"; do
+		tries=$((tries + 1))
+		if [ "$tries" -gt 200 ]; then
+			fail "Timed out waiting for: $1"
+		fi
+		sleep 0.05
+	done
+}
+
+saved() {
+	grep -c "Saved " "$dir/knipser.log" || true
+}
+
+export XDG_RUNTIME_DIR="$dir"
+export WAYLAND_DISPLAY=knipser-test
+"$mock" --head MOCK-1:640x480 --head MOCK-2:320x240 \
+	--socket "$WAYLAND_DISPLAY" >"$dir/mock.out" 2>&1 &
+mock_pid=$!
+wait_for '[ -S "$dir/$WAYLAND_DISPLAY" ]'
+
+# Screenshots are written to the working directory
+cd "$dir"
+KNIPSER_LOG=stderr KNIPSER_LOG_LEVEL=info KNIPSER_COALESCE_MS=0 \
+	"$knipser" 2>"$dir/knipser.log" &
+knipser_pid=$!
+wait_for 'grep -q "Ready after" "$dir/knipser.log"'
+
+# SIGUSR1 captures the output at the origin, SIGUSR2 the desktop
+kill -USR1 "$knipser_pid"
+wait_for '[ "$(saved)" -ge 1 ] || ! kill -0 "$knipser_pid" 2>/dev/null'
+kill -0 "$knipser_pid" 2>/dev/null || fail "knipser died on SIGUSR1"
+kill -USR2 "$knipser_pid"
+wait_for '[ "$(saved)" -ge 2 ] || ! kill -0 "$knipser_pid" 2>/dev/null'
+kill -0 "$knipser_pid" 2>/dev/null || fail "knipser died on SIGUSR2"
+
+# SIGTERM goes through the clean shutdown
+kill -TERM "$knipser_pid"
+status=0
+wait "$knipser_pid" || status=$?
+knipser_pid=
+[ "$status" -eq 0 ] || fail "knipser exited with $status on SIGTERM"
+grep -q "Received signal 15, exiting" "$dir/knipser.log" ||
+	fail "knipser did not shut down cleanly on SIGTERM"
+
+echo "$(saved) captures triggered by signals"
@@ -0,0 +1,125 @@
+#include <png.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "archive.h"
+#include "hash.h"
+#include "test.h"
+
+#define WIDTH 300 // Not a multiple of the tile size, so edge tiles are narrower
+#define HEIGHT 150
+
+static char dir[] = "/tmp/knipser-test-archive-XXXXXX";
+static uint8_t image[HEIGHT][WIDTH * 4];
+static uint8_t band[HEIGHT * WIDTH * 4];
+
+static const uint8_t *read_rows(void *user, int y, int count)
+{
+	memcpy(band, image[y], (size_t)count * sizeof(image[0]));
+	return band;
+}
+
+static off_t pack_size(void)
+{
+	char path[sizeof(dir) + 16];
+	struct stat st;
+	snprintf(path, sizeof(path), "%s/tiles.pack", dir);
+	CHECK(stat(path, &st) == 0);
+	return st.st_size;
+}
+
+static void write_screenshot(const char *name)
+{
+	CHECK(archive_write_rows(name, -1, WIDTH, HEIGHT, 8, 16, read_rows, NULL,
+				 NULL) == 0);
+}
+
+// Unpacked PNGs hold exactly the pixels that went in
+static void check_unpack(const char *name)
+{
+	char manifest[sizeof(dir) + 32], png[sizeof(dir) + 32];
+	archive_path(name, manifest, sizeof(manifest));
+	snprintf(png, sizeof(png), "%s/%s.png", dir, name);
+	CHECK(archive_unpack(manifest, png, -1) == 0);
+
+	png_image decoded = { .version = PNG_IMAGE_VERSION };
+	CHECK(png_image_begin_read_from_file(&decoded, png));
+	CHECK(decoded.width == WIDTH && decoded.height == HEIGHT);
+	decoded.format = PNG_FORMAT_RGBA;
+	static uint8_t pixels[HEIGHT][WIDTH * 4];
+	CHECK(png_image_finish_read(&decoded, NULL, pixels, 0, NULL));
+	CHECK(memcmp(pixels, image, sizeof(image)) == 0);
+	unlink(png);
+}
+
+static void test_hash(void)
+{
+	uint32_t data[64];
+	for (int i = 0; i < 64; i++) {
+		data[i] = i * 2654435761u;
+	}
+
+	uint64_t a[2], b[2];
+	hash128(data, sizeof(data), 0, a);
+	hash128(data, sizeof(data), 0, b);
+	CHECK(a[0] == b[0] && a[1] == b[1]);
+	hash128(data, sizeof(data), 1, b);
+	CHECK(a[0] != b[0] || a[1] != b[1]);
+	hash128(data, sizeof(data) - 4, 0, b);
+	CHECK(a[0] != b[0] || a[1] != b[1]);
+
+	// Every single bit flip changes both halves
+	for (size_t bit = 0; bit < sizeof(data) * 8; bit++) {
+		data[bit / 32] ^= 1u << (bit % 32);
+		hash128(data, sizeof(data), 0, b);
+		data[bit / 32] ^= 1u << (bit % 32);
+		CHECK(a[0] != b[0] && a[1] != b[1]);
+	}
+}
+
+static void test_dedup(void)
+{
+	CHECK(mkdtemp(dir) != NULL);
+	setenv("KNIPSER_ARCHIVE", dir, 1);
+	CHECK(archive_init() == 0);
+
+	// A flat left half, so tiles repeat within the screenshot too
+	for (int y = 0; y < HEIGHT; y++) {
+		for (int x = 0; x < WIDTH * 4; x++) {
+			image[y][x] = x < WIDTH * 2 ? 7 : (uint8_t)(x * 31 + y * 17);
+		}
+	}
+	write_screenshot("a.tiles");
+	off_t first = pack_size();
+	write_screenshot("b.tiles");
+	CHECK(pack_size() == first);
+
+	// Reopening keeps the index, and a changed pixel adds one tile
+	archive_deinit();
+	CHECK(archive_init() == 0);
+	image[100][WIDTH * 4 - 1] ^= 0xff;
+	write_screenshot("c.tiles");
+	off_t third = pack_size();
+	CHECK(third > first);
+	write_screenshot("d.tiles");
+	CHECK(pack_size() == third);
+	archive_deinit();
+
+	check_unpack("c.tiles");
+	image[100][WIDTH * 4 - 1] ^= 0xff;
+	check_unpack("a.tiles");
+	check_unpack("b.tiles");
+
+	char command[sizeof(dir) + 16];
+	snprintf(command, sizeof(command), "rm -rf %s", dir);
+	CHECK(system(command) == 0);
+}
+
+int main(void)
+{
+	test_hash();
+	test_dedup();
+	return EXIT_SUCCESS;
+}
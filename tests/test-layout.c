@@ -0,0 +1,123 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "layout.h"
+#include "test.h"
+
+static uint32_t seed = 1;
+
+static int32_t random_int(int32_t min, int32_t max)
+{
+	seed = seed * 1103515245 + 12345;
+	return min + (int32_t)((seed >> 8) % (uint32_t)(max - min + 1));
+}
+
+static bool contains(const struct layout_output *out, int32_t x, int32_t y)
+{
+	return x >= out->x && x < out->x + out->width && y >= out->y &&
+	       y < out->y + out->height;
+}
+
+// Random overlapping outputs with gaps, some of them empty
+static int random_outputs(struct layout_output *outputs)
+{
+	int count = random_int(1, 12);
+	for (int i = 0; i < count; i++) {
+		outputs[i] = (struct layout_output){
+			.x = random_int(-300, 300),
+			.y = random_int(-300, 300),
+			.width = random_int(0, 200),
+			.height = random_int(1, 200),
+		};
+		snprintf(outputs[i].name, sizeof(outputs[i].name), "OUT-%d", i);
+	}
+	return count;
+}
+
+// The index agrees with checking every output
+static void test_index(void)
+{
+	for (int round = 0; round < 200; round++) {
+		struct layout_output outputs[LAYOUT_MAX_OUTPUTS];
+		int count = random_outputs(outputs);
+		struct layout *layout = layout_create(round, outputs, count);
+		CHECK(layout != NULL);
+
+		for (int probe = 0; probe < 500; probe++) {
+			int32_t x = random_int(-400, 600), y = random_int(-400, 600);
+			const struct layout_output *expected = NULL;
+			for (int i = 0; i < count && expected == NULL; i++) {
+				if (contains(&layout->outputs[i], x, y)) {
+					expected = &layout->outputs[i];
+				}
+			}
+			CHECK(layout_find_point(layout, x, y) == expected);
+			CHECK(layout_find_nearest(layout, x, y) != NULL);
+			if (expected != NULL) {
+				CHECK(layout_find_nearest(layout, x, y) == expected);
+			}
+
+			int32_t width = random_int(1, 300), height = random_int(1, 300);
+			uint64_t mask = 0;
+			for (int i = 0; i < count; i++) {
+				const struct layout_output *out = &outputs[i];
+				if (out->width > 0 && x < out->x + out->width &&
+				    out->x < x + width && y < out->y + out->height &&
+				    out->y < y + height) {
+					mask |= UINT64_C(1) << i;
+				}
+			}
+			CHECK(layout_find_rect(layout, x, y, width, height) == mask);
+		}
+
+		int i = random_int(0, count - 1);
+		CHECK(layout_find_name(layout, outputs[i].name) ==
+		      &layout->outputs[i]);
+		CHECK(layout_find_name(layout, "NONE") == NULL);
+		free(layout);
+	}
+
+	struct layout_output none[1];
+	struct layout *empty = layout_create(0, none, 0);
+	CHECK(empty != NULL);
+	CHECK(layout_find_point(empty, 0, 0) == NULL);
+	CHECK(layout_find_nearest(empty, 0, 0) == NULL);
+	CHECK(layout_find_rect(empty, 0, 0, 10, 10) == 0);
+	free(empty);
+}
+
+// A held snapshot survives being replaced, run under ASan to see it freed too early
+static void test_snapshots(void)
+{
+	struct layout_output output = { .name = "DP-1", .width = 100, .height = 100 };
+	CHECK(layout_acquire() == NULL);
+	layout_release(NULL);
+
+	layout_publish(layout_create(1, &output, 1));
+	const struct layout *held = layout_acquire();
+	CHECK(held != NULL && held->serial == 1);
+
+	output.width = 200;
+	layout_publish(layout_create(2, &output, 1));
+	layout_publish(layout_create(3, &output, 1));
+	CHECK(held->serial == 1 && held->outputs[0].width == 100);
+	CHECK(layout_find_point(held, 150, 50) == NULL);
+
+	const struct layout *current = layout_acquire();
+	CHECK(current != held && current->serial == 3);
+	CHECK(layout_find_point(current, 150, 50) == &current->outputs[0]);
+	layout_release(current);
+	layout_release(held);
+
+	// Frees every replaced snapshot now that no reader is left
+	layout_publish(NULL);
+	CHECK(layout_acquire() == NULL);
+	layout_release(NULL);
+}
+
+int main(void)
+{
+	test_index();
+	test_snapshots();
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,304 @@
+// The request handling is internal to the live view, so it is tested from within
+#include "live.c"
+
+#include <sys/mman.h>
+
+#include "test.h"
+
+// Captures are never made, the test completes them itself
+static int captures = 0;
+static int capture_result = 0;
+static struct capture_waiter last_waiter;
+
+int knipser_handle_capture(enum capture_kind kind, int x, int y, int width,
+			   int height, enum capture_delivery delivery,
+			   struct capture_waiter waiter)
+{
+	CHECK(kind == CAPTURE_OUTPUT);
+	captures++;
+	last_waiter = waiter;
+	return capture_result;
+}
+
+// Takes a slot the way accept_clients() does and returns the viewer's end
+static int connect_client(struct live_client **client)
+{
+	int fds[2];
+	CHECK(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) == 0);
+	int i = 0;
+	while (i < LIVE_MAX_CLIENTS && clients[i].fd >= 0) {
+		i++;
+	}
+	CHECK(i < LIVE_MAX_CLIENTS);
+	clients[i] = (struct live_client){ .fd = fds[0],
+					   .state = LIVE_READING };
+	num_clients++;
+	*client = &clients[i];
+	return fds[1];
+}
+
+static void send_request(int peer, struct live_client *client,
+			 const char *request)
+{
+	size_t len = strlen(request);
+	CHECK(write(peer, request, len) == (ssize_t)len);
+	read_client(client);
+}
+
+// Everything sent so far, the server has already written it all
+static char *receive(int peer)
+{
+	static char buf[8192];
+	size_t len = 0;
+	ssize_t ret;
+	while ((ret = recv(peer, buf + len, sizeof(buf) - 1 - len,
+			   MSG_DONTWAIT)) > 0) {
+		len += ret;
+	}
+	buf[len] = '\0';
+	return buf;
+}
+
+static bool closed(int peer)
+{
+	char c;
+	return recv(peer, &c, 1, MSG_DONTWAIT) == 0;
+}
+
+// A whole exchange with a response that closes the connection
+static char *request(const char *text)
+{
+	struct live_client *client;
+	int peer = connect_client(&client);
+	send_request(peer, client, text);
+	char *response = receive(peer);
+	CHECK(closed(peer));
+	CHECK(client->fd < 0);
+	close(peer);
+	return response;
+}
+
+static bool starts_with(const char *s, const char *prefix)
+{
+	return strncmp(s, prefix, strlen(prefix)) == 0;
+}
+
+static void publish_outputs(const char *const *names, int count)
+{
+	struct layout_output list[LAYOUT_MAX_OUTPUTS] = { 0 };
+	for (int i = 0; i < count; i++) {
+		list[i] = (struct layout_output){
+			.x = i * 100,
+			.width = 100,
+			.height = 100,
+		};
+		snprintf(list[i].name, sizeof(list[i].name), "%s", names[i]);
+	}
+	static uint32_t serial = 0;
+	struct layout *layout = layout_create(++serial, list, count);
+	CHECK(layout != NULL);
+	layout_publish(layout);
+}
+
+// Completes the capture in flight with a frame holding data, or fails it
+static void complete_capture(const char *data)
+{
+	struct capture_job job = { .fd = -1 };
+	if (data != NULL) {
+		job.fd = memfd_create("frame", MFD_CLOEXEC);
+		CHECK(job.fd >= 0);
+		CHECK(write(job.fd, data, strlen(data)) ==
+		      (ssize_t)strlen(data));
+	}
+	last_waiter.complete(last_waiter.user, data != NULL ? 0 : -1,
+			     data != NULL ? &job : NULL);
+	if (job.fd >= 0) {
+		close(job.fd);
+	}
+}
+
+static void test_errors(void)
+{
+	CHECK(starts_with(request("\r\n\r\n"), "HTTP/1.1 400 "));
+	CHECK(starts_with(request("GET\r\n\r\n"), "HTTP/1.1 400 "));
+	CHECK(starts_with(request("POST / HTTP/1.1\r\n\r\n"), "HTTP/1.1 405 "));
+	CHECK(starts_with(request("GETTING / HTTP/1.1\r\n\r\n"),
+			  "HTTP/1.1 405 "));
+
+	const char *not_found[] = {
+		"GET DP-1.png HTTP/1.1\r\n\r\n",
+		"GET /DP-1 HTTP/1.1\r\n\r\n",
+		"GET /.png HTTP/1.1\r\n\r\n",
+		"GET /DP-1.gif HTTP/1.1\r\n\r\n",
+		"GET /DP-1. HTTP/1.1\r\n\r\n",
+		"GET /DP-2.png HTTP/1.1\r\n\r\n",
+		"GET /DP-1.png/ HTTP/1.1\r\n\r\n",
+		"GET /"
+		"aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa"
+		"aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa"
+		"aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa"
+		".png HTTP/1.1\r\n\r\n",
+	};
+	for (size_t i = 0; i < sizeof(not_found) / sizeof(not_found[0]); i++) {
+		CHECK(starts_with(request(not_found[i]), "HTTP/1.1 404 "));
+	}
+	CHECK(captures == 0);
+
+	// A capture that cannot start, or that fails
+	capture_result = -1;
+	CHECK(starts_with(request("GET /DP-1.png HTTP/1.1\r\n\r\n"),
+			  "HTTP/1.1 503 "));
+	capture_result = 0;
+	struct live_client *client;
+	int peer = connect_client(&client);
+	send_request(peer, client, "GET /DP-1.png HTTP/1.1\r\n\r\n");
+	CHECK(client->state == LIVE_WAITING);
+	complete_capture(NULL);
+	CHECK(starts_with(receive(peer), "HTTP/1.1 503 "));
+	CHECK(closed(peer));
+	close(peer);
+	CHECK(captures == 2);
+
+#ifndef KNIPSER_HAVE_JPEG
+	CHECK(starts_with(request("GET /DP-1.jpg HTTP/1.1\r\n\r\n"),
+			  "HTTP/1.1 501 "));
+	CHECK(starts_with(request("GET /DP-1.mjpg HTTP/1.1\r\n\r\n"),
+			  "HTTP/1.1 501 "));
+	CHECK(captures == 2);
+#endif
+	captures = 0;
+}
+
+// The request may arrive in pieces, and must fit the buffer
+static void test_partial(void)
+{
+	struct live_client *client;
+	int peer = connect_client(&client);
+	send_request(peer, client, "POST / HT");
+	send_request(peer, client, "TP/1.1\r\nHost: x\r\n");
+	CHECK(client->state == LIVE_READING);
+	CHECK(receive(peer)[0] == '\0');
+	send_request(peer, client, "\r\n");
+	CHECK(starts_with(receive(peer), "HTTP/1.1 405 "));
+	CHECK(closed(peer));
+	close(peer);
+
+	peer = connect_client(&client);
+	char line[LIVE_MAX_REQUEST - 1];
+	memset(line, 'x', sizeof(line) - 1);
+	line[sizeof(line) - 1] = '\0';
+	send_request(peer, client, line);
+	CHECK(client->state == LIVE_READING);
+	send_request(peer, client, "x");
+	CHECK(starts_with(receive(peer), "HTTP/1.1 431 "));
+	CHECK(closed(peer));
+	close(peer);
+}
+
+// Names are escaped, and the list is empty before the first layout
+static void test_index(void)
+{
+	char *response = request("GET / HTTP/1.1\r\n\r\n");
+	CHECK(starts_with(response, "HTTP/1.1 200 "));
+	CHECK(strstr(response, "Content-Type: text/html\r\n") != NULL);
+	CHECK(strstr(response, "<li>") == NULL);
+
+	const char *names[] = { "DP-1", "<b>&\"'" };
+	publish_outputs(names, 2);
+	response = request("GET /?refresh HTTP/1.1\r\n\r\n");
+	CHECK(starts_with(response, "HTTP/1.1 200 "));
+	CHECK(strstr(response, "<a href=\"DP-1.mjpg\">DP-1</a>") != NULL);
+	CHECK(strstr(response, "&lt;b&gt;&amp;&quot;&#39;.png") != NULL);
+	CHECK(strstr(response, "<b>") == NULL);
+
+	// The body is exactly as long as announced
+	long length = strtol(strstr(response, "Content-Length: ") + 16, NULL,
+			     10);
+	CHECK((long)strlen(strstr(response, "\r\n\r\n") + 4) == length);
+}
+
+// Snapshots waiting together share one capture
+static void test_snapshot(void)
+{
+	struct live_client *first, *second;
+	int first_peer = connect_client(&first);
+	int second_peer = connect_client(&second);
+	send_request(first_peer, first, "GET /DP-1.png HTTP/1.1\r\n\r\n");
+	send_request(second_peer, second,
+		     "GET /DP-1.png?t=1 HTTP/1.1\r\n\r\n");
+	CHECK(captures == 1);
+	complete_capture("PNGDATA");
+
+	int peers[] = { first_peer, second_peer };
+	for (int i = 0; i < 2; i++) {
+		char *response = receive(peers[i]);
+		CHECK(starts_with(response, "HTTP/1.1 200 "));
+		CHECK(strstr(response, "Content-Type: image/png\r\n") != NULL);
+		CHECK(strstr(response, "Content-Length: 7\r\n") != NULL);
+		CHECK(strcmp(strstr(response, "\r\n\r\n"), "\r\n\r\nPNGDATA") ==
+		      0);
+		CHECK(closed(peers[i]));
+		close(peers[i]);
+	}
+
+	// Nobody is left, so nothing is kept
+	CHECK(num_clients == 0);
+	CHECK(outputs[0].name[0] == '\0');
+	captures = 0;
+}
+
+#ifdef KNIPSER_HAVE_JPEG
+// A stream gets every new frame as a part, and stays open between them
+static void test_stream(void)
+{
+	struct live_client *client;
+	int peer = connect_client(&client);
+	send_request(peer, client, "GET /DP-1.mjpg HTTP/1.1\r\n\r\n");
+	CHECK(captures == 1);
+	CHECK(num_streams == 1);
+	complete_capture("one");
+	char *response = receive(peer);
+	CHECK(starts_with(response, "HTTP/1.1 200 "));
+	CHECK(strstr(response, "multipart/x-mixed-replace; boundary=" LIVE_BOUNDARY
+			       "\r\n") != NULL);
+	CHECK(strstr(response, "\r\n\r\n--" LIVE_BOUNDARY "\r\n"
+			       "Content-Type: image/jpeg\r\n"
+			       "Content-Length: 3\r\n\r\none") != NULL);
+	CHECK(client->state == LIVE_IDLE);
+
+	complete_capture("second");
+	CHECK(strcmp(receive(peer), "\r\n--" LIVE_BOUNDARY "\r\n"
+				    "Content-Type: image/jpeg\r\n"
+				    "Content-Length: 6\r\n\r\nsecond") == 0);
+
+	// A failed frame leaves the stream waiting for the next one
+	complete_capture(NULL);
+	CHECK(client->fd >= 0);
+	CHECK(receive(peer)[0] == '\0');
+
+	close(peer);
+	read_client(client);
+	CHECK(client->fd < 0);
+	CHECK(num_streams == 0);
+	captures = 0;
+}
+#endif
+
+int main(void)
+{
+	CHECK(live_init() == 0);
+	test_index();
+
+	const char *names[] = { "DP-1" };
+	publish_outputs(names, 1);
+	test_errors();
+	test_partial();
+	test_snapshot();
+#ifdef KNIPSER_HAVE_JPEG
+	test_stream();
+#endif
+
+	CHECK(num_clients == 0);
+	live_deinit();
+	return EXIT_SUCCESS;
+}
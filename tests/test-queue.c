@@ -0,0 +1,114 @@
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "queue.h"
+#include "test.h"
+
+#define THREADS 4
+#define ITEMS 100000 // Per producer
+
+static struct queue ring;
+static atomic_uint_least64_t popped_sum;
+static atomic_uint_least64_t popped_count;
+static atomic_uchar seen[THREADS * ITEMS + 1];
+
+// Items are never NULL, so they count from 1
+static void *produce(void *data)
+{
+	uintptr_t first = (uintptr_t)data * ITEMS + 1;
+	for (uintptr_t item = first; item < first + ITEMS; item++) {
+		while (!queue_push(&ring, (void *)item)) {
+			sched_yield();
+		}
+	}
+	return NULL;
+}
+
+static void *consume(void *data)
+{
+	void *item;
+	while ((item = queue_wait(&ring)) != NULL) {
+		uintptr_t value = (uintptr_t)item;
+		CHECK(value <= THREADS * ITEMS);
+		CHECK(atomic_fetch_add(&seen[value], 1) == 0);
+		atomic_fetch_add(&popped_sum, value);
+		atomic_fetch_add(&popped_count, 1);
+	}
+	return NULL;
+}
+
+// Every item pushed by several producers is popped exactly once
+static void test_mpmc(void)
+{
+	CHECK(queue_init(&ring, 16, true) == 0);
+
+	pthread_t producers[THREADS], consumers[THREADS];
+	for (uintptr_t i = 0; i < THREADS; i++) {
+		CHECK(pthread_create(&consumers[i], NULL, consume, NULL) == 0);
+		CHECK(pthread_create(&producers[i], NULL, produce,
+				     (void *)i) == 0);
+	}
+	for (int i = 0; i < THREADS; i++) {
+		pthread_join(producers[i], NULL);
+	}
+
+	// A bare wakeup stops one consumer once the items before it are gone
+	for (int i = 0; i < THREADS; i++) {
+		queue_wake(&ring);
+	}
+	for (int i = 0; i < THREADS; i++) {
+		pthread_join(consumers[i], NULL);
+	}
+
+	uint64_t n = (uint64_t)THREADS * ITEMS;
+	CHECK(atomic_load(&popped_count) == n);
+	CHECK(atomic_load(&popped_sum) == n * (n + 1) / 2);
+	CHECK(queue_pop(&ring) == NULL);
+	queue_finish(&ring);
+}
+
+static bool readable(int fd)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	return poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLIN);
+}
+
+// A polled queue's eventfd fires on push and stays quiet once cleared
+static void test_eventfd(void)
+{
+	struct queue queue;
+	int a, b;
+	CHECK(queue_init(&queue, 4, false) == 0);
+	CHECK(!readable(queue_fd(&queue)));
+
+	CHECK(queue_push(&queue, &a));
+	CHECK(queue_push(&queue, &b));
+	CHECK(readable(queue_fd(&queue)));
+	queue_clear(&queue);
+	CHECK(!readable(queue_fd(&queue)));
+	CHECK(queue_pop(&queue) == &a);
+	CHECK(queue_pop(&queue) == &b);
+	CHECK(queue_pop(&queue) == NULL);
+
+	// Full at capacity, and usable again after a pop
+	for (int i = 0; i < 4; i++) {
+		CHECK(queue_push(&queue, &a));
+	}
+	CHECK(!queue_push(&queue, &b));
+	CHECK(queue_pop(&queue) == &a);
+	CHECK(queue_push(&queue, &b));
+
+	queue_wake(&queue);
+	CHECK(readable(queue_fd(&queue)));
+	queue_finish(&queue);
+}
+
+int main(void)
+{
+	test_mpmc();
+	test_eventfd();
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,195 @@
+// The ZRLE encoder is internal to the VNC server, so it is tested from within
+#include "vnc.c"
+
+#include "test.h"
+
+// The server is never started, so it needs neither the scheduler nor Wayland
+int knipser_handle_vnc_capture(int x, int y,
+			       const struct capture_target *target,
+			       struct capture_waiter waiter)
+{
+	return -1;
+}
+
+void wayland_stop_waiting(void)
+{
+}
+
+#define TILE_PIXELS (VNC_TILE * VNC_TILE)
+
+static struct vnc_converter conv;
+
+static uint32_t seed = 1;
+
+static uint32_t random_u32(void)
+{
+	seed = seed * 1103515245 + 12345;
+	return seed >> 4;
+}
+
+// Three bytes, least significant first, for the server's pixel format
+static const uint8_t *get_cpixel(const uint8_t *p, uint32_t *value)
+{
+	*value = p[0] | p[1] << 8 | (uint32_t)p[2] << 16;
+	return p + 3;
+}
+
+static const uint8_t *get_run(const uint8_t *p, int *length)
+{
+	*length = 1;
+	while (*p == 255) {
+		*length += *p++;
+	}
+	*length += *p++;
+	return p;
+}
+
+// Decode one tile as a viewer would, returning its subencoding
+static int decode_tile(const uint8_t *p, const uint8_t *end, int width,
+		       int height, uint32_t *pixels)
+{
+	int n = width * height;
+	int mode = *p++;
+	uint32_t palette[127];
+	int palette_size = mode < 128 ? mode : mode - 128;
+	for (int i = 0; i < palette_size && mode != 0; i++) {
+		p = get_cpixel(p, &palette[i]);
+	}
+
+	if (mode == 0) {
+		for (int i = 0; i < n; i++) {
+			p = get_cpixel(p, &pixels[i]);
+		}
+	} else if (mode == 1) {
+		for (int i = 0; i < n; i++) {
+			pixels[i] = palette[0];
+		}
+	} else if (mode <= 16) {
+		int bits = mode == 2 ? 1 : mode <= 4 ? 2 : 4;
+		for (int y = 0; y < height; y++) {
+			int used = 8;
+			for (int x = 0; x < width; x++) {
+				if (used == 8) {
+					used = 0;
+					p++;
+				}
+				used += bits;
+				int index = (p[-1] >> (8 - used)) & ((1 << bits) - 1);
+				CHECK(index < mode);
+				pixels[y * width + x] = palette[index];
+			}
+		}
+	} else if (mode == 128) {
+		for (int i = 0; i < n;) {
+			uint32_t value;
+			int length;
+			p = get_cpixel(p, &value);
+			p = get_run(p, &length);
+			CHECK(i + length <= n);
+			while (length-- > 0) {
+				pixels[i++] = value;
+			}
+		}
+	} else {
+		CHECK(mode > 129);
+		for (int i = 0; i < n;) {
+			int index = *p & 127, length = 1;
+			if (*p++ & 128) {
+				p = get_run(p, &length);
+			}
+			CHECK(index < palette_size && i + length <= n);
+			while (length-- > 0) {
+				pixels[i++] = palette[index];
+			}
+		}
+	}
+	CHECK(p == end);
+	return mode;
+}
+
+// Encode and decode a tile, the result never being larger than raw
+static int round_trip(const uint32_t *pixels, int width, int height)
+{
+	static uint8_t encoded[1 + 3 * TILE_PIXELS + 1];
+	uint32_t decoded[TILE_PIXELS];
+	uint8_t *end = zrle_tile(&conv, pixels, width, height, encoded);
+	CHECK(end - encoded <= 1 + 3 * width * height);
+
+	int mode = decode_tile(encoded, end, width, height, decoded);
+	CHECK(memcmp(decoded, pixels, sizeof(*pixels) * width * height) == 0);
+	return mode;
+}
+
+// Each subencoding is picked where it is the smallest
+static void test_modes(void)
+{
+	uint32_t pixels[TILE_PIXELS];
+
+	for (int i = 0; i < 16 * 16; i++) {
+		pixels[i] = 0x123456;
+	}
+	CHECK(round_trip(pixels, 16, 16) == 1);
+
+	// Packed palettes, with widths that leave rows padded
+	for (int colours = 2; colours <= 16; colours++) {
+		for (int i = 0; i < 13 * 7; i++) {
+			pixels[i] = i < colours ? (uint32_t)i * 0x010203 :
+						  random_u32() % colours * 0x010203;
+		}
+		CHECK(round_trip(pixels, 13, 7) == colours);
+	}
+	for (int i = 0; i < 16 * 16; i++) {
+		pixels[i] = ((i % 16) ^ (i / 16)) & 1 ? 0xffffff : 0;
+	}
+	CHECK(round_trip(pixels, 16, 16) == 2);
+
+	// Too many colours for a palette, in long runs
+	for (int i = 0; i < TILE_PIXELS; i++) {
+		pixels[i] = (uint32_t)(i / 32) * 0x010203;
+	}
+	CHECK(round_trip(pixels, VNC_TILE, VNC_TILE) == 128);
+
+	// A few colours in short runs, and some single pixels
+	for (int i = 0; i < TILE_PIXELS; i++) {
+		pixels[i] = (uint32_t)(i / 4 % 20) * 0x0a0b0c;
+	}
+	for (int i = 0; i < TILE_PIXELS; i += 97) {
+		pixels[i] = 0xfefefe;
+	}
+	CHECK(round_trip(pixels, VNC_TILE, VNC_TILE) == 128 + 21);
+
+	for (int i = 0; i < TILE_PIXELS; i++) {
+		pixels[i] = random_u32() & 0xffffff;
+	}
+	CHECK(round_trip(pixels, VNC_TILE, VNC_TILE) == 0);
+}
+
+// Whatever the content, tiles decode to what went in
+static void test_random(void)
+{
+	uint32_t pixels[TILE_PIXELS];
+	for (int round = 0; round < 2000; round++) {
+		int width = 1 + random_u32() % VNC_TILE;
+		int height = 1 + random_u32() % VNC_TILE;
+		int colours = 1 + random_u32() % (round % 2 ? 300 : 20);
+		int run = 1 + random_u32() % 300;
+		uint32_t value = 0;
+		for (int i = 0; i < width * height; i++) {
+			if (i % run == 0) {
+				value = random_u32() % colours * 2654435761u & 0xffffff;
+			}
+			pixels[i] = value;
+		}
+		round_trip(pixels, width, height);
+	}
+}
+
+int main(void)
+{
+	init_converter(&conv, &server_format);
+	CHECK(conv.cpixel_bytes == 3 && conv.cpixel_offset == 0);
+
+	test_modes();
+	test_random();
+	return EXIT_SUCCESS;
+}
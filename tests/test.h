@@ -0,0 +1,17 @@
+#ifndef _TEST_H_
+#define _TEST_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// Unit tests are plain programs run by ctest, any failed check ends them
+#define CHECK(cond)                                                        \
+	do {                                                               \
+		if (!(cond)) {                                             \
+			fprintf(stderr, "%s:%d: check failed: %s\n",       \
+				__FILE__, __LINE__, #cond);                \
+			exit(EXIT_FAILURE);                                \
+		}                                                          \
+	} while (0)
+
+#endif /* _TEST_H_ */
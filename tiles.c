@@ -0,0 +1,66 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "image.h"
+#include "tiles.h"
+
+/*
+ * Tiles are compared a row at a time with memcmp, which glibc vectorises
+ * for the CPU it runs on, and a tile stops at its first differing row. An
+ * unchanged tile costs one read of both frames, a changed one usually less.
+ */
+int tiles_count(int width, int height)
+{
+	return ((width + TILE_SIZE - 1) / TILE_SIZE) *
+	       ((height + TILE_SIZE - 1) / TILE_SIZE);
+}
+
+static bool tile_differs(const struct canvas_output *a,
+			 const struct canvas_output *b, int x, int y,
+			 int width, int height, int bpp)
+{
+	const uint8_t *row_a = (const uint8_t *)a->data + (size_t)y * a->stride +
+			       (size_t)x * bpp;
+	const uint8_t *row_b = (const uint8_t *)b->data + (size_t)y * b->stride +
+			       (size_t)x * bpp;
+	for (int i = 0; i < height; i++) {
+		if (memcmp(row_a, row_b, (size_t)width * bpp) != 0) {
+			return true;
+		}
+		row_a += a->stride;
+		row_b += b->stride;
+	}
+	return false;
+}
+
+// Count the tiles touching rect that differ, both frames must be the same format and size
+int tiles_count_changed(const struct canvas_output *a,
+			const struct canvas_output *b,
+			const struct capture_rect *rect)
+{
+	int x0 = rect->x > 0 ? rect->x : 0;
+	int y0 = rect->y > 0 ? rect->y : 0;
+	int x1 = rect->x + rect->width < a->width ? rect->x + rect->width :
+						    a->width;
+	int y1 = rect->y + rect->height < a->height ? rect->y + rect->height :
+						      a->height;
+	if (x0 >= x1 || y0 >= y1) {
+		return 0;
+	}
+
+	int bpp = image_format_bpp(a->format);
+	int changed = 0;
+	for (int y = y0 / TILE_SIZE * TILE_SIZE; y < y1; y += TILE_SIZE) {
+		int height = a->height - y < TILE_SIZE ? a->height - y :
+							 TILE_SIZE;
+		for (int x = x0 / TILE_SIZE * TILE_SIZE; x < x1;
+		     x += TILE_SIZE) {
+			int width = a->width - x < TILE_SIZE ? a->width - x :
+							       TILE_SIZE;
+			changed += tile_differs(a, b, x, y, width, height, bpp);
+		}
+	}
+	return changed;
+}
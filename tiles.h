@@ -0,0 +1,15 @@
+#ifndef _TILES_H_
+#define _TILES_H_
+
+#include "canvas.h"
+#include "job.h"
+
+// Frames are compared in squares of this many pixels, aligned to the frame
+#define TILE_SIZE 64
+
+int tiles_count(int width, int height);
+int tiles_count_changed(const struct canvas_output *a,
+			const struct canvas_output *b,
+			const struct capture_rect *rect);
+
+#endif /* _TILES_H_ */
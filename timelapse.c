@@ -0,0 +1,230 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#include "knipser.h"
+#include "layout.h"
+#include "log.h"
+#include "shm.h"
+#include "timelapse.h"
+#include "wayland.h"
+
+/*
+ * Timelapse for screens that rarely change. Each interval asks for a copy
+ * with damage, which the compositor only makes once the output changes, so
+ * a still screen costs one timer wakeup per interval and nothing else.
+ * Frames are copied into whichever of two buffers doesn't hold the last
+ * frame written, and the encoder compares the tiles within the damage
+ * since then, writing only frames that changed enough.
+ */
+static bool enabled = false;
+static char output_name[64]; // Empty for the output at the origin
+static uint64_t interval_ns = 0;
+static double min_change = 0.01;
+
+static int timer_fd = -1;
+static struct shm_mapping buffers[2]; // data is NULL until the first frame
+static int written = -1; // Buffer holding the last frame written
+static struct canvas_output reference;
+static struct capture_rect damage; // Since the last frame written
+static bool in_flight = false;
+static bool stopped = false;
+
+/*
+ * KNIPSER_TIMELAPSE=<seconds> takes a frame every that many seconds,
+ * KNIPSER_TIMELAPSE_OUTPUT=NAME of that output, and only writes it if
+ * KNIPSER_TIMELAPSE_THRESHOLD percent of its tiles changed.
+ */
+static void read_config(void)
+{
+	const char *env = getenv("KNIPSER_TIMELAPSE");
+	if (env == NULL || env[0] == '\0') {
+		return;
+	}
+
+	char *end;
+	double seconds = strtod(env, &end);
+	if (end == env || *end != '\0' || seconds < 0.1) {
+		log_warn("Ignoring KNIPSER_TIMELAPSE=%s, it must be at least 0.1 s",
+			 env);
+		return;
+	}
+	enabled = true;
+	interval_ns = (uint64_t)(seconds * 1e9);
+
+	env = getenv("KNIPSER_TIMELAPSE_OUTPUT");
+	if (env != NULL) {
+		snprintf(output_name, sizeof(output_name), "%s", env);
+	}
+
+	env = getenv("KNIPSER_TIMELAPSE_THRESHOLD");
+	if (env != NULL) {
+		double percent = strtod(env, &end);
+		if (end != env && *end == '\0' && percent >= 0 &&
+		    percent <= 100) {
+			min_change = percent / 100;
+		} else {
+			log_warn("KNIPSER_TIMELAPSE_THRESHOLD must be between 0 and 100");
+		}
+	}
+}
+
+// The first frame is requested right away
+int timelapse_init(void)
+{
+	read_config();
+	if (!enabled) {
+		return 0;
+	}
+
+	timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (timer_fd < 0) {
+		log_error("Failed to create timelapse timer: %s",
+			  strerror(errno));
+		return -1;
+	}
+	struct itimerspec spec = {
+		.it_interval = {
+			.tv_sec = interval_ns / 1000000000ULL,
+			.tv_nsec = interval_ns % 1000000000ULL,
+		},
+		.it_value = { .tv_nsec = 1 },
+	};
+	timerfd_settime(timer_fd, 0, &spec, NULL);
+	return 0;
+}
+
+bool timelapse_enabled(void)
+{
+	return enabled;
+}
+
+int timelapse_get_fd(void)
+{
+	return timer_fd;
+}
+
+static void destroy_buffers(void)
+{
+	shm_mapping_destroy(&buffers[0]);
+	shm_mapping_destroy(&buffers[1]);
+	written = -1;
+}
+
+static int create_buffers(size_t size)
+{
+	destroy_buffers();
+	if (shm_mapping_create(&buffers[0], size, false) < 0 ||
+	    shm_mapping_create(&buffers[1], size, false) < 0) {
+		destroy_buffers();
+		return -1;
+	}
+	return 0;
+}
+
+static void frame_complete(void *user, int result,
+			   const struct capture_job *job)
+{
+	in_flight = false;
+	if (result < 0 || job == NULL) {
+		return;
+	}
+	if (result == CAPTURE_UNCHANGED) {
+		damage = job->damage;
+		return;
+	}
+
+	// The frame just written is what the next ones are compared to
+	const struct canvas_output *frame = &job->frames[0];
+	log_debug("Timelapse wrote %s", job->filename);
+	damage = (struct capture_rect){ 0 };
+	if (job->mappings[0] != NULL) {
+		// The first frame, or a larger one, had a buffer of its own
+		size_t size = (size_t)frame->stride * frame->height;
+		if (create_buffers(size) < 0) {
+			return;
+		}
+		memcpy(buffers[0].data, frame->data, size);
+		written = 0;
+	} else {
+		written = 1 - written;
+	}
+	reference = *frame;
+	reference.data = buffers[written].data;
+}
+
+static bool find_output(int32_t *x, int32_t *y)
+{
+	*x = 0;
+	*y = 0;
+	if (output_name[0] == '\0') {
+		return true;
+	}
+
+	const struct layout *layout = layout_acquire();
+	const struct layout_output *found = layout_find_name(layout, output_name);
+	if (found != NULL) {
+		*x = found->x;
+		*y = found->y;
+	}
+	layout_release(layout);
+	return found != NULL;
+}
+
+// A frame still waiting for the screen to change covers this tick as well
+static void start_frame(void)
+{
+	int32_t x, y;
+	if (in_flight || stopped || !find_output(&x, &y)) {
+		return;
+	}
+
+	struct capture_target target = { 0 };
+	if (written >= 0) {
+		target.mapping = &buffers[1 - written];
+		target.size = buffers[1 - written].size;
+	}
+
+	struct capture_waiter waiter = { frame_complete, NULL };
+	if (knipser_handle_timelapse_capture(x, y, &target, &damage,
+					     written >= 0 ? &reference : NULL,
+					     min_change, waiter) < 0) {
+		return;
+	}
+	in_flight = true;
+}
+
+void timelapse_dispatch(void)
+{
+	uint64_t expirations;
+	if (timer_fd < 0 ||
+	    read(timer_fd, &expirations, sizeof(expirations)) < 0) {
+		return;
+	}
+	start_frame();
+}
+
+// Stop taking frames and give up on one waiting for the screen to change
+void timelapse_stop(void)
+{
+	if (!enabled || stopped) {
+		return;
+	}
+	stopped = true;
+	struct itimerspec spec = { 0 };
+	timerfd_settime(timer_fd, 0, &spec, NULL);
+	wayland_stop_waiting();
+}
+
+void timelapse_deinit(void)
+{
+	destroy_buffers();
+	if (timer_fd >= 0) {
+		close(timer_fd);
+		timer_fd = -1;
+	}
+}
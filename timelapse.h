@@ -0,0 +1,13 @@
+#ifndef _TIMELAPSE_H_
+#define _TIMELAPSE_H_
+
+#include <stdbool.h>
+
+int timelapse_init(void);
+void timelapse_deinit(void);
+bool timelapse_enabled(void);
+int timelapse_get_fd(void);
+void timelapse_dispatch(void);
+void timelapse_stop(void);
+
+#endif /* _TIMELAPSE_H_ */
@@ -0,0 +1,950 @@
+/*
+ * Minimal headless Wayland compositor for testing and benchmarking knipser.
+ *
+ * It offers wl_shm, one wl_output per configured head,
+ * zwlr_screencopy_manager_v1 (version 3, including damage and buffer_done)
+ * and zwlr_output_manager_v1. Copies are filled with a deterministic test
+ * pattern: a gradient with a box that moves on every frame, so damage
+ * tracking has something to report. Half-float formats get the same pattern
+ * as 8-bit ones, so both encode to the same image.
+ *
+ * Usage: knipser-mock-compositor [--head NAME:WxH[+X+Y]]... [--format FORMAT]
+ *                                [--y-invert] [--copy-delay MS]
+ *                                [--hotplug MS] [--socket NAME]
+ */
+
+#include <getopt.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <wayland-server.h>
+
+#include "wlr-screencopy-unstable-v1-server-protocol.h"
+#include "wlr-output-management-unstable-v1-server-protocol.h"
+
+#define MAX_HEADS 64
+#define BOX_SIZE 64
+#define BOX_STEP 16
+
+struct mock_head {
+	struct wl_list link;
+	int index;
+	char name[32];
+	int32_t width, height;
+	int32_t x, y;
+	struct wl_global *output_global;
+	struct wl_list output_resources;
+	struct wl_list head_resources;
+	struct wl_list mode_resources;
+	struct wl_list frames;
+	uint32_t frame_counter;
+	bool has_box;
+	int32_t box_x, box_y;
+};
+
+struct mock_frame {
+	struct wl_list link;
+	struct mock_head *head;
+	struct wl_resource *resource;
+	struct wl_resource *buffer;
+	struct wl_listener buffer_destroy;
+	struct wl_event_source *delay_timer;
+	int32_t x, y, width, height;
+	bool with_damage;
+	bool used;
+};
+
+static struct {
+	struct wl_display *display;
+	struct wl_event_loop *loop;
+	struct wl_list heads;
+	struct wl_list manager_resources;
+	struct mock_head head_storage[MAX_HEADS];
+	int num_heads;
+	uint32_t format;
+	bool y_invert;
+	int copy_delay_ms;
+	int hotplug_ms;
+	struct wl_event_source *hotplug_timer;
+	struct mock_head *unplugged;
+	uint32_t serial;
+} mock;
+
+static const struct {
+	const char *name;
+	uint32_t format;
+} formats[] = {
+	{ "xrgb8888", WL_SHM_FORMAT_XRGB8888 },
+	{ "argb8888", WL_SHM_FORMAT_ARGB8888 },
+	{ "xbgr8888", WL_SHM_FORMAT_XBGR8888 },
+	{ "abgr8888", WL_SHM_FORMAT_ABGR8888 },
+	{ "xrgb2101010", WL_SHM_FORMAT_XRGB2101010 },
+	{ "argb2101010", WL_SHM_FORMAT_ARGB2101010 },
+	{ "xbgr2101010", WL_SHM_FORMAT_XBGR2101010 },
+	{ "abgr2101010", WL_SHM_FORMAT_ABGR2101010 },
+	{ "xbgr16161616f", WL_SHM_FORMAT_XBGR16161616F },
+	{ "abgr16161616f", WL_SHM_FORMAT_ABGR16161616F },
+};
+
+static void detach_resource(struct wl_resource *resource)
+{
+	wl_list_remove(wl_resource_get_link(resource));
+	wl_list_init(wl_resource_get_link(resource));
+	wl_resource_set_user_data(resource, NULL);
+}
+
+static void unlink_resource(struct wl_resource *resource)
+{
+	wl_list_remove(wl_resource_get_link(resource));
+}
+
+// Pixel pattern
+
+static bool half_float(void)
+{
+	return mock.format == WL_SHM_FORMAT_XBGR16161616F ||
+	       mock.format == WL_SHM_FORMAT_ABGR16161616F;
+}
+
+static int32_t format_bpp(void)
+{
+	return half_float() ? 8 : 4;
+}
+
+// v / 255 as a half float, every such value but 0 is a normal number
+static uint16_t to_half(uint8_t v)
+{
+	if (v == 0) {
+		return 0;
+	}
+	float f = v / 255.0f;
+	uint32_t bits;
+	memcpy(&bits, &f, sizeof(bits));
+	uint32_t exponent = ((bits >> 23) & 0xff) - 127 + 15;
+	uint32_t mantissa = (bits >> 13) & 0x3ff;
+	return (uint16_t)((exponent << 10) | mantissa);
+}
+
+static uint32_t pack_pixel(uint8_t r, uint8_t g, uint8_t b)
+{
+	uint32_t r10 = ((uint32_t)r << 2) | (r >> 6);
+	uint32_t g10 = ((uint32_t)g << 2) | (g >> 6);
+	uint32_t b10 = ((uint32_t)b << 2) | (b >> 6);
+
+	switch (mock.format) {
+	case WL_SHM_FORMAT_XBGR8888:
+	case WL_SHM_FORMAT_ABGR8888:
+		return 0xff000000 | ((uint32_t)b << 16) | ((uint32_t)g << 8) | r;
+	case WL_SHM_FORMAT_XRGB2101010:
+	case WL_SHM_FORMAT_ARGB2101010:
+		return 0xc0000000 | (r10 << 20) | (g10 << 10) | b10;
+	case WL_SHM_FORMAT_XBGR2101010:
+	case WL_SHM_FORMAT_ABGR2101010:
+		return 0xc0000000 | (b10 << 20) | (g10 << 10) | r10;
+	default:
+		return 0xff000000 | ((uint32_t)r << 16) | ((uint32_t)g << 8) | b;
+	}
+}
+
+static bool in_box(const struct mock_head *head, int32_t x, int32_t y)
+{
+	return x >= head->box_x && x < head->box_x + BOX_SIZE &&
+	       y >= head->box_y && y < head->box_y + BOX_SIZE;
+}
+
+static void store_pixel(uint8_t *row, int32_t col, uint8_t r, uint8_t g,
+			uint8_t b)
+{
+	if (half_float()) {
+		// R, G, B, A in memory
+		uint16_t *dst = (uint16_t *)row + (size_t)col * 4;
+		dst[0] = to_half(r);
+		dst[1] = to_half(g);
+		dst[2] = to_half(b);
+		dst[3] = to_half(0xff);
+	} else {
+		((uint32_t *)row)[col] = pack_pixel(r, g, b);
+	}
+}
+
+static void render_frame(struct mock_frame *frame, void *data, int32_t stride)
+{
+	struct mock_head *head = frame->head;
+	uint8_t blue = (uint8_t)(head->index * 64);
+
+	for (int32_t row = 0; row < frame->height; row++) {
+		int32_t y = frame->y + row;
+		int32_t dst_row = mock.y_invert ? frame->height - row - 1 : row;
+		uint8_t *dst = (uint8_t *)data + (size_t)dst_row * stride;
+		uint8_t green = (uint8_t)(y * 255 / head->height);
+
+		for (int32_t col = 0; col < frame->width; col++) {
+			int32_t x = frame->x + col;
+			if (in_box(head, x, y)) {
+				store_pixel(dst, col, 0xff, 0xff, 0xff);
+			} else {
+				uint8_t red = (uint8_t)(x * 255 / head->width);
+				store_pixel(dst, col, red, green, blue);
+			}
+		}
+	}
+}
+
+// Move the box and return the bounding rectangle of what changed
+static void advance_head(struct mock_head *head, int32_t *dx, int32_t *dy,
+			 int32_t *dw, int32_t *dh)
+{
+	int32_t old_x = head->box_x, old_y = head->box_y;
+	bool first = !head->has_box;
+	int32_t span_x = head->width > BOX_SIZE ? head->width - BOX_SIZE : 1;
+	int32_t span_y = head->height > BOX_SIZE ? head->height - BOX_SIZE : 1;
+
+	head->frame_counter++;
+	head->box_x = (int32_t)((head->frame_counter * BOX_STEP) % span_x);
+	head->box_y = (int32_t)((head->frame_counter * BOX_STEP / span_x *
+				 BOX_SIZE) % span_y);
+	head->has_box = true;
+
+	if (first) {
+		*dx = 0;
+		*dy = 0;
+		*dw = head->width;
+		*dh = head->height;
+		return;
+	}
+
+	int32_t x1 = old_x < head->box_x ? old_x : head->box_x;
+	int32_t y1 = old_y < head->box_y ? old_y : head->box_y;
+	int32_t x2 = (old_x > head->box_x ? old_x : head->box_x) + BOX_SIZE;
+	int32_t y2 = (old_y > head->box_y ? old_y : head->box_y) + BOX_SIZE;
+	*dx = x1;
+	*dy = y1;
+	*dw = x2 - x1;
+	*dh = y2 - y1;
+}
+
+// Screencopy frames
+
+static void complete_frame(struct mock_frame *frame)
+{
+	struct wl_shm_buffer *shm = frame->buffer ?
+		wl_shm_buffer_get(frame->buffer) : NULL;
+	if (frame->head == NULL || shm == NULL) {
+		zwlr_screencopy_frame_v1_send_failed(frame->resource);
+		return;
+	}
+
+	int32_t dx, dy, dw, dh;
+	advance_head(frame->head, &dx, &dy, &dw, &dh);
+
+	wl_shm_buffer_begin_access(shm);
+	render_frame(frame, wl_shm_buffer_get_data(shm),
+		     wl_shm_buffer_get_stride(shm));
+	wl_shm_buffer_end_access(shm);
+
+	zwlr_screencopy_frame_v1_send_flags(frame->resource,
+		mock.y_invert ? ZWLR_SCREENCOPY_FRAME_V1_FLAGS_Y_INVERT : 0);
+
+	if (frame->with_damage) {
+		// Damage is reported in buffer coordinates, clipped to the region
+		int32_t x1 = dx > frame->x ? dx : frame->x;
+		int32_t y1 = dy > frame->y ? dy : frame->y;
+		int32_t x2 = dx + dw < frame->x + frame->width ?
+			dx + dw : frame->x + frame->width;
+		int32_t y2 = dy + dh < frame->y + frame->height ?
+			dy + dh : frame->y + frame->height;
+		if (x2 > x1 && y2 > y1) {
+			zwlr_screencopy_frame_v1_send_damage(frame->resource,
+				x1 - frame->x, y1 - frame->y, x2 - x1,
+				y2 - y1);
+		}
+	}
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	uint64_t sec = (uint64_t)now.tv_sec;
+	zwlr_screencopy_frame_v1_send_ready(frame->resource, sec >> 32,
+					    sec & 0xffffffff, now.tv_nsec);
+}
+
+static int frame_handle_delay(void *data)
+{
+	struct mock_frame *frame = data;
+	wl_event_source_remove(frame->delay_timer);
+	frame->delay_timer = NULL;
+	complete_frame(frame);
+	return 0;
+}
+
+static void frame_handle_buffer_destroy(struct wl_listener *listener,
+					void *data)
+{
+	struct mock_frame *frame =
+		wl_container_of(listener, frame, buffer_destroy);
+	wl_list_remove(&frame->buffer_destroy.link);
+	frame->buffer = NULL;
+}
+
+static void frame_copy(struct mock_frame *frame, struct wl_resource *buffer,
+		       bool with_damage)
+{
+	if (frame->used) {
+		wl_resource_post_error(frame->resource,
+				       ZWLR_SCREENCOPY_FRAME_V1_ERROR_ALREADY_USED,
+				       "frame already used");
+		return;
+	}
+
+	struct wl_shm_buffer *shm = wl_shm_buffer_get(buffer);
+	if (shm == NULL || wl_shm_buffer_get_format(shm) != mock.format ||
+	    wl_shm_buffer_get_width(shm) != frame->width ||
+	    wl_shm_buffer_get_height(shm) != frame->height ||
+	    wl_shm_buffer_get_stride(shm) < frame->width * format_bpp()) {
+		wl_resource_post_error(frame->resource,
+				       ZWLR_SCREENCOPY_FRAME_V1_ERROR_INVALID_BUFFER,
+				       "invalid buffer");
+		return;
+	}
+
+	frame->used = true;
+	frame->with_damage = with_damage;
+	frame->buffer = buffer;
+	frame->buffer_destroy.notify = frame_handle_buffer_destroy;
+	wl_resource_add_destroy_listener(buffer, &frame->buffer_destroy);
+
+	if (mock.copy_delay_ms > 0) {
+		frame->delay_timer = wl_event_loop_add_timer(mock.loop,
+			frame_handle_delay, frame);
+		wl_event_source_timer_update(frame->delay_timer,
+					     mock.copy_delay_ms);
+	} else {
+		complete_frame(frame);
+	}
+}
+
+static void frame_handle_copy(struct wl_client *client,
+			      struct wl_resource *resource,
+			      struct wl_resource *buffer)
+{
+	frame_copy(wl_resource_get_user_data(resource), buffer, false);
+}
+
+static void frame_handle_copy_with_damage(struct wl_client *client,
+					  struct wl_resource *resource,
+					  struct wl_resource *buffer)
+{
+	frame_copy(wl_resource_get_user_data(resource), buffer, true);
+}
+
+static void frame_handle_destroy(struct wl_client *client,
+				 struct wl_resource *resource)
+{
+	wl_resource_destroy(resource);
+}
+
+static const struct zwlr_screencopy_frame_v1_interface frame_impl = {
+	.copy = frame_handle_copy,
+	.destroy = frame_handle_destroy,
+	.copy_with_damage = frame_handle_copy_with_damage,
+};
+
+static void frame_resource_destroy(struct wl_resource *resource)
+{
+	struct mock_frame *frame = wl_resource_get_user_data(resource);
+	if (frame->delay_timer != NULL) {
+		wl_event_source_remove(frame->delay_timer);
+	}
+	if (frame->buffer != NULL) {
+		wl_list_remove(&frame->buffer_destroy.link);
+	}
+	wl_list_remove(&frame->link);
+	free(frame);
+}
+
+static void capture(struct wl_client *client, struct wl_resource *manager,
+		    uint32_t id, struct wl_resource *output, int32_t x,
+		    int32_t y, int32_t width, int32_t height)
+{
+	struct mock_frame *frame = calloc(1, sizeof(*frame));
+	if (frame == NULL) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+
+	frame->resource = wl_resource_create(client,
+		&zwlr_screencopy_frame_v1_interface,
+		wl_resource_get_version(manager), id);
+	if (frame->resource == NULL) {
+		free(frame);
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_list_init(&frame->link);
+	wl_resource_set_implementation(frame->resource, &frame_impl, frame,
+				       frame_resource_destroy);
+
+	struct mock_head *head = wl_resource_get_user_data(output);
+	if (head == NULL) {
+		zwlr_screencopy_frame_v1_send_failed(frame->resource);
+		return;
+	}
+
+	// Clip the requested region to the output
+	int32_t x2 = x + width < head->width ? x + width : head->width;
+	int32_t y2 = y + height < head->height ? y + height : head->height;
+	frame->x = x > 0 ? x : 0;
+	frame->y = y > 0 ? y : 0;
+	frame->width = x2 - frame->x;
+	frame->height = y2 - frame->y;
+	if (frame->width <= 0 || frame->height <= 0) {
+		zwlr_screencopy_frame_v1_send_failed(frame->resource);
+		return;
+	}
+
+	frame->head = head;
+	wl_list_insert(&head->frames, &frame->link);
+
+	zwlr_screencopy_frame_v1_send_buffer(frame->resource, mock.format,
+					     frame->width, frame->height,
+					     frame->width * format_bpp());
+	if (wl_resource_get_version(frame->resource) >=
+	    ZWLR_SCREENCOPY_FRAME_V1_BUFFER_DONE_SINCE_VERSION) {
+		zwlr_screencopy_frame_v1_send_buffer_done(frame->resource);
+	}
+}
+
+static void manager_handle_capture_output(struct wl_client *client,
+					  struct wl_resource *resource,
+					  uint32_t frame, int32_t overlay_cursor,
+					  struct wl_resource *output)
+{
+	capture(client, resource, frame, output, 0, 0, INT32_MAX / 2,
+		INT32_MAX / 2);
+}
+
+static void manager_handle_capture_output_region(struct wl_client *client,
+						 struct wl_resource *resource,
+						 uint32_t frame,
+						 int32_t overlay_cursor,
+						 struct wl_resource *output,
+						 int32_t x, int32_t y,
+						 int32_t width, int32_t height)
+{
+	capture(client, resource, frame, output, x, y, width, height);
+}
+
+static void manager_handle_destroy(struct wl_client *client,
+				   struct wl_resource *resource)
+{
+	wl_resource_destroy(resource);
+}
+
+static const struct zwlr_screencopy_manager_v1_interface screencopy_impl = {
+	.capture_output = manager_handle_capture_output,
+	.capture_output_region = manager_handle_capture_output_region,
+	.destroy = manager_handle_destroy,
+};
+
+static void bind_screencopy(struct wl_client *client, void *data,
+			    uint32_t version, uint32_t id)
+{
+	struct wl_resource *resource = wl_resource_create(client,
+		&zwlr_screencopy_manager_v1_interface, version, id);
+	if (resource == NULL) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(resource, &screencopy_impl, NULL, NULL);
+}
+
+// wl_output
+
+static void output_handle_release(struct wl_client *client,
+				  struct wl_resource *resource)
+{
+	wl_resource_destroy(resource);
+}
+
+static const struct wl_output_interface output_impl = {
+	.release = output_handle_release,
+};
+
+static void bind_output(struct wl_client *client, void *data,
+			uint32_t version, uint32_t id)
+{
+	struct mock_head *head = data;
+	struct wl_resource *resource = wl_resource_create(client,
+		&wl_output_interface, version, id);
+	if (resource == NULL) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(resource, &output_impl, head,
+				       unlink_resource);
+	wl_list_insert(&head->output_resources, wl_resource_get_link(resource));
+
+	wl_output_send_geometry(resource, head->x, head->y, 0, 0,
+				WL_OUTPUT_SUBPIXEL_UNKNOWN, "knipser", "mock",
+				WL_OUTPUT_TRANSFORM_NORMAL);
+	wl_output_send_mode(resource,
+			    WL_OUTPUT_MODE_CURRENT | WL_OUTPUT_MODE_PREFERRED,
+			    head->width, head->height, 60000);
+	if (version >= WL_OUTPUT_SCALE_SINCE_VERSION) {
+		wl_output_send_scale(resource, 1);
+	}
+	if (version >= WL_OUTPUT_NAME_SINCE_VERSION) {
+		wl_output_send_name(resource, head->name);
+		wl_output_send_description(resource, "Mock output");
+	}
+	if (version >= WL_OUTPUT_DONE_SINCE_VERSION) {
+		wl_output_send_done(resource);
+	}
+}
+
+// zwlr_output_manager_v1
+
+static void resource_handle_destroy(struct wl_client *client,
+				    struct wl_resource *resource)
+{
+	wl_resource_destroy(resource);
+}
+
+static const struct zwlr_output_head_v1_interface head_impl = {
+	.release = resource_handle_destroy,
+};
+
+static const struct zwlr_output_mode_v1_interface mode_impl = {
+	.release = resource_handle_destroy,
+};
+
+static void config_head_handle_set_mode(struct wl_client *client,
+					struct wl_resource *resource,
+					struct wl_resource *mode)
+{
+}
+
+static void config_head_handle_set_custom_mode(struct wl_client *client,
+					       struct wl_resource *resource,
+					       int32_t width, int32_t height,
+					       int32_t refresh)
+{
+}
+
+static void config_head_handle_set_position(struct wl_client *client,
+					    struct wl_resource *resource,
+					    int32_t x, int32_t y)
+{
+}
+
+static void config_head_handle_set_transform(struct wl_client *client,
+					     struct wl_resource *resource,
+					     int32_t transform)
+{
+}
+
+static void config_head_handle_set_scale(struct wl_client *client,
+					 struct wl_resource *resource,
+					 wl_fixed_t scale)
+{
+}
+
+static void config_head_handle_set_adaptive_sync(struct wl_client *client,
+						 struct wl_resource *resource,
+						 uint32_t state)
+{
+}
+
+static const struct zwlr_output_configuration_head_v1_interface config_head_impl = {
+	.set_mode = config_head_handle_set_mode,
+	.set_custom_mode = config_head_handle_set_custom_mode,
+	.set_position = config_head_handle_set_position,
+	.set_transform = config_head_handle_set_transform,
+	.set_scale = config_head_handle_set_scale,
+	.set_adaptive_sync = config_head_handle_set_adaptive_sync,
+};
+
+static void config_handle_enable_head(struct wl_client *client,
+				      struct wl_resource *resource,
+				      uint32_t id, struct wl_resource *head)
+{
+	struct wl_resource *config_head = wl_resource_create(client,
+		&zwlr_output_configuration_head_v1_interface,
+		wl_resource_get_version(resource), id);
+	if (config_head == NULL) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(config_head, &config_head_impl, NULL,
+				       NULL);
+}
+
+static void config_handle_disable_head(struct wl_client *client,
+				       struct wl_resource *resource,
+				       struct wl_resource *head)
+{
+}
+
+// The mock layout is fixed, so every configuration is rejected
+static void config_handle_apply(struct wl_client *client,
+				struct wl_resource *resource)
+{
+	zwlr_output_configuration_v1_send_failed(resource);
+}
+
+static const struct zwlr_output_configuration_v1_interface config_impl = {
+	.enable_head = config_handle_enable_head,
+	.disable_head = config_handle_disable_head,
+	.apply = config_handle_apply,
+	.test = config_handle_apply,
+	.destroy = resource_handle_destroy,
+};
+
+static void output_manager_handle_create_configuration(struct wl_client *client,
+						       struct wl_resource *resource,
+						       uint32_t id,
+						       uint32_t serial)
+{
+	struct wl_resource *config = wl_resource_create(client,
+		&zwlr_output_configuration_v1_interface,
+		wl_resource_get_version(resource), id);
+	if (config == NULL) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(config, &config_impl, NULL, NULL);
+}
+
+static void output_manager_handle_stop(struct wl_client *client,
+				       struct wl_resource *resource)
+{
+	zwlr_output_manager_v1_send_finished(resource);
+	wl_resource_destroy(resource);
+}
+
+static const struct zwlr_output_manager_v1_interface output_manager_impl = {
+	.create_configuration = output_manager_handle_create_configuration,
+	.stop = output_manager_handle_stop,
+};
+
+static void send_head(struct wl_resource *manager, struct mock_head *head)
+{
+	struct wl_client *client = wl_resource_get_client(manager);
+	int version = wl_resource_get_version(manager);
+
+	struct wl_resource *head_resource = wl_resource_create(client,
+		&zwlr_output_head_v1_interface, version, 0);
+	if (head_resource == NULL) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(head_resource, &head_impl, head,
+				       unlink_resource);
+	wl_list_insert(&head->head_resources,
+		       wl_resource_get_link(head_resource));
+
+	zwlr_output_manager_v1_send_head(manager, head_resource);
+	zwlr_output_head_v1_send_name(head_resource, head->name);
+	zwlr_output_head_v1_send_description(head_resource, "Mock output");
+
+	struct wl_resource *mode = wl_resource_create(client,
+		&zwlr_output_mode_v1_interface, version, 0);
+	if (mode == NULL) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(mode, &mode_impl, head,
+				       unlink_resource);
+	wl_list_insert(&head->mode_resources, wl_resource_get_link(mode));
+
+	zwlr_output_head_v1_send_mode(head_resource, mode);
+	zwlr_output_mode_v1_send_size(mode, head->width, head->height);
+	zwlr_output_mode_v1_send_refresh(mode, 60000);
+	zwlr_output_mode_v1_send_preferred(mode);
+
+	zwlr_output_head_v1_send_enabled(head_resource, 1);
+	zwlr_output_head_v1_send_current_mode(head_resource, mode);
+	zwlr_output_head_v1_send_position(head_resource, head->x, head->y);
+	zwlr_output_head_v1_send_transform(head_resource,
+					   WL_OUTPUT_TRANSFORM_NORMAL);
+	zwlr_output_head_v1_send_scale(head_resource, wl_fixed_from_int(1));
+	if (version >= ZWLR_OUTPUT_HEAD_V1_MAKE_SINCE_VERSION) {
+		zwlr_output_head_v1_send_make(head_resource, "knipser");
+		zwlr_output_head_v1_send_model(head_resource, "mock");
+		zwlr_output_head_v1_send_serial_number(head_resource,
+						       head->name);
+	}
+}
+
+static void bind_output_manager(struct wl_client *client, void *data,
+				uint32_t version, uint32_t id)
+{
+	struct wl_resource *resource = wl_resource_create(client,
+		&zwlr_output_manager_v1_interface, version, id);
+	if (resource == NULL) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(resource, &output_manager_impl, NULL,
+				       unlink_resource);
+	wl_list_insert(&mock.manager_resources, wl_resource_get_link(resource));
+
+	struct mock_head *head;
+	wl_list_for_each(head, &mock.heads, link) {
+		send_head(resource, head);
+	}
+	zwlr_output_manager_v1_send_done(resource, mock.serial);
+}
+
+static void send_done_to_managers(void)
+{
+	struct wl_resource *resource;
+
+	mock.serial++;
+	wl_resource_for_each(resource, &mock.manager_resources) {
+		zwlr_output_manager_v1_send_done(resource, mock.serial);
+	}
+}
+
+// Hotplug
+
+static void plug_head(struct mock_head *head)
+{
+	struct wl_resource *resource;
+
+	wl_list_insert(mock.heads.prev, &head->link);
+	head->output_global = wl_global_create(mock.display,
+		&wl_output_interface, 4, head, bind_output);
+
+	wl_resource_for_each(resource, &mock.manager_resources) {
+		send_head(resource, head);
+	}
+	send_done_to_managers();
+}
+
+static void unplug_head(struct mock_head *head)
+{
+	struct wl_resource *resource, *tmp;
+	struct mock_frame *frame, *frame_tmp;
+
+	wl_list_remove(&head->link);
+	wl_global_destroy(head->output_global);
+	head->output_global = NULL;
+
+	wl_list_for_each_safe(frame, frame_tmp, &head->frames, link) {
+		wl_list_remove(&frame->link);
+		wl_list_init(&frame->link);
+		frame->head = NULL;
+	}
+	wl_resource_for_each_safe(resource, tmp, &head->output_resources) {
+		detach_resource(resource);
+	}
+	wl_resource_for_each_safe(resource, tmp, &head->mode_resources) {
+		zwlr_output_mode_v1_send_finished(resource);
+		detach_resource(resource);
+	}
+	wl_resource_for_each_safe(resource, tmp, &head->head_resources) {
+		zwlr_output_head_v1_send_finished(resource);
+		detach_resource(resource);
+	}
+	send_done_to_managers();
+}
+
+// Alternately remove and re-add the last head
+static int handle_hotplug(void *data)
+{
+	if (mock.unplugged != NULL) {
+		fprintf(stderr, "Plugging in %s\n", mock.unplugged->name);
+		plug_head(mock.unplugged);
+		mock.unplugged = NULL;
+	} else if (!wl_list_empty(&mock.heads)) {
+		mock.unplugged = wl_container_of(mock.heads.prev,
+						 mock.unplugged, link);
+		fprintf(stderr, "Unplugging %s\n", mock.unplugged->name);
+		unplug_head(mock.unplugged);
+	}
+
+	wl_event_source_timer_update(mock.hotplug_timer, mock.hotplug_ms);
+	return 0;
+}
+
+static int handle_signal(int signal_number, void *data)
+{
+	wl_display_terminate(mock.display);
+	return 0;
+}
+
+// Configuration
+
+static int add_head(const char *spec)
+{
+	if (mock.num_heads >= MAX_HEADS) {
+		fprintf(stderr, "Too many heads\n");
+		return -1;
+	}
+
+	struct mock_head *head = &mock.head_storage[mock.num_heads];
+	int n = sscanf(spec, "%31[^:]:%dx%d+%d+%d", head->name, &head->width,
+		       &head->height, &head->x, &head->y);
+	if (n != 3 && n != 5) {
+		fprintf(stderr, "Invalid head '%s', expected NAME:WxH[+X+Y]\n",
+			spec);
+		return -1;
+	}
+	if (head->width <= 0 || head->height <= 0) {
+		fprintf(stderr, "Invalid size for head %s\n", head->name);
+		return -1;
+	}
+
+	// Without a position, place the head right of the previous one
+	if (n == 3 && mock.num_heads > 0) {
+		struct mock_head *prev = &mock.head_storage[mock.num_heads - 1];
+		head->x = prev->x + prev->width;
+		head->y = prev->y;
+	}
+
+	head->index = mock.num_heads++;
+	wl_list_init(&head->output_resources);
+	wl_list_init(&head->head_resources);
+	wl_list_init(&head->mode_resources);
+	wl_list_init(&head->frames);
+	return 0;
+}
+
+static int parse_format(const char *name)
+{
+	for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+		if (strcmp(formats[i].name, name) == 0) {
+			mock.format = formats[i].format;
+			return 0;
+		}
+	}
+
+	fprintf(stderr, "Unsupported format '%s', expected one of:", name);
+	for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+		fprintf(stderr, " %s", formats[i].name);
+	}
+	fprintf(stderr, "\n");
+	return -1;
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"  --head NAME:WxH[+X+Y]  add an output (repeatable)\n"
+		"  --format FORMAT        shm format of copies (default xrgb8888)\n"
+		"  --y-invert             report y-inverted frames\n"
+		"  --copy-delay MS        delay before a copy completes\n"
+		"  --hotplug MS           unplug/replug the last head periodically\n"
+		"  --socket NAME          listen on NAME instead of wayland-N\n",
+		argv0);
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct option options[] = {
+		{ "head", required_argument, NULL, 'H' },
+		{ "format", required_argument, NULL, 'f' },
+		{ "y-invert", no_argument, NULL, 'y' },
+		{ "copy-delay", required_argument, NULL, 'd' },
+		{ "hotplug", required_argument, NULL, 'p' },
+		{ "socket", required_argument, NULL, 's' },
+		{ "help", no_argument, NULL, 'h' },
+		{ 0 },
+	};
+	const char *socket_name = NULL;
+	int opt;
+
+	mock.format = WL_SHM_FORMAT_XRGB8888;
+	while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+		switch (opt) {
+		case 'H':
+			if (add_head(optarg) < 0) {
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'f':
+			if (parse_format(optarg) < 0) {
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'y':
+			mock.y_invert = true;
+			break;
+		case 'd':
+			mock.copy_delay_ms = atoi(optarg);
+			break;
+		case 'p':
+			mock.hotplug_ms = atoi(optarg);
+			break;
+		case 's':
+			socket_name = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+	if (mock.num_heads == 0 && add_head("MOCK-1:1920x1080+0+0") < 0) {
+		return EXIT_FAILURE;
+	}
+
+	mock.display = wl_display_create();
+	if (mock.display == NULL) {
+		fprintf(stderr, "Failed to create display\n");
+		return EXIT_FAILURE;
+	}
+	mock.loop = wl_display_get_event_loop(mock.display);
+	wl_list_init(&mock.heads);
+	wl_list_init(&mock.manager_resources);
+
+	if (socket_name != NULL) {
+		if (wl_display_add_socket(mock.display, socket_name) < 0) {
+			fprintf(stderr, "Failed to listen on %s\n",
+				socket_name);
+			return EXIT_FAILURE;
+		}
+	} else {
+		socket_name = wl_display_add_socket_auto(mock.display);
+		if (socket_name == NULL) {
+			fprintf(stderr, "Failed to create socket\n");
+			return EXIT_FAILURE;
+		}
+	}
+
+	wl_display_init_shm(mock.display);
+	if (mock.format != WL_SHM_FORMAT_XRGB8888 &&
+	    mock.format != WL_SHM_FORMAT_ARGB8888) {
+		wl_display_add_shm_format(mock.display, mock.format);
+	}
+
+	wl_global_create(mock.display, &zwlr_screencopy_manager_v1_interface,
+			 3, NULL, bind_screencopy);
+	wl_global_create(mock.display, &zwlr_output_manager_v1_interface, 4,
+			 NULL, bind_output_manager);
+	for (int i = 0; i < mock.num_heads; i++) {
+		plug_head(&mock.head_storage[i]);
+	}
+
+	if (mock.hotplug_ms > 0) {
+		mock.hotplug_timer = wl_event_loop_add_timer(mock.loop,
+			handle_hotplug, NULL);
+		wl_event_source_timer_update(mock.hotplug_timer,
+					     mock.hotplug_ms);
+	}
+	wl_event_loop_add_signal(mock.loop, SIGINT, handle_signal, NULL);
+	wl_event_loop_add_signal(mock.loop, SIGTERM, handle_signal, NULL);
+
+	// Scripts read the socket name from the first line of output
+	printf("WAYLAND_DISPLAY=%s\n", socket_name);
+	fflush(stdout);
+
+	wl_display_run(mock.display);
+
+	wl_display_destroy_clients(mock.display);
+	wl_display_destroy(mock.display);
+	return EXIT_SUCCESS;
+}
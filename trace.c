@@ -0,0 +1,201 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "io.h"
+#include "log.h"
+#include "trace.h"
+
+#define TRACE_RING_SIZE 16384 // Events per thread, must be a power of two
+#define TRACE_INSTANT UINT64_MAX
+
+struct trace_event {
+	const char *category;
+	const char *name;
+	uint64_t start_ns;
+	uint64_t duration_ns;
+};
+
+// Written by its owning thread only, read by trace_dump()
+struct trace_ring {
+	atomic_uint_fast64_t head;
+	struct trace_ring *next;
+	pid_t tid;
+	_Atomic(const char *) thread_name;
+	struct trace_event events[TRACE_RING_SIZE];
+};
+
+atomic_bool trace_active = false;
+
+static _Atomic(struct trace_ring *) rings = NULL;
+static _Thread_local struct trace_ring *local_ring = NULL;
+static _Thread_local const char *local_thread_name = NULL;
+static const char *exit_dump_path = NULL;
+
+static struct trace_ring *get_local_ring(void)
+{
+	if (local_ring != NULL) {
+		return local_ring;
+	}
+
+	struct trace_ring *ring = calloc(1, sizeof(*ring));
+	if (ring == NULL) {
+		return NULL;
+	}
+	ring->tid = (pid_t)syscall(SYS_gettid);
+	atomic_init(&ring->thread_name, local_thread_name);
+
+	// Rings are never freed, so events of exited threads can still be dumped
+	struct trace_ring *head = atomic_load(&rings);
+	do {
+		ring->next = head;
+	} while (!atomic_compare_exchange_weak(&rings, &head, ring));
+
+	local_ring = ring;
+	return ring;
+}
+
+static void trace_record(const char *category, const char *name,
+			 uint64_t start_ns, uint64_t duration_ns)
+{
+	struct trace_ring *ring = get_local_ring();
+	if (ring == NULL) {
+		return;
+	}
+
+	uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	struct trace_event *event = &ring->events[head & (TRACE_RING_SIZE - 1)];
+	event->category = category;
+	event->name = name;
+	event->start_ns = start_ns;
+	event->duration_ns = duration_ns;
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+void trace_end(const char *category, const char *name, uint64_t start_ns)
+{
+	if (start_ns == 0) {
+		return;
+	}
+	trace_record(category, name, start_ns, stats_now() - start_ns);
+}
+
+void trace_instant(const char *category, const char *name)
+{
+	if (!trace_enabled()) {
+		return;
+	}
+	trace_record(category, name, stats_now(), TRACE_INSTANT);
+}
+
+void trace_set_enabled(bool enabled)
+{
+	atomic_store(&trace_active, enabled);
+}
+
+// The ring itself is only allocated once the thread records an event
+void trace_set_thread_name(const char *name)
+{
+	local_thread_name = name;
+	if (local_ring != NULL) {
+		atomic_store(&local_ring->thread_name, name);
+	}
+}
+
+static void write_ring(FILE *f, struct trace_ring *ring,
+		       struct trace_event *copy, pid_t pid, bool *first)
+{
+	uint64_t end = atomic_load_explicit(&ring->head, memory_order_acquire);
+	uint64_t begin = end > TRACE_RING_SIZE ? end - TRACE_RING_SIZE : 0;
+	for (uint64_t i = begin; i < end; i++) {
+		copy[i - begin] = ring->events[i & (TRACE_RING_SIZE - 1)];
+	}
+
+	// Drop whatever the owner may have overwritten while we were copying
+	uint64_t now = atomic_load_explicit(&ring->head, memory_order_acquire);
+	if (now + 1 > TRACE_RING_SIZE && now + 1 - TRACE_RING_SIZE > begin) {
+		begin = now + 1 - TRACE_RING_SIZE;
+	}
+
+	const char *thread_name = atomic_load(&ring->thread_name);
+	if (thread_name != NULL) {
+		fprintf(f,
+			"%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+			*first ? "" : ",", (int)pid, (int)ring->tid,
+			thread_name);
+		*first = false;
+	}
+
+	uint64_t base = end > TRACE_RING_SIZE ? end - TRACE_RING_SIZE : 0;
+	for (uint64_t i = begin; i < end; i++) {
+		const struct trace_event *event = &copy[i - base];
+		fprintf(f,
+			"%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f",
+			*first ? "" : ",", event->name, event->category,
+			(int)pid, (int)ring->tid, event->start_ns / 1000.0);
+		if (event->duration_ns == TRACE_INSTANT) {
+			fprintf(f, ",\"ph\":\"i\",\"s\":\"t\"}");
+		} else {
+			fprintf(f, ",\"ph\":\"X\",\"dur\":%.3f}",
+				event->duration_ns / 1000.0);
+		}
+		*first = false;
+	}
+}
+
+// Write all recorded events as Chrome trace-event JSON to path, or to fd
+int trace_dump(const char *path, int fd)
+{
+	struct trace_event *copy = malloc(sizeof(struct trace_event) *
+					  TRACE_RING_SIZE);
+	if (copy == NULL) {
+		return -1;
+	}
+
+	FILE *f = io_open_output(path, fd);
+	if (f == NULL) {
+		free(copy);
+		return -1;
+	}
+
+	pid_t pid = getpid();
+	bool first = true;
+	fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+	for (struct trace_ring *ring = atomic_load(&rings); ring != NULL;
+	     ring = ring->next) {
+		write_ring(f, ring, copy, pid, &first);
+	}
+	fprintf(f, "\n]}\n");
+
+	free(copy);
+	return fclose(f) == 0 ? 0 : -1;
+}
+
+static void dump_at_exit(void)
+{
+	if (trace_dump(exit_dump_path, -1) < 0) {
+		log_error("Failed to write trace to %s", exit_dump_path);
+	}
+}
+
+/*
+ * KNIPSER_TRACE=1 enables tracing from startup. Any other value is taken as
+ * a path the trace is written to when the process exits.
+ */
+void trace_init(void)
+{
+	trace_set_thread_name("main");
+
+	const char *env = getenv("KNIPSER_TRACE");
+	if (env == NULL || env[0] == '\0' || strcmp(env, "0") == 0) {
+		return;
+	}
+
+	trace_set_enabled(true);
+	if (strcmp(env, "1") != 0) {
+		exit_dump_path = env;
+		atexit(dump_at_exit);
+	}
+}
@@ -0,0 +1,52 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "stats.h"
+
+/*
+ * Span tracing of the capture pipeline. Every thread records into its own
+ * ring buffer, so recording never takes a lock; trace_dump() writes all rings
+ * as Chrome trace-event JSON, which chrome://tracing and ui.perfetto.dev load.
+ *
+ * Names and categories must be string literals, only the pointer is stored.
+ */
+
+#ifdef KNIPSER_LIBRARY
+// libknipser never traces, the rings are the daemon's
+static inline bool trace_enabled(void)
+{
+	return false;
+}
+
+static inline void trace_end(const char *category, const char *name,
+			     uint64_t start_ns)
+{
+}
+#else
+extern atomic_bool trace_active;
+
+static inline bool trace_enabled(void)
+{
+	return atomic_load_explicit(&trace_active, memory_order_relaxed);
+}
+
+void trace_end(const char *category, const char *name, uint64_t start_ns);
+#endif
+
+// Returns the span start, or 0 when tracing is off
+static inline uint64_t trace_begin(void)
+{
+	return trace_enabled() ? stats_now() : 0;
+}
+
+void trace_init(void);
+void trace_set_enabled(bool enabled);
+void trace_set_thread_name(const char *name);
+void trace_instant(const char *category, const char *name);
+int trace_dump(const char *path, int fd);
+
+#endif /* _TRACE_H_ */
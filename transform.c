@@ -0,0 +1,239 @@
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "transform.h"
+
+/*
+ * Rotating a buffer turns its columns into rows, so a naive loop reads one
+ * pixel per cache line. Instead, 4x4 blocks are transposed in registers and
+ * walked in tiles of TRANSFORM_TILE source rows, keeping the source lines of
+ * a whole band of output rows in L1 while they are used.
+ */
+#define TRANSFORM_TILE 64
+
+static bool is_rotated(enum wl_output_transform transform)
+{
+	return transform & WL_OUTPUT_TRANSFORM_90;
+}
+
+void transform_size(enum wl_output_transform transform, int width, int height,
+		    int *upright_width, int *upright_height)
+{
+	*upright_width = is_rotated(transform) ? height : width;
+	*upright_height = is_rotated(transform) ? width : height;
+}
+
+// Map a pixel of the upright image to the buffer, like wlr_box_transform()
+void transform_coords(enum wl_output_transform transform, int width,
+		      int height, int u, int v, int *x, int *y)
+{
+	switch (transform) {
+	default:
+	case WL_OUTPUT_TRANSFORM_NORMAL:
+		*x = u;
+		*y = v;
+		break;
+	case WL_OUTPUT_TRANSFORM_90:
+		*x = height - v - 1;
+		*y = u;
+		break;
+	case WL_OUTPUT_TRANSFORM_180:
+		*x = width - u - 1;
+		*y = height - v - 1;
+		break;
+	case WL_OUTPUT_TRANSFORM_270:
+		*x = v;
+		*y = width - u - 1;
+		break;
+	case WL_OUTPUT_TRANSFORM_FLIPPED:
+		*x = width - u - 1;
+		*y = v;
+		break;
+	case WL_OUTPUT_TRANSFORM_FLIPPED_90:
+		*x = height - v - 1;
+		*y = width - u - 1;
+		break;
+	case WL_OUTPUT_TRANSFORM_FLIPPED_180:
+		*x = u;
+		*y = height - v - 1;
+		break;
+	case WL_OUTPUT_TRANSFORM_FLIPPED_270:
+		*x = v;
+		*y = u;
+		break;
+	}
+}
+
+static const void *source_row(const struct transform_source *src, int y)
+{
+	if (src->y_invert) {
+		y = src->height - y - 1;
+	}
+	return (const uint8_t *)src->data + (size_t)y * src->stride;
+}
+
+static uint32_t pixel_32(const struct transform_source *src, int x, int y)
+{
+	return ((const uint32_t *)source_row(src, y))[x];
+}
+
+static uint64_t pixel_64(const struct transform_source *src, int x, int y)
+{
+	return ((const uint64_t *)source_row(src, y))[x];
+}
+
+/*
+ * Transpose the 4x4 block whose rows start at rows[0..3], writing its
+ * columns as rows of dst. With reverse the columns are written bottom up.
+ */
+static void transpose_4x4(const uint32_t *rows[4], uint32_t *dst,
+			  size_t dst_stride, bool reverse)
+{
+	uint32_t *out[4];
+	for (int i = 0; i < 4; i++) {
+		out[i] = dst + (size_t)(reverse ? 3 - i : i) * dst_stride;
+	}
+
+#ifdef __SSE2__
+	__m128i r0 = _mm_loadu_si128((const __m128i *)rows[0]);
+	__m128i r1 = _mm_loadu_si128((const __m128i *)rows[1]);
+	__m128i r2 = _mm_loadu_si128((const __m128i *)rows[2]);
+	__m128i r3 = _mm_loadu_si128((const __m128i *)rows[3]);
+	__m128i t0 = _mm_unpacklo_epi32(r0, r1);
+	__m128i t1 = _mm_unpacklo_epi32(r2, r3);
+	__m128i t2 = _mm_unpackhi_epi32(r0, r1);
+	__m128i t3 = _mm_unpackhi_epi32(r2, r3);
+	_mm_storeu_si128((__m128i *)out[0], _mm_unpacklo_epi64(t0, t1));
+	_mm_storeu_si128((__m128i *)out[1], _mm_unpackhi_epi64(t0, t1));
+	_mm_storeu_si128((__m128i *)out[2], _mm_unpacklo_epi64(t2, t3));
+	_mm_storeu_si128((__m128i *)out[3], _mm_unpackhi_epi64(t2, t3));
+#else
+	for (int i = 0; i < 4; i++) {
+		for (int j = 0; j < 4; j++) {
+			out[i][j] = rows[j][i];
+		}
+	}
+#endif
+}
+
+// Produce upright rows that are columns of a 32-bit buffer
+static void rotate_rows_32(const struct transform_source *src, uint32_t *dst,
+			   size_t dst_stride, int v0, int count)
+{
+	int width, height;
+	transform_size(src->transform, src->width, src->height, &width,
+		       &height);
+
+	// Buffer columns run towards lower x as v grows for 90 and flipped 90
+	bool reverse = src->transform == WL_OUTPUT_TRANSFORM_90 ||
+		       src->transform == WL_OUTPUT_TRANSFORM_FLIPPED_90;
+	int blocks = count & ~3;
+	int x, y;
+
+	for (int tile = 0; tile < width; tile += TRANSFORM_TILE) {
+		int tile_end = tile + TRANSFORM_TILE < width ?
+				       tile + TRANSFORM_TILE :
+				       width;
+		for (int v = v0; v < v0 + blocks; v += 4) {
+			transform_coords(src->transform, width, height, 0,
+					 reverse ? v + 3 : v, &x, &y);
+			uint32_t *out = dst + (size_t)(v - v0) * dst_stride;
+
+			int u = tile;
+			for (; u + 4 <= tile_end; u += 4) {
+				const uint32_t *rows[4];
+				for (int j = 0; j < 4; j++) {
+					int row_x;
+					transform_coords(src->transform, width,
+							 height, u + j, v,
+							 &row_x, &y);
+					rows[j] = &((const uint32_t *)
+							    source_row(src, y))[x];
+				}
+				transpose_4x4(rows, out + u, dst_stride,
+					      reverse);
+			}
+			for (; u < tile_end; u++) {
+				for (int i = 0; i < 4; i++) {
+					transform_coords(src->transform, width,
+							 height, u, v + i, &x,
+							 &y);
+					out[(size_t)i * dst_stride + u] =
+						pixel_32(src, x, y);
+				}
+			}
+		}
+	}
+
+	// Leftover rows when count is not a multiple of four
+	for (int v = v0 + blocks; v < v0 + count; v++) {
+		uint32_t *out = dst + (size_t)(v - v0) * dst_stride;
+		for (int u = 0; u < width; u++) {
+			transform_coords(src->transform, width, height, u, v,
+					 &x, &y);
+			out[u] = pixel_32(src, x, y);
+		}
+	}
+}
+
+// 64-bit pixels are moved one at a time, but still in cache-friendly tiles
+static void rotate_rows_64(const struct transform_source *src, uint64_t *dst,
+			   size_t dst_stride, int v0, int count)
+{
+	int width, height;
+	transform_size(src->transform, src->width, src->height, &width,
+		       &height);
+
+	for (int tile = 0; tile < width; tile += TRANSFORM_TILE) {
+		int tile_end = tile + TRANSFORM_TILE < width ?
+				       tile + TRANSFORM_TILE :
+				       width;
+		for (int v = v0; v < v0 + count; v++) {
+			uint64_t *out = dst + (size_t)(v - v0) * dst_stride;
+			for (int u = tile; u < tile_end; u++) {
+				int x, y;
+				transform_coords(src->transform, width, height,
+						 u, v, &x, &y);
+				out[u] = pixel_64(src, x, y);
+			}
+		}
+	}
+}
+
+/*
+ * Write count rows of the upright image, starting at row v, to dst, with
+ * dst_stride counted in pixels. Pixels keep the buffer's format, so
+ * conversion can follow while they are cached.
+ */
+void transform_rows(const struct transform_source *src, void *dst,
+		    size_t dst_stride, int v, int count)
+{
+	if (is_rotated(src->transform)) {
+		if (src->bpp == 8) {
+			rotate_rows_64(src, dst, dst_stride, v, count);
+		} else {
+			rotate_rows_32(src, dst, dst_stride, v, count);
+		}
+		return;
+	}
+
+	for (int i = 0; i < count; i++) {
+		int x, y;
+		transform_coords(src->transform, src->width, src->height, 0,
+				 v + i, &x, &y);
+		const uint8_t *row = source_row(src, y);
+		uint8_t *out = (uint8_t *)dst + (size_t)i * dst_stride * src->bpp;
+		if (x == 0) {
+			memcpy(out, row, (size_t)src->width * src->bpp);
+			continue;
+		}
+
+		for (int u = 0; u < src->width; u++) {
+			memcpy(out + (size_t)u * src->bpp,
+			       row + (size_t)(src->width - u - 1) * src->bpp,
+			       src->bpp);
+		}
+	}
+}
@@ -0,0 +1,25 @@
+#ifndef _TRANSFORM_H_
+#define _TRANSFORM_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <wayland-client.h>
+
+// A captured buffer and the transform that makes it upright
+struct transform_source {
+	const void *data;
+	int width, height, stride;
+	int bpp; // Bytes per pixel, 4 or 8
+	bool y_invert;
+	enum wl_output_transform transform;
+};
+
+void transform_size(enum wl_output_transform transform, int width, int height,
+		    int *upright_width, int *upright_height);
+void transform_coords(enum wl_output_transform transform, int width,
+		      int height, int u, int v, int *x, int *y);
+void transform_rows(const struct transform_source *src, void *dst,
+		    size_t dst_stride, int v, int count);
+
+#endif /* _TRANSFORM_H_ */
@@ -1,29 +1,105 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
+#include "clipboard.h"
 #include "knipser.h"
+#include "log.h"
+#include "ring.h"
+#include "shm.h"
+#include "startup.h"
+#include "stats.h"
+#include "trace.h"
 #include "tray.h"
 #include "wayland.h"
 
 static sd_bus_slot *dbusSlot = NULL;
+static sd_bus_slot *statsSlot = NULL;
+static sd_bus_slot *traceSlot = NULL;
+static sd_bus_slot *captureSlot = NULL;
+static sd_bus_slot *watcherSlot = NULL;
+static sd_bus_slot *filterSlot = NULL;
 static sd_bus *dbusConnection = NULL;
 
+// Startup progress, set once the bus has answered each request
+static bool name_acquired = false;
+static bool item_registered = false;
+
+// Set for every call to one of our interfaces, cleared by tray_take_activity()
+static bool had_activity = false;
+
+// The reply is sent once the capture is written, the message is kept until then
+static int submit_capture(sd_bus_message *m, int ret)
+{
+	if (ret < 0) {
+		return sd_bus_reply_method_errorf(m, SD_BUS_ERROR_LIMITS_EXCEEDED,
+						  "Capture not queued");
+	}
+	sd_bus_message_ref(m);
+	return 1;
+}
+
+// Reply with an error if the capture queued by submit_capture() failed
+static bool reply_failed(sd_bus_message *m, int result)
+{
+	if (result == -ECANCELED) {
+		sd_bus_reply_method_errorf(m, SD_BUS_ERROR_LIMITS_EXCEEDED,
+					   "Superseded by a newer capture");
+	} else if (result < 0) {
+		sd_bus_reply_method_errorf(m, SD_BUS_ERROR_FAILED,
+					   "Capture failed");
+	}
+	return result < 0;
+}
+
+static void tray_complete(void *user, int result,
+			  const struct capture_job *job)
+{
+	sd_bus_message *m = user;
+	if (!reply_failed(m, result)) {
+		sd_bus_reply_method_return(m, "");
+	}
+	sd_bus_message_unref(m);
+}
+
 // Callback for context menu activation
 int on_context_menu(sd_bus_message *m, void *userdata, sd_bus_error *ret_error)
 {
+	uint64_t span = trace_begin();
 	int x, y;
 	int ret = sd_bus_message_read(m, "ii", &x, &y);
 	if (ret < 0) {
-		fprintf(stderr, "Failed to parse ContextMenu arguments: %s\n",
+		log_error("Failed to parse ContextMenu arguments: %s",
 			strerror(-ret));
 		return ret;
 	}
-	printf("Display in (%d,%d): %s", x, y, get_display_name_for_coordinates(x,y));
-	knipser_handle_screenshot(x, y);
+	char name[64];
+	if (get_display_name_for_coordinates(x, y, name, sizeof(name))) {
+		log_debug("Display in (%d,%d): %s", x, y, name);
+	}
+	struct capture_waiter waiter = { tray_complete, m };
+	ret = submit_capture(m, knipser_handle_screenshot(x, y, waiter));
+	trace_end("dbus", "ContextMenu", span);
 
-	return sd_bus_reply_method_return(m, "");
+	return ret;
+}
+
+// Middle click captures the whole desktop instead of a single output
+int on_secondary_activate(sd_bus_message *m, void *userdata,
+			  sd_bus_error *ret_error)
+{
+	uint64_t span = trace_begin();
+	struct capture_waiter waiter = { tray_complete, m };
+	int ret = submit_capture(m, knipser_handle_desktop_screenshot(waiter));
+	trace_end("dbus", "SecondaryActivate", span);
+
+	return ret;
 }
 
 // Getter for D-Bus properties
@@ -60,9 +136,451 @@ const sd_bus_vtable tray_vtable[] = {
 			SD_BUS_VTABLE_PROPERTY_EMITS_CHANGE),
 	SD_BUS_METHOD("ContextMenu", "ii", "", on_context_menu,
 		      SD_BUS_VTABLE_UNPRIVILEGED),
+	SD_BUS_METHOD("SecondaryActivate", "ii", "", on_secondary_activate,
+		      SD_BUS_VTABLE_UNPRIVILEGED),
+	SD_BUS_VTABLE_END
+};
+
+// Getter for the per-stage latency histograms, all values in microseconds
+int get_stats_property(sd_bus *bus, const char *path, const char *interface,
+		       const char *property, sd_bus_message *reply,
+		       void *userdata, sd_bus_error *ret_error)
+{
+	for (int stage = 0; stage < STATS_NUM_STAGES; stage++) {
+		if (strcmp(property, stats_stage_name(stage)) != 0) {
+			continue;
+		}
+
+		struct stats_summary summary;
+		stats_get_summary(stage, &summary);
+		return sd_bus_message_append(reply, "(ttttttt)", summary.count,
+					     summary.min_us, summary.mean_us,
+					     summary.p50_us, summary.p90_us,
+					     summary.p99_us, summary.max_us);
+	}
+
+	return -1; // Unknown property
+}
+
+// Scheduler counters, each a plain count
+int get_scheduler_property(sd_bus *bus, const char *path,
+			   const char *interface, const char *property,
+			   sd_bus_message *reply, void *userdata,
+			   sd_bus_error *ret_error)
+{
+	struct knipser_counters counters;
+	knipser_get_counters(&counters);
+
+	uint64_t value;
+	if (strcmp(property, "Captures") == 0) {
+		value = counters.captures;
+	} else if (strcmp(property, "Coalesced") == 0) {
+		value = counters.coalesced;
+	} else if (strcmp(property, "Rejected") == 0) {
+		value = counters.rejected;
+	} else if (strcmp(property, "Superseded") == 0) {
+		value = counters.superseded;
+	} else {
+		return -1; // Unknown property
+	}
+	return sd_bus_message_append(reply, "t", value);
+}
+
+int on_stats_reset(sd_bus_message *m, void *userdata, sd_bus_error *ret_error)
+{
+	stats_reset();
+	knipser_reset_counters();
+	return sd_bus_reply_method_return(m, "");
+}
+
+// Each stage is (count, min, mean, p50, p90, p99, max)
+const sd_bus_vtable stats_vtable[] = {
+	SD_BUS_VTABLE_START(0),
+	SD_BUS_PROPERTY("FindOutput", "(ttttttt)", get_stats_property, 0, 0),
+	SD_BUS_PROPERTY("CreateBuffer", "(ttttttt)", get_stats_property, 0, 0),
+	SD_BUS_PROPERTY("Copy", "(ttttttt)", get_stats_property, 0, 0),
+	SD_BUS_PROPERTY("Convert", "(ttttttt)", get_stats_property, 0, 0),
+	SD_BUS_PROPERTY("Compress", "(ttttttt)", get_stats_property, 0, 0),
+	SD_BUS_PROPERTY("Write", "(ttttttt)", get_stats_property, 0, 0),
+	SD_BUS_PROPERTY("Close", "(ttttttt)", get_stats_property, 0, 0),
+	SD_BUS_PROPERTY("Total", "(ttttttt)", get_stats_property, 0, 0),
+	SD_BUS_PROPERTY("Captures", "t", get_scheduler_property, 0, 0),
+	SD_BUS_PROPERTY("Coalesced", "t", get_scheduler_property, 0, 0),
+	SD_BUS_PROPERTY("Rejected", "t", get_scheduler_property, 0, 0),
+	SD_BUS_PROPERTY("Superseded", "t", get_scheduler_property, 0, 0),
+	SD_BUS_METHOD("Reset", "", "", on_stats_reset,
+		      SD_BUS_VTABLE_UNPRIVILEGED),
 	SD_BUS_VTABLE_END
 };
 
+int get_trace_enabled(sd_bus *bus, const char *path, const char *interface,
+		      const char *property, sd_bus_message *reply,
+		      void *userdata, sd_bus_error *ret_error)
+{
+	return sd_bus_message_append(reply, "b", (int)trace_enabled());
+}
+
+int on_trace_start(sd_bus_message *m, void *userdata, sd_bus_error *ret_error)
+{
+	trace_set_enabled(true);
+	return sd_bus_reply_method_return(m, "");
+}
+
+int on_trace_stop(sd_bus_message *m, void *userdata, sd_bus_error *ret_error)
+{
+	trace_set_enabled(false);
+	return sd_bus_reply_method_return(m, "");
+}
+
+/*
+ * Write the trace recorded so far as Chrome trace-event JSON. Callers only
+ * name the file, it always goes to $XDG_RUNTIME_DIR and is never followed
+ * through a symlink, so a bus peer can't make the daemon overwrite others.
+ */
+int on_trace_dump(sd_bus_message *m, void *userdata, sd_bus_error *ret_error)
+{
+	const char *name;
+	int ret = sd_bus_message_read(m, "s", &name);
+	if (ret < 0) {
+		return ret;
+	}
+
+	const char *dir = getenv("XDG_RUNTIME_DIR");
+	if (name[0] == '\0' || name[0] == '.' || strchr(name, '/') != NULL) {
+		return sd_bus_reply_method_errorf(m, SD_BUS_ERROR_INVALID_ARGS,
+						  "%s is not a file name", name);
+	}
+	if (dir == NULL || dir[0] != '/') {
+		return sd_bus_reply_method_errorf(m, SD_BUS_ERROR_NOT_SUPPORTED,
+						  "XDG_RUNTIME_DIR is not set");
+	}
+
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC,
+		      0600);
+	ret = fd >= 0 ? trace_dump(NULL, fd) : -1;
+	if (fd >= 0) {
+		close(fd);
+	}
+	if (ret < 0) {
+		return sd_bus_reply_method_errorf(m, SD_BUS_ERROR_IO_ERROR,
+						  "Failed to write trace to %s",
+						  path);
+	}
+	return sd_bus_reply_method_return(m, "s", path);
+}
+
+const sd_bus_vtable trace_vtable[] = {
+	SD_BUS_VTABLE_START(0),
+	SD_BUS_PROPERTY("Enabled", "b", get_trace_enabled, 0, 0),
+	SD_BUS_METHOD("Start", "", "", on_trace_start,
+		      SD_BUS_VTABLE_UNPRIVILEGED),
+	SD_BUS_METHOD("Stop", "", "", on_trace_stop,
+		      SD_BUS_VTABLE_UNPRIVILEGED),
+	SD_BUS_METHOD("Dump", "s", "s", on_trace_dump,
+		      SD_BUS_VTABLE_UNPRIVILEGED),
+	SD_BUS_VTABLE_END
+};
+
+/*
+ * Describe a raw buffer, PNG files describe themselves. The compositor may
+ * still map a raw buffer, then it is only sealed against new writers and
+ * write-sealed is false: the compositor could in theory still write to it.
+ */
+static int append_frame_info(sd_bus_message *reply,
+			     const struct capture_job *job)
+{
+	const struct canvas_output *frame = &job->frames[0];
+	int seals = fcntl(job->fd, F_GET_SEALS);
+	int ret = sd_bus_message_open_container(reply, 'a', "{sv}");
+	if (ret < 0) {
+		return ret;
+	}
+	if (job->delivery == CAPTURE_TO_PNG_FD) {
+		ret = sd_bus_message_append(reply, "{sv}", "format", "s", "png");
+	} else {
+		ret = sd_bus_message_append(
+			reply, "{sv}{sv}{sv}{sv}{sv}{sv}{sv}{sv}", "format", "s",
+			"raw", "width", "u", (uint32_t)frame->width, "height",
+			"u", (uint32_t)frame->height, "stride", "u",
+			(uint32_t)frame->stride, "shm-format", "u",
+			(uint32_t)frame->format, "y-invert", "b",
+			(int)frame->y_invert, "transform", "u",
+			(uint32_t)frame->transform, "write-sealed", "b",
+			seals >= 0 && (seals & F_SEAL_WRITE) != 0);
+	}
+	if (ret < 0) {
+		return ret;
+	}
+	return sd_bus_message_close_container(reply);
+}
+
+// Reply to Capture() with the memfd, each caller reading from its own offset
+static void capture_complete(void *user, int result,
+			     const struct capture_job *job)
+{
+	sd_bus_message *m = user;
+	sd_bus_message *reply = NULL;
+	if (reply_failed(m, result)) {
+		sd_bus_message_unref(m);
+		return;
+	}
+
+	// Coalesced callers share the job, a dup would share its offset too
+	int fd = shm_reopen(job->fd);
+	int ret = fd < 0 ? -errno : sd_bus_message_new_method_return(m, &reply);
+	if (ret >= 0) {
+		ret = sd_bus_message_append(reply, "h", fd);
+	}
+	if (ret >= 0) {
+		ret = append_frame_info(reply, job);
+	}
+	if (ret >= 0) {
+		ret = sd_bus_send(NULL, reply, NULL);
+	}
+	if (ret < 0) {
+		log_error("Failed to send capture: %s", strerror(-ret));
+		sd_bus_reply_method_errorf(m, SD_BUS_ERROR_FAILED,
+					   "Failed to send capture");
+	}
+	if (fd >= 0) {
+		close(fd);
+	}
+	sd_bus_message_unref(reply);
+	sd_bus_message_unref(m);
+}
+
+static bool parse_target(const char *target, enum capture_kind *kind)
+{
+	if (strcmp(target, "output") == 0) {
+		*kind = CAPTURE_OUTPUT;
+	} else if (strcmp(target, "desktop") == 0) {
+		*kind = CAPTURE_DESKTOP;
+	} else if (strcmp(target, "region") == 0) {
+		*kind = CAPTURE_REGION;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Capture the output at x, y, the desktop or a region and return it as a
+ * sealed memfd, either PNG encoded or the raw screencopy buffer. Width and
+ * height are only used for regions.
+ */
+int on_capture(sd_bus_message *m, void *userdata, sd_bus_error *ret_error)
+{
+	uint64_t span = trace_begin();
+	const char *target, *format;
+	int x, y, width, height;
+	int ret = sd_bus_message_read(m, "siiiis", &target, &x, &y, &width,
+				      &height, &format);
+	if (ret < 0) {
+		return ret;
+	}
+
+	enum capture_kind kind;
+	if (!parse_target(target, &kind)) {
+		return sd_bus_reply_method_errorf(m, SD_BUS_ERROR_INVALID_ARGS,
+						  "Unknown target %s", target);
+	}
+	enum capture_delivery delivery;
+	if (strcmp(format, "png") == 0) {
+		delivery = CAPTURE_TO_PNG_FD;
+	} else if (strcmp(format, "raw") == 0 && kind != CAPTURE_DESKTOP) {
+		delivery = CAPTURE_TO_RAW_FD;
+	} else {
+		return sd_bus_reply_method_errorf(m, SD_BUS_ERROR_INVALID_ARGS,
+						  "Unsupported format %s for %s",
+						  format, target);
+	}
+	if (kind == CAPTURE_REGION && (width <= 0 || height <= 0)) {
+		return sd_bus_reply_method_errorf(m, SD_BUS_ERROR_INVALID_ARGS,
+						  "Empty region");
+	}
+
+	struct capture_waiter waiter = { capture_complete, m };
+	ret = submit_capture(m, knipser_handle_capture(kind, x, y, width,
+						       height, delivery,
+						       waiter));
+	trace_end("dbus", "Capture", span);
+	return ret;
+}
+
+// Replies once the screenshot is on the clipboard, it is encoded when pasted
+int on_copy_to_clipboard(sd_bus_message *m, void *userdata,
+			 sd_bus_error *ret_error)
+{
+	uint64_t span = trace_begin();
+	const char *target;
+	int x, y, width, height;
+	int ret = sd_bus_message_read(m, "siiii", &target, &x, &y, &width,
+				      &height);
+	if (ret < 0) {
+		return ret;
+	}
+
+	enum capture_kind kind;
+	if (!parse_target(target, &kind)) {
+		return sd_bus_reply_method_errorf(m, SD_BUS_ERROR_INVALID_ARGS,
+						  "Unknown target %s", target);
+	}
+	if (kind == CAPTURE_REGION && (width <= 0 || height <= 0)) {
+		return sd_bus_reply_method_errorf(m, SD_BUS_ERROR_INVALID_ARGS,
+						  "Empty region");
+	}
+	if (!clipboard_available()) {
+		return sd_bus_reply_method_errorf(m, SD_BUS_ERROR_NOT_SUPPORTED,
+						  "Compositor lacks wlr-data-control");
+	}
+
+	struct capture_waiter waiter = { tray_complete, m };
+	ret = submit_capture(m, knipser_handle_capture(kind, x, y, width,
+						       height,
+						       CAPTURE_TO_CLIPBOARD,
+						       waiter));
+	trace_end("dbus", "CopyToClipboard", span);
+	return ret;
+}
+
+// Reply to Subscribe() once the frame ring exists
+static void subscribe_complete(void *user, int ring_fd, int notify_fd)
+{
+	sd_bus_message *m = user;
+	if (ring_fd < 0) {
+		sd_bus_reply_method_errorf(m, SD_BUS_ERROR_FAILED,
+					   "Frame ring not available");
+	} else {
+		sd_bus_reply_method_return(m, "hh", ring_fd, notify_fd);
+	}
+	sd_bus_message_unref(m);
+}
+
+// Subscribers are dropped when they call Unsubscribe() or leave the bus
+int on_subscribe(sd_bus_message *m, void *userdata, sd_bus_error *ret_error)
+{
+	if (!ring_enabled()) {
+		return sd_bus_reply_method_errorf(m, SD_BUS_ERROR_NOT_SUPPORTED,
+						  "Set KNIPSER_RING to publish frames");
+	}
+
+	struct ring_waiter waiter = { subscribe_complete, m };
+	sd_bus_message_ref(m);
+	if (ring_subscribe(sd_bus_message_get_sender(m), waiter) < 0) {
+		sd_bus_message_unref(m);
+		return sd_bus_reply_method_errorf(m, SD_BUS_ERROR_LIMITS_EXCEEDED,
+						  "Too many subscribers");
+	}
+	return 1;
+}
+
+int on_unsubscribe(sd_bus_message *m, void *userdata, sd_bus_error *ret_error)
+{
+	ring_unsubscribe(sd_bus_message_get_sender(m));
+	return sd_bus_reply_method_return(m, "");
+}
+
+const sd_bus_vtable capture_vtable[] = {
+	SD_BUS_VTABLE_START(0),
+	SD_BUS_METHOD("Capture", "siiiis", "ha{sv}", on_capture,
+		      SD_BUS_VTABLE_UNPRIVILEGED),
+	SD_BUS_METHOD("CopyToClipboard", "siiii", "", on_copy_to_clipboard,
+		      SD_BUS_VTABLE_UNPRIVILEGED),
+	SD_BUS_METHOD("Subscribe", "", "hh", on_subscribe,
+		      SD_BUS_VTABLE_UNPRIVILEGED),
+	SD_BUS_METHOD("Unsubscribe", "", "", on_unsubscribe,
+		      SD_BUS_VTABLE_UNPRIVILEGED),
+	SD_BUS_VTABLE_END
+};
+
+static int on_name_acquired(sd_bus_message *m, void *userdata,
+			    sd_bus_error *ret_error)
+{
+	const sd_bus_error *error = sd_bus_message_get_error(m);
+	if (error != NULL) {
+		log_error("Failed to acquire D-Bus name: %s", error->message);
+	} else {
+		startup_mark("dbus.name");
+	}
+	name_acquired = true;
+	return 0;
+}
+
+// Without a watcher the item is registered once one appears
+static int on_item_registered(sd_bus_message *m, void *userdata,
+			      sd_bus_error *ret_error)
+{
+	const sd_bus_error *error = sd_bus_message_get_error(m);
+	if (error != NULL) {
+		log_warn("Failed to register with StatusNotifierWatcher: %s",
+			 error->message);
+	} else {
+		startup_mark("dbus.registered");
+		log_info("SNI tray icon running...");
+	}
+	item_registered = true;
+	return 0;
+}
+
+static int register_item(void)
+{
+	// Notify the StatusNotifierWatcher
+	int ret = sd_bus_call_method_async(dbusConnection, NULL,
+					   "org.kde.StatusNotifierWatcher", // Destination
+					   "/StatusNotifierWatcher", // Path
+					   "org.kde.StatusNotifierWatcher", // Interface
+					   "RegisterStatusNotifierItem", // Method
+					   on_item_registered, NULL, "s",
+					   "/knipser/tray");
+	if (ret < 0) {
+		log_error("Failed to register with StatusNotifierWatcher: %s",
+			strerror(-ret));
+	}
+	return ret;
+}
+
+static int on_name_owner_changed(sd_bus_message *m, void *userdata,
+				 sd_bus_error *ret_error)
+{
+	const char *name, *old_owner, *new_owner;
+	int ret = sd_bus_message_read(m, "sss", &name, &old_owner, &new_owner);
+	if (ret < 0) {
+		return 0;
+	}
+
+	if (strcmp(name, "org.kde.StatusNotifierWatcher") == 0 &&
+	    new_owner[0] != '\0') {
+		log_debug("StatusNotifierWatcher appeared, registering");
+		register_item();
+	}
+
+	// Frame ring subscribers that disconnect without unsubscribing
+	if (name[0] == ':' && new_owner[0] == '\0') {
+		ring_unsubscribe(name);
+	}
+	return 0;
+}
+
+// Panels reading properties or introspecting don't keep an idle daemon alive
+static int on_message(sd_bus_message *m, void *userdata,
+		      sd_bus_error *ret_error)
+{
+	uint8_t type;
+	if (sd_bus_message_get_type(m, &type) < 0 ||
+	    type != SD_BUS_MESSAGE_METHOD_CALL) {
+		return 0;
+	}
+
+	const char *interface = sd_bus_message_get_interface(m);
+	if (interface != NULL &&
+	    strncmp(interface, "org.freedesktop.DBus", 20) != 0) {
+		had_activity = true;
+	}
+	return 0;
+}
+
 int init_tray(void)
 {
 	int ret;
@@ -70,10 +588,17 @@ int init_tray(void)
 	// Connect to D-Bus session bus
 	ret = sd_bus_default_user(&dbusConnection);
 	if (ret < 0) {
-		fprintf(stderr, "Failed to connect to D-Bus: %s\n",
+		log_error("Failed to connect to D-Bus: %s",
 			strerror(-ret));
 		return 1;
 	}
+	startup_mark("dbus.connected");
+
+	ret = sd_bus_add_filter(dbusConnection, &filterSlot, on_message, NULL);
+	if (ret < 0) {
+		log_error("Failed to add D-Bus filter: %s", strerror(-ret));
+		return 1;
+	}
 
 	// Export the StatusNotifierItem interface
 	ret = sd_bus_add_object_vtable(dbusConnection, &dbusSlot,
@@ -82,57 +607,133 @@ int init_tray(void)
 				       tray_vtable, NULL);
 
 	if (ret < 0) {
-		fprintf(stderr, "Failed to export methods: %s\n",
+		log_error("Failed to export methods: %s",
 			strerror(-ret));
 		return 1;
 	}
 
-	// Request ownership of the StatusNotifier service
-	ret = sd_bus_request_name(dbusConnection, "org.knipser.Tray", 0);
+	// Export the capture statistics next to the tray item
+	ret = sd_bus_add_object_vtable(dbusConnection, &statsSlot,
+				       "/knipser/tray", "org.knipser.Stats",
+				       stats_vtable, NULL);
 	if (ret < 0) {
-		fprintf(stderr, "Failed to acquire D-Bus name: %s\n",
+		log_error("Failed to export statistics: %s",
 			strerror(-ret));
 		return 1;
 	}
 
-	// Notify the StatusNotifierWatcher
-	ret = sd_bus_call_method(dbusConnection,
-				 "org.kde.StatusNotifierWatcher", // Destination
-				 "/StatusNotifierWatcher", // Path
-				 "org.kde.StatusNotifierWatcher", // Interface
-				 "RegisterStatusNotifierItem", // Method
-				 NULL, NULL, "s", "/knipser/tray");
-	if (ret < 0) {
-		fprintf(stderr,
-			"Failed to register with StatusNotifierWatcher: %s\n",
+	ret = sd_bus_add_object_vtable(dbusConnection, &traceSlot,
+				       "/knipser/tray", "org.knipser.Trace",
+				       trace_vtable, NULL);
+	if (ret < 0) {
+		log_error("Failed to export tracing: %s",
 			strerror(-ret));
 		return 1;
 	}
 
-	while (1) {
-		sd_bus_wait(dbusConnection, 2000);
-		int ret = sd_bus_process(dbusConnection, NULL);
-		if (ret < 0) {
-			fprintf(stderr, "Error processing bus: %s (errno %d)\n",
-				strerror(-ret), -ret);
-			return -1;
-		} else if (ret == 0) {
-			break;
-		}
+	ret = sd_bus_add_object_vtable(dbusConnection, &captureSlot,
+				       "/knipser/tray", "org.knipser.Capture",
+				       capture_vtable, NULL);
+	if (ret < 0) {
+		log_error("Failed to export capture methods: %s",
+			strerror(-ret));
+		return 1;
+	}
+
+	// Request the name and register with the watcher without waiting for
+	// either reply, the main loop handles them alongside Wayland startup
+	ret = sd_bus_request_name_async(dbusConnection, NULL,
+					"org.knipser.Tray", 0, on_name_acquired,
+					NULL);
+	if (ret < 0) {
+		log_error("Failed to acquire D-Bus name: %s",
+			strerror(-ret));
+		return 1;
+	}
+
+	// Register again whenever a (new) watcher appears on the bus, and
+	// notice frame ring subscribers leaving
+	ret = sd_bus_match_signal_async(dbusConnection, &watcherSlot,
+					"org.freedesktop.DBus",
+					"/org/freedesktop/DBus",
+					"org.freedesktop.DBus",
+					"NameOwnerChanged",
+					on_name_owner_changed,
+					NULL, NULL);
+	if (ret < 0) {
+		log_warn("Failed to watch for StatusNotifierWatcher: %s",
+			 strerror(-ret));
 	}
 
-	printf("SNI tray icon running...\n");
+	ret = register_item();
+	if (ret < 0) {
+		return 1;
+	}
+
+	ret = sd_bus_flush(dbusConnection);
+	if (ret < 0) {
+		log_error("Failed to flush D-Bus connection: %s",
+			strerror(-ret));
+		return 1;
+	}
 	return 0;
 }
 
-void handle_sd_process()
+// Returns the poll timeout in milliseconds, or -1 without a pending timeout
+int tray_prepare_poll(struct pollfd *pfd)
 {
-	if ((dbusConnection != NULL) && sd_bus_is_open(dbusConnection)) {
-		while (1) {
-			sd_bus_wait(dbusConnection, UINT64_MAX);
-			sd_bus_process(dbusConnection, NULL);
-		}
+	pfd->fd = sd_bus_get_fd(dbusConnection);
+	pfd->events = sd_bus_get_events(dbusConnection);
+
+	uint64_t until;
+	if (sd_bus_get_timeout(dbusConnection, &until) < 0 ||
+	    until == UINT64_MAX) {
+		return -1;
+	}
+	uint64_t now = stats_now() / 1000;
+	return until > now ? (int)((until - now + 999) / 1000) : 0;
+}
+
+// Process everything that is queued, without blocking
+int tray_dispatch(void)
+{
+	int ret;
+	do {
+		ret = sd_bus_process(dbusConnection, NULL);
+	} while (ret > 0);
+
+	if (ret < 0) {
+		log_error("Error processing bus: %s (errno %d)",
+			strerror(-ret), -ret);
+		return -1;
+	}
+	return 0;
+}
+
+// Ready once the name is ours and the watcher has answered
+bool tray_ready(void)
+{
+	return name_acquired && item_registered;
+}
+
+bool tray_take_activity(void)
+{
+	bool activity = had_activity;
+	had_activity = false;
+	return activity;
+}
+
+// Give up the name, so the next call activates a new instance
+int tray_release_name(void)
+{
+	int ret = sd_bus_release_name(dbusConnection, "org.knipser.Tray");
+	if (ret < 0) {
+		log_error("Failed to release D-Bus name: %s", strerror(-ret));
+		return -1;
 	}
+
+	// Calls sent before the release are already queued, answer them
+	return tray_dispatch();
 }
 
 void deinit_tray(void)
@@ -142,6 +743,20 @@ void deinit_tray(void)
 		sd_bus_slot_unref(dbusSlot);
 		dbusSlot = NULL;
 	}
+	if (statsSlot) {
+		sd_bus_slot_unref(statsSlot);
+		statsSlot = NULL;
+	}
+	if (traceSlot) {
+		sd_bus_slot_unref(traceSlot);
+		traceSlot = NULL;
+	}
+	if (captureSlot) {
+		sd_bus_slot_unref(captureSlot);
+		captureSlot = NULL;
+	}
+	watcherSlot = sd_bus_slot_unref(watcherSlot);
+	filterSlot = sd_bus_slot_unref(filterSlot);
 
 	// Close and unref the D-Bus connection if it exists
 	if (dbusConnection && sd_bus_is_open(dbusConnection)) {
@@ -151,5 +766,5 @@ void deinit_tray(void)
 		dbusConnection = NULL;
 	}
 
-	printf("Tray icon cleaned up.\n");
+	log_info("Tray icon cleaned up.");
 }
\ No newline at end of file
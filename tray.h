@@ -1,12 +1,21 @@
 #ifndef _TRAY_H_
 #define _TRAY_H_
 
+#include <poll.h>
+#include <stdbool.h>
 #include <systemd/sd-bus.h>
 
 extern const sd_bus_vtable tray_vtable[];
+extern const sd_bus_vtable stats_vtable[];
+extern const sd_bus_vtable trace_vtable[];
+extern const sd_bus_vtable capture_vtable[];
 
 int init_tray(void);
-void handle_sd_process(void);
+int tray_prepare_poll(struct pollfd *pfd);
+int tray_dispatch(void);
+bool tray_ready(void);
+bool tray_take_activity(void);
+int tray_release_name(void);
 void deinit_tray(void);
 
 #endif /* _TRAY_H_ */
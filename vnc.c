@@ -0,0 +1,1415 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <zlib.h>
+
+#include "image.h"
+#include "knipser.h"
+#include "layout.h"
+#include "local.h"
+#include "log.h"
+#include "queue.h"
+#include "shm.h"
+#include "stats.h"
+#include "trace.h"
+#include "transform.h"
+#include "vnc.h"
+#include "wayland.h"
+
+/*
+ * Frames are captured with damage, so the compositor only copies once the
+ * output changes, and into whichever of two buffers no update is being
+ * encoded from. The damage is added to every client's dirty rectangle. A
+ * client that asked for an update and took the last one gets the dirty
+ * part of the newest frame, converted to its pixel format and encoded by a
+ * worker. Work and bandwidth follow what changes on screen, not its size,
+ * and a slow client gets fewer, larger updates instead of a backlog.
+ */
+#define VNC_MAX_CLIENTS (VNC_MAX_FDS - 3)
+#define VNC_THREADS 2
+#define VNC_MAX_MESSAGE 1024 // Room for SetEncodings with 255 encodings
+#define VNC_TILE 64 // ZRLE tiles are at most this many pixels square
+#define VNC_ZLIB_LEVEL 1 // ZRLE's own packing does most of the work
+
+enum rfb_message {
+	RFB_SET_PIXEL_FORMAT = 0,
+	RFB_SET_ENCODINGS = 2,
+	RFB_UPDATE_REQUEST = 3,
+	RFB_KEY_EVENT = 4,
+	RFB_POINTER_EVENT = 5,
+	RFB_CUT_TEXT = 6,
+};
+
+enum rfb_encoding {
+	RFB_ENCODING_RAW = 0,
+	RFB_ENCODING_ZRLE = 16,
+	RFB_ENCODING_DESKTOP_SIZE = -223,
+};
+
+struct vnc_pixel_format {
+	uint8_t bpp;
+	uint8_t depth;
+	bool big_endian;
+	bool true_colour;
+	uint16_t red_max, green_max, blue_max;
+	uint8_t red_shift, green_shift, blue_shift;
+};
+
+// What ServerInit announces, viewers usually keep it
+static const struct vnc_pixel_format server_format = {
+	.bpp = 32,
+	.depth = 24,
+	.true_colour = true,
+	.red_max = 255,
+	.green_max = 255,
+	.blue_max = 255,
+	.red_shift = 16,
+	.green_shift = 8,
+	.blue_shift = 0,
+};
+
+// A captured frame, freed once it is neither front, spare nor encoded from
+struct vnc_frame {
+	struct shm_mapping mapping;
+	struct canvas_output frame;
+	int refs;
+};
+
+enum vnc_state {
+	VNC_VERSION, // Waiting for ProtocolVersion
+	VNC_SECURITY, // For the security type
+	VNC_INIT, // For ClientInit
+	VNC_WAIT_FRAME, // For a frame to describe in ServerInit
+	VNC_READY,
+};
+
+struct vnc_client {
+	int fd; // -1 once closed
+	bool encoding; // An update is with the workers, which keeps the slot taken
+	enum vnc_state state;
+	int minor; // Protocol version 3.minor
+	uint8_t in[VNC_MAX_MESSAGE];
+	size_t in_len;
+	uint32_t skip; // Cut text still to be ignored
+	struct vnc_pixel_format format;
+	int32_t encoding_type; // Raw or ZRLE
+	bool desktop_size; // Follows resolution changes
+	bool wants_update;
+	struct capture_rect dirty; // Upright, not sent yet
+	int width, height; // Of the framebuffer as the client knows it
+	uint64_t last_update_ns;
+	z_stream zlib; // One stream for the connection, only used by workers
+	bool zlib_ready;
+	uint8_t *out;
+	size_t out_len, out_sent, out_size;
+};
+
+struct vnc_buffer {
+	uint8_t *data;
+	size_t len, capacity;
+};
+
+// One FramebufferUpdate, encoded by a worker and sent by the D-Bus thread
+struct vnc_update {
+	struct vnc_client *client;
+	struct vnc_frame *frame;
+	struct capture_rect rect; // Upright
+	bool resize;
+	struct vnc_pixel_format format;
+	int32_t encoding_type;
+	struct vnc_buffer message;
+	int result;
+};
+
+// Pixel values for 8-bit intensities, and how ZRLE packs them
+struct vnc_converter {
+	uint32_t red[256], green[256], blue[256];
+	int bytes;
+	bool big_endian;
+	int cpixel_bytes, cpixel_offset;
+};
+
+struct zrle_palette {
+	uint32_t colours[127];
+	int size; // -1 once there were too many colours
+	int8_t slots[256];
+};
+
+static struct local_socket server = { .fd = -1 };
+static int timer_fd = -1;
+static char output_name[64]; // Empty for the output at the origin
+static uint64_t interval_ns = 33333333; // 30 updates per second per client
+static struct vnc_client clients[VNC_MAX_CLIENTS];
+static int num_clients = 0;
+static struct vnc_frame *front = NULL; // The newest frame
+static struct vnc_frame *spare = NULL; // Captured into next
+static bool in_flight = false;
+static bool stopped = false;
+
+static struct queue updates; // To the workers
+static struct queue encoded; // Back to the D-Bus thread
+static pthread_t threads[VNC_THREADS];
+static int num_threads = 0;
+static atomic_bool stopping = false;
+
+static void put16(uint8_t *p, uint16_t value)
+{
+	p[0] = value >> 8;
+	p[1] = value;
+}
+
+static void put32(uint8_t *p, uint32_t value)
+{
+	p[0] = value >> 24;
+	p[1] = value >> 16;
+	p[2] = value >> 8;
+	p[3] = value;
+}
+
+static uint16_t get16(const uint8_t *p)
+{
+	return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+	       (uint32_t)p[2] << 8 | p[3];
+}
+
+// Room for size more bytes at the end, NULL if there is no memory for them
+static uint8_t *buffer_grow(struct vnc_buffer *buffer, size_t size)
+{
+	if (buffer->len + size > buffer->capacity) {
+		size_t capacity = buffer->capacity * 2;
+		if (capacity < buffer->len + size) {
+			capacity = buffer->len + size + 4096;
+		}
+		uint8_t *data = realloc(buffer->data, capacity);
+		if (data == NULL) {
+			return NULL;
+		}
+		buffer->data = data;
+		buffer->capacity = capacity;
+	}
+	uint8_t *p = buffer->data + buffer->len;
+	buffer->len += size;
+	return p;
+}
+
+static void init_converter(struct vnc_converter *conv,
+			   const struct vnc_pixel_format *format)
+{
+	for (int i = 0; i < 256; i++) {
+		conv->red[i] = (uint32_t)((i * format->red_max + 127) / 255)
+			       << format->red_shift;
+		conv->green[i] = (uint32_t)((i * format->green_max + 127) / 255)
+				 << format->green_shift;
+		conv->blue[i] = (uint32_t)((i * format->blue_max + 127) / 255)
+				<< format->blue_shift;
+	}
+	conv->bytes = format->bpp / 8;
+	conv->big_endian = format->big_endian;
+
+	// 32-bit pixels whose colour fits in three of their bytes are sent as those three
+	uint32_t mask = conv->red[255] | conv->green[255] | conv->blue[255];
+	conv->cpixel_bytes = conv->bytes;
+	conv->cpixel_offset = 0;
+	if (format->bpp == 32 && format->depth <= 24) {
+		if ((mask & 0xff000000) == 0) {
+			conv->cpixel_bytes = 3;
+			conv->cpixel_offset = format->big_endian ? 1 : 0;
+		} else if ((mask & 0xff) == 0) {
+			conv->cpixel_bytes = 3;
+			conv->cpixel_offset = format->big_endian ? 0 : 1;
+		}
+	}
+}
+
+static uint8_t *put_pixel(const struct vnc_converter *conv, uint8_t *p,
+			  uint32_t value)
+{
+	for (int i = 0; i < conv->bytes; i++) {
+		p[conv->big_endian ? conv->bytes - 1 - i : i] = value >> (8 * i);
+	}
+	return p + conv->bytes;
+}
+
+static uint8_t *put_cpixel(const struct vnc_converter *conv, uint8_t *p,
+			   uint32_t value)
+{
+	uint8_t full[4];
+	put_pixel(conv, full, value);
+	memcpy(p, full + conv->cpixel_offset, conv->cpixel_bytes);
+	return p + conv->cpixel_bytes;
+}
+
+// Inverse of each transform, for mapping buffer coordinates to upright ones
+static const enum wl_output_transform inverse_transforms[] = {
+	[WL_OUTPUT_TRANSFORM_NORMAL] = WL_OUTPUT_TRANSFORM_NORMAL,
+	[WL_OUTPUT_TRANSFORM_90] = WL_OUTPUT_TRANSFORM_270,
+	[WL_OUTPUT_TRANSFORM_180] = WL_OUTPUT_TRANSFORM_180,
+	[WL_OUTPUT_TRANSFORM_270] = WL_OUTPUT_TRANSFORM_90,
+	[WL_OUTPUT_TRANSFORM_FLIPPED] = WL_OUTPUT_TRANSFORM_FLIPPED,
+	[WL_OUTPUT_TRANSFORM_FLIPPED_90] = WL_OUTPUT_TRANSFORM_FLIPPED_90,
+	[WL_OUTPUT_TRANSFORM_FLIPPED_180] = WL_OUTPUT_TRANSFORM_FLIPPED_180,
+	[WL_OUTPUT_TRANSFORM_FLIPPED_270] = WL_OUTPUT_TRANSFORM_FLIPPED_270,
+};
+
+// Damage is reported in buffer coordinates, clients see the upright frame
+static struct capture_rect upright_rect(const struct canvas_output *frame,
+					struct capture_rect rect)
+{
+	int32_t x1 = rect.x + rect.width, y1 = rect.y + rect.height;
+	rect.x = rect.x < 0 ? 0 : rect.x;
+	rect.y = rect.y < 0 ? 0 : rect.y;
+	rect.width = (x1 > frame->width ? frame->width : x1) - rect.x;
+	rect.height = (y1 > frame->height ? frame->height : y1) - rect.y;
+	if (rect.width <= 0 || rect.height <= 0) {
+		return (struct capture_rect){ 0 };
+	}
+	if (frame->y_invert) {
+		rect.y = frame->height - rect.y - rect.height;
+	}
+
+	enum wl_output_transform inverse =
+		inverse_transforms[frame->transform & 7];
+	int u0, v0, u1, v1;
+	transform_coords(inverse, frame->width, frame->height, rect.x, rect.y,
+			 &u0, &v0);
+	transform_coords(inverse, frame->width, frame->height,
+			 rect.x + rect.width - 1, rect.y + rect.height - 1, &u1,
+			 &v1);
+	return (struct capture_rect){
+		.x = u0 < u1 ? u0 : u1,
+		.y = v0 < v1 ? v0 : v1,
+		.width = abs(u1 - u0) + 1,
+		.height = abs(v1 - v0) + 1,
+	};
+}
+
+// The upright pixels of rect as 8-bit RGBA, gather holds a row of the buffer's pixels
+static void read_rect(const struct canvas_output *frame,
+		      const struct capture_rect *rect, uint32_t *rgba,
+		      uint8_t *gather)
+{
+	int bpp = image_format_bpp(frame->format);
+	int width, height;
+	transform_size(frame->transform, frame->width, frame->height, &width,
+		       &height);
+
+	for (int v = 0; v < rect->height; v++) {
+		uint32_t *dst = rgba + (size_t)v * rect->width;
+		if (frame->transform == WL_OUTPUT_TRANSFORM_NORMAL) {
+			int y = rect->y + v;
+			if (frame->y_invert) {
+				y = frame->height - y - 1;
+			}
+			image_convert_row(frame->format, dst,
+					  (const uint8_t *)frame->data +
+						  (size_t)y * frame->stride +
+						  (size_t)rect->x * bpp,
+					  rect->width);
+			continue;
+		}
+
+		for (int u = 0; u < rect->width; u++) {
+			int x, y;
+			transform_coords(frame->transform, width, height,
+					 rect->x + u, rect->y + v, &x, &y);
+			if (frame->y_invert) {
+				y = frame->height - y - 1;
+			}
+			memcpy(gather + (size_t)u * bpp,
+			       (const uint8_t *)frame->data +
+				       (size_t)y * frame->stride +
+				       (size_t)x * bpp,
+			       bpp);
+		}
+		image_convert_row(frame->format, dst, gather, rect->width);
+	}
+}
+
+// Index of value in the palette, adding it if there is room, or -1
+static int palette_index(struct zrle_palette *palette, uint32_t value)
+{
+	unsigned slot = (value * 2654435761u) >> 24;
+	while (palette->slots[slot] >= 0) {
+		if (palette->colours[palette->slots[slot]] == value) {
+			return palette->slots[slot];
+		}
+		slot = (slot + 1) & 255;
+	}
+	if (palette->size < 0 || palette->size == 127) {
+		palette->size = -1;
+		return -1;
+	}
+	palette->slots[slot] = palette->size;
+	palette->colours[palette->size] = value;
+	return palette->size++;
+}
+
+// Bytes ZRLE needs for a run of length pixels
+static size_t run_bytes(size_t length)
+{
+	return (length - 1) / 255 + 1;
+}
+
+static uint8_t *put_run(uint8_t *p, size_t length)
+{
+	for (length--; length >= 255; length -= 255) {
+		*p++ = 255;
+	}
+	*p++ = length;
+	return p;
+}
+
+/*
+ * Encode one tile of pixel values in whichever ZRLE subencoding comes out
+ * smallest, which is never more than raw. Runs are counted once and the
+ * palette is built from them, so a tile is only looked at twice.
+ */
+static uint8_t *zrle_tile(const struct vnc_converter *conv,
+			  const uint32_t *pixels, int width, int height,
+			  uint8_t *p)
+{
+	int n = width * height;
+	int cpixel = conv->cpixel_bytes;
+	struct zrle_palette palette = { .size = 0 };
+	memset(palette.slots, -1, sizeof(palette.slots));
+
+	size_t runs = 0, length_bytes = 0, single_runs = 0;
+	for (int i = 0; i < n;) {
+		int j = i + 1;
+		while (j < n && pixels[j] == pixels[i]) {
+			j++;
+		}
+		runs++;
+		length_bytes += run_bytes(j - i);
+		single_runs += j - i == 1;
+		if (palette.size >= 0) {
+			palette_index(&palette, pixels[i]);
+		}
+		i = j;
+	}
+
+	if (palette.size == 1) {
+		*p++ = 1;
+		return put_cpixel(conv, p, pixels[0]);
+	}
+
+	int mode = 0; // Raw
+	size_t best = (size_t)n * cpixel;
+	int bits = 0;
+	if (runs * cpixel + length_bytes < best) {
+		mode = 128;
+		best = runs * cpixel + length_bytes;
+	}
+	if (palette.size > 1) {
+		size_t palette_rle = palette.size * cpixel + runs + length_bytes -
+				     single_runs;
+		if (palette_rle < best) {
+			mode = 128 + palette.size;
+			best = palette_rle;
+		}
+		if (palette.size <= 16) {
+			int packed_bits = palette.size <= 2 ? 1 :
+					  palette.size <= 4 ? 2 : 4;
+			size_t packed = palette.size * cpixel +
+					(size_t)height *
+						((width * packed_bits + 7) / 8);
+			if (packed < best) {
+				mode = palette.size;
+				bits = packed_bits;
+			}
+		}
+	}
+
+	*p++ = mode;
+	if (mode == 0) {
+		for (int i = 0; i < n; i++) {
+			p = put_cpixel(conv, p, pixels[i]);
+		}
+		return p;
+	}
+	if (mode == 128) {
+		for (int i = 0; i < n;) {
+			int j = i + 1;
+			while (j < n && pixels[j] == pixels[i]) {
+				j++;
+			}
+			p = put_cpixel(conv, p, pixels[i]);
+			p = put_run(p, j - i);
+			i = j;
+		}
+		return p;
+	}
+
+	for (int i = 0; i < palette.size; i++) {
+		p = put_cpixel(conv, p, palette.colours[i]);
+	}
+	if (mode > 128) {
+		for (int i = 0; i < n;) {
+			int j = i + 1;
+			while (j < n && pixels[j] == pixels[i]) {
+				j++;
+			}
+			int index = palette_index(&palette, pixels[i]);
+			if (j - i == 1) {
+				*p++ = index;
+			} else {
+				*p++ = index | 128;
+				p = put_run(p, j - i);
+			}
+			i = j;
+		}
+		return p;
+	}
+
+	// Packed palette, most significant bits first and every row padded to a byte
+	for (int y = 0; y < height; y++) {
+		unsigned byte = 0, used = 0;
+		for (int x = 0; x < width; x++) {
+			byte = byte << bits |
+			       palette_index(&palette, pixels[y * width + x]);
+			used += bits;
+			if (used == 8) {
+				*p++ = byte;
+				byte = used = 0;
+			}
+		}
+		if (used > 0) {
+			*p++ = byte << (8 - used);
+		}
+	}
+	return p;
+}
+
+// Compressed with the connection's zlib stream and prefixed by its length
+static int zrle_compress(z_stream *zlib, const struct vnc_buffer *raw,
+			 struct vnc_buffer *out)
+{
+	size_t start = out->len;
+	if (buffer_grow(out, 4) == NULL) {
+		return -1;
+	}
+	zlib->next_in = raw->data;
+	zlib->avail_in = raw->len;
+	do {
+		size_t room = deflateBound(zlib, zlib->avail_in) + 64;
+		uint8_t *p = buffer_grow(out, room);
+		if (p == NULL) {
+			return -1;
+		}
+		zlib->next_out = p;
+		zlib->avail_out = room;
+		if (deflate(zlib, Z_SYNC_FLUSH) == Z_STREAM_ERROR) {
+			return -1;
+		}
+		out->len -= zlib->avail_out;
+	} while (zlib->avail_out == 0);
+	put32(out->data + start, out->len - start - 4);
+	return 0;
+}
+
+static int encode_zrle(struct vnc_client *client,
+		       const struct vnc_converter *conv, const uint32_t *pixels,
+		       const struct capture_rect *rect, struct vnc_buffer *out)
+{
+	if (!client->zlib_ready) {
+		if (deflateInit(&client->zlib, VNC_ZLIB_LEVEL) != Z_OK) {
+			return -1;
+		}
+		client->zlib_ready = true;
+	}
+
+	struct vnc_buffer raw = { 0 };
+	uint32_t tile[VNC_TILE * VNC_TILE];
+	int ret = 0;
+	for (int y = 0; y < rect->height && ret == 0; y += VNC_TILE) {
+		int height = rect->height - y < VNC_TILE ? rect->height - y :
+							    VNC_TILE;
+		for (int x = 0; x < rect->width; x += VNC_TILE) {
+			int width = rect->width - x < VNC_TILE ? rect->width - x :
+								  VNC_TILE;
+			for (int row = 0; row < height; row++) {
+				memcpy(tile + row * width,
+				       pixels + (size_t)(y + row) * rect->width + x,
+				       width * sizeof(*tile));
+			}
+			size_t worst = 1 + (size_t)width * height *
+						   conv->cpixel_bytes;
+			uint8_t *p = buffer_grow(&raw, worst);
+			if (p == NULL) {
+				ret = -1;
+				break;
+			}
+			uint8_t *end = zrle_tile(conv, tile, width, height, p);
+			raw.len -= worst - (end - p);
+		}
+	}
+	if (ret == 0) {
+		ret = zrle_compress(&client->zlib, &raw, out);
+	}
+	free(raw.data);
+	return ret;
+}
+
+static int encode_update(struct vnc_update *update)
+{
+	const struct capture_rect *rect = &update->rect;
+	const struct canvas_output *frame = &update->frame->frame;
+	struct vnc_buffer *out = &update->message;
+	bool has_rect = rect->width > 0 && rect->height > 0;
+
+	uint8_t *header = buffer_grow(out, 4);
+	if (header == NULL) {
+		return -1;
+	}
+	header[0] = 0; // FramebufferUpdate
+	header[1] = 0;
+	put16(header + 2, update->resize + has_rect);
+
+	if (update->resize) {
+		int width, height;
+		transform_size(frame->transform, frame->width, frame->height,
+			       &width, &height);
+		uint8_t *p = buffer_grow(out, 12);
+		if (p == NULL) {
+			return -1;
+		}
+		put16(p, 0);
+		put16(p + 2, 0);
+		put16(p + 4, width);
+		put16(p + 6, height);
+		put32(p + 8, (uint32_t)RFB_ENCODING_DESKTOP_SIZE);
+	}
+	if (!has_rect) {
+		return 0;
+	}
+
+	size_t count = (size_t)rect->width * rect->height;
+	uint32_t *pixels = malloc(count * sizeof(*pixels));
+	uint8_t *gather = malloc((size_t)rect->width * 8);
+	int ret = -1;
+	if (pixels == NULL || gather == NULL) {
+		goto out;
+	}
+
+	// Converted in place, from RGBA bytes to the client's pixel values
+	read_rect(frame, rect, pixels, gather);
+	struct vnc_converter conv;
+	init_converter(&conv, &update->format);
+	for (size_t i = 0; i < count; i++) {
+		const uint8_t *rgba = (const uint8_t *)&pixels[i];
+		pixels[i] = conv.red[rgba[0]] | conv.green[rgba[1]] |
+			    conv.blue[rgba[2]];
+	}
+
+	uint8_t *p = buffer_grow(out, 12);
+	if (p == NULL) {
+		goto out;
+	}
+	put16(p, rect->x);
+	put16(p + 2, rect->y);
+	put16(p + 4, rect->width);
+	put16(p + 6, rect->height);
+	put32(p + 8, (uint32_t)update->encoding_type);
+
+	if (update->encoding_type == RFB_ENCODING_ZRLE) {
+		ret = encode_zrle(update->client, &conv, pixels, rect, out);
+	} else if ((p = buffer_grow(out, count * conv.bytes)) != NULL) {
+		for (size_t i = 0; i < count; i++) {
+			p = put_pixel(&conv, p, pixels[i]);
+		}
+		ret = 0;
+	}
+
+out:
+	free(pixels);
+	free(gather);
+	return ret;
+}
+
+static void *worker_main(void *data)
+{
+	trace_set_thread_name("vnc");
+	while (1) {
+		struct vnc_update *update = queue_wait(&updates);
+		if (update == NULL) {
+			if (atomic_load(&stopping)) {
+				break;
+			}
+			continue;
+		}
+
+		uint64_t span = trace_begin();
+		update->result = encode_update(update);
+		trace_end("vnc", "update", span);
+
+		// Never full, every client has at most one update out
+		queue_push(&encoded, update);
+	}
+	return NULL;
+}
+
+static struct vnc_frame *create_frame(size_t size)
+{
+	struct vnc_frame *frame = calloc(1, sizeof(*frame));
+	if (frame == NULL) {
+		return NULL;
+	}
+	if (shm_mapping_create(&frame->mapping, size, false) < 0) {
+		free(frame);
+		return NULL;
+	}
+	frame->refs = 1;
+	return frame;
+}
+
+static void frame_unref(struct vnc_frame *frame)
+{
+	if (frame != NULL && --frame->refs == 0) {
+		shm_mapping_destroy(&frame->mapping);
+		free(frame);
+	}
+}
+
+static void set_timer(bool running)
+{
+	struct itimerspec spec = { 0 };
+	if (running) {
+		spec.it_interval.tv_sec = interval_ns / 1000000000ULL;
+		spec.it_interval.tv_nsec = interval_ns % 1000000000ULL;
+		spec.it_value = spec.it_interval;
+	}
+	timerfd_settime(timer_fd, 0, &spec, NULL);
+}
+
+static void free_client(struct vnc_client *client)
+{
+	if (client->zlib_ready) {
+		deflateEnd(&client->zlib);
+		client->zlib_ready = false;
+	}
+	free(client->out);
+	client->out = NULL;
+	client->out_len = client->out_sent = client->out_size = 0;
+}
+
+// A client with an update out is freed once the update comes back
+static void close_client(struct vnc_client *client)
+{
+	if (client->fd < 0) {
+		return;
+	}
+	close(client->fd);
+	client->fd = -1;
+	if (!client->encoding) {
+		free_client(client);
+	}
+	if (--num_clients == 0) {
+		set_timer(false);
+	}
+}
+
+static void queue_output(struct vnc_client *client, const void *data,
+			 size_t size)
+{
+	if (client->out_sent == client->out_len) {
+		client->out_len = client->out_sent = 0;
+	}
+	if (client->out_len + size > client->out_size) {
+		size_t out_size = client->out_len + size + 256;
+		uint8_t *out = realloc(client->out, out_size);
+		if (out == NULL) {
+			close_client(client);
+			return;
+		}
+		client->out = out;
+		client->out_size = out_size;
+	}
+	memcpy(client->out + client->out_len, data, size);
+	client->out_len += size;
+}
+
+static void get_size(const struct vnc_frame *frame, int *width, int *height)
+{
+	transform_size(frame->frame.transform, frame->frame.width,
+		       frame->frame.height, width, height);
+}
+
+static void send_server_init(struct vnc_client *client)
+{
+	get_size(front, &client->width, &client->height);
+	client->dirty = (struct capture_rect){ 0, 0, client->width,
+					       client->height };
+
+	char name[80];
+	int name_len = output_name[0] != '\0' ?
+			       snprintf(name, sizeof(name), "knipser %s",
+					output_name) :
+			       snprintf(name, sizeof(name), "knipser");
+	if (name_len >= (int)sizeof(name)) {
+		name_len = sizeof(name) - 1;
+	}
+
+	const struct vnc_pixel_format *f = &server_format;
+	uint8_t msg[24 + sizeof(name)] = { 0 };
+	put16(msg, client->width);
+	put16(msg + 2, client->height);
+	msg[4] = f->bpp;
+	msg[5] = f->depth;
+	msg[6] = f->big_endian;
+	msg[7] = f->true_colour;
+	put16(msg + 8, f->red_max);
+	put16(msg + 10, f->green_max);
+	put16(msg + 12, f->blue_max);
+	msg[14] = f->red_shift;
+	msg[15] = f->green_shift;
+	msg[16] = f->blue_shift;
+	put32(msg + 20, name_len);
+	memcpy(msg + 24, name, name_len);
+	queue_output(client, msg, 24 + name_len);
+	client->state = VNC_READY;
+}
+
+// Hand the dirty part of the newest frame to a worker, paced per client
+static void update_client(struct vnc_client *client)
+{
+	if (client->fd < 0 || front == NULL) {
+		return;
+	}
+	if (client->state == VNC_WAIT_FRAME) {
+		send_server_init(client);
+	}
+	if (client->state != VNC_READY || !client->wants_update ||
+	    client->encoding || client->out_sent < client->out_len) {
+		return;
+	}
+
+	int width, height;
+	get_size(front, &width, &height);
+	bool resize = width != client->width || height != client->height;
+	if (resize && !client->desktop_size) {
+		log_info("VNC client can't follow a resolution change");
+		close_client(client);
+		return;
+	}
+	struct capture_rect rect = resize ? (struct capture_rect){ 0, 0, width,
+								    height } :
+					    client->dirty;
+	int32_t x1 = rect.x + rect.width, y1 = rect.y + rect.height;
+	rect.width = (x1 > width ? width : x1) - rect.x;
+	rect.height = (y1 > height ? height : y1) - rect.y;
+	if (!resize && (rect.width <= 0 || rect.height <= 0)) {
+		return;
+	}
+	uint64_t now = stats_now();
+	if (now - client->last_update_ns < interval_ns) {
+		return;
+	}
+
+	struct vnc_update *update = calloc(1, sizeof(*update));
+	if (update == NULL) {
+		return;
+	}
+	*update = (struct vnc_update){
+		.client = client,
+		.frame = front,
+		.rect = rect,
+		.resize = resize,
+		.format = client->format,
+		.encoding_type = client->encoding_type,
+	};
+	if (!queue_push(&updates, update)) {
+		free(update);
+		return;
+	}
+	front->refs++;
+	client->encoding = true;
+	client->wants_update = false;
+	client->dirty = (struct capture_rect){ 0 };
+	client->width = width;
+	client->height = height;
+	client->last_update_ns = now;
+}
+
+// Sends what the socket takes, and the next update once all is sent
+static void flush_client(struct vnc_client *client)
+{
+	while (client->out_sent < client->out_len) {
+		ssize_t sent = send(client->fd, client->out + client->out_sent,
+				    client->out_len - client->out_sent,
+				    MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (sent < 0 && errno == EINTR) {
+			continue;
+		}
+		if (sent < 0 && errno == EAGAIN) {
+			return;
+		}
+		if (sent <= 0) {
+			close_client(client);
+			return;
+		}
+		client->out_sent += sent;
+	}
+
+	// Large updates don't stay allocated while the screen is still
+	if (client->out_size > 65536) {
+		free(client->out);
+		client->out = NULL;
+		client->out_size = 0;
+	}
+	client->out_len = client->out_sent = 0;
+	update_client(client);
+}
+
+static void finish_updates(void)
+{
+	struct vnc_update *update;
+	queue_clear(&encoded);
+	while ((update = queue_pop(&encoded)) != NULL) {
+		struct vnc_client *client = update->client;
+		client->encoding = false;
+		frame_unref(update->frame);
+		if (client->fd < 0) {
+			free_client(client);
+		} else if (update->result < 0) {
+			log_error("Failed to encode VNC update");
+			close_client(client);
+		} else if (client->out_len == 0) {
+			// Sent straight from the worker's buffer
+			free(client->out);
+			client->out = update->message.data;
+			client->out_size = update->message.capacity;
+			client->out_len = update->message.len;
+			update->message.data = NULL;
+			flush_client(client);
+		} else {
+			queue_output(client, update->message.data,
+				     update->message.len);
+			flush_client(client);
+		}
+		free(update->message.data);
+		free(update);
+	}
+}
+
+static bool find_output(int32_t *x, int32_t *y)
+{
+	*x = 0;
+	*y = 0;
+	if (output_name[0] == '\0') {
+		return true;
+	}
+
+	const struct layout *layout = layout_acquire();
+	const struct layout_output *found = layout_find_name(layout, output_name);
+	if (found != NULL) {
+		*x = found->x;
+		*y = found->y;
+	}
+	layout_release(layout);
+	return found != NULL;
+}
+
+static void frame_complete(void *user, int result,
+			   const struct capture_job *job)
+{
+	in_flight = false;
+	if (result < 0 || job == NULL) {
+		// Failed, or gave way to another capture, the next tick tries again
+		return;
+	}
+
+	const struct canvas_output *captured = &job->frames[0];
+	struct capture_rect damage = job->damage;
+	if (job->mappings[0] != NULL) {
+		// The first frame, or one that didn't fit, came in a buffer of its own
+		size_t size = (size_t)captured->stride * captured->height;
+		struct vnc_frame *frame = create_frame(size);
+		if (frame == NULL) {
+			return;
+		}
+		memcpy(frame->mapping.data, captured->data, size);
+		frame->frame = *captured;
+		frame->frame.data = frame->mapping.data;
+		frame_unref(front);
+		frame_unref(spare);
+		front = frame;
+		spare = NULL;
+		damage = (struct capture_rect){ 0, 0, captured->width,
+						captured->height };
+	} else {
+		struct vnc_frame *frame = spare;
+		spare = front;
+		front = frame;
+		front->frame = *captured;
+	}
+
+	struct capture_rect rect = upright_rect(&front->frame, damage);
+	for (int i = 0; i < VNC_MAX_CLIENTS; i++) {
+		if (clients[i].fd >= 0) {
+			capture_rect_add(&clients[i].dirty, &rect);
+			update_client(&clients[i]);
+		}
+	}
+}
+
+// One capture at a time, into the spare frame once nothing is encoded from it
+static void start_capture(void)
+{
+	bool watched = false;
+	for (int i = 0; i < VNC_MAX_CLIENTS; i++) {
+		watched |= clients[i].fd >= 0 &&
+			   clients[i].state >= VNC_WAIT_FRAME;
+	}
+	int32_t x, y;
+	if (in_flight || stopped || !watched || !find_output(&x, &y)) {
+		return;
+	}
+
+	struct capture_target target = { 0 };
+	if (front != NULL) {
+		if (spare == NULL) {
+			spare = create_frame(front->mapping.size);
+		}
+		if (spare == NULL || spare->refs > 1) {
+			return;
+		}
+		target.mapping = &spare->mapping;
+		target.size = spare->mapping.size;
+	}
+
+	struct capture_waiter waiter = { frame_complete, NULL };
+	if (knipser_handle_vnc_capture(x, y, &target, waiter) < 0) {
+		return;
+	}
+	in_flight = true;
+}
+
+static bool read_pixel_format(struct vnc_pixel_format *format,
+			      const uint8_t *p)
+{
+	*format = (struct vnc_pixel_format){
+		.bpp = p[0],
+		.depth = p[1],
+		.big_endian = p[2] != 0,
+		.true_colour = p[3] != 0,
+		.red_max = get16(p + 4),
+		.green_max = get16(p + 6),
+		.blue_max = get16(p + 8),
+		.red_shift = p[10],
+		.green_shift = p[11],
+		.blue_shift = p[12],
+	};
+	return (format->bpp == 8 || format->bpp == 16 || format->bpp == 32) &&
+	       format->true_colour && format->red_shift < 32 &&
+	       format->green_shift < 32 && format->blue_shift < 32;
+}
+
+// Returns the bytes used, 0 until a whole message is there or once the client is closed
+static size_t handle_message(struct vnc_client *client)
+{
+	const uint8_t *in = client->in;
+	size_t len = client->in_len;
+	if (len == 0) {
+		return 0;
+	}
+
+	switch (in[0]) {
+	case RFB_SET_PIXEL_FORMAT:
+		if (len < 20) {
+			return 0;
+		}
+		if (!read_pixel_format(&client->format, in + 4)) {
+			log_warn("VNC client asked for an unsupported pixel format");
+			close_client(client);
+			return 0;
+		}
+		// What it has was sent in the old format
+		client->dirty = (struct capture_rect){ 0, 0, client->width,
+						       client->height };
+		return 20;
+	case RFB_SET_ENCODINGS: {
+		if (len < 4) {
+			return 0;
+		}
+		size_t size = 4 + (size_t)get16(in + 2) * 4;
+		if (size > sizeof(client->in)) {
+			log_warn("VNC client sent too many encodings");
+			close_client(client);
+			return 0;
+		}
+		if (len < size) {
+			return 0;
+		}
+		// The first of those we have, in the client's order of preference
+		bool chosen = false;
+		client->encoding_type = RFB_ENCODING_RAW;
+		client->desktop_size = false;
+		for (size_t i = 4; i < size; i += 4) {
+			int32_t type = (int32_t)get32(in + i);
+			if (!chosen && (type == RFB_ENCODING_RAW ||
+					type == RFB_ENCODING_ZRLE)) {
+				client->encoding_type = type;
+				chosen = true;
+			}
+			client->desktop_size |= type == RFB_ENCODING_DESKTOP_SIZE;
+		}
+		return size;
+	}
+	case RFB_UPDATE_REQUEST:
+		if (len < 10) {
+			return 0;
+		}
+		if (!in[1]) {
+			struct capture_rect rect = { get16(in + 2), get16(in + 4),
+						     get16(in + 6),
+						     get16(in + 8) };
+			capture_rect_add(&client->dirty, &rect);
+		}
+		client->wants_update = true;
+		update_client(client);
+		return 10;
+	case RFB_KEY_EVENT:
+		// Read-only, so input is read and dropped
+		return len < 8 ? 0 : 8;
+	case RFB_POINTER_EVENT:
+		return len < 6 ? 0 : 6;
+	case RFB_CUT_TEXT:
+		if (len < 8) {
+			return 0;
+		}
+		client->skip = get32(in + 4);
+		return 8;
+	default:
+		log_warn("Unknown VNC message type %u", in[0]);
+		close_client(client);
+		return 0;
+	}
+}
+
+// Version 3.8, and 3.7 and 3.3 for older viewers, all with security type None
+static size_t handle_handshake(struct vnc_client *client)
+{
+	const uint8_t *in = client->in;
+	size_t len = client->in_len;
+
+	switch (client->state) {
+	case VNC_VERSION: {
+		if (len < 12) {
+			return 0;
+		}
+		if (memcmp(in, "RFB 003.", 8) != 0 || in[11] != '\n' ||
+		    in[8] < '0' || in[8] > '9' || in[9] < '0' || in[9] > '9' ||
+		    in[10] < '0' || in[10] > '9') {
+			log_warn("VNC client doesn't speak RFB 3");
+			close_client(client);
+			return 0;
+		}
+		int minor = (in[8] - '0') * 100 + (in[9] - '0') * 10 +
+			    (in[10] - '0');
+		client->minor = minor >= 8 ? 8 : minor == 7 ? 7 : 3;
+		if (client->minor == 3) {
+			uint8_t none[4];
+			put32(none, 1);
+			queue_output(client, none, sizeof(none));
+			client->state = VNC_INIT;
+		} else {
+			uint8_t types[2] = { 1, 1 }; // One type, None
+			queue_output(client, types, sizeof(types));
+			client->state = VNC_SECURITY;
+		}
+		return 12;
+	}
+	case VNC_SECURITY:
+		if (len < 1) {
+			return 0;
+		}
+		if (in[0] != 1) {
+			close_client(client);
+			return 0;
+		}
+		if (client->minor == 8) {
+			uint8_t ok[4] = { 0 };
+			queue_output(client, ok, sizeof(ok));
+		}
+		client->state = VNC_INIT;
+		return 1;
+	case VNC_INIT:
+		// Shared or not, viewers never disconnect each other
+		if (len < 1) {
+			return 0;
+		}
+		client->state = VNC_WAIT_FRAME;
+		start_capture();
+		update_client(client);
+		return 1;
+	default:
+		// Nothing is expected before ServerInit
+		return 0;
+	}
+}
+
+static void read_client(struct vnc_client *client)
+{
+	ssize_t len = recv(client->fd, client->in + client->in_len,
+			   sizeof(client->in) - client->in_len, MSG_DONTWAIT);
+	if (len < 0 && (errno == EAGAIN || errno == EINTR)) {
+		return;
+	}
+	if (len <= 0) {
+		close_client(client);
+		return;
+	}
+	client->in_len += len;
+
+	while (client->fd >= 0 && client->in_len > 0) {
+		size_t used;
+		if (client->skip > 0) {
+			used = client->skip < client->in_len ? client->skip :
+							       client->in_len;
+			client->skip -= used;
+		} else if (client->state == VNC_READY) {
+			used = handle_message(client);
+		} else {
+			used = handle_handshake(client);
+		}
+		if (used == 0) {
+			break;
+		}
+		memmove(client->in, client->in + used, client->in_len - used);
+		client->in_len -= used;
+	}
+	if (client->fd >= 0 && client->in_len == sizeof(client->in)) {
+		log_warn("VNC client sent an oversized message");
+		close_client(client);
+	}
+	if (client->fd >= 0) {
+		flush_client(client);
+	}
+}
+
+static void accept_clients(void)
+{
+	int fd;
+	while ((fd = local_accept(&server)) >= 0) {
+		int i = 0;
+		while (i < VNC_MAX_CLIENTS &&
+		       (clients[i].fd >= 0 || clients[i].encoding)) {
+			i++;
+		}
+		if (i == VNC_MAX_CLIENTS) {
+			log_warn("Too many VNC clients");
+			close(fd);
+			continue;
+		}
+
+		clients[i] = (struct vnc_client){
+			.fd = fd,
+			.state = VNC_VERSION,
+			.format = server_format,
+			.encoding_type = RFB_ENCODING_RAW,
+		};
+		if (num_clients++ == 0) {
+			set_timer(true);
+		}
+		queue_output(&clients[i], "RFB 003.008\n", 12);
+		flush_client(&clients[i]);
+	}
+}
+
+/*
+ * KNIPSER_VNC=PORT, PATH or @NAME serves the output at the origin, or
+ * KNIPSER_VNC_OUTPUT=NAME, with at most KNIPSER_VNC_FPS updates per second
+ * to each client.
+ */
+int vnc_init(void)
+{
+	for (int i = 0; i < VNC_MAX_CLIENTS; i++) {
+		clients[i].fd = -1;
+	}
+
+	const char *env = getenv("KNIPSER_VNC");
+	if (env == NULL || env[0] == '\0') {
+		return 0;
+	}
+	const char *output_env = getenv("KNIPSER_VNC_OUTPUT");
+	if (output_env != NULL) {
+		snprintf(output_name, sizeof(output_name), "%s", output_env);
+	}
+	const char *fps_env = getenv("KNIPSER_VNC_FPS");
+	if (fps_env != NULL) {
+		int fps = atoi(fps_env);
+		if (fps >= 1 && fps <= 240) {
+			interval_ns = 1000000000ULL / fps;
+		} else {
+			log_warn("KNIPSER_VNC_FPS must be between 1 and 240");
+		}
+	}
+
+	timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (timer_fd < 0) {
+		log_error("Failed to create VNC timer: %s", strerror(errno));
+		return -1;
+	}
+	if (queue_init(&updates, VNC_MAX_CLIENTS, true) < 0) {
+		return -1;
+	}
+	if (queue_init(&encoded, VNC_MAX_CLIENTS, false) < 0) {
+		queue_finish(&updates);
+		return -1;
+	}
+	for (; num_threads < VNC_THREADS; num_threads++) {
+		if (pthread_create(&threads[num_threads], NULL, worker_main,
+				   NULL) != 0) {
+			break;
+		}
+	}
+	if (num_threads == 0) {
+		log_error("Failed to start VNC threads");
+		queue_finish(&updates);
+		queue_finish(&encoded);
+		return -1;
+	}
+
+	if (local_listen(&server, env, VNC_MAX_CLIENTS) < 0) {
+		return -1;
+	}
+	log_info("Serving VNC on %s", env);
+	return 0;
+}
+
+// Connected viewers keep an idle daemon alive
+bool vnc_active(void)
+{
+	return num_clients > 0;
+}
+
+int vnc_prepare_poll(struct pollfd *fds, int max)
+{
+	int count = 0;
+	if (server.fd >= 0 && count < max) {
+		fds[count++] = (struct pollfd){ .fd = server.fd, .events = POLLIN };
+	}
+	if (timer_fd >= 0 && count < max) {
+		fds[count++] = (struct pollfd){ .fd = timer_fd, .events = POLLIN };
+	}
+	if (num_threads > 0 && count < max) {
+		fds[count++] = (struct pollfd){ .fd = queue_fd(&encoded),
+						.events = POLLIN };
+	}
+	for (int i = 0; i < VNC_MAX_CLIENTS && count < max; i++) {
+		if (clients[i].fd >= 0) {
+			short events = POLLIN;
+			if (clients[i].out_sent < clients[i].out_len) {
+				events |= POLLOUT;
+			}
+			fds[count++] = (struct pollfd){ .fd = clients[i].fd,
+							.events = events };
+		}
+	}
+	return count;
+}
+
+// A tick starts the next capture and sends updates held back by pacing
+static void tick(void)
+{
+	uint64_t expirations;
+	if (read(timer_fd, &expirations, sizeof(expirations)) < 0) {
+		return;
+	}
+	start_capture();
+	for (int i = 0; i < VNC_MAX_CLIENTS; i++) {
+		update_client(&clients[i]);
+	}
+}
+
+void vnc_dispatch(const struct pollfd *fds, int count)
+{
+	for (int i = 0; i < count; i++) {
+		if (fds[i].revents == 0) {
+			continue;
+		}
+
+		if (fds[i].fd == server.fd) {
+			accept_clients();
+		} else if (fds[i].fd == timer_fd) {
+			tick();
+		} else if (num_threads > 0 && fds[i].fd == queue_fd(&encoded)) {
+			finish_updates();
+		} else {
+			for (int j = 0; j < VNC_MAX_CLIENTS; j++) {
+				struct vnc_client *client = &clients[j];
+				if (client->fd != fds[i].fd) {
+					continue;
+				}
+				if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+					read_client(client);
+				}
+				if (client->fd >= 0 && (fds[i].revents & POLLOUT)) {
+					flush_client(client);
+				}
+				break;
+			}
+		}
+	}
+}
+
+// Stop capturing and give up on a capture waiting for the screen to change
+void vnc_stop(void)
+{
+	if (server.fd < 0 || stopped) {
+		return;
+	}
+	stopped = true;
+	wayland_stop_waiting();
+}
+
+void vnc_deinit(void)
+{
+	for (int i = 0; i < VNC_MAX_CLIENTS; i++) {
+		close_client(&clients[i]);
+	}
+	if (num_threads > 0) {
+		atomic_store(&stopping, true);
+		for (int i = 0; i < num_threads; i++) {
+			queue_wake(&updates);
+		}
+		for (int i = 0; i < num_threads; i++) {
+			pthread_join(threads[i], NULL);
+		}
+		num_threads = 0;
+
+		struct vnc_update *update;
+		while ((update = queue_pop(&updates)) != NULL ||
+		       (update = queue_pop(&encoded)) != NULL) {
+			frame_unref(update->frame);
+			free(update->message.data);
+			free(update);
+		}
+		queue_finish(&updates);
+		queue_finish(&encoded);
+	}
+	for (int i = 0; i < VNC_MAX_CLIENTS; i++) {
+		clients[i].encoding = false;
+		free_client(&clients[i]);
+	}
+	frame_unref(front);
+	frame_unref(spare);
+	front = spare = NULL;
+	local_close(&server);
+	if (timer_fd >= 0) {
+		close(timer_fd);
+		timer_fd = -1;
+	}
+}
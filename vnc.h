@@ -0,0 +1,23 @@
+#ifndef _VNC_H_
+#define _VNC_H_
+
+#include <poll.h>
+#include <stdbool.h>
+
+/*
+ * Read-only RFB 3.8 (VNC) server. With KNIPSER_VNC set to a port on
+ * 127.0.0.1, the path of a UNIX socket or @NAME, viewers see the output at
+ * the origin, or output KNIPSER_VNC_OUTPUT, and their input is ignored.
+ * There is no authentication, the socket is only reachable from this
+ * machine. Updates are Raw or ZRLE, whichever the viewer prefers.
+ */
+#define VNC_MAX_FDS 11 // Listening socket, timer, encoded updates and clients
+
+int vnc_init(void);
+void vnc_deinit(void);
+bool vnc_active(void);
+int vnc_prepare_poll(struct pollfd *fds, int max);
+void vnc_dispatch(const struct pollfd *fds, int count);
+void vnc_stop(void);
+
+#endif /* _VNC_H_ */
@@ -27,15 +27,30 @@
 #include <string.h>
 #include <unistd.h>
 #include <assert.h>
-#include <png.h>
 #include <sys/mman.h>
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "canvas.h"
+#include "clipboard.h"
+#include "encoder.h"
+#include "image.h"
+#include "job.h"
+#include "knipser.h"
+#include "layout.h"
+#include "log.h"
+#include "queue.h"
+#include "shm.h"
+#include "startup.h"
+#include "stats.h"
+#include "trace.h"
+#include "transform.h"
 #include "wayland-protocols/wlr-screencopy-unstable-v1-client-protocol.h"
 #include "wayland-protocols/wlr-output-management-unstable-v1-client-protocol.h"
-
-#define MAX_NUM_WAYLAND_DISPLAYS 64
+#include "wayland-protocols/wlr-data-control-unstable-v1-client-protocol.h"
 
 // Forward declarations
 static const struct zwlr_output_manager_v1_listener output_manager_listener;
@@ -46,80 +61,157 @@ static const struct wl_output_listener output_listener;
 // Global Wayland state
 static struct wl_shm *shm = NULL;
 static struct zwlr_screencopy_manager_v1 *screencopy_manager = NULL;
+static uint32_t screencopy_version = 0; // Damage tracking needs version 2
 static struct wl_output *output = NULL;
 static struct zwlr_output_manager_v1 *output_manager = NULL;
+static struct wl_seat *seat = NULL; // The first one, for the clipboard
+static struct zwlr_data_control_manager_v1 *data_control_manager = NULL;
 static uint32_t serial = 0;
 static struct wl_list output_heads;  // List of output_head structures
 
-static struct {
+// A screencopy frame of one output and the buffer it is copied into
+struct capture {
+    struct zwlr_screencopy_frame_v1 *frame;
     struct wl_buffer *wl_buffer;
-    void *data;
+    struct shm_mapping *mapping; // Handed to the job once copied
+    void *data; // Where the frame is copied, in mapping or the job's target
     enum wl_shm_format format;
     int width, height, stride;
     bool y_invert;
-} buffer;
+    bool done, failed;
+    struct capture_rect damage; // Reported for copies with damage
+    uint64_t copy_start_ns;
+};
+
+// Startup progress, the output manager sends its first done after the initial heads
+static struct wl_callback *startup_sync = NULL;
+
+// Set from the Wayland thread, read by the main loop
+static atomic_bool globals_ready = false;
+static atomic_bool outputs_ready = false;
+static atomic_bool wayland_stopped = false;
 
-static bool buffer_copy_done = false;
+// KNIPSER_HUGEPAGES=1 keeps pre-faulted, hugepage-backed buffers between captures
+#define SPARE_MAPPINGS 4
+static bool use_hugepages = false;
+static struct shm_mapping *spare_mappings[SPARE_MAPPINGS];
+
+/*
+ * All proxies live on a private event queue that only the Wayland thread
+ * dispatches. Jobs arrive on the request queue and are captured one at a
+ * time, so every head's capture is free when a job starts. Encoders hand
+ * mappings back on the recycle queue.
+ */
+static struct wl_event_queue *event_queue = NULL;
+static pthread_t wayland_thread;
+static bool thread_started = false;
+static atomic_bool stopping = false;
+static atomic_bool stop_waiting = false;
+static struct queue requests;
+static struct queue recycled;
+
+static struct capture_job *active_job = NULL;
+static struct output_head *active_heads[LAYOUT_MAX_OUTPUTS];
+static struct layout_output active_outputs[LAYOUT_MAX_OUTPUTS];
 
 struct {
     struct wl_display *display;
     struct wl_registry *registry;
 } wl_state;
 
+// Pending head state, only touched by listeners. Lookups use layout snapshots
 struct output_head {
     struct zwlr_output_head_v1 *wlr_head;
     struct wl_output *wl_output;  // Add standard wl_output
+    uint32_t output_name;  // Registry name of wl_output
     struct wl_list link;
     char *name;
     char *description;
     int32_t x, y;
     int32_t width, height;
     int32_t enabled;
+    int32_t transform;  // enum wl_output_transform
+    wl_fixed_t scale;
     struct zwlr_output_mode_v1 *current_mode;
+    struct capture capture;
 };
 
-struct output_head display_list[MAX_NUM_WAYLAND_DISPLAYS] = {0};
-static int current_num_displays = 0;
 
 // Function prototypes
-static struct wl_buffer *create_shm_buffer(enum wl_shm_format fmt, int width, int height, int stride, void **data_out);
-static void write_image(const char *filename, enum wl_shm_format wl_fmt, int width, int height, int stride, bool y_invert, png_bytep data);
-struct output_head *find_output_for_coordinates(int32_t x, int32_t y);
-const char *get_display_name_for_coordinates(int32_t x, int32_t y);
+static struct wl_buffer *create_shm_buffer(struct capture *capture);
+static struct output_head *find_output_for_coordinates(int32_t x, int32_t y, struct layout_output *out);
+static void finish_capture(struct capture *capture);
+static struct output_head *head_for_output(struct wl_output *wl_output);
+static void publish_layout(uint32_t serial_arg);
+static void *wayland_main(void *data);
 
 // Frame listener callbacks
 static void frame_handle_buffer(void *data, struct zwlr_screencopy_frame_v1 *frame, uint32_t format, uint32_t width, uint32_t height, uint32_t stride)
 {
-    buffer.format = format;
-    buffer.width = width;
-    buffer.height = height;
-    buffer.stride = stride;
+    struct capture *capture = data;
+    capture->format = format;
+    capture->width = width;
+    capture->height = height;
+    capture->stride = stride;
+
+    // Don't let the compositor copy a frame we could not encode anyway
+    trace_instant("wayland", "frame.buffer");
+    if (!image_format_supported(format)) {
+        log_error("Unsupported format 0x%08x", format);
+        capture->failed = true;
+        return;
+    }
 
     // Make sure the buffer is not allocated
-    assert(!buffer.wl_buffer);
-    buffer.wl_buffer = create_shm_buffer(format, width, height, stride, &buffer.data);
-    if (buffer.wl_buffer == NULL) {
-        fprintf(stderr, "Failed to create buffer\n");
-        exit(EXIT_FAILURE);
+    assert(!capture->wl_buffer);
+    uint64_t start_ns = stats_now();
+    capture->wl_buffer = create_shm_buffer(capture);
+    stats_record_since(STATS_STAGE_CREATE_BUFFER, start_ns);
+    trace_end("capture", "create_shm_buffer", start_ns);
+    if (capture->wl_buffer == NULL) {
+        log_error("Failed to create buffer");
+        capture->failed = true;
+        return;
     }
 
-    zwlr_screencopy_frame_v1_copy(frame, buffer.wl_buffer);
+    // A copy with damage is only made once the output changes
+    capture->copy_start_ns = stats_now();
+    if (active_job != NULL && active_job->with_damage && screencopy_version >= 2) {
+        zwlr_screencopy_frame_v1_copy_with_damage(frame, capture->wl_buffer);
+    } else {
+        zwlr_screencopy_frame_v1_copy(frame, capture->wl_buffer);
+    }
 }
 
 static void frame_handle_flags(void *data, struct zwlr_screencopy_frame_v1 *frame, uint32_t flags)
 {
-    buffer.y_invert = flags & ZWLR_SCREENCOPY_FRAME_V1_FLAGS_Y_INVERT;
+    struct capture *capture = data;
+    trace_instant("wayland", "frame.flags");
+    capture->y_invert = flags & ZWLR_SCREENCOPY_FRAME_V1_FLAGS_Y_INVERT;
+}
+
+static void frame_handle_damage(void *data, struct zwlr_screencopy_frame_v1 *frame, uint32_t x, uint32_t y, uint32_t width, uint32_t height)
+{
+    struct capture *capture = data;
+    capture_rect_add(&capture->damage, &(struct capture_rect){ x, y, width, height });
 }
 
 static void frame_handle_ready(void *data, struct zwlr_screencopy_frame_v1 *frame, uint32_t tv_sec_hi, uint32_t tv_sec_lo, uint32_t tv_nsec)
 {
-    buffer_copy_done = true;
+    struct capture *capture = data;
+    stats_record_since(STATS_STAGE_COPY, capture->copy_start_ns);
+    if (trace_enabled()) {
+        trace_end("capture", "copy", capture->copy_start_ns);
+    }
+    capture->done = true;
 }
 
 static void frame_handle_failed(void *data, struct zwlr_screencopy_frame_v1 *frame)
 {
-    fprintf(stderr, "Failed to copy frame\n");
-    exit(EXIT_FAILURE);
+    struct capture *capture = data;
+    trace_instant("wayland", "frame.failed");
+    log_error("Failed to copy frame");
+    capture->failed = true;
 }
 
 static const struct zwlr_screencopy_frame_v1_listener frame_listener = {
@@ -127,6 +219,7 @@ static const struct zwlr_screencopy_frame_v1_listener frame_listener = {
     .flags = frame_handle_flags,
     .ready = frame_handle_ready,
     .failed = frame_handle_failed,
+    .damage = frame_handle_damage,
 };
 
 // Registry listener callbacks
@@ -141,29 +234,87 @@ static void handle_global(void *data, struct wl_registry *registry, uint32_t nam
             output = wl_output;
         }
 
-        // Create a new output head for each wl_output
-        struct output_head *head = calloc(1, sizeof(struct output_head));
-        if (head) {
-            head->wl_output = wl_output;
-            head->enabled = 1;  // Assume enabled by default
-            wl_list_insert(&output_heads, &head->link);
+        // A head that lost its output when it was disabled gets it back
+        struct output_head *head, *found = NULL;
+        wl_list_for_each(head, &output_heads, link) {
+            if (head->wlr_head != NULL && head->wl_output == NULL) {
+                found = head;
+                break;
+            }
+        }
 
-            // Add the standard output listener
-            wl_output_add_listener(wl_output, &output_listener, head);
+        // Otherwise create a new output head for each wl_output
+        if (found == NULL) {
+            found = calloc(1, sizeof(struct output_head));
+            if (found == NULL) {
+                wl_output_destroy(wl_output);
+                return;
+            }
+            found->enabled = 1;  // Assume enabled by default
+            found->scale = wl_fixed_from_int(1);
+            wl_list_insert(&output_heads, &found->link);
         }
+        found->wl_output = wl_output;
+        found->output_name = name;
+
+        // Add the standard output listener
+        wl_output_add_listener(wl_output, &output_listener, found);
     } else if (strcmp(interface, wl_shm_interface.name) == 0) {
         shm = wl_registry_bind(registry, name, &wl_shm_interface, 1);
     } else if (strcmp(interface, zwlr_screencopy_manager_v1_interface.name) == 0) {
-        screencopy_manager = wl_registry_bind(registry, name, &zwlr_screencopy_manager_v1_interface, 1);
+        screencopy_version = version < 2 ? version : 2;
+        screencopy_manager = wl_registry_bind(registry, name, &zwlr_screencopy_manager_v1_interface,
+                                              screencopy_version);
     } else if (strcmp(interface, zwlr_output_manager_v1_interface.name) == 0) {
         output_manager = wl_registry_bind(registry, name, &zwlr_output_manager_v1_interface, 1);
         zwlr_output_manager_v1_add_listener(output_manager, &output_manager_listener, NULL);
+    } else if (strcmp(interface, wl_seat_interface.name) == 0 && seat == NULL) {
+        seat = wl_registry_bind(registry, name, &wl_seat_interface, 1);
+    } else if (strcmp(interface, zwlr_data_control_manager_v1_interface.name) == 0) {
+        data_control_manager = wl_registry_bind(registry, name,
+                                                &zwlr_data_control_manager_v1_interface, 1);
+    }
+}
+
+// Fail the capture in progress on a head that is going away
+static void abort_head_capture(struct output_head *head)
+{
+    for (int i = 0; active_job != NULL && i < active_job->count; i++) {
+        if (active_heads[i] == head) {
+            log_warn("Output %s removed during capture", head->name ? head->name : "(unnamed)");
+            active_heads[i] = NULL;
+            active_job->result = -1;
+        }
     }
+    finish_capture(&head->capture);
 }
 
+/*
+ * An output was unplugged or disabled. A disabled one keeps its head and is
+ * paired with the next wl_output, an unplugged one also gets the head's
+ * finished event. The layout is published again right away, since the output
+ * manager's done may come later or, with some compositors, not at all.
+ */
 static void handle_global_remove(void *data, struct wl_registry *registry, uint32_t name)
 {
-    // No-op
+    struct output_head *head;
+    wl_list_for_each(head, &output_heads, link) {
+        if (head->wl_output == NULL || head->output_name != name) {
+            continue;
+        }
+
+        abort_head_capture(head);
+        wl_output_destroy(head->wl_output);
+        head->wl_output = NULL;
+        if (head->wlr_head == NULL) {
+            wl_list_remove(&head->link);
+            free(head->name);
+            free(head->description);
+            free(head);
+        }
+        publish_layout(serial);
+        return;
+    }
 }
 
 static const struct wl_registry_listener registry_listener = {
@@ -171,144 +322,252 @@ static const struct wl_registry_listener registry_listener = {
     .global_remove = handle_global_remove,
 };
 
-// Create shared memory buffer
-static struct wl_buffer *create_shm_buffer(enum wl_shm_format fmt, int width, int height, int stride, void **data_out)
+static void free_mapping(struct shm_mapping *mapping)
 {
-    int size = stride * height;
+    shm_mapping_destroy(mapping);
+    free(mapping);
+}
 
-    const char shm_name[] = "/wlroots-screencopy";
-    int fd = shm_open(shm_name, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
-    if (fd < 0) {
-        fprintf(stderr, "shm_open failed\n");
-        return NULL;
+// Hand a mapping back once its frame is encoded, safe from any thread.
+// Mappings whose fd was given away are only freed.
+void wayland_release_mapping(struct shm_mapping *mapping)
+{
+    if (mapping == NULL) {
+        return;
     }
-    shm_unlink(shm_name);
+    if (!use_hugepages || mapping->data == NULL ||
+        !queue_push(&recycled, mapping)) {
+        free_mapping(mapping);
+    }
+}
 
-    int ret;
-    while ((ret = ftruncate(fd, size)) == EINTR) {
-        // No-op
+// Reuse a recycled mapping that is big enough, or map a new one
+static struct shm_mapping *take_mapping(size_t size)
+{
+    struct shm_mapping *mapping;
+    while ((mapping = queue_pop(&recycled)) != NULL) {
+        int i = 0;
+        while (i < SPARE_MAPPINGS && spare_mappings[i] != NULL) {
+            i++;
+        }
+        if (i < SPARE_MAPPINGS) {
+            spare_mappings[i] = mapping;
+        } else {
+            free_mapping(mapping);
+        }
     }
-    if (ret < 0) {
-        close(fd);
-        fprintf(stderr, "ftruncate failed\n");
-        return NULL;
+
+    for (int i = 0; i < SPARE_MAPPINGS; i++) {
+        if (spare_mappings[i] != NULL && spare_mappings[i]->size >= size) {
+            mapping = spare_mappings[i];
+            spare_mappings[i] = NULL;
+            return mapping;
+        }
     }
 
-    void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if (data == MAP_FAILED) {
-        perror("mmap failed");
-        close(fd);
+    mapping = calloc(1, sizeof(*mapping));
+    if (mapping == NULL || shm_mapping_create(mapping, size, use_hugepages) < 0) {
+        free(mapping);
         return NULL;
     }
-
-    struct wl_shm_pool *pool = wl_shm_create_pool(shm, fd, size);
-    close(fd);
-    struct wl_buffer *buffer = wl_shm_pool_create_buffer(pool, 0, width, height, stride, fmt);
-    wl_shm_pool_destroy(pool);
-
-    *data_out = data;
-    return buffer;
+    log_debug("Created %zu KiB capture buffer (%s)", mapping->size / 1024,
+              mapping->hugetlb ? "hugetlb" : use_hugepages ? "thp" : "4k pages");
+    return mapping;
 }
 
-// Write image to file
-static void write_image(const char *filename, enum wl_shm_format wl_fmt, int width, int height, int stride, bool y_invert, png_bytep data)
+/*
+ * The pool is only needed to create the buffer, the mapping outlives both.
+ * A frame that fits the job's target is copied straight into it.
+ */
+static struct wl_buffer *create_shm_buffer(struct capture *capture)
 {
-    const struct format {
-        enum wl_shm_format wl_format;
-        bool is_bgr;
-    } formats[] = {
-        { WL_SHM_FORMAT_XRGB8888, true },
-        { WL_SHM_FORMAT_ARGB8888, true },
-        { WL_SHM_FORMAT_XBGR8888, false },
-        { WL_SHM_FORMAT_ABGR8888, false },
-    };
-
-    const struct format *fmt = NULL;
-    for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); ++i) {
-        if (formats[i].wl_format == wl_fmt) {
-            fmt = &formats[i];
-            break;
+    size_t size = (size_t)capture->stride * capture->height;
+    const struct capture_target *target = &active_job->target;
+    const struct shm_mapping *pool_mapping = target->mapping;
+    size_t offset = target->offset;
+    if (pool_mapping == NULL || size > target->size) {
+        capture->mapping = take_mapping(size);
+        if (capture->mapping == NULL) {
+            return NULL;
         }
+        pool_mapping = capture->mapping;
+        offset = 0;
     }
-    if (fmt == NULL) {
-        fprintf(stderr, "Unsupported format %" PRIu32 "\n", wl_fmt);
-        exit(EXIT_FAILURE);
-    }
+    capture->data = (uint8_t *)pool_mapping->data + offset;
 
-    FILE *f = fopen(filename, "wb");
-    if (f == NULL) {
-        fprintf(stderr, "Failed to open output file\n");
-        exit(EXIT_FAILURE);
-    }
-
-    png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    png_infop info = png_create_info_struct(png);
-
-    png_init_io(png, f);
+    struct wl_shm_pool *pool = wl_shm_create_pool(shm, pool_mapping->fd, pool_mapping->size);
+    struct wl_buffer *buffer = wl_shm_pool_create_buffer(pool, offset, capture->width, capture->height,
+                                                         capture->stride, capture->format);
+    wl_shm_pool_destroy(pool);
+    return buffer;
+}
 
-    png_set_IHDR(png, info, width, height, 8, PNG_COLOR_TYPE_RGBA, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+// The first sync callback fires once every global announced at connect time has been handled
+static void startup_sync_handle_done(void *data, struct wl_callback *callback, uint32_t callback_data)
+{
+    wl_callback_destroy(callback);
+    startup_sync = NULL;
+    startup_mark("wayland.globals");
 
-    if (fmt->is_bgr) {
-        png_set_bgr(png);
+    bool failed = true;
+    if (!shm) {
+        log_error("Compositor is missing wl_shm");
+    } else if (!screencopy_manager) {
+        log_error("Compositor doesn't support wlr-screencopy-unstable-v1");
+    } else if (!output) {
+        log_error("No output available");
+    } else if (!output_manager) {
+        log_error("Compositor doesn't support wlr-output-management-unstable-v1");
+    } else {
+        failed = false;
     }
 
-    png_write_info(png, info);
-
-    for (size_t i = 0; i < (size_t)height; ++i) {
-        png_bytep row;
-        if (y_invert) {
-            row = data + (height - i - 1) * stride;
-        } else {
-            row = data + i * stride;
-        }
-        png_write_row(png, row);
+    if (failed) {
+        atomic_store(&stopping, true);
+    } else if (data_control_manager != NULL && seat != NULL) {
+        clipboard_bind(data_control_manager, seat);
     }
-
-    png_write_end(png, NULL);
-
-    png_destroy_write_struct(&png, &info);
-
-    fclose(f);
+    atomic_store(&globals_ready, true);
+    knipser_wake();
 }
 
-// Initialize Wayland
+static const struct wl_callback_listener startup_sync_listener = {
+    .done = startup_sync_handle_done,
+};
+
+// Initialize Wayland and start the thread that owns the connection
 int init_wayland(void)
 {
     wl_list_init(&output_heads);
 
+    const char *hugepages = getenv("KNIPSER_HUGEPAGES");
+    use_hugepages = hugepages != NULL && strcmp(hugepages, "1") == 0;
+
+    if (queue_init(&requests, CAPTURE_MAX_JOBS, false) < 0) {
+        return EXIT_FAILURE;
+    }
+    if (queue_init(&recycled, CAPTURE_MAX_JOBS * 4, false) < 0) {
+        queue_finish(&requests);
+        return EXIT_FAILURE;
+    }
+
     // Connect to the Wayland display
     wl_state.display = wl_display_connect(NULL);
     if (!wl_state.display) {
-        fprintf(stderr, "Failed to connect to Wayland display\n");
+        log_error("Failed to connect to Wayland display");
         return EXIT_FAILURE;
     }
 
-    wl_state.registry = wl_display_get_registry(wl_state.display);
+    startup_mark("wayland.connected");
+
+    // Objects created from the registry inherit its queue, and so do their events
+    event_queue = wl_display_create_queue(wl_state.display);
+    struct wl_display *wrapper = wl_proxy_create_wrapper(wl_state.display);
+    wl_proxy_set_queue((struct wl_proxy *)wrapper, event_queue);
+    wl_state.registry = wl_display_get_registry(wrapper);
     wl_registry_add_listener(wl_state.registry, &registry_listener, NULL);
-    wl_display_roundtrip(wl_state.display); // Ensure registry is populated
-    wl_display_roundtrip(wl_state.display); // Another roundtrip for output heads
+    startup_sync = wl_display_sync(wrapper);
+    wl_callback_add_listener(startup_sync, &startup_sync_listener, NULL);
+    wl_proxy_wrapper_destroy(wrapper);
 
-    if (!shm) {
-        fprintf(stderr, "Compositor is missing wl_shm\n");
+    if (pthread_create(&wayland_thread, NULL, wayland_main, NULL) != 0) {
+        log_error("Failed to start Wayland thread");
         return EXIT_FAILURE;
     }
-    if (!screencopy_manager) {
-        fprintf(stderr, "Compositor doesn't support wlr-screencopy-unstable-v1\n");
-        return EXIT_FAILURE;
+    thread_started = true;
+    return EXIT_SUCCESS;
+}
+
+// Stop the Wayland thread, then release every buffer and proxy and close the connection
+void deinit_wayland(void)
+{
+    if (thread_started) {
+        atomic_store(&stopping, true);
+        queue_wake(&requests);
+        pthread_join(wayland_thread, NULL);
+        thread_started = false;
     }
-    if (!output) {
-        fprintf(stderr, "No output available\n");
-        return EXIT_FAILURE;
+    if (wl_state.display == NULL) {
+        return;
     }
-    if (!output_manager) {
-        fprintf(stderr, "Compositor doesn't support wlr-output-management-unstable-v1\n");
-        return EXIT_FAILURE;
+
+    // Pastes in progress still hold mappings, and hand them back below
+    clipboard_deinit();
+
+    struct output_head *head, *tmp;
+    wl_list_for_each_safe(head, tmp, &output_heads, link) {
+        finish_capture(&head->capture);
+        if (head->wl_output != NULL) {
+            wl_output_destroy(head->wl_output);
+        }
+        if (head->wlr_head != NULL) {
+            zwlr_output_head_v1_destroy(head->wlr_head);
+        }
+        wl_list_remove(&head->link);
+        free(head->name);
+        free(head->description);
+        free(head);
     }
+    output = NULL;
 
-    return EXIT_SUCCESS;
+    for (int i = 0; i < SPARE_MAPPINGS; i++) {
+        if (spare_mappings[i] != NULL) {
+            free_mapping(spare_mappings[i]);
+            spare_mappings[i] = NULL;
+        }
+    }
+    struct shm_mapping *mapping;
+    while ((mapping = queue_pop(&recycled)) != NULL) {
+        free_mapping(mapping);
+    }
+
+    // Retire the last snapshot, no reader is left once the loop has stopped
+    layout_publish(NULL);
+
+    if (startup_sync != NULL) {
+        wl_callback_destroy(startup_sync);
+        startup_sync = NULL;
+    }
+    if (output_manager != NULL) {
+        zwlr_output_manager_v1_destroy(output_manager);
+        output_manager = NULL;
+    }
+    if (screencopy_manager != NULL) {
+        zwlr_screencopy_manager_v1_destroy(screencopy_manager);
+        screencopy_manager = NULL;
+    }
+    if (data_control_manager != NULL) {
+        zwlr_data_control_manager_v1_destroy(data_control_manager);
+        data_control_manager = NULL;
+    }
+    if (seat != NULL) {
+        wl_seat_destroy(seat);
+        seat = NULL;
+    }
+    if (shm != NULL) {
+        wl_shm_destroy(shm);
+        shm = NULL;
+    }
+    wl_registry_destroy(wl_state.registry);
+    wl_event_queue_destroy(event_queue);
+    wl_display_disconnect(wl_state.display);
+    wl_state.registry = NULL;
+    wl_state.display = NULL;
+    queue_finish(&requests);
+    queue_finish(&recycled);
 }
 
+// Ready once the globals are bound and the first output configuration is published
+bool wayland_ready(void)
+{
+    return atomic_load(&globals_ready) && atomic_load(&outputs_ready);
+}
 
+// The connection failed or the compositor lacks a required protocol
+bool wayland_failed(void)
+{
+    return atomic_load(&wayland_stopped);
+}
 
 // Output head listener callbacks
 static void output_head_handle_name(void *data, struct zwlr_output_head_v1 *wlr_head, const char *name)
@@ -352,7 +611,7 @@ static void output_head_handle_current_mode(void *data, struct zwlr_output_head_
     // Then register the listener for this mode
     zwlr_output_mode_v1_add_listener(mode, &output_mode_listener, data);
 
-    printf("Current mode set for %s at position (%d,%d)\n",
+    log_debug("Current mode set for %s at position (%d,%d)",
            head->name ? head->name : "(unnamed)", head->x, head->y);
 }
 
@@ -361,30 +620,31 @@ static void output_head_handle_position(void *data, struct zwlr_output_head_v1 *
     struct output_head *head = data;
     head->x = x;
     head->y = y;
-    printf("Position: %d, %d\n", x, y);
+    log_debug("Position: %d, %d", x, y);
 }
 
 static void output_head_handle_transform(void *data, struct zwlr_output_head_v1 *wlr_head, int32_t transform)
 {
-    // Not needed for our purpose
+    struct output_head *head = data;
+    head->transform = transform;
 }
 
 static void output_head_handle_scale(void *data, struct zwlr_output_head_v1 *wlr_head, wl_fixed_t scale)
 {
-    // Not needed for our purpose
+    struct output_head *head = data;
+    head->scale = scale;
 }
 
 static void output_head_handle_finished(void *data, struct zwlr_output_head_v1 *wlr_head)
 {
     // This head has been removed
+    // The next done event publishes a layout without it
     struct output_head *head = data;
-    for(int i = 0; i < current_num_displays; i++) {
-        if(strcmp(display_list[i].name, "")) {
-            memcpy(&display_list[i], head, sizeof(struct output_head));
-	    display_list[i].name = strdup(head->name);
-        display_list[i].description = strdup(head->description);
-	}
+    abort_head_capture(head);
+    if (head->wl_output != NULL) {
+        wl_output_destroy(head->wl_output);
     }
+    zwlr_output_head_v1_destroy(wlr_head);
     wl_list_remove(&head->link);
     free(head->name);
     free(head->description);
@@ -399,7 +659,7 @@ static void output_mode_handle_size(void *data,
     head->width = width;
     head->height = height;
 
-    printf("Current mode size for %s: %dx%d\n",
+    log_debug("Current mode size for %s: %dx%d",
            head->name ? head->name : "(unnamed)",
            width, height);
 
@@ -506,9 +766,10 @@ static void output_manager_handle_head(void *data,
     if (!new_head) {
         new_head = calloc(1, sizeof(struct output_head));
         if (!new_head) {
-            fprintf(stderr, "Failed to allocate output head\n");
+            log_error("Failed to allocate output head");
             return;
         }
+        new_head->scale = wl_fixed_from_int(1);
         wl_list_insert(&output_heads, &new_head->link);
     }
 
@@ -519,11 +780,58 @@ static void output_manager_handle_head(void *data,
     zwlr_output_head_v1_add_listener(wlr_head, &output_head_listener, new_head);
 }
 
+// Publish the heads as a new layout snapshot once a configuration is complete
+static void publish_layout(uint32_t serial_arg)
+{
+    struct layout_output outputs[LAYOUT_MAX_OUTPUTS];
+    int count = 0;
+
+    struct output_head *head;
+    wl_list_for_each_reverse(head, &output_heads, link) {
+        if (!head->enabled || head->wl_output == NULL || head->width <= 0 ||
+            head->height <= 0 || count == LAYOUT_MAX_OUTPUTS) {
+            continue;
+        }
+
+        struct layout_output *out = &outputs[count++];
+        int width, height;
+        transform_size(head->transform, head->width, head->height, &width, &height);
+        double scale = head->scale > 0 ? wl_fixed_to_double(head->scale) : 1.0;
+
+        *out = (struct layout_output){
+            .wl_output = head->wl_output,
+            .x = head->x,
+            .y = head->y,
+            .width = (int32_t)(width / scale + 0.5),
+            .height = (int32_t)(height / scale + 0.5),
+            .transform = head->transform,
+            .scale = head->scale > 0 ? head->scale : wl_fixed_from_int(1),
+        };
+        snprintf(out->name, sizeof(out->name), "%s", head->name ? head->name : "");
+        snprintf(out->description, sizeof(out->description), "%s",
+                 head->description ? head->description : "");
+    }
+
+    struct layout *layout = layout_create(serial_arg, outputs, count);
+    if (layout == NULL) {
+        log_error("Failed to allocate output layout");
+        return;
+    }
+    layout_publish(layout);
+    log_debug("Published layout %u with %d outputs", serial_arg, count);
+}
+
 static void output_manager_handle_done(void *data,
 				       struct zwlr_output_manager_v1 *manager,
 				       uint32_t serial_arg)
 {
 	serial = serial_arg;
+	publish_layout(serial_arg);
+	if (!atomic_load(&outputs_ready)) {
+		startup_mark("wayland.outputs");
+		atomic_store(&outputs_ready, true);
+		knipser_wake();
+	}
 }
 
 static const struct zwlr_output_manager_v1_listener output_manager_listener = {
@@ -572,14 +880,14 @@ static void handle_output_mode(void *data, struct wl_output *wl_output,
     head->width = width;
     head->height = height;
 
-    printf("Standard output mode for %s: %dx%d (current)\n",
+    log_debug("Standard output mode for %s: %dx%d (current)",
            head->name ? head->name : "(unnamed)", width, height);
 }
 
 static void handle_output_done(void *data, struct wl_output *wl_output)
 {
     struct output_head *head = data;
-    printf("Standard output done for %s: %dx%d at (%d,%d)\n",
+    log_debug("Standard output done for %s: %dx%d at (%d,%d)",
            head->name ? head->name : "(unnamed)",
            head->width, head->height, head->x, head->y);
 }
@@ -599,93 +907,384 @@ static const struct wl_output_listener output_listener = {
     .scale = handle_output_scale
 };
 
-// Function to find the display containing specific coordinates
-struct output_head *find_output_for_coordinates(int32_t x, int32_t y)
+// Find the head of the output at or nearest to a point, filling out with its layout
+static struct output_head *find_output_for_coordinates(int32_t x, int32_t y, struct layout_output *out)
 {
-    struct output_head *head;
-    struct output_head *nearest_head = NULL;
-    int32_t nearest_distance = INT32_MAX;
+    const struct layout *layout = layout_acquire();
+    const struct layout_output *found = layout_find_nearest(layout, x, y);
+    if (found != NULL) {
+        *out = *found;
+    }
+    layout_release(layout);
+
+    // Heads only change on the Wayland thread, so the one matching the snapshot is still there
+    return found != NULL ? head_for_output(out->wl_output) : NULL;
+}
+
+// Copy the name of the display at or nearest to a point, safe from any thread
+bool get_display_name_for_coordinates(int32_t x, int32_t y, char *name, size_t size)
+{
+    const struct layout *layout = layout_acquire();
+    const struct layout_output *found = layout_find_nearest(layout, x, y);
+    if (found != NULL) {
+        snprintf(name, size, "%s", found->name);
+    }
+    layout_release(layout);
+    return found != NULL;
+}
+
+// A region is in logical coordinates relative to the output, NULL captures all of it
+static void start_capture(struct output_head *head, const int32_t *region)
+{
+    struct capture *capture = &head->capture;
+    capture->done = false;
+    capture->failed = false;
+    capture->y_invert = false;
+    capture->damage = (struct capture_rect){ 0 };
+    if (region != NULL) {
+        capture->frame = zwlr_screencopy_manager_v1_capture_output_region(
+            screencopy_manager, 0, head->wl_output, region[0], region[1], region[2], region[3]);
+    } else {
+        capture->frame = zwlr_screencopy_manager_v1_capture_output(screencopy_manager, 0,
+                                                                   head->wl_output);
+    }
+    zwlr_screencopy_frame_v1_add_listener(capture->frame, &frame_listener, capture);
+}
+
+// Release the frame and buffer, and the mapping unless it was handed to a job
+static void finish_capture(struct capture *capture)
+{
+    if (capture->wl_buffer != NULL) {
+        wl_buffer_destroy(capture->wl_buffer);
+        capture->wl_buffer = NULL; // Reset the buffer to NULL to avoid reuse
+    }
+    if (capture->frame != NULL) {
+        zwlr_screencopy_frame_v1_destroy(capture->frame);
+        capture->frame = NULL;
+    }
+    wayland_release_mapping(capture->mapping);
+    capture->mapping = NULL;
+    capture->data = NULL;
+}
 
-    printf("Looking for coordinates (%d,%d)\n", x, y);
+/*
+ * Place a captured output on the canvas. The canvas uses the largest output
+ * scale, so a HiDPI output keeps its resolution and lower scale outputs are
+ * enlarged to match, as they appear when moving a window between them.
+ */
+static void place_on_canvas(const struct layout_output *output, const struct capture *capture,
+                            wl_fixed_t canvas_scale, struct canvas_output *out)
+{
+    int width, height;
+    transform_size(output->transform, capture->width, capture->height, &width, &height);
+
+    *out = (struct canvas_output){
+        .data = capture->data,
+        .format = capture->format,
+        .width = capture->width,
+        .height = capture->height,
+        .stride = capture->stride,
+        .y_invert = capture->y_invert,
+        .transform = output->transform,
+        .x = (int)(output->x * wl_fixed_to_double(canvas_scale)),
+        .y = (int)(output->y * wl_fixed_to_double(canvas_scale)),
+        .canvas_width = (int)((int64_t)width * canvas_scale / output->scale),
+        .canvas_height = (int)((int64_t)height * canvas_scale / output->scale),
+    };
+}
 
+static struct output_head *head_for_output(struct wl_output *wl_output)
+{
+    struct output_head *head;
     wl_list_for_each(head, &output_heads, link) {
-        if (!head->enabled) {
-            continue;
+        if (head->wl_output == wl_output) {
+            return head;
+        }
+    }
+    return NULL;
+}
+
+// Resolve the outputs of a job and request their frames
+static int begin_job(struct capture_job *job)
+{
+    job->count = 0;
+    job->result = 0;
+    int32_t region[4];
+    bool has_region = false;
+
+    if (job->kind == CAPTURE_OUTPUT || job->kind == CAPTURE_REGION) {
+        uint64_t start_ns = stats_now();
+        struct output_head *head = find_output_for_coordinates(job->x, job->y, &active_outputs[0]);
+        stats_record_since(STATS_STAGE_FIND_OUTPUT, start_ns);
+        if (head == NULL) {
+            log_error("failed getting output for screenshot");
+            return -1;
+        }
+        active_heads[job->count++] = head;
+
+        // The compositor crops, a region is clipped to the output containing its origin
+        if (job->kind == CAPTURE_REGION) {
+            const struct layout_output *out = &active_outputs[0];
+            region[0] = job->x - out->x;
+            region[1] = job->y - out->y;
+            region[2] = job->width < out->width - region[0] ? job->width : out->width - region[0];
+            region[3] = job->height < out->height - region[1] ? job->height : out->height - region[1];
+            if (region[0] < 0 || region[1] < 0 || region[2] <= 0 || region[3] <= 0) {
+                log_error("Region %dx%d+%d+%d is outside of %s", job->width, job->height,
+                          job->x, job->y, out->name);
+                return -1;
+            }
+            has_region = true;
+        }
+    } else {
+        // Work on a copy so the layout can't change between capture and placement
+        const struct layout *layout = layout_acquire();
+        for (int i = 0; layout != NULL && i < layout->count; i++) {
+            struct output_head *head = head_for_output(layout->outputs[i].wl_output);
+            if (head != NULL) {
+                active_outputs[job->count] = layout->outputs[i];
+                active_heads[job->count++] = head;
+            }
+        }
+        layout_release(layout);
+        if (job->count == 0) {
+            log_error("No output available");
+            return -1;
         }
+    }
 
-        // Use fallback dimensions if width/height are zero
-        int32_t width = (head->width > 0) ? head->width : 1920;
-        int32_t height = (head->height > 0) ? head->height : 1080;
+    // For the catalog, a desktop covers the bounding box of the layout
+    job->area = (struct capture_rect){ 0 };
+    for (int i = 0; i < job->count; i++) {
+        const struct layout_output *out = &active_outputs[i];
+        struct capture_rect rect = { out->x, out->y, out->width, out->height };
+        capture_rect_add(&job->area, &rect);
+    }
+    if (has_region) {
+        job->area.x += region[0];
+        job->area.y += region[1];
+        job->area.width = region[2];
+        job->area.height = region[3];
+    }
+    if (job->kind != CAPTURE_DESKTOP) {
+        snprintf(job->output, sizeof(job->output), "%s", active_outputs[0].name);
+        snprintf(job->description, sizeof(job->description), "%s",
+                 active_outputs[0].description);
+    }
 
-        printf("Checking display %s: bounds (%d,%d)-(%d,%d)\n",
-               head->name ? head->name : "(unnamed)",
-               head->x, head->y,
-               head->x + width, head->y + height);
+    // Request all frames up front so the compositor copies them together
+    for (int i = 0; i < job->count; i++) {
+        start_capture(active_heads[i], has_region ? region : NULL);
+    }
+    active_job = job;
+    return 0;
+}
 
-        // Check if the coordinates are within this output's boundaries
-        if (x >= head->x && x < head->x + width &&
-            y >= head->y && y < head->y + height) {
-            printf("Found coordinates on display: %s\n",
-                head->name ? head->name : "(unnamed)");
-            return head;
+// Once every frame is copied, move the mappings into the job and pass it on
+static void complete_job(void)
+{
+    struct capture_job *job = active_job;
+    for (int i = 0; i < job->count; i++) {
+        const struct capture *capture = active_heads[i] != NULL ? &active_heads[i]->capture : NULL;
+        if (capture != NULL && !capture->done && !capture->failed) {
+            return;
+        }
+    }
+    active_job = NULL;
+
+    wl_fixed_t canvas_scale = wl_fixed_from_int(1);
+    for (int i = 0; i < job->count; i++) {
+        if (active_heads[i] == NULL || active_heads[i]->capture.failed) {
+            job->result = -1;
+        } else if (active_outputs[i].scale > canvas_scale) {
+            canvas_scale = active_outputs[i].scale;
         }
+    }
 
-        // Calculate distance to center of display for fallback
-        int32_t center_x = head->x + (width / 2);
-        int32_t center_y = head->y + (height / 2);
-        int32_t dx = x - center_x;
-        int32_t dy = y - center_y;
-        int32_t distance = dx*dx + dy*dy;
+    for (int i = 0; i < job->count; i++) {
+        job->mappings[i] = NULL;
+        if (active_heads[i] == NULL) {
+            continue;
+        }
 
-        if (distance < nearest_distance) {
-            nearest_distance = distance;
-            nearest_head = head;
+        struct capture *capture = &active_heads[i]->capture;
+        if (job->result == 0) {
+            // Without damage tracking any part of the frame may have changed
+            if (job->with_damage) {
+                if (screencopy_version < 2) {
+                    capture->damage = (struct capture_rect){ 0, 0, capture->width, capture->height };
+                }
+                capture_rect_add(&job->damage, &capture->damage);
+            }
+            place_on_canvas(&active_outputs[i], capture, canvas_scale, &job->frames[i]);
+            job->mappings[i] = capture->mapping;
+            capture->mapping = NULL;
         }
+        finish_capture(capture);
+        active_heads[i] = NULL;
     }
 
-    // If no exact match, return the nearest display
-    printf("No exact match found, using nearest display: %s\n",
-           nearest_head ? (nearest_head->name ? nearest_head->name : "(unnamed)") : "none");
-    return nearest_head;
+    // Ring and VNC frames are used by the D-Bus thread, there is nothing to encode
+    if (job->result == 0 &&
+        (job->delivery == CAPTURE_TO_RING || job->delivery == CAPTURE_TO_VNC)) {
+        knipser_complete(job);
+        return;
+    }
+    // Clipboard frames are encoded when pasted, and only in the type asked for
+    if (job->result == 0 && job->delivery == CAPTURE_TO_CLIPBOARD &&
+        clipboard_publish(job) == 0) {
+        knipser_complete(job);
+        return;
+    }
+    if (job->result == 0 && encoder_submit(job)) {
+        return;
+    }
+    for (int i = 0; i < job->count; i++) {
+        wayland_release_mapping(job->mappings[i]);
+        job->mappings[i] = NULL;
+    }
+    job->result = -1;
+    knipser_complete(job);
 }
 
-// Helper function to get display name for coordinates
-const char *get_display_name_for_coordinates(int32_t x, int32_t y)
+// Drop a job that is still waiting for damage, before the compositor copies anything
+static void cancel_job(void)
 {
-    struct output_head *head = find_output_for_coordinates(x, y);
-    if (head) {
-        return head->name;
+    struct capture_job *job = active_job;
+    active_job = NULL;
+    for (int i = 0; i < job->count; i++) {
+        if (active_heads[i] != NULL) {
+            finish_capture(&active_heads[i]->capture);
+            active_heads[i] = NULL;
+        }
     }
-    return NULL;
+    job->count = 0;
+    job->result = -ECANCELED;
+    knipser_complete(job);
 }
 
-// Take a screenshot
-int take_screenshot(const char *filename, int x, int y)
+/*
+ * Start queued jobs until one is waiting for the compositor. A job waiting
+ * for damage may wait forever on a still screen, so it gives way to the
+ * next job instead of holding it up.
+ */
+static void run_jobs(void)
 {
-    struct output_head *display_meta = find_output_for_coordinates(x, y);
-    if (display_meta == NULL) {
-        printf("failed getting output for screenshot");
-        return -1;
+    if (active_job != NULL) {
+        complete_job();
     }
-	struct zwlr_screencopy_frame_v1 *frame =
-		zwlr_screencopy_manager_v1_capture_output(screencopy_manager, 0,
-							  display_meta->wl_output);
-	zwlr_screencopy_frame_v1_add_listener(frame, &frame_listener, NULL);
 
-	buffer_copy_done = false;
-	while (!buffer_copy_done &&
-	       wl_display_dispatch(wl_state.display) != -1) {
-		// Wait for the frame to be copied
-	}
-
-	write_image(filename, buffer.format, buffer.width, buffer.height,
-		    buffer.stride, buffer.y_invert, buffer.data);
+    while (!atomic_load(&stopping)) {
+        if (active_job != NULL && active_job->with_damage && atomic_load(&stop_waiting)) {
+            cancel_job();
+        }
+        if (active_job != NULL && !active_job->with_damage) {
+            return;
+        }
+        struct capture_job *job = queue_pop(&requests);
+        if (job == NULL) {
+            return;
+        }
+        if (active_job != NULL) {
+            cancel_job();
+        }
+        if (begin_job(job) < 0) {
+            job->result = -1;
+            knipser_complete(job);
+        }
+    }
+}
 
-	// Clean up the buffer
-	wl_buffer_destroy(buffer.wl_buffer);
-	munmap(buffer.data, buffer.stride * buffer.height);
-	buffer.wl_buffer = NULL; // Reset the buffer to NULL to avoid reuse
+// Queue a capture, safe from any thread
+bool wayland_submit(struct capture_job *job)
+{
+    if (atomic_load(&wayland_stopped)) {
+        return false;
+    }
+    return queue_push(&requests, job);
+}
 
-	return EXIT_SUCCESS;
+// From now on cancel captures waiting for damage, for shutting down, safe from any thread
+void wayland_stop_waiting(void)
+{
+    atomic_store(&stop_waiting, true);
+    queue_wake(&requests);
 }
 
+// Owns the connection: dispatches the private queue and runs jobs as they arrive
+static void *wayland_main(void *data)
+{
+    trace_set_thread_name("wayland");
+    struct wl_display *display = wl_state.display;
+
+    while (!atomic_load(&stopping)) {
+        while (wl_display_prepare_read_queue(display, event_queue) != 0) {
+            if (wl_display_dispatch_queue_pending(display, event_queue) < 0) {
+                goto out;
+            }
+        }
+
+        // A full socket buffer is flushed once the display is writable again
+        struct pollfd fds[2] = {
+            { .fd = wl_display_get_fd(display), .events = POLLIN },
+            { .fd = queue_fd(&requests), .events = POLLIN },
+        };
+        if (wl_display_flush(display) < 0) {
+            if (errno != EAGAIN) {
+                wl_display_cancel_read(display);
+                log_error("Failed to flush Wayland display: %s", strerror(errno));
+                break;
+            }
+            fds[0].events |= POLLOUT;
+        }
+
+        if (poll(fds, 2, -1) < 0) {
+            fds[0].revents = 0;
+            fds[1].revents = 0;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            if (wl_display_read_events(display) < 0) {
+                log_error("Failed to read Wayland events: %s", strerror(errno));
+                break;
+            }
+        } else {
+            wl_display_cancel_read(display);
+        }
+        if (fds[0].revents & (POLLERR | POLLHUP)) {
+            log_error("Lost connection to the Wayland display");
+            break;
+        }
+
+        uint64_t span = trace_begin();
+        int ret = wl_display_dispatch_queue_pending(display, event_queue);
+        trace_end("wayland", "dispatch", span);
+        if (ret < 0) {
+            break;
+        }
+
+        if (fds[1].revents & POLLIN) {
+            queue_clear(&requests);
+        }
+        run_jobs();
+    }
+
+out:
+    // Fail the capture in progress and everything still queued
+    atomic_store(&wayland_stopped, true);
+    if (active_job != NULL) {
+        for (int i = 0; i < active_job->count; i++) {
+            if (active_heads[i] != NULL) {
+                active_heads[i]->capture.failed = true;
+            }
+        }
+        complete_job();
+    }
+    struct capture_job *job;
+    while ((job = queue_pop(&requests)) != NULL) {
+        job->result = -1;
+        knipser_complete(job);
+    }
+    knipser_wake();
+    return NULL;
+}
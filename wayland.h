@@ -1,10 +1,20 @@
 #ifndef _WAYLAND_H_
 #define _WAYLAND_H_
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
-void init_wayland(void);
-int take_screenshot(const char *, int, int);
-const char *get_display_name_for_coordinates(int32_t x, int32_t y);
+#include "job.h"
 
-#endif /*ifndef _WAYLAND_H_*/
\ No newline at end of file
+int init_wayland(void);
+void deinit_wayland(void);
+bool wayland_ready(void);
+bool wayland_failed(void);
+bool wayland_submit(struct capture_job *job);
+void wayland_stop_waiting(void);
+void wayland_release_mapping(struct shm_mapping *mapping);
+bool get_display_name_for_coordinates(int32_t x, int32_t y, char *name,
+				      size_t size);
+
+#endif /*ifndef _WAYLAND_H_*/